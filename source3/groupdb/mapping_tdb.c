@@ -39,13 +39,15 @@ static bool init_group_mapping(void)
 	}
 
 	db = db_open(NULL, state_path("group_mapping.tdb"), 0,
-			   TDB_DEFAULT, O_RDWR|O_CREAT, 0600);
+			   TDB_SEQNUM, O_RDWR|O_CREAT, 0600);
 	if (db == NULL) {
 		DEBUG(0, ("Failed to open group mapping database: %s\n",
 			  strerror(errno)));
 		return false;
 	}
 
+	db = db_open_cache(NULL, db);
+
 #if 0
 	/*
 	 * This code was designed to handle a group mapping version
@@ -48,8 +48,12 @@ NTSTATUS ctdbd_db_attach(struct ctdbd_connection *conn, const char *name,
 NTSTATUS ctdbd_migrate(struct ctdbd_connection *conn, uint32 db_id,
 		       TDB_DATA key);
 
+NTSTATUS ctdbd_migrate_multi(struct ctdbd_connection *conn, uint32 db_id,
+			     const TDB_DATA *keys, int num_keys);
+
 NTSTATUS ctdbd_fetch(struct ctdbd_connection *conn, uint32 db_id,
-		     TDB_DATA key, TALLOC_CTX *mem_ctx, TDB_DATA *data);
+		     TDB_DATA key, TALLOC_CTX *mem_ctx, TDB_DATA *data,
+		     bool local_copy);
 
 NTSTATUS ctdbd_traverse(uint32 db_id,
 			void (*fn)(TDB_DATA key, TDB_DATA data,
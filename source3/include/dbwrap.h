@@ -63,6 +63,9 @@ struct db_context *db_open(TALLOC_CTX *mem_ctx,
 
 struct db_context *db_open_rbt(TALLOC_CTX *mem_ctx);
 
+struct db_context *db_open_cache(TALLOC_CTX *mem_ctx,
+				 struct db_context *backing);
+
 struct db_context *db_open_tdb(TALLOC_CTX *mem_ctx,
 			       const char *name,
 			       int hash_size, int tdb_flags,
@@ -80,6 +83,8 @@ struct db_context *db_open_ctdb(TALLOC_CTX *mem_ctx,
 				const char *name,
 				int hash_size, int tdb_flags,
 				int open_flags, mode_t mode);
+NTSTATUS db_ctdb_migrate_records(struct db_context *db,
+				 const TDB_DATA *keys, int num_keys);
 #endif
 
 struct db_context *db_open_file(TALLOC_CTX *mem_ctx,
@@ -89,6 +94,8 @@ struct db_context *db_open_file(TALLOC_CTX *mem_ctx,
 				int open_flags, mode_t mode);
 
 
+NTSTATUS dbwrap_migrate_records(struct db_context *db,
+				const TDB_DATA *keys, int num_keys);
 NTSTATUS dbwrap_delete(struct db_context *db, TDB_DATA key);
 NTSTATUS dbwrap_store(struct db_context *db, TDB_DATA key,
 		      TDB_DATA data, int flags);
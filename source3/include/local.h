@@ -51,6 +51,29 @@
 /* maximum number of file caches per smbd */
 #define MAX_WRITE_CACHES 10
 
+/* maximum number of disjoint extents held in one file's write cache
+   before we start writing them behind */
+#define MAX_WRITE_CACHE_EXTENTS 64
+
+/* directories with at least this many entries get a case-folded name
+   index the first time get_real_filename() has to scan them */
+#define DIR_NAME_INDEX_MIN_ENTRIES 256
+
+/* maximum number of directory name indexes kept per connection */
+#define MAX_DIR_NAME_INDEXES 8
+
+/* maximum memory used by the directory name indexes of a connection, a
+   directory whose index alone would be bigger is not indexed */
+#define DIR_NAME_INDEX_MAX_BYTES (8*1024*1024)
+
+/* first and largest batch of directory entries read and stat'ed ahead
+   of a wildcard search */
+#define DIR_PREFETCH_MIN 8
+#define DIR_PREFETCH_MAX 128
+
+/* seconds a read ahead stat may be handed to a client */
+#define DIR_PREFETCH_MAX_AGE 1
+
 /* define what facility to use for syslog */
 #ifndef SYSLOG_FACILITY
 #define SYSLOG_FACILITY LOG_DAEMON
@@ -162,6 +185,21 @@
 
 #define OPLOCK_BREAK_TIMEOUT_FUDGEFACTOR 2
 
+/* How long (in milliseconds) level2 oplock breaks for another smbd are
+   held to be sent together, and how many fit in one message. */
+
+#define LEVEL2_BREAK_BATCH_MSEC 2
+#define LEVEL2_BREAK_BATCH_MAX 64
+
+/* How long (in milliseconds) change notify events for another smbd are
+   held to be sent together, how many fit in one message, and how many
+   one watch may have queued before they are replaced by a request to
+   enumerate the directory. */
+
+#define NOTIFY_BATCH_MSEC 10
+#define NOTIFY_BATCH_MAX 256
+#define NOTIFY_BATCH_WATCH_MAX 64
+
 /* the read preciction code has been disabled until some problems with
    it are worked out */
 #define USE_READ_PREDICTION 0
@@ -256,4 +294,35 @@
 /* Maximum size of RPC data we will accept for one call. */
 #define MAX_RPC_DATA_SIZE (15*1024*1024)
 
+/* Number of records a dbwrap read cache holds before it starts over. */
+#define DBWRAP_CACHE_MAX_ENTRIES 1000
+
+/* Seconds a failed clustered persistent commit is retried, long enough to
+   get through a ctdb recovery. */
+#define DB_CTDB_COMMIT_RETRY_SECONDS 5
+
+/* Longest wait in milliseconds between two commit retries. */
+#define DB_CTDB_COMMIT_RETRY_MAX_MSECS 1000
+
+/* Bytes of gencache entries each process keeps in memory. */
+#define GENCACHE_RAM_CACHE_SIZE (256*1024)
+
+/* Queued gencache_set_writebehind() entries before they are written. */
+#define GENCACHE_WRITEBEHIND_MAX 32
+
+/* Seconds a gencache_set_writebehind() entry may stay queued. */
+#define GENCACHE_WRITEBEHIND_SECONDS 5
+
+/* Width in seconds of one bucket of the gencache expiry index. */
+#define GENCACHE_EXPIRY_BUCKET_SECONDS 60
+
+/* Expired gencache entries removed by one background sweep. */
+#define GENCACHE_SWEEP_BATCH 100
+
+/* Seconds between background gencache sweeps of a process. */
+#define GENCACHE_SWEEP_INTERVAL 300
+
+/* Each per-file cache type may fill 1/n of the smbd memcache. */
+#define SMBD_MEMCACHE_FILE_CACHE_DIVISOR 4
+
 #endif
@@ -58,14 +58,17 @@ struct byte_range_lock {
 	bool modified;
 	bool read_only;
 	struct file_id key;
-	struct lock_struct *lock_data;
+	struct lock_struct *lock_data; /* Room for the index after the locks. */
+	bool index_valid; /* The index after lock_data is up to date. */
 	struct db_record *record;
 };
 
 /* Internal structure in brlock.tdb. 
-   The data in brlock records is an unsorted linear array of these
-   records.  It is unnecessary to store the count as tdb provides the
-   size of the record */
+   The data in brlock records is a linear array of these records,
+   sorted by start offset, followed by one br_off per record holding
+   the interval index (see brlock.c). Locks with the same start keep
+   the order they were added in. It is unnecessary to store the count
+   as tdb provides the size of the record */
 
 struct lock_struct {
 	struct lock_context context;
@@ -35,6 +35,7 @@ struct memcache;
 
 enum memcache_number {
 	STAT_CACHE,
+	STAT_CACHE_NEGATIVE,
 	UID_SID_CACHE,
 	SID_UID_CACHE,
 	GID_SID_CACHE,
@@ -42,9 +43,28 @@ enum memcache_number {
 	GETWD_CACHE,
 	GETPWNAM_CACHE,		/* talloc */
 	MANGLE_HASH2_CACHE,
+	DOS_ATTR_CACHE,
+	NT_ACL_CACHE,
 	PDB_GETPWSID_CACHE,	/* talloc */
 	SINGLETON_CACHE_TALLOC,	/* talloc */
-	SINGLETON_CACHE
+	NOTIFY_ARRAY_CACHE,	/* talloc */
+	GENCACHE_RAM,
+	SINGLETON_CACHE,
+
+	MEMCACHE_NUM_TYPES	/* must be last */
+};
+
+/*
+ * Per cache type statistics
+ */
+
+struct memcache_stats {
+	unsigned num_entries;
+	size_t size;
+	size_t max_size;
+	unsigned hits;
+	unsigned misses;
+	unsigned evictions;
 };
 
 /*
@@ -62,6 +82,15 @@ struct memcache *memcache_init(TALLOC_CTX *mem_ctx, size_t max_size);
 
 void memcache_set_global(struct memcache *cache);
 
+/*
+ * Limit the memory one cache type may use, on top of the max_size of the
+ * whole cache. 0 means no own limit. When the whole cache is full, the
+ * cache type using the most memory has to give up entries first.
+ */
+
+void memcache_set_budget(struct memcache *cache, enum memcache_number n,
+			 size_t max_size);
+
 /*
  * Add a data blob to the cache
  */
@@ -112,4 +141,19 @@ void *memcache_lookup_talloc(struct memcache *cache, enum memcache_number n,
 
 void memcache_flush(struct memcache *cache, enum memcache_number n);
 
+/*
+ * Get the hit, miss and eviction counters and the memory use of one cache
+ * type.
+ */
+
+bool memcache_get_stats(struct memcache *cache, enum memcache_number n,
+			struct memcache_stats *stats);
+
+/*
+ * Human-readable statistics of all cache types in use, as sent back for
+ * "smbcontrol memcache-stats".
+ */
+
+char *memcache_report(TALLOC_CTX *mem_ctx, struct memcache *cache);
+
 #endif
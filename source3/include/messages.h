@@ -103,6 +103,15 @@ struct messaging_backend {
 			    struct server_id pid, int msg_type,
 			    const DATA_BLOB *data,
 			    struct messaging_backend *backend);
+	/*
+	 * Send the same message to a group of processes, setting a status
+	 * for each of them. A failure return means nothing was sent.
+	 */
+	NTSTATUS (*send_multi_fn)(struct messaging_context *msg_ctx,
+				  const struct server_id *pids, int num_pids,
+				  int msg_type, const DATA_BLOB *data,
+				  NTSTATUS *statuses,
+				  struct messaging_backend *backend);
 	void *private_data;
 };
 
@@ -110,6 +119,10 @@ NTSTATUS messaging_tdb_init(struct messaging_context *msg_ctx,
 			    TALLOC_CTX *mem_ctx,
 			    struct messaging_backend **presult);
 
+NTSTATUS messaging_dgm_init(struct messaging_context *msg_ctx,
+			    TALLOC_CTX *mem_ctx,
+			    struct messaging_backend **presult);
+
 NTSTATUS messaging_ctdbd_init(struct messaging_context *msg_ctx,
 			      TALLOC_CTX *mem_ctx,
 			      struct messaging_backend **presult);
@@ -145,6 +158,10 @@ NTSTATUS messaging_send(struct messaging_context *msg_ctx,
 NTSTATUS messaging_send_buf(struct messaging_context *msg_ctx,
 			    struct server_id server, uint32_t msg_type,
 			    const uint8 *buf, size_t len);
+NTSTATUS messaging_send_multi(struct messaging_context *msg_ctx,
+			      const struct server_id *pids, int num_pids,
+			      uint32_t msg_type, const DATA_BLOB *data,
+			      NTSTATUS *statuses);
 void messaging_dispatch_rec(struct messaging_context *msg_ctx,
 			    struct messaging_rec *rec);
 
@@ -343,6 +343,7 @@ int bitmap_find(struct bitmap *bm, unsigned ofs);
 NTSTATUS smb_register_charset(struct charset_functions *funcs);
 char lp_failed_convert_char(void);
 void lazy_initialize_conv(void);
+bool unix_charset_is_utf8(void);
 void gfree_charcnv(void);
 void init_iconv(void);
 size_t convert_string(charset_t from, charset_t to,
@@ -514,12 +515,16 @@ void pull_file_id_24(char *buf, struct file_id *id);
 bool gencache_init(void);
 bool gencache_shutdown(void);
 bool gencache_set(const char *keystr, const char *value, time_t timeout);
+bool gencache_set_writebehind(const char *keystr, const char *value,
+			      time_t timeout);
 bool gencache_del(const char *keystr);
 bool gencache_get(const char *keystr, char **valstr, time_t *timeout);
 bool gencache_get_data_blob(const char *keystr, DATA_BLOB *blob, bool *expired);
 bool gencache_set_data_blob(const char *keystr, const DATA_BLOB *blob, time_t timeout);
 void gencache_iterate(void (*fn)(const char* key, const char *value, time_t timeout, void* dptr),
                       void* data, const char* keystr_pattern);
+int gencache_sweep(int max_entries);
+void gencache_housekeeping(void);
 int gencache_lock_entry( const char *key );
 void gencache_unlock_entry( const char *key );
 
@@ -635,6 +640,7 @@ int cmd_history(void);
 
 /* The following definitions come from lib/recvfile.c  */
 
+void sys_recvfile_set_pipe(int fd);
 ssize_t sys_recvfile(int fromfd,
 			int tofd,
 			SMB_OFF_T offset,
@@ -643,6 +649,8 @@ ssize_t sys_recvfile(int fromfd,
 			int tofd,
 			SMB_OFF_T offset,
 			size_t count);
+ssize_t sys_recvfile_park(int fromfd, int pipefd, size_t count);
+ssize_t sys_pipe_tee(int pipefd, int teefd, size_t count);
 ssize_t drain_socket(int sockfd, size_t count);
 
 /* The following definitions come from lib/secdesc.c  */
@@ -1557,6 +1565,8 @@ int rpcstr_push(void *dest, const char *src, size_t dest_len, int flags);
 int rpcstr_push_talloc(TALLOC_CTX *ctx, smb_ucs2_t **dest, const char *src);
 smb_ucs2_t toupper_w(smb_ucs2_t val);
 smb_ucs2_t tolower_w( smb_ucs2_t val );
+codepoint_t toupper_m(codepoint_t val);
+codepoint_t tolower_m(codepoint_t val);
 bool islower_w(smb_ucs2_t c);
 bool isupper_w(smb_ucs2_t c);
 bool isvalid83_w(smb_ucs2_t c);
@@ -3049,6 +3059,11 @@ void cli_set_signing_negotiated(struct cli_state *cli);
 struct smbd_server_connection;
 bool srv_check_sign_mac(struct smbd_server_connection *conn,
 			const char *inbuf, uint32_t *seqnum);
+bool srv_check_sign_mac_pull(struct smbd_server_connection *conn,
+			     const char *inbuf, size_t hdr_len,
+			     smb_signing_pull_fn pull_fn,
+			     void *private_data,
+			     uint32_t *seqnum);
 void srv_calculate_sign_mac(struct smbd_server_connection *conn,
 			    char *outbuf, uint32_t seqnum);
 void srv_cancel_sign_response(struct smbd_server_connection *conn);
@@ -5890,7 +5905,10 @@ bool schedule_aio_write_and_X(connection_struct *conn,
 			      files_struct *fsp, char *data,
 			      SMB_OFF_T startpos,
 			      size_t numtowrite);
+bool schedule_aio_write_cache_flush(files_struct *fsp,
+				    struct write_cache_extent *ext);
 int wait_for_aio_completion(files_struct *fsp);
+int wait_for_aio_write_cache_flush(files_struct *fsp);
 void cancel_aio_by_fsp(files_struct *fsp);
 void smbd_aio_complete_mid(unsigned int mid);
 
@@ -6122,6 +6140,10 @@ bool directory_has_default_acl(connection_struct *conn, const char *fname);
 /* The following definitions come from smbd/fileio.c  */
 
 ssize_t read_file(files_struct *fsp,char *data,SMB_OFF_T pos,size_t n);
+void write_cache_flush_done(files_struct *fsp, struct write_cache_extent *ext,
+			    int err);
+int write_cache_sync_range(files_struct *fsp, SMB_OFF_T pos, size_t n,
+			   enum flush_reason_enum reason);
 void trigger_write_time_update(struct files_struct *fsp);
 void trigger_write_time_update_immediate(struct files_struct *fsp);
 ssize_t write_file(struct smb_request *req,
@@ -6151,6 +6173,7 @@ int get_real_filename(connection_struct *conn, const char *path,
 
 /* The following definitions come from smbd/files.c  */
 
+void file_set_file_id(files_struct *fsp, struct file_id id);
 NTSTATUS file_new(struct smb_request *req, connection_struct *conn,
 		  files_struct **result);
 void file_close_conn(connection_struct *conn);
@@ -6442,6 +6465,7 @@ void process_oplock_async_level2_break_message(struct messaging_context *msg_ctx
 						      uint32_t msg_type,
 						      struct server_id src,
 						      DATA_BLOB *data);
+void flush_level2_breaks(void);
 void contend_level2_oplocks_begin(files_struct *fsp,
 				  enum level2_contention_type type);
 void contend_level2_oplocks_end(files_struct *fsp,
@@ -6524,6 +6548,7 @@ SEC_DESC *get_nt_acl_no_snum( TALLOC_CTX *ctx, const char *fname);
 
 void smbd_setup_sig_term_handler(void);
 void smbd_setup_sig_hup_handler(void);
+int smbd_unread_fd(void);
 bool srv_send_smb(int fd, char *buffer,
 		  bool no_signing, uint32_t seqnum,
 		  bool do_encrypt,
@@ -6786,14 +6811,22 @@ ssize_t message_push_string(uint8 **outbuf, const char *str, int flags);
 
 /* The following definitions come from smbd/statcache.c  */
 
-void stat_cache_add( const char *full_orig_name,
-		char *translated_path,
-		bool case_sensitive);
+void stat_cache_add(connection_struct *conn,
+		    const char *full_orig_name,
+		    char *translated_path);
 bool stat_cache_lookup(connection_struct *conn,
 			char **pp_name,
 			char **pp_dirpath,
 			char **pp_start,
 			SMB_STRUCT_STAT *pst);
+void stat_cache_add_negative(connection_struct *conn,
+			     const char *dirpath,
+			     const char *name,
+			     const SMB_STRUCT_STAT *dir_st);
+bool stat_cache_lookup_negative(connection_struct *conn,
+				const char *dirpath,
+				const char *name,
+				SMB_STRUCT_STAT *dir_st);
 void send_stat_cache_delete_message(const char *name);
 void stat_cache_delete(const char *name);
 unsigned int fast_string_hash(TDB_DATA *key);
@@ -327,12 +327,23 @@ typedef struct time_info {
 	uint32 time;
 } UTIME;
 
-typedef struct write_cache {
-	SMB_OFF_T file_size;
+struct write_cache_extent {
+	struct write_cache_extent *prev, *next;
 	SMB_OFF_T offset;
 	size_t alloc_size;
 	size_t data_size;
+	bool flushing; /* Handed to aio, waiting for completion. */
 	char *data;
+};
+
+typedef struct write_cache {
+	SMB_OFF_T file_size;
+	size_t alloc_size; /* Max bytes of dirty data we hold. */
+	size_t data_size; /* Bytes held in all extents. */
+	size_t flush_size; /* Bytes in extents being written behind. */
+	unsigned int num_extents;
+	int flush_error; /* errno from a failed write behind. */
+	struct write_cache_extent *extents; /* Sorted by offset, disjoint. */
 } write_cache;
 
 typedef struct {
@@ -417,6 +428,9 @@ struct notify_change_buf {
 
 typedef struct files_struct {
 	struct files_struct *next, *prev;
+	/* Chains in the file_id hash and on conn->files, see files.c. */
+	struct files_struct *id_next, *id_prev;
+	struct files_struct *conn_next, *conn_prev;
 	int fnum;
 	struct connection_struct *conn;
 	struct fd_handle *fh;
@@ -443,6 +457,8 @@ typedef struct files_struct {
 	struct timed_event *oplock_timeout;
 	struct lock_struct last_lock_failure;
 	int current_lock_count; /* Count the number of outstanding locks and pending locks. */
+	bool brl_unlocked; /* No byte range locks as of brl_unlocked_seqnum. */
+	int brl_unlocked_seqnum; /* brlock.tdb sequence number, see brlock.c. */
 
 	struct share_mode_entry *pending_break_messages;
 	int num_pending_break_messages;
@@ -608,6 +624,19 @@ typedef struct connection_struct {
 	struct dfree_cached_info *dfree_info;
 	struct trans_state *pending_trans;
 	struct notify_context *notify_ctx;
+
+	/* Name lookup cache for unix_convert, see smbd/statcache.c. */
+	struct memcache *stat_cache;
+	unsigned int stat_cache_lookups;
+	unsigned int stat_cache_hits;
+	unsigned int stat_cache_misses;
+	unsigned int stat_cache_negative_hits;
+
+	/* Case-folded indexes of large directories, see smbd/filename.c. */
+	struct dir_name_index *dir_name_indexes;
+
+	/* Files open on this connection, linked through conn_next. */
+	struct files_struct *files;
 } connection_struct;
 
 struct current_user {
@@ -789,6 +818,7 @@ struct share_mode_lock {
 	struct timespec changed_write_time;
 	bool fresh;
 	bool modified;
+	bool relayout; /* share_modes or the names are no longer in record */
 	struct db_record *record;
 };
 
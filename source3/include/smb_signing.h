@@ -24,6 +24,10 @@
 
 struct smb_signing_state;
 
+/* Fetch the next len bytes of a PDU that is not held in memory. */
+typedef bool (*smb_signing_pull_fn)(void *private_data,
+				    uint8_t *buf, size_t len);
+
 struct smb_signing_state *smb_signing_init(TALLOC_CTX *mem_ctx,
 					   bool allowed,
 					   bool mandatory);
@@ -33,6 +37,11 @@ void smb_signing_sign_pdu(struct smb_signing_state *si,
 			  uint8_t *outbuf, uint32_t seqnum);
 bool smb_signing_check_pdu(struct smb_signing_state *si,
 			   const uint8_t *inbuf, uint32_t seqnum);
+bool smb_signing_check_pdu_pull(struct smb_signing_state *si,
+				const uint8_t *inbuf, size_t hdr_len,
+				smb_signing_pull_fn pull_fn,
+				void *private_data,
+				uint32_t seqnum);
 bool smb_signing_set_bsrspyl(struct smb_signing_state *si);
 bool smb_signing_activate(struct smb_signing_state *si,
 			  const DATA_BLOB user_session_key,
@@ -26,7 +26,7 @@
 
 #define PROF_SHMEM_KEY ((key_t)0x07021999)
 #define PROF_SHM_MAGIC 0x6349985
-#define PROF_SHM_VERSION 11
+#define PROF_SHM_VERSION 16
 
 /* time values in the following structure are in microseconds */
 
@@ -783,6 +783,7 @@ struct profile_stats {
 	unsigned statcache_lookups;
 	unsigned statcache_misses;
 	unsigned statcache_hits;
+	unsigned statcache_negative_hits;
 
 /* write cache counters */
 	unsigned writecache_read_hits;
@@ -795,6 +796,25 @@ struct profile_stats {
 	unsigned writecache_num_perfect_writes;
 	unsigned writecache_num_write_caches;
 	unsigned writecache_allocated_write_caches;
+
+/* change notify counters */
+	unsigned notify_events_sent;
+	unsigned notify_events_merged;
+	unsigned notify_events_dropped;
+	unsigned notify_batches_sent;
+
+/* dbwrap read cache counters */
+	unsigned dbwrap_cache_hits;
+	unsigned dbwrap_cache_negative_hits;
+	unsigned dbwrap_cache_misses;
+	unsigned dbwrap_cache_flushes;
+
+/* gencache counters */
+	unsigned gencache_ram_hits;
+	unsigned gencache_ram_misses;
+	unsigned gencache_writebehind_flushes;
+	unsigned gencache_sweeps;
+	unsigned gencache_swept_entries;
 };
 
 struct profile_header {
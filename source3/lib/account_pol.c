@@ -212,19 +212,21 @@ bool init_account_policy(void)
 		return True;
 	}
 
-	db = db_open(NULL, state_path("account_policy.tdb"), 0, TDB_DEFAULT,
+	db = db_open(NULL, state_path("account_policy.tdb"), 0, TDB_SEQNUM,
 		     O_RDWR, 0600);
 
 	if (db == NULL) { /* the account policies files does not exist or open
 			   * failed, try to create a new one */
 		db = db_open(NULL, state_path("account_policy.tdb"), 0,
-			     TDB_DEFAULT, O_RDWR|O_CREAT, 0600);
+			     TDB_SEQNUM, O_RDWR|O_CREAT, 0600);
 		if (db == NULL) {
 			DEBUG(0,("Failed to open account policy database\n"));
 			return False;
 		}
 	}
 
+	db = db_open_cache(NULL, db);
+
 	version = dbwrap_fetch_int32(db, vstring);
 	if (version == DATABASE_VERSION) {
 		return true;
@@ -22,6 +22,10 @@
 */
 #include "includes.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /* We can parameterize this if someone complains.... JRA. */
 
 char lp_failed_convert_char(void)
@@ -46,6 +50,7 @@ char lp_failed_convert_char(void)
 
 
 static smb_iconv_t conv_handles[NUM_CHARSETS][NUM_CHARSETS];
+static bool conv_is_utf8[NUM_CHARSETS]; /* convert to UTF-16LE ourselves */
 static bool conv_silent; /* Should we do a debug if the conversion fails ? */
 static bool initialized;
 
@@ -100,6 +105,16 @@ void lazy_initialize_conv(void)
 	}
 }
 
+/**
+ * Is CH_UNIX UTF-8? Then a string can be walked with next_codepoint()
+ * without calling iconv.
+ **/
+bool unix_charset_is_utf8(void)
+{
+	lazy_initialize_conv();
+	return conv_is_utf8[CH_UNIX];
+}
+
 /**
  * Destroy global objects allocated by init_iconv()
  **/
@@ -173,6 +188,18 @@ void init_iconv(void)
 		}
 	}
 
+	for (c1=0;c1<NUM_CHARSETS;c1++) {
+		smb_iconv_t h = conv_handles[c1][CH_UTF16LE];
+
+		conv_is_utf8[c1] = false;
+		if ((c1 == CH_UTF16LE) || (c1 == CH_UTF16BE)
+		    || (h == (smb_iconv_t)-1) || (h == NULL)) {
+			continue;
+		}
+		conv_is_utf8[c1] = strequal(h->from_name, "UTF-8")
+			|| strequal(h->from_name, "UTF8");
+	}
+
 	if (did_reload) {
 		/* XXX: Does this really get called every time the dos
 		 * codepage changes? */
@@ -356,6 +383,437 @@ static size_t convert_string_internal(charset_t from, charset_t to,
 	}
 }
 
+/*
+ * Block kernels for the ASCII fast paths in convert_string(). They convert
+ * at most n characters while these are in 0x01..0x7f and return how many
+ * they did, the byte loops in convert_string() take care of the rest. They
+ * are only used when the source length is known, so we never read beyond
+ * the end of the source buffer.
+ */
+
+#ifdef __SSE2__
+
+static size_t charcnv_copy_ascii(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+
+	while (n - i >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+
+		/* high bit set or 0 byte */
+		if (_mm_movemask_epi8(
+			    _mm_or_si128(v, _mm_cmpeq_epi8(v, zero))) != 0) {
+			break;
+		}
+		_mm_storeu_si128((__m128i *)(dst + i), v);
+		i += 16;
+	}
+
+	while ((i < n) && (src[i] != 0) && (src[i] <= 0x7f)) {
+		dst[i] = src[i];
+		i++;
+	}
+	return i;
+}
+
+static size_t charcnv_push_ascii16(uint8_t *dst, const uint8_t *src,
+				   size_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+
+	while (n - i >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+
+		if (_mm_movemask_epi8(
+			    _mm_or_si128(v, _mm_cmpeq_epi8(v, zero))) != 0) {
+			break;
+		}
+		_mm_storeu_si128((__m128i *)(dst + 2*i),
+				 _mm_unpacklo_epi8(v, zero));
+		_mm_storeu_si128((__m128i *)(dst + 2*i + 16),
+				 _mm_unpackhi_epi8(v, zero));
+		i += 16;
+	}
+
+	while ((i < n) && (src[i] != 0) && (src[i] <= 0x7f)) {
+		dst[2*i] = src[i];
+		dst[2*i+1] = 0;
+		i++;
+	}
+	return i;
+}
+
+static size_t charcnv_pull_ascii16(uint8_t *dst, const uint8_t *src,
+				   size_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i high = _mm_set1_epi16((short)0xff80);
+	size_t i = 0;
+
+	while (n - i >= 16) {
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(src + 2*i));
+		__m128i v2 = _mm_loadu_si128((const __m128i *)(src + 2*i + 16));
+		__m128i bad1, bad2;
+
+		/* not below 0x80 or 0 */
+		bad1 = _mm_or_si128(
+			_mm_andnot_si128(
+				_mm_cmpeq_epi16(_mm_and_si128(v1, high), zero),
+				_mm_set1_epi16(-1)),
+			_mm_cmpeq_epi16(v1, zero));
+		bad2 = _mm_or_si128(
+			_mm_andnot_si128(
+				_mm_cmpeq_epi16(_mm_and_si128(v2, high), zero),
+				_mm_set1_epi16(-1)),
+			_mm_cmpeq_epi16(v2, zero));
+
+		if (_mm_movemask_epi8(_mm_or_si128(bad1, bad2)) != 0) {
+			break;
+		}
+		_mm_storeu_si128((__m128i *)(dst + i),
+				 _mm_packus_epi16(v1, v2));
+		i += 16;
+	}
+
+	while ((i < n) && (src[2*i] != 0) && (src[2*i] <= 0x7f)
+	       && (src[2*i+1] == 0)) {
+		dst[i] = src[2*i];
+		i++;
+	}
+	return i;
+}
+
+#else
+
+static size_t charcnv_copy_ascii(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	size_t i = 0;
+
+	while ((i < n) && (src[i] != 0) && (src[i] <= 0x7f)) {
+		dst[i] = src[i];
+		i++;
+	}
+	return i;
+}
+
+static size_t charcnv_push_ascii16(uint8_t *dst, const uint8_t *src,
+				   size_t n)
+{
+	size_t i = 0;
+
+	while ((i < n) && (src[i] != 0) && (src[i] <= 0x7f)) {
+		dst[2*i] = src[i];
+		dst[2*i+1] = 0;
+		i++;
+	}
+	return i;
+}
+
+static size_t charcnv_pull_ascii16(uint8_t *dst, const uint8_t *src,
+				   size_t n)
+{
+	size_t i = 0;
+
+	while ((i < n) && (src[2*i] != 0) && (src[2*i] <= 0x7f)
+	       && (src[2*i+1] == 0)) {
+		dst[i] = src[2*i];
+		i++;
+	}
+	return i;
+}
+
+#endif /* __SSE2__ */
+
+#ifndef BROKEN_UNICODE_COMPOSE_CHARACTERS
+
+/*
+ * UTF-8 <-> UTF-16LE without iconv, used when the 8-bit side is UTF-8. Like
+ * the fast paths in convert_string() they stop after a 0 character. An
+ * invalid or incomplete sequence and everything after it is left to iconv,
+ * which knows how to handle allow_bad_conv.
+ */
+
+static size_t utf8_decode(const uint8_t *p, size_t slen, codepoint_t *pc)
+{
+	codepoint_t c, min;
+	size_t len, i;
+
+	if (p[0] <= 0x7f) {
+		*pc = p[0];
+		return 1;
+	}
+
+	if ((p[0] & 0xe0) == 0xc0) {
+		len = 2; c = p[0] & 0x1f; min = 0x80;
+	} else if ((p[0] & 0xf0) == 0xe0) {
+		len = 3; c = p[0] & 0x0f; min = 0x800;
+	} else if ((p[0] & 0xf8) == 0xf0) {
+		len = 4; c = p[0] & 0x07; min = 0x10000;
+	} else {
+		return 0;
+	}
+
+	if (slen < len) {
+		return 0;
+	}
+
+	for (i=1; i<len; i++) {
+		/* This also stops at the terminating 0 */
+		if ((p[i] & 0xc0) != 0x80) {
+			return 0;
+		}
+		c = (c << 6) | (p[i] & 0x3f);
+	}
+
+	if ((c < min) || (c > 0x10ffff) || ((c >= 0xd800) && (c <= 0xdfff))) {
+		return 0;
+	}
+
+	*pc = c;
+	return len;
+}
+
+/*
+ * Store c as UTF-8, returns the number of bytes used or 0 if it does not fit
+ * into dlen bytes.
+ */
+
+static size_t utf8_encode(uint8_t *q, size_t dlen, codepoint_t c)
+{
+	size_t olen;
+
+	if (c <= 0x7f) {
+		olen = 1;
+	} else if (c <= 0x7ff) {
+		olen = 2;
+	} else if (c <= 0xffff) {
+		olen = 3;
+	} else {
+		olen = 4;
+	}
+
+	if (dlen < olen) {
+		return 0;
+	}
+
+	switch (olen) {
+	case 1:
+		q[0] = c;
+		break;
+	case 2:
+		q[0] = 0xc0 | (c >> 6);
+		q[1] = 0x80 | (c & 0x3f);
+		break;
+	case 3:
+		q[0] = 0xe0 | (c >> 12);
+		q[1] = 0x80 | ((c >> 6) & 0x3f);
+		q[2] = 0x80 | (c & 0x3f);
+		break;
+	default:
+		q[0] = 0xf0 | (c >> 18);
+		q[1] = 0x80 | ((c >> 12) & 0x3f);
+		q[2] = 0x80 | ((c >> 6) & 0x3f);
+		q[3] = 0x80 | (c & 0x3f);
+		break;
+	}
+	return olen;
+}
+
+static size_t utf8_to_utf16le(charset_t from, const uint8_t *p, size_t slen,
+			      uint8_t *q, size_t dlen, bool allow_bad_conv)
+{
+	size_t retval = 0;
+
+	while (slen != 0) {
+		codepoint_t c;
+		size_t clen, olen;
+
+		if (slen != (size_t)-1) {
+			size_t n = charcnv_push_ascii16(q, p, MIN(slen, dlen/2));
+			p += n;
+			slen -= n;
+			q += 2*n;
+			dlen -= 2*n;
+			retval += 2*n;
+			if (slen == 0) {
+				break;
+			}
+		}
+
+		clen = utf8_decode(p, slen, &c);
+		if (clen == 0) {
+			size_t ret = convert_string_internal(
+				from, CH_UTF16LE, p, slen, q, dlen,
+				allow_bad_conv);
+			if (ret == (size_t)-1) {
+				return ret;
+			}
+			return retval + ret;
+		}
+
+		olen = (c >= 0x10000) ? 4 : 2;
+		if (dlen < olen) {
+			errno = E2BIG;
+			break;
+		}
+
+		if (c >= 0x10000) {
+			SSVAL(q, 0, 0xd800 | ((c - 0x10000) >> 10));
+			SSVAL(q, 2, 0xdc00 | ((c - 0x10000) & 0x3ff));
+		} else {
+			SSVAL(q, 0, c);
+		}
+
+		p += clen;
+		if (slen != (size_t)-1) {
+			slen -= clen;
+		}
+		q += olen;
+		dlen -= olen;
+		retval += olen;
+
+		if (c == 0) {
+			break;
+		}
+	}
+	return retval;
+}
+
+static size_t utf16le_to_utf8(charset_t to, const uint8_t *p, size_t slen,
+			      uint8_t *q, size_t dlen, bool allow_bad_conv)
+{
+	size_t retval = 0;
+	size_t ret;
+
+	while ((slen == (size_t)-1) || (slen >= 2)) {
+		codepoint_t c;
+		size_t clen, olen;
+
+		if (slen != (size_t)-1) {
+			size_t n = charcnv_pull_ascii16(q, p, MIN(slen/2, dlen));
+			p += 2*n;
+			slen -= 2*n;
+			q += n;
+			dlen -= n;
+			retval += n;
+			if (slen < 2) {
+				break;
+			}
+		}
+
+		c = SVAL(p, 0);
+		clen = 2;
+
+		if ((c >= 0xd800) && (c <= 0xdbff)) {
+			codepoint_t c2;
+
+			if ((slen != (size_t)-1) && (slen < 4)) {
+				goto fallback;
+			}
+			c2 = SVAL(p, 2);
+			if ((c2 < 0xdc00) || (c2 > 0xdfff)) {
+				goto fallback;
+			}
+			c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+			clen = 4;
+		} else if ((c >= 0xdc00) && (c <= 0xdfff)) {
+			goto fallback;
+		}
+
+		olen = utf8_encode(q, dlen, c);
+		if (olen == 0) {
+			errno = E2BIG;
+			break;
+		}
+
+		p += clen;
+		if (slen != (size_t)-1) {
+			slen -= clen;
+		}
+		q += olen;
+		dlen -= olen;
+		retval += olen;
+
+		if (c == 0) {
+			break;
+		}
+	}
+	return retval;
+
+ fallback:
+	ret = convert_string_internal(CH_UTF16LE, to, p, slen, q, dlen,
+				      allow_bad_conv);
+	if (ret == (size_t)-1) {
+		return ret;
+	}
+	return retval + ret;
+}
+
+/*
+ * Change the case of a UTF-8 string without going through UTF-16, using the
+ * same tables as strupper_w() and strlower_w(). This only works as long as
+ * no character changes its length, for that and for invalid input we
+ * return false and the caller has to convert the string. Like the UTF-16
+ * path we stop at the terminating 0, *psize includes it.
+ */
+
+static bool utf8_strcase(const char *src, size_t srclen,
+			 char *dest, size_t destlen, bool upper, size_t *psize)
+{
+	const uint8_t *p = (const uint8_t *)src;
+	uint8_t *q = (uint8_t *)dest;
+	size_t i = 0;
+
+	while ((i < srclen) && (p[i] != 0)) {
+		codepoint_t c, c2;
+		uint8_t buf[4];
+		size_t clen;
+
+		if (p[i] <= 0x7f) {
+			if (i >= destlen) {
+				return false;
+			}
+			if (upper && (p[i] >= 'a') && (p[i] <= 'z')) {
+				q[i] = p[i] - ('a' - 'A');
+			} else if (!upper && (p[i] >= 'A') && (p[i] <= 'Z')) {
+				q[i] = p[i] + ('a' - 'A');
+			} else {
+				q[i] = p[i];
+			}
+			i += 1;
+			continue;
+		}
+
+		clen = utf8_decode(p+i, srclen-i, &c);
+		if ((clen == 0) || (clen > destlen-i)) {
+			return false;
+		}
+
+		c2 = upper ? toupper_m(c) : tolower_m(c);
+
+		if (c2 != c) {
+			if (utf8_encode(buf, sizeof(buf), c2) != clen) {
+				return false;
+			}
+			memcpy(q+i, buf, clen);
+		} else if (q != p) {
+			memcpy(q+i, p+i, clen);
+		}
+		i += clen;
+	}
+
+	if (i >= destlen) {
+		return false;
+	}
+	q[i] = 0;
+	*psize = i+1;
+	return true;
+}
+
+#endif /* BROKEN_UNICODE_COMPOSE_CHARACTERS */
+
 /**
  * Convert string from one encoding to another, making error checking etc
  * Fast path version - handles ASCII first.
@@ -398,6 +856,18 @@ size_t convert_string(charset_t from, charset_t to,
 		unsigned char lastp = '\0';
 		size_t retval = 0;
 
+		if (slen != (size_t)-1) {
+			size_t n = charcnv_copy_ascii(q, p, MIN(slen, dlen));
+			p += n;
+			q += n;
+			slen -= n;
+			dlen -= n;
+			retval += n;
+			if (n != 0) {
+				lastp = p[-1];
+			}
+		}
+
 		/* If all characters are ascii, fast path here. */
 		while (slen && dlen) {
 			if ((lastp = *p) <= 0x7f) {
@@ -437,6 +907,19 @@ size_t convert_string(charset_t from, charset_t to,
 		size_t dlen = destlen;
 		unsigned char lastp = '\0';
 
+		if (slen != (size_t)-1) {
+			size_t n = charcnv_pull_ascii16(q, p,
+							MIN(slen/2, dlen));
+			p += 2*n;
+			q += n;
+			slen -= 2*n;
+			dlen -= n;
+			retval += n;
+			if (n != 0) {
+				lastp = q[-1];
+			}
+		}
+
 		/* If all characters are ascii, fast path here. */
 		while (((slen == (size_t)-1) || (slen >= 2)) && dlen) {
 			if (((lastp = *p) <= 0x7f) && (p[1] == 0)) {
@@ -453,7 +936,13 @@ size_t convert_string(charset_t from, charset_t to,
 #ifdef BROKEN_UNICODE_COMPOSE_CHARACTERS
 				goto general_case;
 #else
-				size_t ret = convert_string_internal(from, to, p, slen, q, dlen, allow_bad_conv);
+				size_t ret;
+
+				if (conv_is_utf8[to]) {
+					ret = utf16le_to_utf8(to, p, slen, q, dlen, allow_bad_conv);
+				} else {
+					ret = convert_string_internal(from, to, p, slen, q, dlen, allow_bad_conv);
+				}
 				if (ret == (size_t)-1) {
 					return ret;
 				}
@@ -477,6 +966,19 @@ size_t convert_string(charset_t from, charset_t to,
 		size_t dlen = destlen;
 		unsigned char lastp = '\0';
 
+		if (slen != (size_t)-1) {
+			size_t n = charcnv_push_ascii16(q, p,
+							MIN(slen, dlen/2));
+			p += n;
+			q += 2*n;
+			slen -= n;
+			dlen -= 2*n;
+			retval += 2*n;
+			if (n != 0) {
+				lastp = p[-1];
+			}
+		}
+
 		/* If all characters are ascii, fast path here. */
 		while (slen && (dlen >= 2)) {
 			if ((lastp = *p) <= 0x7F) {
@@ -493,7 +995,13 @@ size_t convert_string(charset_t from, charset_t to,
 #ifdef BROKEN_UNICODE_COMPOSE_CHARACTERS
 				goto general_case;
 #else
-				size_t ret = convert_string_internal(from, to, p, slen, q, dlen, allow_bad_conv);
+				size_t ret;
+
+				if (conv_is_utf8[from]) {
+					ret = utf8_to_utf16le(from, p, slen, q, dlen, allow_bad_conv);
+				} else {
+					ret = convert_string_internal(from, to, p, slen, q, dlen, allow_bad_conv);
+				}
 				if (ret == (size_t)-1) {
 					return ret;
 				}
@@ -754,6 +1262,14 @@ size_t unix_strupper(const char *src, size_t srclen, char *dest, size_t destlen)
 	size_t size;
 	smb_ucs2_t *buffer;
 
+#ifndef BROKEN_UNICODE_COMPOSE_CHARACTERS
+	lazy_initialize_conv();
+	if (conv_is_utf8[CH_UNIX]
+	    && utf8_strcase(src, srclen, dest, destlen, true, &size)) {
+		return size;
+	}
+#endif
+
 	if (!push_ucs2_talloc(NULL, &buffer, src, &size)) {
 		return (size_t)-1;
 	}
@@ -838,6 +1354,14 @@ size_t unix_strlower(const char *src, size_t srclen, char *dest, size_t destlen)
 	size_t size;
 	smb_ucs2_t *buffer = NULL;
 
+#ifndef BROKEN_UNICODE_COMPOSE_CHARACTERS
+	lazy_initialize_conv();
+	if (conv_is_utf8[CH_UNIX]
+	    && utf8_strcase(src, srclen, dest, destlen, false, &size)) {
+		return size;
+	}
+#endif
+
 	if (!convert_string_talloc(NULL, CH_UNIX, CH_UTF16LE, src, srclen,
 				   (void **)(void *)&buffer, &size,
 				   True))
@@ -1180,8 +1704,12 @@ size_t push_ucs2(const void *base_ptr, void *dest, const char *src, size_t dest_
 		smb_panic("push_ucs2 - invalid dest_len of -1");
 	}
 
+	/*
+	 * Pass the length including the terminator, with a known length
+	 * convert_string() can convert ASCII in blocks.
+	 */
 	if (flags & STR_TERMINATE)
-		src_len = (size_t)-1;
+		src_len = strlen(src) + 1;
 	else
 		src_len = strlen(src);
 
@@ -1813,6 +2341,17 @@ codepoint_t next_codepoint(const char *str, size_t *size)
 
         lazy_initialize_conv();
 
+#ifndef BROKEN_UNICODE_COMPOSE_CHARACTERS
+	if (conv_is_utf8[CH_UNIX]) {
+		codepoint_t c;
+
+		*size = utf8_decode((const uint8_t *)str, ilen, &c);
+		if (*size != 0) {
+			return c;
+		}
+	}
+#endif
+
         descriptor = conv_handles[CH_UNIX][CH_UTF16LE];
 	if (descriptor == (smb_iconv_t)-1 || descriptor == (smb_iconv_t)0) {
 		*size = 1;
@@ -277,16 +277,25 @@ static struct messaging_rec *ctdb_pull_messaging_rec(TALLOC_CTX *mem_ctx,
 
 /*
  * Read a full ctdbd request. If we have a messaging context, defer incoming
- * messages that might come in between.
+ * messages that might come in between. Any reply to one of the num_reqids
+ * requests starting with reqid is accepted, the caller has to look at
+ * hdr->reqid if it has more than one request outstanding.
  */
 
-static NTSTATUS ctdb_read_req(struct ctdbd_connection *conn, uint32 reqid,
-			      TALLOC_CTX *mem_ctx, void *result)
+static NTSTATUS ctdb_read_reqs(struct ctdbd_connection *conn, uint32 reqid,
+			       uint32 num_reqids,
+			       TALLOC_CTX *mem_ctx, void *result)
 {
 	struct ctdb_req_header *hdr;
 	struct req_pull_state state;
 	NTSTATUS status;
 
+	/*
+	 * With several requests outstanding, the last read might already
+	 * have brought in the reply we're waiting for
+	 */
+	goto next_pkt;
+
  again:
 
 	status = packet_fd_read_sync(conn->pkt);
@@ -395,12 +404,12 @@ static NTSTATUS ctdb_read_req(struct ctdbd_connection *conn, uint32 reqid,
 		goto next_pkt;
 	}
 
-	if (hdr->reqid != reqid) {
+	if ((uint32)(hdr->reqid - reqid) >= num_reqids) {
 		/* we got the wrong reply */
 		DEBUG(0,("Discarding mismatched ctdb reqid %u should have "
 			 "been %u\n", hdr->reqid, reqid));
 		TALLOC_FREE(hdr);
-		goto again;
+		goto next_pkt;
 	}
 
 	*((void **)result) = talloc_move(mem_ctx, &hdr);
@@ -408,6 +417,12 @@ static NTSTATUS ctdb_read_req(struct ctdbd_connection *conn, uint32 reqid,
 	return NT_STATUS_OK;
 }
 
+static NTSTATUS ctdb_read_req(struct ctdbd_connection *conn, uint32 reqid,
+			      TALLOC_CTX *mem_ctx, void *result)
+{
+	return ctdb_read_reqs(conn, reqid, 1, mem_ctx, result);
+}
+
 /*
  * Get us a ctdbd connection
  */
@@ -701,8 +716,17 @@ static NTSTATUS ctdbd_control(struct ctdbd_connection *conn,
 	struct ctdbd_connection *new_conn = NULL;
 	NTSTATUS status;
 
-	/* the samba3 ctdb code can't handle NOREPLY yet */
-	flags &= ~CTDB_CTRL_FLAG_NOREPLY;
+	/*
+	 * Only the transaction notifications go out without waiting for
+	 * ctdbd's answer. ctdbd processes them in order with the next
+	 * request on the same connection. All other callers rely on the
+	 * control being done when we return.
+	 */
+	if ((conn == NULL)
+	    || ((opcode != CTDB_CONTROL_TRANS2_FINISHED)
+		&& (opcode != CTDB_CONTROL_TRANS2_ERROR))) {
+		flags &= ~CTDB_CTRL_FLAG_NOREPLY;
+	}
 
 	if (conn == NULL) {
 		status = ctdbd_init_connection(NULL, &new_conn);
@@ -726,6 +750,7 @@ static NTSTATUS ctdbd_control(struct ctdbd_connection *conn,
 	req.opcode           = opcode;
 	req.srvid            = srvid;
 	req.datalen          = data.dsize;
+	req.flags            = flags;
 
 	DEBUG(10, ("ctdbd_control: Sending ctdb packet\n"));
 	ctdb_packet_dump(&req.hdr);
@@ -947,10 +972,97 @@ NTSTATUS ctdbd_migrate(struct ctdbd_connection *conn, uint32 db_id,
 }
 
 /*
- * remotely fetch a record without locking it or forcing a migration
+ * force the migration of a batch of records to this node. All requests are
+ * sent in one go, ctdbd can then work on them in parallel instead of us
+ * waiting for one round trip per record.
+ */
+NTSTATUS ctdbd_migrate_multi(struct ctdbd_connection *conn, uint32 db_id,
+			     const TDB_DATA *keys, int num_keys)
+{
+	struct ctdb_req_call req;
+	struct ctdb_reply_call *reply;
+	uint32 first_reqid;
+	NTSTATUS status;
+	int i;
+
+	if (num_keys == 0) {
+		return NT_STATUS_OK;
+	}
+
+	first_reqid = conn->reqid + 1;
+
+	for (i=0; i<num_keys; i++) {
+		ZERO_STRUCT(req);
+
+		req.hdr.length = offsetof(struct ctdb_req_call, data)
+			+ keys[i].dsize;
+		req.hdr.ctdb_magic   = CTDB_MAGIC;
+		req.hdr.ctdb_version = CTDB_VERSION;
+		req.hdr.operation    = CTDB_REQ_CALL;
+		req.hdr.reqid        = ++conn->reqid;
+		req.flags            = CTDB_IMMEDIATE_MIGRATION;
+		req.callid           = CTDB_NULL_FUNC;
+		req.db_id            = db_id;
+		req.keylen           = keys[i].dsize;
+
+		status = packet_send(
+			conn->pkt, 2,
+			data_blob_const(&req,
+					offsetof(struct ctdb_req_call, data)),
+			data_blob_const(keys[i].dptr, keys[i].dsize));
+
+		if (!NT_STATUS_IS_OK(status)) {
+			DEBUG(3, ("packet_send failed: %s\n",
+				  nt_errstr(status)));
+			return status;
+		}
+	}
+
+	DEBUG(10, ("ctdbd_migrate_multi: Sending %d ctdb packets\n",
+		   num_keys));
+
+	status = packet_flush(conn->pkt);
+
+	if (!NT_STATUS_IS_OK(status)) {
+		DEBUG(3, ("write to ctdbd failed: %s\n", nt_errstr(status)));
+		cluster_fatal("cluster dispatch daemon control write error\n");
+	}
+
+	/*
+	 * Collect all replies, even if one of them fails: We must not leave
+	 * replies to outstanding requests on the socket.
+	 */
+
+	for (i=0; i<num_keys; i++) {
+		NTSTATUS rstatus;
+
+		rstatus = ctdb_read_reqs(conn, first_reqid, num_keys, NULL,
+					 (void *)&reply);
+		if (!NT_STATUS_IS_OK(rstatus)) {
+			DEBUG(0, ("ctdb_read_req failed: %s\n",
+				  nt_errstr(rstatus)));
+			cluster_fatal("ctdbd died\n");
+		}
+
+		if (reply->hdr.operation != CTDB_REPLY_CALL) {
+			DEBUG(0, ("received invalid reply\n"));
+			status = NT_STATUS_INTERNAL_ERROR;
+		}
+		TALLOC_FREE(reply);
+	}
+
+	return status;
+}
+
+/*
+ * remotely fetch a record without locking it or forcing a migration. With
+ * local_copy, ask ctdbd to leave a read-only copy of the record in our local
+ * tdb, so that following reads can be served locally until a writer on
+ * another node revokes it.
  */
 NTSTATUS ctdbd_fetch(struct ctdbd_connection *conn, uint32 db_id,
-		     TDB_DATA key, TALLOC_CTX *mem_ctx, TDB_DATA *data)
+		     TDB_DATA key, TALLOC_CTX *mem_ctx, TDB_DATA *data,
+		     bool local_copy)
 {
 	struct ctdb_req_call req;
 	struct ctdb_reply_call *reply;
@@ -964,6 +1076,11 @@ NTSTATUS ctdbd_fetch(struct ctdbd_connection *conn, uint32 db_id,
 	req.hdr.operation    = CTDB_REQ_CALL;
 	req.hdr.reqid        = ++conn->reqid;
 	req.flags            = 0;
+#ifdef HAVE_CTDB_WANT_READONLY_DECL
+	if (local_copy) {
+		req.flags |= CTDB_WANT_READONLY;
+	}
+#endif
 	req.callid           = CTDB_FETCH_FUNC;
 	req.db_id            = db_id;
 	req.keylen           = key.dsize;
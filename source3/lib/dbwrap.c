@@ -158,6 +158,22 @@ struct db_context *db_open(TALLOC_CTX *mem_ctx,
 	return result;
 }
 
+/**
+ * Announce that we are about to lock all of "keys". For clustered
+ * databases this pulls the records we don't own yet to this node in one
+ * batch instead of one round trip per record. A no-op for local databases.
+ */
+NTSTATUS dbwrap_migrate_records(struct db_context *db,
+				const TDB_DATA *keys, int num_keys)
+{
+#ifdef CLUSTER_SUPPORT
+	if (lp_clustering()) {
+		return db_ctdb_migrate_records(db, keys, num_keys);
+	}
+#endif
+	return NT_STATUS_OK;
+}
+
 NTSTATUS dbwrap_delete(struct db_context *db, TDB_DATA key)
 {
 	struct db_record *rec;
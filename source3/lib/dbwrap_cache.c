@@ -0,0 +1,357 @@
+/*
+   Unix SMB/CIFS implementation.
+   Process-local read cache in front of a dbwrap database
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "includes.h"
+
+/*
+ * The cache keeps copies of records read from the backing database in two
+ * rbt databases, one for records found and one for records known not to
+ * exist. Both are thrown away as soon as the sequence number of the backing
+ * database moves, so the backing database must be opened with TDB_SEQNUM.
+ *
+ * The sequence number is read before the backing database is asked, so a
+ * record changed while we fetch it is cached under the old sequence number
+ * and dropped on the next lookup. All writes go straight to the backing
+ * database.
+ */
+
+struct db_cache_ctx {
+	struct db_context *backing;
+	struct db_context *positive;
+	struct db_context *negative;
+	int seqnum;
+	unsigned num_entries;
+	unsigned num_parsers;
+	bool stale;
+};
+
+static void dbwrap_cache_invalidate(struct db_cache_ctx *ctx)
+{
+	if (ctx->num_parsers != 0) {
+		/*
+		 * A parser further up the stack still looks at our
+		 * records, drop them once it is done.
+		 */
+		ctx->stale = true;
+		return;
+	}
+	if ((ctx->positive != NULL) && (ctx->num_entries != 0)) {
+		DO_PROFILE_INC(dbwrap_cache_flushes);
+	}
+	TALLOC_FREE(ctx->positive);
+	TALLOC_FREE(ctx->negative);
+	ctx->num_entries = 0;
+	ctx->stale = false;
+}
+
+/*
+ * Make sure the cached records belong to the current sequence number of the
+ * backing database. Returns false if we can't cache right now, the caller
+ * then has to ask the backing database directly.
+ */
+
+static bool dbwrap_cache_validate(struct db_cache_ctx *ctx)
+{
+	int seqnum = ctx->backing->get_seqnum(ctx->backing);
+
+	if ((ctx->positive != NULL) && !ctx->stale && (seqnum == ctx->seqnum)
+	    && (ctx->num_entries < DBWRAP_CACHE_MAX_ENTRIES)) {
+		return true;
+	}
+
+	if (ctx->num_parsers != 0) {
+		ctx->stale = true;
+		return false;
+	}
+
+	dbwrap_cache_invalidate(ctx);
+
+	ctx->positive = db_open_rbt(ctx);
+	ctx->negative = db_open_rbt(ctx);
+	if ((ctx->positive == NULL) || (ctx->negative == NULL)) {
+		TALLOC_FREE(ctx->positive);
+		TALLOC_FREE(ctx->negative);
+		return false;
+	}
+
+	ctx->seqnum = seqnum;
+	return true;
+}
+
+static int dbwrap_cache_parse_fn(TDB_DATA key, TDB_DATA data,
+				 void *private_data)
+{
+	TDB_DATA *value = (TDB_DATA *)private_data;
+	*value = data;
+	return 0;
+}
+
+/*
+ * Look up a key in the cache. Returns true if the cache knows about the
+ * key, *value is then either the cached record or tdb_null for a record
+ * known not to exist. The data belongs to the cache.
+ */
+
+static bool dbwrap_cache_lookup(struct db_cache_ctx *ctx, TDB_DATA key,
+				TDB_DATA *value)
+{
+	if (ctx->positive->parse_record(ctx->positive, key,
+					dbwrap_cache_parse_fn, value) == 0) {
+		DO_PROFILE_INC(dbwrap_cache_hits);
+		return true;
+	}
+
+	if (ctx->negative->parse_record(ctx->negative, key,
+					dbwrap_cache_parse_fn, value) == 0) {
+		DO_PROFILE_INC(dbwrap_cache_negative_hits);
+		*value = tdb_null;
+		return true;
+	}
+
+	DO_PROFILE_INC(dbwrap_cache_misses);
+	return false;
+}
+
+static void dbwrap_cache_add(struct db_cache_ctx *ctx, TDB_DATA key,
+			     TDB_DATA value)
+{
+	struct db_context *db;
+	NTSTATUS status;
+
+	db = (value.dptr != NULL) ? ctx->positive : ctx->negative;
+
+	status = dbwrap_store(db, key, value, 0);
+	if (!NT_STATUS_IS_OK(status)) {
+		DEBUG(5, ("dbwrap_cache_add: could not cache record: %s\n",
+			  nt_errstr(status)));
+		return;
+	}
+	ctx->num_entries += 1;
+}
+
+static int dbwrap_cache_fetch(struct db_context *db, TALLOC_CTX *mem_ctx,
+			      TDB_DATA key, TDB_DATA *data)
+{
+	struct db_cache_ctx *ctx = talloc_get_type_abort(
+		db->private_data, struct db_cache_ctx);
+	TDB_DATA value;
+	int res;
+
+	if (!dbwrap_cache_validate(ctx)) {
+		return ctx->backing->fetch(ctx->backing, mem_ctx, key, data);
+	}
+
+	if (dbwrap_cache_lookup(ctx, key, &value)) {
+		if (value.dptr == NULL) {
+			*data = tdb_null;
+			return 0;
+		}
+		data->dptr = (uint8 *)talloc_memdup(mem_ctx, value.dptr,
+						    value.dsize);
+		if (data->dptr == NULL) {
+			return -1;
+		}
+		data->dsize = value.dsize;
+		return 0;
+	}
+
+	res = ctx->backing->fetch(ctx->backing, mem_ctx, key, data);
+	if (res == 0) {
+		dbwrap_cache_add(ctx, key, *data);
+	}
+	return res;
+}
+
+static int dbwrap_cache_parse_record(struct db_context *db, TDB_DATA key,
+				     int (*parser)(TDB_DATA key,
+						   TDB_DATA data,
+						   void *private_data),
+				     void *private_data)
+{
+	struct db_cache_ctx *ctx = talloc_get_type_abort(
+		db->private_data, struct db_cache_ctx);
+	TDB_DATA value;
+	int res;
+
+	if (!dbwrap_cache_validate(ctx)) {
+		return ctx->backing->parse_record(ctx->backing, key, parser,
+						  private_data);
+	}
+
+	if (!dbwrap_cache_lookup(ctx, key, &value)) {
+		res = ctx->backing->fetch(ctx->backing, talloc_tos(), key,
+					  &value);
+		if (res != 0) {
+			return res;
+		}
+		dbwrap_cache_add(ctx, key, value);
+		if (value.dptr == NULL) {
+			return -1;
+		}
+		res = parser(key, value, private_data);
+		TALLOC_FREE(value.dptr);
+		return res;
+	}
+
+	if (value.dptr == NULL) {
+		return -1;
+	}
+
+	ctx->num_parsers += 1;
+	res = parser(key, value, private_data);
+	ctx->num_parsers -= 1;
+
+	if (ctx->stale && (ctx->num_parsers == 0)) {
+		dbwrap_cache_invalidate(ctx);
+	}
+	return res;
+}
+
+static struct db_record *dbwrap_cache_fetch_locked(struct db_context *db,
+						   TALLOC_CTX *mem_ctx,
+						   TDB_DATA key)
+{
+	struct db_cache_ctx *ctx = talloc_get_type_abort(
+		db->private_data, struct db_cache_ctx);
+	return ctx->backing->fetch_locked(ctx->backing, mem_ctx, key);
+}
+
+static int dbwrap_cache_traverse(struct db_context *db,
+				 int (*f)(struct db_record *rec,
+					  void *private_data),
+				 void *private_data)
+{
+	struct db_cache_ctx *ctx = talloc_get_type_abort(
+		db->private_data, struct db_cache_ctx);
+	return ctx->backing->traverse(ctx->backing, f, private_data);
+}
+
+static int dbwrap_cache_traverse_read(struct db_context *db,
+				      int (*f)(struct db_record *rec,
+					       void *private_data),
+				      void *private_data)
+{
+	struct db_cache_ctx *ctx = talloc_get_type_abort(
+		db->private_data, struct db_cache_ctx);
+	return ctx->backing->traverse_read(ctx->backing, f, private_data);
+}
+
+static int dbwrap_cache_get_seqnum(struct db_context *db)
+{
+	struct db_cache_ctx *ctx = talloc_get_type_abort(
+		db->private_data, struct db_cache_ctx);
+	return ctx->backing->get_seqnum(ctx->backing);
+}
+
+static int dbwrap_cache_get_flags(struct db_context *db)
+{
+	struct db_cache_ctx *ctx = talloc_get_type_abort(
+		db->private_data, struct db_cache_ctx);
+	return ctx->backing->get_flags(ctx->backing);
+}
+
+/*
+ * A cancelled transaction rolls the sequence number back, so a record we
+ * read inside the transaction could later match a different commit with
+ * the same sequence number. Start over around transactions.
+ */
+
+static int dbwrap_cache_transaction_start(struct db_context *db)
+{
+	struct db_cache_ctx *ctx = talloc_get_type_abort(
+		db->private_data, struct db_cache_ctx);
+	dbwrap_cache_invalidate(ctx);
+	return ctx->backing->transaction_start(ctx->backing);
+}
+
+static int dbwrap_cache_transaction_commit(struct db_context *db)
+{
+	struct db_cache_ctx *ctx = talloc_get_type_abort(
+		db->private_data, struct db_cache_ctx);
+	dbwrap_cache_invalidate(ctx);
+	return ctx->backing->transaction_commit(ctx->backing);
+}
+
+static int dbwrap_cache_transaction_cancel(struct db_context *db)
+{
+	struct db_cache_ctx *ctx = talloc_get_type_abort(
+		db->private_data, struct db_cache_ctx);
+	dbwrap_cache_invalidate(ctx);
+	return ctx->backing->transaction_cancel(ctx->backing);
+}
+
+/*
+ * Put a read cache in front of "backing". On success the cache takes over
+ * ownership of "backing". If the database can't be cached, "backing" is
+ * returned unchanged: the cache is only an optimization.
+ */
+
+struct db_context *db_open_cache(TALLOC_CTX *mem_ctx,
+				 struct db_context *backing)
+{
+	struct db_context *result;
+	struct db_cache_ctx *ctx;
+
+	if (backing == NULL) {
+		return NULL;
+	}
+
+	if (lp_clustering()) {
+		/*
+		 * ctdb pushes records from other nodes into the local
+		 * copy, we can't rely on the sequence number there.
+		 */
+		return backing;
+	}
+
+	if ((backing->get_seqnum == NULL) || (backing->get_flags == NULL)
+	    || ((backing->get_flags(backing) & TDB_SEQNUM) == 0)) {
+		DEBUG(1, ("db_open_cache: database not opened with "
+			  "TDB_SEQNUM, not caching\n"));
+		return backing;
+	}
+
+	result = TALLOC_ZERO_P(mem_ctx, struct db_context);
+	if (result == NULL) {
+		DEBUG(0, ("talloc failed\n"));
+		return backing;
+	}
+
+	result->private_data = ctx = TALLOC_ZERO_P(result,
+						   struct db_cache_ctx);
+	if (ctx == NULL) {
+		DEBUG(0, ("talloc failed\n"));
+		TALLOC_FREE(result);
+		return backing;
+	}
+
+	ctx->backing = talloc_move(ctx, &backing);
+
+	result->fetch_locked = dbwrap_cache_fetch_locked;
+	result->fetch = dbwrap_cache_fetch;
+	result->traverse = dbwrap_cache_traverse;
+	result->traverse_read = dbwrap_cache_traverse_read;
+	result->parse_record = dbwrap_cache_parse_record;
+	result->get_seqnum = dbwrap_cache_get_seqnum;
+	result->get_flags = dbwrap_cache_get_flags;
+	result->transaction_start = dbwrap_cache_transaction_start;
+	result->transaction_commit = dbwrap_cache_transaction_commit;
+	result->transaction_cancel = dbwrap_cache_transaction_cancel;
+	result->persistent = ctx->backing->persistent;
+	return result;
+}
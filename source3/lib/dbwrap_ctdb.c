@@ -609,6 +609,20 @@ failed:
 }
 
 
+/*
+  how long to wait before retrying a failed commit. A conflicting commit
+  from another node is usually resolved quickly, a recovery takes longer.
+  Back off exponentially up to DB_CTDB_COMMIT_RETRY_MAX_MSECS, with some
+  jitter so that nodes that collided don't collide again.
+ */
+static unsigned int db_ctdb_commit_retry_msecs(int retries)
+{
+	unsigned int msecs = 50 << MIN(retries, 5);
+
+	msecs += sys_random() % msecs;
+	return MIN(msecs, DB_CTDB_COMMIT_RETRY_MAX_MSECS);
+}
+
 /*
   commit a transaction
  */
@@ -620,6 +634,7 @@ static int db_ctdb_transaction_commit(struct db_context *db)
 	int ret;
 	int status;
 	int retries = 0;
+	struct timeval start;
 	struct db_ctdb_transaction_handle *h = ctx->transaction;
 	enum ctdb_controls failure_control = CTDB_CONTROL_TRANS2_ERROR;
 
@@ -643,6 +658,8 @@ static int db_ctdb_transaction_commit(struct db_context *db)
 
 	talloc_set_destructor(h, NULL);
 
+	start = timeval_current();
+
 	/* our commit strategy is quite complex.
 
 	   - we first try to commit the changes to all other nodes
@@ -656,6 +673,10 @@ static int db_ctdb_transaction_commit(struct db_context *db)
 	     reads and writes (checking that reads give the same data,
 	     and writes succeed). Then we retry the transaction to the
 	     other nodes
+
+	   Only the commit to the other nodes needs an answer from
+	   ctdbd. The final notifications are sent without waiting for a
+	   reply, ctdbd processes them in order before our next request.
 	*/
 
 again:
@@ -674,7 +695,7 @@ again:
 				   db_ctdb_marshall_finish(h->m_write), NULL, NULL, &status);
 	if (!NT_STATUS_IS_OK(rets) || status != 0) {
 		tdb_transaction_cancel(h->ctx->wtdb->tdb);
-		sleep(1);
+		smb_msleep(db_ctdb_commit_retry_msecs(retries));
 
 		if (!NT_STATUS_IS_OK(rets)) {
 			failure_control = CTDB_CONTROL_TRANS2_ERROR;			
@@ -693,7 +714,16 @@ again:
 			}
 		}
 
-		if (++retries == 5) {
+		DEBUG(5, (__location__ " Commit on db 0x%08x failed, "
+			  "retry %d\n", h->ctx->db_id, retries+1));
+
+		retries += 1;
+
+		/*
+		 * Keep retrying for a while, a recovery of the cluster
+		 * can take a few seconds.
+		 */
+		if (timeval_elapsed(&start) >= DB_CTDB_COMMIT_RETRY_SECONDS) {
 			DEBUG(0,(__location__ " Giving up transaction on db 0x%08x after %d retries failure_control=%u\n", 
 				 h->ctx->db_id, retries, (unsigned)failure_control));
 			ctdbd_control_local(messaging_ctdbd_connection(), failure_control,
@@ -812,6 +842,44 @@ static NTSTATUS db_ctdb_delete(struct db_record *rec)
 
 }
 
+/*
+ * Can we serve a request for this record from our local copy? For a read,
+ * being dmaster or holding a read-only copy delegated by the dmaster is
+ * enough. A write has to go through ctdbd as long as other nodes hold
+ * read-only copies, the migration request makes ctdbd revoke them.
+ */
+
+static bool db_ctdb_can_use_local_copy(TDB_DATA ctdb_data, bool read_only)
+{
+	struct ctdb_ltdb_header *hdr;
+
+	if ((ctdb_data.dptr == NULL) ||
+	    (ctdb_data.dsize < sizeof(struct ctdb_ltdb_header))) {
+		return false;
+	}
+
+	hdr = (struct ctdb_ltdb_header *)ctdb_data.dptr;
+
+#ifdef HAVE_CTDB_WANT_READONLY_DECL
+	if (read_only) {
+		if (hdr->dmaster == get_my_vnn()) {
+			return true;
+		}
+		return ((hdr->flags & CTDB_REC_RO_HAVE_READONLY) != 0)
+			&& ((hdr->flags & CTDB_REC_RO_REVOKING_READONLY) == 0);
+	}
+
+	if ((hdr->flags & (CTDB_REC_RO_HAVE_DELEGATIONS|
+			   CTDB_REC_RO_HAVE_READONLY|
+			   CTDB_REC_RO_REVOKING_READONLY|
+			   CTDB_REC_RO_REVOKE_COMPLETE)) != 0) {
+		return false;
+	}
+#endif
+
+	return (hdr->dmaster == get_my_vnn());
+}
+
 static int db_ctdb_record_destr(struct db_record* data)
 {
 	struct db_ctdb_rec *crec = talloc_get_type_abort(
@@ -896,13 +964,7 @@ again:
 	 * take the shortcut and just return it.
 	 */
 
-	if ((ctdb_data.dptr == NULL) ||
-	    (ctdb_data.dsize < sizeof(struct ctdb_ltdb_header)) ||
-	    ((struct ctdb_ltdb_header *)ctdb_data.dptr)->dmaster != get_my_vnn()
-#if 0
-	    || (random() % 2 != 0)
-#endif
-) {
+	if (!db_ctdb_can_use_local_copy(ctdb_data, false)) {
 		SAFE_FREE(ctdb_data.dptr);
 		tdb_chainunlock(ctx->wtdb->tdb, key);
 		talloc_set_destructor(result, NULL);
@@ -985,15 +1047,15 @@ static int db_ctdb_fetch(struct db_context *db, TALLOC_CTX *mem_ctx,
 	ctdb_data = tdb_fetch(ctx->wtdb->tdb, key);
 
 	/*
-	 * See if we have a valid record and we are the dmaster. If so, we can
-	 * take the shortcut and just return it.
+	 * See if we have a valid record and we are the dmaster or hold a
+	 * read-only copy. If so, we can take the shortcut and just return it.
 	 * we bypass the dmaster check for persistent databases
 	 */
 	if ((ctdb_data.dptr != NULL) &&
 	    (ctdb_data.dsize >= sizeof(struct ctdb_ltdb_header)) &&
 	    (db->persistent ||
-	     ((struct ctdb_ltdb_header *)ctdb_data.dptr)->dmaster == get_my_vnn())) {
-		/* we are the dmaster - avoid the ctdb protocol op */
+	     db_ctdb_can_use_local_copy(ctdb_data, true))) {
+		/* avoid the ctdb protocol op */
 
 		data->dsize = ctdb_data.dsize - sizeof(struct ctdb_ltdb_header);
 		if (data->dsize == 0) {
@@ -1016,8 +1078,12 @@ static int db_ctdb_fetch(struct db_context *db, TALLOC_CTX *mem_ctx,
 
 	SAFE_FREE(ctdb_data.dptr);
 
-	/* we weren't able to get it locally - ask ctdb to fetch it for us */
-	status = ctdbd_fetch(messaging_ctdbd_connection(),ctx->db_id, key, mem_ctx, data);
+	/*
+	 * we weren't able to get it locally - ask ctdb to fetch it for us,
+	 * and to keep a read-only copy here for the next reader
+	 */
+	status = ctdbd_fetch(messaging_ctdbd_connection(), ctx->db_id, key,
+			     mem_ctx, data, true);
 	if (!NT_STATUS_IS_OK(status)) {
 		DEBUG(5, ("ctdbd_fetch failed: %s\n", nt_errstr(status)));
 		return -1;
@@ -1026,6 +1092,50 @@ static int db_ctdb_fetch(struct db_context *db, TALLOC_CTX *mem_ctx,
 	return 0;
 }
 
+/*
+ * Make sure we are dmaster of all the records in "keys" before locking them
+ * one by one. Records we don't own yet are migrated with one batch of
+ * requests to ctdbd. This is only an optimization: fetch_locked checks
+ * again and migrates a record on its own if we lost it in between.
+ */
+NTSTATUS db_ctdb_migrate_records(struct db_context *db,
+				 const TDB_DATA *keys, int num_keys)
+{
+	struct db_ctdb_ctx *ctx;
+	TDB_DATA *to_migrate;
+	int i, num_to_migrate;
+	NTSTATUS status;
+
+	ctx = talloc_get_type(db->private_data, struct db_ctdb_ctx);
+	if ((ctx == NULL) || db->persistent || (ctx->transaction != NULL)) {
+		/* not a volatile ctdb database, nothing to migrate */
+		return NT_STATUS_OK;
+	}
+
+	to_migrate = TALLOC_ARRAY(talloc_tos(), TDB_DATA, num_keys);
+	if (to_migrate == NULL) {
+		return NT_STATUS_NO_MEMORY;
+	}
+	num_to_migrate = 0;
+
+	for (i=0; i<num_keys; i++) {
+		TDB_DATA ctdb_data = tdb_fetch(ctx->wtdb->tdb, keys[i]);
+
+		if (!db_ctdb_can_use_local_copy(ctdb_data, false)) {
+			to_migrate[num_to_migrate++] = keys[i];
+		}
+		SAFE_FREE(ctdb_data.dptr);
+	}
+
+	DEBUG(10, ("db_ctdb_migrate_records: migrating %d of %d records\n",
+		   num_to_migrate, num_keys));
+
+	status = ctdbd_migrate_multi(messaging_ctdbd_connection(),
+				     ctx->db_id, to_migrate, num_to_migrate);
+	TALLOC_FREE(to_migrate);
+	return status;
+}
+
 struct traverse_state {
 	struct db_context *db;
 	int (*fn)(struct db_record *rec, void *private_data);
@@ -1204,6 +1314,33 @@ struct db_context *db_open_ctdb(TALLOC_CTX *mem_ctx,
 
 	result->persistent = ((tdb_flags & TDB_CLEAR_IF_FIRST) == 0);
 
+#ifdef HAVE_CTDB_WANT_READONLY_DECL
+	/*
+	 * ctdbd only hands out read-only copies of records in databases
+	 * that asked for it. This pays off for records that are read a lot
+	 * more often than written, so by default only for locking.tdb.
+	 */
+	if (!result->persistent &&
+	    lp_parm_bool(-1, "ctdb readonly", name,
+			 strequal(name, "locking.tdb"))) {
+		TDB_DATA indata;
+		NTSTATUS status;
+		int cstatus;
+
+		indata = make_tdb_data((uint8_t *)&db_ctdb->db_id,
+				       sizeof(db_ctdb->db_id));
+
+		status = ctdbd_control_local(
+			messaging_ctdbd_connection(),
+			CTDB_CONTROL_SET_DB_READONLY, 0, 0, indata,
+			NULL, NULL, &cstatus);
+		if (!NT_STATUS_IS_OK(status) || (cstatus != 0)) {
+			DEBUG(1, ("Could not enable read-only records "
+				  "for %s\n", name));
+		}
+	}
+#endif
+
 	/* only pass through specific flags */
 	tdb_flags &= TDB_SEQNUM;
 
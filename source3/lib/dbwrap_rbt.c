@@ -284,17 +284,15 @@ static struct db_record *db_rbt_fetch_locked(struct db_context *db_ctx,
 	return result;
 }
 
-static int db_rbt_fetch(struct db_context *db, TALLOC_CTX *mem_ctx,
-			TDB_DATA key, TDB_DATA *data)
+static bool db_rbt_search_internal(struct db_context *db, TDB_DATA key,
+				   TDB_DATA *value)
 {
 	struct db_rbt_ctx *ctx = talloc_get_type_abort(
 		db->private_data, struct db_rbt_ctx);
 
 	struct rb_node *n;
-	bool found = false;
 	struct db_rbt_node *r = NULL;
 	TDB_DATA search_key, search_val;
-	uint8_t *result;
 
 	n = ctx->tree.rb_node;
 
@@ -314,12 +312,21 @@ static int db_rbt_fetch(struct db_context *db, TALLOC_CTX *mem_ctx,
 			n = n->rb_right;
 		}
 		else {
-			found = true;
-			break;
+			*value = search_val;
+			return true;
 		}
 	}
 
-	if (!found) {
+	return false;
+}
+
+static int db_rbt_fetch(struct db_context *db, TALLOC_CTX *mem_ctx,
+			TDB_DATA key, TDB_DATA *data)
+{
+	TDB_DATA search_val;
+	uint8_t *result;
+
+	if (!db_rbt_search_internal(db, key, &search_val)) {
 		*data = tdb_null;
 		return 0;
 	}
@@ -335,6 +342,19 @@ static int db_rbt_fetch(struct db_context *db, TALLOC_CTX *mem_ctx,
 	return 0;
 }
 
+static int db_rbt_parse_record(struct db_context *db, TDB_DATA key,
+			       int (*parser)(TDB_DATA key, TDB_DATA data,
+					     void *private_data),
+			       void *private_data)
+{
+	TDB_DATA value;
+
+	if (!db_rbt_search_internal(db, key, &value)) {
+		return -1;
+	}
+
+	return parser(key, value, private_data);
+}
 
 static int db_rbt_traverse(struct db_context *db,
 			   int (*f)(struct db_record *db,
@@ -379,6 +399,7 @@ struct db_context *db_open_rbt(TALLOC_CTX *mem_ctx)
 
 	result->fetch_locked = db_rbt_fetch_locked;
 	result->fetch = db_rbt_fetch;
+	result->parse_record = db_rbt_parse_record;
 	result->traverse = db_rbt_traverse;
 	result->traverse_read = db_rbt_traverse;
 	result->get_seqnum = db_rbt_get_seqnum;
@@ -38,8 +38,69 @@ static TDB_CONTEXT *cache;
  * @brief Generic, persistent and shared between processes cache mechanism
  *        for use by various parts of the Samba code
  *
+ * Lookups are served from a per-process memcache in front of gencache.tdb
+ * whenever possible. The in-memory entries are dropped as soon as the
+ * sequence number of gencache.tdb changes, so we see changes made by other
+ * processes on the next lookup.
+ *
+ * gencache_set_writebehind() does not store the entry in gencache.tdb right
+ * away but queues it. The queue is written out when it is full, when its
+ * oldest entry is older than GENCACHE_WRITEBEHIND_SECONDS or when the
+ * whole tdb is looked at. Entries that are lost when a process dies before
+ * that must be cheap to recreate.
+ *
+ * Every store also lists the key in a time-ordered expiry index, so that
+ * gencache_sweep() can remove expired entries nobody asks for anymore
+ * without walking the whole tdb.
  **/
 
+/*
+ * In-memory representation of an entry. The value follows the header,
+ * strings include their terminating 0.
+ */
+
+enum gencache_ram_type {
+	GENCACHE_RAM_ABSENT,	/* we know there is no entry */
+	GENCACHE_RAM_STRING,
+	GENCACHE_RAM_BLOB
+};
+
+struct gencache_ram_hdr {
+	time_t timeout;
+	uint8_t type;
+};
+
+static struct memcache *gencache_ram;
+static int gencache_seqnum;
+
+struct gencache_pending {
+	char *keystr;
+	char *value;
+	time_t timeout;
+};
+
+static struct gencache_pending *gencache_pending;
+static int gencache_num_pending;
+static time_t gencache_pending_since;
+
+static bool gencache_set_tdb(const char *keystr, const char *value,
+			     time_t timeout);
+static bool gencache_parse_timeout(TDB_DATA value, time_t *timeout);
+
+/*
+ * The expiry index lives in gencache.tdb itself. GENCACHE_EXPIRY/<n> holds
+ * the 0-terminated keys of all entries stored with a timeout in the n-th
+ * slot of GENCACHE_EXPIRY_BUCKET_SECONDS. GENCACHE_EXPIRY/FIRST is the
+ * oldest bucket not yet swept.
+ */
+
+#define GENCACHE_EXPIRY_PREFIX "GENCACHE_EXPIRY/"
+#define GENCACHE_EXPIRY_FIRST GENCACHE_EXPIRY_PREFIX "FIRST"
+
+/* Don't look at more than a day of buckets in one gencache_sweep() */
+#define GENCACHE_SWEEP_MAX_BUCKETS \
+	((24*60*60) / GENCACHE_EXPIRY_BUCKET_SECONDS)
+
 
 /**
  * Cache initialisation function. Opens cache tdb file or creates
@@ -60,11 +121,11 @@ bool gencache_init(void)
 
 	DEBUG(5, ("Opening cache file at %s\n", cache_fname));
 
-	cache = tdb_open_log(cache_fname, 0, TDB_DEFAULT,
+	cache = tdb_open_log(cache_fname, 0, TDB_SEQNUM,
 	                     O_RDWR|O_CREAT, 0644);
 
 	if (!cache && (errno == EACCES)) {
-		cache = tdb_open_log(cache_fname, 0, TDB_DEFAULT, O_RDONLY, 0644);
+		cache = tdb_open_log(cache_fname, 0, TDB_SEQNUM, O_RDONLY, 0644);
 		if (cache) {
 			DEBUG(5, ("gencache_init: Opening cache file %s read-only.\n", cache_fname));
 		}
@@ -74,9 +135,258 @@ bool gencache_init(void)
 		DEBUG(5, ("Attempt to open gencache.tdb has failed.\n"));
 		return False;
 	}
+
+	gencache_ram = memcache_init(NULL, GENCACHE_RAM_CACHE_SIZE);
+	if (gencache_ram == NULL) {
+		DEBUG(1, ("gencache_init: could not create the in-memory "
+			  "cache\n"));
+	}
+	gencache_seqnum = tdb_get_seqnum(cache);
+
 	return True;
 }
 
+/*
+ * Throw away the in-memory entries if someone changed gencache.tdb
+ */
+
+static void gencache_ram_validate(void)
+{
+	int seqnum;
+
+	if (gencache_ram == NULL) {
+		return;
+	}
+
+	seqnum = tdb_get_seqnum(cache);
+	if (seqnum != gencache_seqnum) {
+		memcache_flush(gencache_ram, GENCACHE_RAM);
+		gencache_seqnum = seqnum;
+	}
+}
+
+/*
+ * Look up a key in the in-memory cache. Returns the type of the entry,
+ * or -1 if we have to ask gencache.tdb.
+ */
+
+static int gencache_ram_lookup(const char *keystr, time_t *timeout,
+			       DATA_BLOB *value)
+{
+	struct gencache_ram_hdr hdr;
+	DATA_BLOB blob;
+
+	if (gencache_ram == NULL) {
+		return -1;
+	}
+
+	if (!memcache_lookup(gencache_ram, GENCACHE_RAM,
+			     data_blob_string_const(keystr), &blob)) {
+		DO_PROFILE_INC(gencache_ram_misses);
+		return -1;
+	}
+
+	DO_PROFILE_INC(gencache_ram_hits);
+
+	memcpy(&hdr, blob.data, sizeof(hdr));
+	*timeout = hdr.timeout;
+	*value = data_blob_const(blob.data + sizeof(hdr),
+				 blob.length - sizeof(hdr));
+	return hdr.type;
+}
+
+static void gencache_ram_add(const char *keystr, enum gencache_ram_type type,
+			     time_t timeout, const void *data, size_t length)
+{
+	struct gencache_ram_hdr hdr;
+	uint8_t *buf;
+
+	if (gencache_ram == NULL) {
+		return;
+	}
+
+	buf = TALLOC_ARRAY(talloc_tos(), uint8_t, sizeof(hdr) + length);
+	if (buf == NULL) {
+		return;
+	}
+
+	ZERO_STRUCT(hdr);
+	hdr.timeout = timeout;
+	hdr.type = type;
+	memcpy(buf, &hdr, sizeof(hdr));
+	if (length != 0) {
+		memcpy(buf + sizeof(hdr), data, length);
+	}
+
+	memcache_add(gencache_ram, GENCACHE_RAM,
+		     data_blob_string_const(keystr),
+		     data_blob_const(buf, sizeof(hdr) + length));
+	TALLOC_FREE(buf);
+}
+
+static void gencache_ram_del(const char *keystr)
+{
+	if (gencache_ram == NULL) {
+		return;
+	}
+	memcache_delete(gencache_ram, GENCACHE_RAM,
+			data_blob_string_const(keystr));
+}
+
+/*
+ * Write-behind queue handling
+ */
+
+static struct gencache_pending *gencache_pending_find(const char *keystr)
+{
+	int i;
+
+	for (i=0; i<gencache_num_pending; i++) {
+		if (strcmp(gencache_pending[i].keystr, keystr) == 0) {
+			return &gencache_pending[i];
+		}
+	}
+	return NULL;
+}
+
+static void gencache_pending_remove(struct gencache_pending *p)
+{
+	TALLOC_FREE(p->keystr);
+	TALLOC_FREE(p->value);
+	gencache_num_pending -= 1;
+	*p = gencache_pending[gencache_num_pending];
+}
+
+static void gencache_writebehind_flush(void)
+{
+	int i;
+
+	if (gencache_num_pending == 0) {
+		return;
+	}
+
+	DEBUG(10, ("Writing %d queued cache entries\n",
+		   gencache_num_pending));
+	DO_PROFILE_INC(gencache_writebehind_flushes);
+
+	for (i=0; i<gencache_num_pending; i++) {
+		struct gencache_pending *p = &gencache_pending[i];
+
+		if (!gencache_set_tdb(p->keystr, p->value, p->timeout)) {
+			DEBUG(5, ("Could not write cache entry %s\n",
+				  p->keystr));
+		}
+		TALLOC_FREE(p->keystr);
+		TALLOC_FREE(p->value);
+	}
+	gencache_num_pending = 0;
+}
+
+static void gencache_writebehind_check(void)
+{
+	if ((gencache_num_pending != 0) &&
+	    (time(NULL) - gencache_pending_since
+	     >= GENCACHE_WRITEBEHIND_SECONDS)) {
+		gencache_writebehind_flush();
+	}
+}
+
+
+/*
+ * Expiry index handling
+ */
+
+static bool gencache_is_expiry_key(const char *keystr)
+{
+	return strncmp(keystr, GENCACHE_EXPIRY_PREFIX,
+		       sizeof(GENCACHE_EXPIRY_PREFIX)-1) == 0;
+}
+
+static uint32_t gencache_expiry_bucket(time_t t)
+{
+	return (uint32_t)t / GENCACHE_EXPIRY_BUCKET_SECONDS;
+}
+
+static void gencache_expiry_keyname(fstring keyname, uint32_t bucket)
+{
+	fstr_sprintf(keyname, GENCACHE_EXPIRY_PREFIX "%u", (unsigned)bucket);
+}
+
+/*
+ * List a freshly stored key in the expiry index. A key can end up in more
+ * than one bucket when it is stored again with another timeout, the
+ * sweeper looks at the real timeout before it deletes anything.
+ */
+
+static void gencache_expiry_add(const char *keystr, time_t timeout)
+{
+	uint32_t bucket = gencache_expiry_bucket(timeout);
+	uint32_t now_bucket = gencache_expiry_bucket(time(NULL));
+	fstring keyname;
+
+	if (gencache_is_expiry_key(keystr)) {
+		return;
+	}
+
+	if (bucket < now_bucket) {
+		/*
+		 * Already expired. Older buckets might have been swept
+		 * already, let the next sweep pick it up.
+		 */
+		bucket = now_bucket;
+	}
+
+	gencache_expiry_keyname(keyname, bucket);
+
+	if (tdb_append(cache, string_term_tdb_data(keyname),
+		       string_term_tdb_data(keystr)) != 0) {
+		DEBUG(5, ("Could not add %s to expiry index: %s\n", keystr,
+			  tdb_errorstr(cache)));
+	}
+}
+
+/*
+ * Store an entry and list it in the expiry index. When the entry we
+ * overwrite is already listed in the bucket of the new timeout, the index
+ * is left alone, so a key stored over and over does not grow its bucket
+ * record. The chainlock keeps the sweeper from deleting the old entry
+ * between us looking at it and storing the new one.
+ */
+
+static int gencache_store_indexed(const char *keystr, TDB_DATA databuf,
+				  time_t timeout)
+{
+	TDB_DATA key = string_term_tdb_data(keystr);
+	TDB_DATA old;
+	time_t old_timeout;
+	uint32_t bucket = gencache_expiry_bucket(timeout);
+	bool listed = false;
+	int ret;
+
+	if (tdb_chainlock(cache, key) != 0) {
+		return -1;
+	}
+
+	old = tdb_fetch(cache, key);
+	if (gencache_parse_timeout(old, &old_timeout)) {
+		/*
+		 * Entries with a timeout in the past were listed in
+		 * whatever bucket was current then, we don't know which.
+		 */
+		listed = (gencache_expiry_bucket(old_timeout) == bucket)
+			&& (bucket >= gencache_expiry_bucket(time(NULL)));
+	}
+	SAFE_FREE(old.dptr);
+
+	ret = tdb_store(cache, key, databuf, 0);
+	tdb_chainunlock(cache, key);
+
+	if ((ret == 0) && !listed) {
+		gencache_expiry_add(keystr, timeout);
+	}
+	return ret;
+}
+
 
 /**
  * Cache shutdown function. Closes opened cache tdb file.
@@ -90,6 +400,9 @@ bool gencache_shutdown(void)
 	int ret;
 	/* tdb_close routine returns -1 on error */
 	if (!cache) return False;
+	gencache_writebehind_flush();
+	TALLOC_FREE(gencache_pending);
+	TALLOC_FREE(gencache_ram);
 	DEBUG(5, ("Closing cache file\n"));
 	ret = tdb_close(cache);
 	cache = NULL;
@@ -111,15 +424,29 @@ bool gencache_shutdown(void)
 
 bool gencache_set(const char *keystr, const char *value, time_t timeout)
 {
-	int ret;
-	TDB_DATA databuf;
-	char* valstr = NULL;
+	struct gencache_pending *p;
 
 	/* fail completely if get null pointers passed */
 	SMB_ASSERT(keystr && value);
 
 	if (!gencache_init()) return False;
 
+	p = gencache_pending_find(keystr);
+	if (p != NULL) {
+		gencache_pending_remove(p);
+	}
+	gencache_ram_del(keystr);
+
+	return gencache_set_tdb(keystr, value, timeout);
+}
+
+static bool gencache_set_tdb(const char *keystr, const char *value,
+			     time_t timeout)
+{
+	int ret;
+	TDB_DATA databuf;
+	char* valstr = NULL;
+
 	if (asprintf(&valstr, CACHE_DATA_FMT, (int)timeout, value) == -1) {
 		return False;
 	}
@@ -130,10 +457,76 @@ bool gencache_set(const char *keystr, const char *value, time_t timeout)
 		   (int)(timeout - time(NULL)), 
 		   timeout > time(NULL) ? "ahead" : "in the past"));
 
-	ret = tdb_store_bystring(cache, keystr, databuf, 0);
+	ret = gencache_store_indexed(keystr, databuf, timeout);
 	SAFE_FREE(valstr);
 
-	return ret == 0;
+	return (ret == 0);
+}
+
+/**
+ * Like gencache_set(), but queue the entry instead of writing it to
+ * gencache.tdb right away. Only for entries that other processes can
+ * live without for a few seconds, and that are cheap to recreate if this
+ * process dies before the queue is written.
+ *
+ * @param keystr string that represents a key of this entry
+ * @param value text representation value being cached
+ * @param timeout time when the value is expired
+ *
+ * @retval true when entry is successfuly queued or stored
+ * @retval false on failure
+ **/
+
+bool gencache_set_writebehind(const char *keystr, const char *value,
+			      time_t timeout)
+{
+	struct gencache_pending *p;
+
+	/* fail completely if get null pointers passed */
+	SMB_ASSERT(keystr && value);
+
+	if (!gencache_init()) return False;
+
+	if (gencache_pending == NULL) {
+		gencache_pending = TALLOC_ARRAY(
+			NULL, struct gencache_pending,
+			GENCACHE_WRITEBEHIND_MAX);
+		if (gencache_pending == NULL) {
+			return gencache_set(keystr, value, timeout);
+		}
+	}
+
+	p = gencache_pending_find(keystr);
+	if (p == NULL) {
+		if (gencache_num_pending == GENCACHE_WRITEBEHIND_MAX) {
+			gencache_writebehind_flush();
+		}
+		if (gencache_num_pending == 0) {
+			gencache_pending_since = time(NULL);
+		}
+		p = &gencache_pending[gencache_num_pending];
+		p->keystr = talloc_strdup(gencache_pending, keystr);
+		p->value = NULL;
+		if (p->keystr == NULL) {
+			return gencache_set(keystr, value, timeout);
+		}
+		gencache_num_pending += 1;
+	}
+
+	TALLOC_FREE(p->value);
+	p->value = talloc_strdup(gencache_pending, value);
+	if (p->value == NULL) {
+		gencache_pending_remove(p);
+		return gencache_set(keystr, value, timeout);
+	}
+	p->timeout = timeout;
+
+	DEBUG(10, ("Queued cache entry with key = %s; value = %s\n",
+		   keystr, value));
+
+	gencache_ram_del(keystr);
+	gencache_writebehind_check();
+	return True;
 }
 
 /**
@@ -147,6 +540,8 @@ bool gencache_set(const char *keystr, const char *value, time_t timeout)
 
 bool gencache_del(const char *keystr)
 {
+	struct gencache_pending *p;
+	bool was_pending = false;
 	int ret;
 
 	/* fail completely if get null pointers passed */
@@ -154,10 +549,17 @@ bool gencache_del(const char *keystr)
 
 	if (!gencache_init()) return False;	
 
+	p = gencache_pending_find(keystr);
+	if (p != NULL) {
+		gencache_pending_remove(p);
+		was_pending = true;
+	}
+	gencache_ram_del(keystr);
+
 	DEBUG(10, ("Deleting cache entry (key = %s)\n", keystr));
 	ret = tdb_delete_bystring(cache, keystr);
 
-	return ret == 0;
+	return (ret == 0) || was_pending;
 }
 
 
@@ -176,9 +578,12 @@ bool gencache_del(const char *keystr)
 
 bool gencache_get(const char *keystr, char **valstr, time_t *timeout)
 {
+	struct gencache_pending *p;
 	TDB_DATA databuf;
+	DATA_BLOB ramval;
 	time_t t;
 	char *endptr;
+	const char *value;
 
 	/* fail completely if get null pointers passed */
 	SMB_ASSERT(keystr);
@@ -187,11 +592,33 @@ bool gencache_get(const char *keystr, char **valstr, time_t *timeout)
 		return False;
 	}
 
+	gencache_writebehind_check();
+
+	p = gencache_pending_find(keystr);
+	if (p != NULL) {
+		t = p->timeout;
+		value = p->value;
+		goto found;
+	}
+
+	gencache_ram_validate();
+
+	switch (gencache_ram_lookup(keystr, &t, &ramval)) {
+	case GENCACHE_RAM_ABSENT:
+		return False;
+	case GENCACHE_RAM_STRING:
+		value = (const char *)ramval.data;
+		goto found;
+	default:
+		break;
+	}
+
 	databuf = tdb_fetch_bystring(cache, keystr);
 
 	if (databuf.dptr == NULL) {
 		DEBUG(10, ("Cache entry with key = %s couldn't be found\n",
 			   keystr));
+		gencache_ram_add(keystr, GENCACHE_RAM_ABSENT, 0, NULL, 0);
 		return False;
 	}
 
@@ -216,6 +643,9 @@ bool gencache_get(const char *keystr, char **valstr, time_t *timeout)
 		return False;
 	}
 
+	gencache_ram_add(keystr, GENCACHE_RAM_STRING, t, endptr+1,
+			 strlen(endptr+1)+1);
+
 	if (valstr) {
 		*valstr = SMB_STRDUP(endptr+1);
 		if (*valstr == NULL) {
@@ -231,6 +661,31 @@ bool gencache_get(const char *keystr, char **valstr, time_t *timeout)
 		*timeout = t;
 	}
 
+	return True;
+
+ found:
+	if (t <= time(NULL)) {
+		/* We're expired, delete the entry everywhere */
+		if (p != NULL) {
+			gencache_pending_remove(p);
+		}
+		gencache_ram_del(keystr);
+		tdb_delete_bystring(cache, keystr);
+		return False;
+	}
+
+	if (valstr) {
+		*valstr = SMB_STRDUP(value);
+		if (*valstr == NULL) {
+			DEBUG(0, ("strdup failed\n"));
+			return False;
+		}
+	}
+
+	if (timeout) {
+		*timeout = t;
+	}
+
 	return True;
 } 
 
@@ -248,6 +703,7 @@ bool gencache_get(const char *keystr, char **valstr, time_t *timeout)
 bool gencache_get_data_blob(const char *keystr, DATA_BLOB *blob, bool *expired)
 {
 	TDB_DATA databuf;
+	DATA_BLOB ramval;
 	time_t t;
 	char *blob_type;
 	unsigned char *buf = NULL;
@@ -263,10 +719,35 @@ bool gencache_get_data_blob(const char *keystr, DATA_BLOB *blob, bool *expired)
 		return False;
 	}
 
+	gencache_writebehind_check();
+
+	if (gencache_pending_find(keystr) == NULL) {
+		gencache_ram_validate();
+
+		switch (gencache_ram_lookup(keystr, &t, &ramval)) {
+		case GENCACHE_RAM_ABSENT:
+			return False;
+		case GENCACHE_RAM_BLOB:
+			if ((t <= time(NULL)) && expired) {
+				*expired = True;
+			}
+			if (blob) {
+				*blob = data_blob(ramval.data, ramval.length);
+				if (!blob->data) {
+					return False;
+				}
+			}
+			return True;
+		default:
+			break;
+		}
+	}
+
 	databuf = tdb_fetch_bystring(cache, keystr);
 	if (!databuf.dptr) {
 		DEBUG(10,("Cache entry with key = %s couldn't be found\n",
 			  keystr));
+		gencache_ram_add(keystr, GENCACHE_RAM_ABSENT, 0, NULL, 0);
 		return False;
 	}
 
@@ -297,6 +778,8 @@ bool gencache_get_data_blob(const char *keystr, DATA_BLOB *blob, bool *expired)
 		}
 	}
 
+	gencache_ram_add(keystr, GENCACHE_RAM_BLOB, t, blob_buf, blob_len);
+
 	if (blob) {
 		*blob = data_blob(blob_buf, blob_len);
 		if (!blob->data) {
@@ -326,6 +809,7 @@ bool gencache_get_data_blob(const char *keystr, DATA_BLOB *blob, bool *expired)
 
 bool gencache_set_data_blob(const char *keystr, const DATA_BLOB *blob, time_t timeout)
 {
+	struct gencache_pending *p;
 	bool ret = False;
 	int tdb_ret;
 	TDB_DATA databuf;
@@ -340,6 +824,12 @@ bool gencache_set_data_blob(const char *keystr, const DATA_BLOB *blob, time_t ti
 		return False;
 	}
 
+	p = gencache_pending_find(keystr);
+	if (p != NULL) {
+		gencache_pending_remove(p);
+	}
+	gencache_ram_del(keystr);
+
 	if (asprintf(&valstr, "%12u/%s", (int)timeout, BLOB_TYPE) == -1) {
 		return False;
 	}
@@ -373,7 +863,7 @@ bool gencache_set_data_blob(const char *keystr, const DATA_BLOB *blob, time_t ti
 		  ctime(&timeout), (int)(timeout - time(NULL)),
 		  timeout > time(NULL) ? "ahead" : "in the past"));
 
-	tdb_ret = tdb_store_bystring(cache, keystr, databuf, 0);
+	tdb_ret = gencache_store_indexed(keystr, databuf, timeout);
 	if (tdb_ret == 0) {
 		ret = True;
 	}
@@ -428,6 +918,10 @@ static int gencache_iterate_fn(struct tdb_context *tdb, TDB_DATA key,
 		goto done;
 	}
 
+	if (gencache_is_expiry_key(keystr)) {
+		goto done;
+	}
+
 	if (fnmatch(state->pattern, keystr, 0) != 0) {
 		goto done;
 	}
@@ -470,6 +964,8 @@ void gencache_iterate(void (*fn)(const char* key, const char *value, time_t time
 
 	if (!gencache_init()) return;
 
+	gencache_writebehind_flush();
+
 	DEBUG(5, ("Searching cache keys with pattern %s\n", keystr_pattern));
 
 	state.fn = fn;
@@ -478,6 +974,329 @@ void gencache_iterate(void (*fn)(const char* key, const char *value, time_t time
 	tdb_traverse(cache, gencache_iterate_fn, &state);
 }
 
+/*
+ * Get the timeout of a stored entry, both string and blob entries start
+ * with it.
+ */
+
+static bool gencache_parse_timeout(TDB_DATA value, time_t *timeout)
+{
+	char buf[TIMEOUT_LEN+2];
+	char *endp;
+	unsigned long u;
+
+	if ((value.dptr == NULL) || (value.dsize <= TIMEOUT_LEN)) {
+		return false;
+	}
+
+	memcpy(buf, value.dptr, TIMEOUT_LEN+1);
+	buf[TIMEOUT_LEN+1] = '\0';
+
+	u = strtoul(buf, &endp, 10);
+	if ((*endp != '/') || ((endp-buf) != TIMEOUT_LEN)) {
+		return false;
+	}
+	*timeout = u;
+	return true;
+}
+
+/*
+ * Delete an entry listed in the expiry index if it is really expired. It
+ * might have been stored again with a different timeout in the meantime,
+ * it is then listed in another bucket as well. Returns true if the entry
+ * was swept, *keep is set if it still belongs into "bucket".
+ */
+
+static bool gencache_sweep_entry(const char *keystr, uint32_t bucket,
+				 time_t now, bool *keep)
+{
+	TDB_DATA key = string_term_tdb_data(keystr);
+	TDB_DATA value;
+	time_t timeout;
+	bool swept = false;
+
+	*keep = false;
+
+	if (tdb_chainlock(cache, key) != 0) {
+		return false;
+	}
+
+	value = tdb_fetch(cache, key);
+
+	if (gencache_parse_timeout(value, &timeout)) {
+		if (timeout <= now) {
+			DEBUG(10, ("Sweeping expired cache entry %s\n",
+				   keystr));
+			swept = (tdb_delete(cache, key) == 0);
+		} else {
+			*keep = (gencache_expiry_bucket(timeout) == bucket);
+		}
+	}
+
+	SAFE_FREE(value.dptr);
+	tdb_chainunlock(cache, key);
+	return swept;
+}
+
+/*
+ * Sweep one bucket of the index. The bucket record is taken away as a
+ * whole, so concurrent stores start a new one. Entries that are not
+ * expired yet are listed again.
+ */
+
+static int gencache_sweep_bucket(uint32_t bucket, time_t now)
+{
+	fstring keyname;
+	TDB_DATA key, keys;
+	struct db_context *seen;
+	size_t ofs;
+	int swept = 0;
+
+	gencache_expiry_keyname(keyname, bucket);
+	key = string_term_tdb_data(keyname);
+
+	if (tdb_chainlock(cache, key) != 0) {
+		return 0;
+	}
+	keys = tdb_fetch(cache, key);
+	if (keys.dptr != NULL) {
+		tdb_delete(cache, key);
+	}
+	tdb_chainunlock(cache, key);
+
+	if (keys.dptr == NULL) {
+		return 0;
+	}
+
+	/*
+	 * A key stored more than once within one bucket is listed more
+	 * than once, look at it only once.
+	 */
+	seen = db_open_rbt(talloc_tos());
+
+	ofs = 0;
+	while (ofs < keys.dsize) {
+		const char *keystr = (const char *)keys.dptr + ofs;
+		size_t len = strnlen(keystr, keys.dsize - ofs);
+		bool keep;
+
+		if (len == keys.dsize - ofs) {
+			DEBUG(1, ("Invalid gencache expiry record %s\n",
+				  keyname));
+			break;
+		}
+		ofs += len + 1;
+
+		if (seen != NULL) {
+			if (dbwrap_fetch_int32(seen, keystr) != -1) {
+				continue;
+			}
+			dbwrap_store_int32(seen, keystr, 0);
+		}
+
+		if (gencache_sweep_entry(keystr, bucket, now, &keep)) {
+			swept += 1;
+		}
+		if (keep) {
+			tdb_append(cache, key, string_term_tdb_data(keystr));
+		}
+	}
+
+	TALLOC_FREE(seen);
+	SAFE_FREE(keys.dptr);
+	return swept;
+}
+
+/*
+ * gencache.tdb written before we had the expiry index: remove what is
+ * expired and index the rest.
+ */
+
+struct gencache_sweep_legacy_state {
+	time_t now;
+	int swept;
+	struct gencache_pending *valid;
+	int num_valid;
+};
+
+static int gencache_sweep_legacy_fn(struct tdb_context *tdb, TDB_DATA key,
+				    TDB_DATA value, void *priv)
+{
+	struct gencache_sweep_legacy_state *state =
+		(struct gencache_sweep_legacy_state *)priv;
+	struct gencache_pending ent;
+	time_t timeout;
+
+	if ((key.dsize == 0) || (key.dptr[key.dsize-1] != '\0')) {
+		return 0;
+	}
+	if (gencache_is_expiry_key((const char *)key.dptr)) {
+		return 0;
+	}
+	if (!gencache_parse_timeout(value, &timeout)) {
+		return 0;
+	}
+
+	if (timeout <= state->now) {
+		if (tdb_delete(tdb, key) == 0) {
+			state->swept += 1;
+		}
+		return 0;
+	}
+
+	/*
+	 * We can't append to the index while traversing, remember the
+	 * entry for later.
+	 */
+	ZERO_STRUCT(ent);
+	ent.keystr = talloc_strdup(talloc_tos(), (const char *)key.dptr);
+	ent.timeout = timeout;
+	if (ent.keystr == NULL) {
+		return -1;
+	}
+	ADD_TO_ARRAY(talloc_tos(), struct gencache_pending, ent,
+		     &state->valid, &state->num_valid);
+	return 0;
+}
+
+static int gencache_sweep_legacy(time_t now)
+{
+	struct gencache_sweep_legacy_state state;
+	int i;
+
+	DEBUG(5, ("Building gencache expiry index\n"));
+
+	ZERO_STRUCT(state);
+	state.now = now;
+
+	if (tdb_traverse(cache, gencache_sweep_legacy_fn, &state) == -1) {
+		DEBUG(1, ("Could not build gencache expiry index\n"));
+	}
+
+	for (i=0; i<state.num_valid; i++) {
+		gencache_expiry_add(state.valid[i].keystr,
+				    state.valid[i].timeout);
+	}
+
+	return state.swept;
+}
+
+/*
+ * Take the oldest bucket that lies completely in the past. Only one
+ * process gets it, a process that finds someone else at it gives up.
+ */
+
+static bool gencache_sweep_claim(uint32_t now_bucket, uint32_t *bucket,
+				 bool *legacy)
+{
+	TDB_DATA key = string_term_tdb_data(GENCACHE_EXPIRY_FIRST);
+	uint32_t first;
+	bool ret = false;
+
+	if (tdb_chainlock_nonblock(cache, key) != 0) {
+		return false;
+	}
+
+	*legacy = false;
+
+	if (!tdb_fetch_uint32(cache, GENCACHE_EXPIRY_FIRST, &first)) {
+		*legacy = true;
+		ret = tdb_store_uint32(cache, GENCACHE_EXPIRY_FIRST,
+				       now_bucket);
+		goto done;
+	}
+
+	if (first < now_bucket) {
+		*bucket = first;
+		ret = tdb_store_uint32(cache, GENCACHE_EXPIRY_FIRST,
+				       first + 1);
+	}
+
+ done:
+	tdb_chainunlock(cache, key);
+	return ret;
+}
+
+/**
+ * Remove expired entries from the cache file. Entries are normally only
+ * removed when someone looks them up, this gets rid of the ones nobody
+ * asks for anymore.
+ *
+ * @param max_entries stop after roughly this many entries
+ *
+ * @return the number of entries removed
+ **/
+
+int gencache_sweep(int max_entries)
+{
+	TALLOC_CTX *frame;
+	time_t now = time(NULL);
+	uint32_t now_bucket = gencache_expiry_bucket(now);
+	uint32_t bucket = 0;
+	bool legacy;
+	int num_buckets = 0;
+	int swept = 0;
+
+	if (!gencache_init()) {
+		return 0;
+	}
+
+	frame = talloc_stackframe();
+	DO_PROFILE_INC(gencache_sweeps);
+
+	while ((swept < max_entries)
+	       && (num_buckets < GENCACHE_SWEEP_MAX_BUCKETS)
+	       && gencache_sweep_claim(now_bucket, &bucket, &legacy)) {
+		if (legacy) {
+			swept += gencache_sweep_legacy(now);
+			break;
+		}
+		swept += gencache_sweep_bucket(bucket, now);
+		num_buckets += 1;
+	}
+
+	if (swept < max_entries) {
+		/*
+		 * Entries stored with a timeout in the past are listed in
+		 * the current bucket, and entries here might just have
+		 * expired. Nobody claims this bucket, it is still growing.
+		 */
+		swept += gencache_sweep_bucket(now_bucket, now);
+		num_buckets += 1;
+	}
+
+	DO_PROFILE_ADD(gencache_swept_entries, swept);
+	DEBUG(swept ? 5 : 10, ("Swept %d expired cache entries from %d "
+			       "buckets\n", swept, num_buckets));
+
+	TALLOC_FREE(frame);
+	return swept;
+}
+
+/**
+ * Periodic cache maintenance, to be called from the main loop of long
+ * running daemons. Writes out queued entries that are due and sweeps
+ * expired entries every GENCACHE_SWEEP_INTERVAL seconds.
+ **/
+
+void gencache_housekeeping(void)
+{
+	static time_t last_sweep;
+	time_t now = time(NULL);
+
+	if (cache != NULL) {
+		gencache_writebehind_check();
+	}
+
+	if ((now >= last_sweep)
+	    && ((now - last_sweep) < GENCACHE_SWEEP_INTERVAL)) {
+		return;
+	}
+	last_sweep = now;
+
+	gencache_sweep(GENCACHE_SWEEP_BATCH);
+}
+
 /********************************************************************
  lock a key
 ********************************************************************/
@@ -487,6 +1306,8 @@ int gencache_lock_entry( const char *key )
 	if (!gencache_init())
 		return -1;
 
+	gencache_writebehind_flush();
+
 	return tdb_lock_bystring(cache, key);
 }
 
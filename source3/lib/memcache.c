@@ -18,25 +18,43 @@
 */
 
 #include "memcache.h"
-#include "../lib/util/rbtree.h"
 
 static struct memcache *global_cache;
 
+/*
+ * Every memcache_number lives in its own shard with its own hash table, LRU
+ * list, optional size budget and statistics. Churn in one cache type thus
+ * does not walk or evict the entries of the others.
+ */
+
 struct memcache_element {
-	struct rb_node rb_node;
+	struct memcache_element *hash_next;
 	struct memcache_element *prev, *next;
-	size_t keylength, valuelength;
+	uint32_t keylength, valuelength;
+	uint32_t valuespace;	/* allocated, a reused record can shrink */
+	uint32_t hash;
 	uint8 n;		/* This is really an enum, but save memory */
 	char data[1];		/* placeholder for offsetof */
 };
 
-struct memcache {
+struct memcache_shard {
+	struct memcache_element **table;
+	uint32_t table_size;	/* power of 2 or 0 */
+	uint32_t num_entries;
 	struct memcache_element *mru, *lru;
-	struct rb_root tree;
+	size_t size;
+	size_t max_size;
+	struct memcache_stats stats;
+};
+
+struct memcache {
+	struct memcache_shard shards[MEMCACHE_NUM_TYPES];
 	size_t size;
 	size_t max_size;
 };
 
+#define MEMCACHE_MIN_TABLE_SIZE 16
+
 static void memcache_element_parse(struct memcache_element *e,
 				   DATA_BLOB *key, DATA_BLOB *value);
 
@@ -48,6 +66,7 @@ static bool memcache_is_talloc(enum memcache_number n)
 	case GETPWNAM_CACHE:
 	case PDB_GETPWSID_CACHE:
 	case SINGLETON_CACHE_TALLOC:
+	case NOTIFY_ARRAY_CACHE:
 		result = true;
 		break;
 	default:
@@ -58,12 +77,40 @@ static bool memcache_is_talloc(enum memcache_number n)
 	return result;
 }
 
+static const char *memcache_name(enum memcache_number n)
+{
+	switch (n) {
+	case STAT_CACHE:		return "STAT_CACHE";
+	case STAT_CACHE_NEGATIVE:	return "STAT_CACHE_NEGATIVE";
+	case UID_SID_CACHE:		return "UID_SID_CACHE";
+	case SID_UID_CACHE:		return "SID_UID_CACHE";
+	case GID_SID_CACHE:		return "GID_SID_CACHE";
+	case SID_GID_CACHE:		return "SID_GID_CACHE";
+	case GETWD_CACHE:		return "GETWD_CACHE";
+	case GETPWNAM_CACHE:		return "GETPWNAM_CACHE";
+	case MANGLE_HASH2_CACHE:	return "MANGLE_HASH2_CACHE";
+	case DOS_ATTR_CACHE:		return "DOS_ATTR_CACHE";
+	case NT_ACL_CACHE:		return "NT_ACL_CACHE";
+	case PDB_GETPWSID_CACHE:	return "PDB_GETPWSID_CACHE";
+	case SINGLETON_CACHE_TALLOC:	return "SINGLETON_CACHE_TALLOC";
+	case NOTIFY_ARRAY_CACHE:	return "NOTIFY_ARRAY_CACHE";
+	case GENCACHE_RAM:		return "GENCACHE_RAM";
+	case SINGLETON_CACHE:		return "SINGLETON_CACHE";
+	default:
+		break;
+	}
+	return "unknown";
+}
+
 static int memcache_destructor(struct memcache *cache) {
 	struct memcache_element *e, *next;
+	int i;
 
-	for (e = cache->mru; e != NULL; e = next) {
-		next = e->next;
-		SAFE_FREE(e);
+	for (i=0; i<MEMCACHE_NUM_TYPES; i++) {
+		for (e = cache->shards[i].mru; e != NULL; e = next) {
+			next = e->next;
+			SAFE_FREE(e);
+		}
 	}
 	return 0;
 }
@@ -87,10 +134,16 @@ void memcache_set_global(struct memcache *cache)
 	global_cache = cache;
 }
 
-static struct memcache_element *memcache_node2elem(struct rb_node *node)
+void memcache_set_budget(struct memcache *cache, enum memcache_number n,
+			 size_t max_size)
 {
-	return (struct memcache_element *)
-		((char *)node - offsetof(struct memcache_element, rb_node));
+	if (cache == NULL) {
+		cache = global_cache;
+	}
+	if ((cache == NULL) || ((int)n >= MEMCACHE_NUM_TYPES)) {
+		return;
+	}
+	cache->shards[n].max_size = max_size;
 }
 
 static void memcache_element_parse(struct memcache_element *e,
@@ -104,48 +157,92 @@ static void memcache_element_parse(struct memcache_element *e,
 
 static size_t memcache_element_size(size_t key_length, size_t value_length)
 {
-	return sizeof(struct memcache_element) - 1 + key_length + value_length;
+	return offsetof(struct memcache_element, data) + key_length
+		+ value_length;
 }
 
-static int memcache_compare(struct memcache_element *e, enum memcache_number n,
-			    DATA_BLOB key)
-{
-	DATA_BLOB this_key, this_value;
-
-	if ((int)e->n < (int)n) return 1;
-	if ((int)e->n > (int)n) return -1;
+/*
+ * FNV-1a, the keys are mostly short strings and SIDs
+ */
 
-	if (e->keylength < key.length) return 1;
-	if (e->keylength > key.length) return -1;
+static uint32_t memcache_hash(DATA_BLOB key)
+{
+	uint32_t hash = 2166136261U;
+	size_t i;
 
-	memcache_element_parse(e, &this_key, &this_value);
-	return memcmp(this_key.data, key.data, key.length);
+	for (i=0; i<key.length; i++) {
+		hash ^= key.data[i];
+		hash *= 16777619U;
+	}
+	return hash;
 }
 
 static struct memcache_element *memcache_find(
-	struct memcache *cache, enum memcache_number n, DATA_BLOB key)
+	struct memcache *cache, enum memcache_number n, DATA_BLOB key,
+	uint32_t hash)
 {
-	struct rb_node *node;
+	struct memcache_shard *shard = &cache->shards[n];
+	struct memcache_element *e;
 
-	node = cache->tree.rb_node;
+	if (shard->table == NULL) {
+		return NULL;
+	}
 
-	while (node != NULL) {
-		struct memcache_element *elem = memcache_node2elem(node);
-		int cmp;
+	for (e = shard->table[hash & (shard->table_size-1)]; e != NULL;
+	     e = e->hash_next) {
+		DATA_BLOB this_key, this_value;
 
-		cmp = memcache_compare(elem, n, key);
-		if (cmp == 0) {
-			return elem;
+		if ((e->hash != hash) || (e->keylength != key.length)) {
+			continue;
+		}
+		memcache_element_parse(e, &this_key, &this_value);
+		if (memcmp(this_key.data, key.data, key.length) == 0) {
+			return e;
 		}
-		node = (cmp < 0) ? node->rb_left : node->rb_right;
 	}
 
 	return NULL;
 }
 
+/*
+ * Keep the hash chains short, double the table when it is full
+ */
+
+static void memcache_grow(struct memcache *cache, struct memcache_shard *shard)
+{
+	struct memcache_element **table;
+	struct memcache_element *e;
+	uint32_t table_size;
+
+	if (shard->num_entries < shard->table_size) {
+		return;
+	}
+
+	table_size = (shard->table_size == 0)
+		? MEMCACHE_MIN_TABLE_SIZE : shard->table_size * 2;
+
+	table = TALLOC_ZERO_ARRAY(cache, struct memcache_element *,
+				  table_size);
+	if (table == NULL) {
+		/* Go on with longer chains */
+		return;
+	}
+
+	for (e = shard->mru; e != NULL; e = e->next) {
+		uint32_t idx = e->hash & (table_size-1);
+		e->hash_next = table[idx];
+		table[idx] = e;
+	}
+
+	TALLOC_FREE(shard->table);
+	shard->table = table;
+	shard->table_size = table_size;
+}
+
 bool memcache_lookup(struct memcache *cache, enum memcache_number n,
 		     DATA_BLOB key, DATA_BLOB *value)
 {
+	struct memcache_shard *shard;
 	struct memcache_element *e;
 
 	if (cache == NULL) {
@@ -155,21 +252,25 @@ bool memcache_lookup(struct memcache *cache, enum memcache_number n,
 		return false;
 	}
 
-	e = memcache_find(cache, n, key);
+	shard = &cache->shards[n];
+
+	e = memcache_find(cache, n, key, memcache_hash(key));
 	if (e == NULL) {
+		shard->stats.misses += 1;
 		return false;
 	}
+	shard->stats.hits += 1;
 
-	if (cache->size != 0) {
+	if ((cache->max_size != 0) || (shard->max_size != 0)) {
 		/*
 		 * Do LRU promotion only when we will ever shrink
 		 */
-		if (e == cache->lru) {
-			cache->lru = e->prev;
+		if (e == shard->lru) {
+			shard->lru = e->prev;
 		}
-		DLIST_PROMOTE(cache->mru, e);
-		if (cache->mru == NULL) {
-			cache->mru = e;
+		DLIST_PROMOTE(shard->mru, e);
+		if (shard->lru == NULL) {
+			shard->lru = e;
 		}
 	}
 
@@ -199,14 +300,23 @@ void *memcache_lookup_talloc(struct memcache *cache, enum memcache_number n,
 static void memcache_delete_element(struct memcache *cache,
 				    struct memcache_element *e)
 {
-	rb_erase(&e->rb_node, &cache->tree);
+	struct memcache_shard *shard = &cache->shards[e->n];
+	struct memcache_element **pe;
+	size_t element_size;
 
-	if (e == cache->lru) {
-		cache->lru = e->prev;
+	for (pe = &shard->table[e->hash & (shard->table_size-1)];
+	     *pe != e; pe = &(*pe)->hash_next) {
+		SMB_ASSERT(*pe != NULL);
 	}
-	DLIST_REMOVE(cache->mru, e);
+	*pe = e->hash_next;
 
-	if (memcache_is_talloc(e->n)) {
+	if (e == shard->lru) {
+		shard->lru = e->prev;
+	}
+	DLIST_REMOVE(shard->mru, e);
+	shard->num_entries -= 1;
+
+	if (memcache_is_talloc((enum memcache_number)e->n)) {
 		DATA_BLOB cache_key, cache_value;
 		void *ptr;
 
@@ -216,19 +326,56 @@ static void memcache_delete_element(struct memcache *cache,
 		TALLOC_FREE(ptr);
 	}
 
-	cache->size -= memcache_element_size(e->keylength, e->valuelength);
+	element_size = memcache_element_size(e->keylength, e->valuespace);
+	shard->size -= element_size;
+	cache->size -= element_size;
 
 	SAFE_FREE(e);
 }
 
-static void memcache_trim(struct memcache *cache)
+static void memcache_evict(struct memcache *cache,
+			   struct memcache_shard *shard)
+{
+	shard->stats.evictions += 1;
+	memcache_delete_element(cache, shard->lru);
+}
+
+/*
+ * First keep the shard we just added to within its own budget. If the
+ * whole cache is still too large, take from the shard that uses the most
+ * memory, so a busy cache type does not push out the smaller ones.
+ */
+
+static void memcache_trim(struct memcache *cache,
+			  struct memcache_shard *shard)
 {
+	if (shard->max_size != 0) {
+		while ((shard->size > shard->max_size)
+		       && (shard->lru != NULL)) {
+			memcache_evict(cache, shard);
+		}
+	}
+
 	if (cache->max_size == 0) {
 		return;
 	}
 
-	while ((cache->size > cache->max_size) && (cache->lru != NULL)) {
-		memcache_delete_element(cache, cache->lru);
+	while (cache->size > cache->max_size) {
+		struct memcache_shard *largest = NULL;
+		int i;
+
+		for (i=0; i<MEMCACHE_NUM_TYPES; i++) {
+			struct memcache_shard *s = &cache->shards[i];
+			if ((s->lru != NULL)
+			    && ((largest == NULL)
+				|| (s->size > largest->size))) {
+				largest = s;
+			}
+		}
+		if (largest == NULL) {
+			break;
+		}
+		memcache_evict(cache, largest);
 	}
 }
 
@@ -244,7 +391,7 @@ void memcache_delete(struct memcache *cache, enum memcache_number n,
 		return;
 	}
 
-	e = memcache_find(cache, n, key);
+	e = memcache_find(cache, n, key, memcache_hash(key));
 	if (e == NULL) {
 		return;
 	}
@@ -255,11 +402,11 @@ void memcache_delete(struct memcache *cache, enum memcache_number n,
 void memcache_add(struct memcache *cache, enum memcache_number n,
 		  DATA_BLOB key, DATA_BLOB value)
 {
+	struct memcache_shard *shard;
 	struct memcache_element *e;
-	struct rb_node **p;
-	struct rb_node *parent;
 	DATA_BLOB cache_key, cache_value;
 	size_t element_size;
+	uint32_t hash, idx;
 
 	if (cache == NULL) {
 		cache = global_cache;
@@ -268,17 +415,21 @@ void memcache_add(struct memcache *cache, enum memcache_number n,
 		return;
 	}
 
-	if (key.length == 0) {
+	if ((key.length == 0) || (key.length > UINT32_MAX)
+	    || (value.length > UINT32_MAX)) {
 		return;
 	}
 
-	e = memcache_find(cache, n, key);
+	shard = &cache->shards[n];
+	hash = memcache_hash(key);
+
+	e = memcache_find(cache, n, key, hash);
 
 	if (e != NULL) {
 		memcache_element_parse(e, &cache_key, &cache_value);
 
 		if (value.length <= cache_value.length) {
-			if (memcache_is_talloc(e->n)) {
+			if (memcache_is_talloc((enum memcache_number)e->n)) {
 				void *ptr;
 				SMB_ASSERT(cache_value.length == sizeof(ptr));
 				memcpy(&ptr, cache_value.data, sizeof(ptr));
@@ -289,12 +440,26 @@ void memcache_add(struct memcache *cache, enum memcache_number n,
 			 */
 			memcpy(cache_value.data, value.data, value.length);
 			e->valuelength = value.length;
+
+			if (e == shard->lru) {
+				shard->lru = e->prev;
+			}
+			DLIST_PROMOTE(shard->mru, e);
+			if (shard->lru == NULL) {
+				shard->lru = e;
+			}
 			return;
 		}
 
 		memcache_delete_element(cache, e);
 	}
 
+	memcache_grow(cache, shard);
+	if (shard->table == NULL) {
+		DEBUG(0, ("talloc failed\n"));
+		return;
+	}
+
 	element_size = memcache_element_size(key.length, value.length);
 
 
@@ -306,37 +471,28 @@ void memcache_add(struct memcache *cache, enum memcache_number n,
 	}
 
 	e->n = n;
+	e->hash = hash;
 	e->keylength = key.length;
 	e->valuelength = value.length;
+	e->valuespace = value.length;
 
 	memcache_element_parse(e, &cache_key, &cache_value);
 	memcpy(cache_key.data, key.data, key.length);
 	memcpy(cache_value.data, value.data, value.length);
 
-	parent = NULL;
-	p = &cache->tree.rb_node;
-
-	while (*p) {
-		struct memcache_element *elem = memcache_node2elem(*p);
-		int cmp;
-
-		parent = (*p);
-
-		cmp = memcache_compare(elem, n, key);
-
-		p = (cmp < 0) ? &(*p)->rb_left : &(*p)->rb_right;
-	}
-
-	rb_link_node(&e->rb_node, parent, p);
-	rb_insert_color(&e->rb_node, &cache->tree);
+	idx = hash & (shard->table_size-1);
+	e->hash_next = shard->table[idx];
+	shard->table[idx] = e;
 
-	DLIST_ADD(cache->mru, e);
-	if (cache->lru == NULL) {
-		cache->lru = e;
+	DLIST_ADD(shard->mru, e);
+	if (shard->lru == NULL) {
+		shard->lru = e;
 	}
+	shard->num_entries += 1;
 
+	shard->size += element_size;
 	cache->size += element_size;
-	memcache_trim(cache);
+	memcache_trim(cache, shard);
 }
 
 void memcache_add_talloc(struct memcache *cache, enum memcache_number n,
@@ -358,7 +514,7 @@ void memcache_add_talloc(struct memcache *cache, enum memcache_number n,
 
 void memcache_flush(struct memcache *cache, enum memcache_number n)
 {
-	struct rb_node *node;
+	struct memcache_shard *shard;
 
 	if (cache == NULL) {
 		cache = global_cache;
@@ -367,70 +523,66 @@ void memcache_flush(struct memcache *cache, enum memcache_number n)
 		return;
 	}
 
-	/*
-	 * Find the smallest element of number n
-	 */
+	shard = &cache->shards[n];
 
-	node = cache->tree.rb_node;
-	if (node == NULL) {
-		return;
+	while (shard->mru != NULL) {
+		memcache_delete_element(cache, shard->mru);
 	}
+}
 
-	/*
-	 * First, find *any* element of number n
-	 */
-
-	while (true) {
-		struct memcache_element *elem = memcache_node2elem(node);
-		struct rb_node *next;
-
-		if ((int)elem->n == (int)n) {
-			break;
-		}
+bool memcache_get_stats(struct memcache *cache, enum memcache_number n,
+			struct memcache_stats *stats)
+{
+	struct memcache_shard *shard;
 
-		if ((int)elem->n < (int)n) {
-			next = node->rb_right;
-		}
-		else {
-			next = node->rb_left;
-		}
-		if (next == NULL) {
-			break;
-		}
-		node = next;
+	if (cache == NULL) {
+		cache = global_cache;
 	}
-
-	if (node == NULL) {
-		return;
+	if ((cache == NULL) || ((int)n >= MEMCACHE_NUM_TYPES)) {
+		return false;
 	}
 
-	/*
-	 * Then, find the leftmost element with number n
-	 */
+	shard = &cache->shards[n];
 
-	while (true) {
-		struct rb_node *prev = rb_prev(node);
-		struct memcache_element *elem;
+	*stats = shard->stats;
+	stats->num_entries = shard->num_entries;
+	stats->size = shard->size;
+	stats->max_size = shard->max_size;
+	return true;
+}
 
-		if (prev == NULL) {
-			break;
-		}
-		elem = memcache_node2elem(prev);
-		if ((int)elem->n != (int)n) {
-			break;
-		}
-		node = prev;
+char *memcache_report(TALLOC_CTX *mem_ctx, struct memcache *cache)
+{
+	char *result;
+	int i;
+
+	if (cache == NULL) {
+		cache = global_cache;
+	}
+	if (cache == NULL) {
+		return NULL;
 	}
 
-	while (node != NULL) {
-		struct memcache_element *e = memcache_node2elem(node);
-		struct rb_node *next = rb_next(node);
+	result = talloc_asprintf(mem_ctx, "memcache size %lu of %lu bytes\n",
+				 (unsigned long)cache->size,
+				 (unsigned long)cache->max_size);
 
-		if (e->n != n) {
-			break;
+	for (i=0; (result != NULL) && (i<MEMCACHE_NUM_TYPES); i++) {
+		struct memcache_shard *s = &cache->shards[i];
+
+		if ((s->num_entries == 0) && (s->stats.hits == 0)
+		    && (s->stats.misses == 0)) {
+			continue;
 		}
 
-		memcache_delete_element(cache, e);
-		node = next;
+		result = talloc_asprintf_append_buffer(
+			result, "%-24s entries %6u size %8lu budget %8lu "
+			"hits %8u misses %8u evictions %8u\n",
+			memcache_name((enum memcache_number)i),
+			(unsigned)s->num_entries, (unsigned long)s->size,
+			(unsigned long)s->max_size, s->stats.hits,
+			s->stats.misses, s->stats.evictions);
 	}
+
+	return result;
 }
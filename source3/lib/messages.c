@@ -83,16 +83,14 @@ static void ping_message(struct messaging_context *msg_ctx,
 ****************************************************************************/
 
 struct msg_all {
-	struct messaging_context *msg_ctx;
-	int msg_type;
 	uint32 msg_flag;
-	const void *buf;
-	size_t len;
-	int n_sent;
+	TALLOC_CTX *mem_ctx;
+	struct connections_key *keys;
+	int num_keys;
 };
 
 /****************************************************************************
- Send one of the messages for the broadcast.
+ Collect the receivers of the broadcast.
 ****************************************************************************/
 
 static int traverse_fn(struct db_record *rec,
@@ -101,7 +99,6 @@ static int traverse_fn(struct db_record *rec,
 		       void *state)
 {
 	struct msg_all *msg_all = (struct msg_all *)state;
-	NTSTATUS status;
 
 	if (crec->cnum != -1)
 		return 0;
@@ -111,33 +108,16 @@ static int traverse_fn(struct db_record *rec,
 	if(!(crec->bcast_msg_flags & msg_all->msg_flag))
 		return 0;
 
-	/* If the msg send fails because the pid was not found (i.e. smbd died), 
-	 * the msg has already been deleted from the messages.tdb.*/
-
-	status = messaging_send_buf(msg_all->msg_ctx,
-				    crec->pid, msg_all->msg_type,
-				    (uint8 *)msg_all->buf, msg_all->len);
-
-	if (NT_STATUS_EQUAL(status, NT_STATUS_INVALID_HANDLE)) {
-		
-		/* If the pid was not found delete the entry from connections.tdb */
-
-		DEBUG(2,("pid %s doesn't exist - deleting connections %d [%s]\n",
-			 procid_str_static(&crec->pid), crec->cnum,
-			 crec->servicename));
-
-		rec->delete_rec(rec);
-	}
-	msg_all->n_sent++;
+	ADD_TO_ARRAY(msg_all->mem_ctx, struct connections_key, *ckey,
+		     &msg_all->keys, &msg_all->num_keys);
 	return 0;
 }
 
 /**
  * Send a message to all smbd processes.
  *
- * It isn't very efficient, but should be OK for the sorts of
- * applications that use it. When we need efficient broadcast we can add
- * it.
+ * The receivers are collected first and then sent the message as one
+ * group, see messaging_send_multi().
  *
  * @param n_sent Set to the number of messages sent.  This should be
  * equal to the number of processes, but be careful for races.
@@ -150,8 +130,11 @@ bool message_send_all(struct messaging_context *msg_ctx,
 		      int *n_sent)
 {
 	struct msg_all msg_all;
+	struct server_id *pids;
+	NTSTATUS *statuses;
+	DATA_BLOB blob;
+	int i;
 
-	msg_all.msg_type = msg_type;
 	if (msg_type < 1000)
 		msg_all.msg_flag = FLAG_MSG_GENERAL;
 	else if (msg_type > 1000 && msg_type < 2000)
@@ -167,14 +150,62 @@ bool message_send_all(struct messaging_context *msg_ctx,
 	else
 		return False;
 
-	msg_all.buf = buf;
-	msg_all.len = len;
-	msg_all.n_sent = 0;
-	msg_all.msg_ctx = msg_ctx;
+	msg_all.mem_ctx = talloc_new(NULL);
+	if (msg_all.mem_ctx == NULL) {
+		return False;
+	}
+	msg_all.keys = NULL;
+	msg_all.num_keys = 0;
 
 	connections_forall(traverse_fn, &msg_all);
+
+	pids = TALLOC_ARRAY(msg_all.mem_ctx, struct server_id,
+			    msg_all.num_keys);
+	statuses = TALLOC_ARRAY(msg_all.mem_ctx, NTSTATUS, msg_all.num_keys);
+	if ((msg_all.num_keys != 0) && ((pids == NULL) || (statuses == NULL))) {
+		TALLOC_FREE(msg_all.mem_ctx);
+		return False;
+	}
+
+	for (i=0; i<msg_all.num_keys; i++) {
+		pids[i] = msg_all.keys[i].pid;
+	}
+
+	blob = data_blob_const(buf, len);
+	messaging_send_multi(msg_ctx, pids, msg_all.num_keys, msg_type,
+			     &blob, statuses);
+
+	for (i=0; i<msg_all.num_keys; i++) {
+		struct db_record *rec;
+
+		if (!NT_STATUS_EQUAL(statuses[i], NT_STATUS_INVALID_HANDLE)) {
+			continue;
+		}
+
+		/*
+		 * If the pid was not found delete the entry from
+		 * connections.tdb. The messages have already been deleted
+		 * from messages.tdb.
+		 */
+
+		DEBUG(2,("pid %s doesn't exist - deleting connections %d "
+			 "[%s]\n", procid_str_static(&pids[i]),
+			 msg_all.keys[i].cnum, msg_all.keys[i].name));
+
+		rec = connections_fetch_record(
+			msg_all.mem_ctx,
+			make_tdb_data((uint8 *)&msg_all.keys[i],
+				      sizeof(msg_all.keys[i])));
+		if (rec != NULL) {
+			rec->delete_rec(rec);
+			TALLOC_FREE(rec);
+		}
+	}
+
 	if (n_sent)
-		*n_sent = msg_all.n_sent;
+		*n_sent = msg_all.num_keys;
+
+	TALLOC_FREE(msg_all.mem_ctx);
 	return True;
 }
 
@@ -183,6 +214,33 @@ struct event_context *messaging_event_context(struct messaging_context *msg_ctx)
 	return msg_ctx->event_ctx;
 }
 
+/*
+ * Set up the backend for local messages. With "messaging:dgm = yes" we
+ * send and receive through unix datagram sockets, falling back to
+ * messages.tdb for processes that don't.
+ */
+static NTSTATUS messaging_local_init(struct messaging_context *msg_ctx)
+{
+	NTSTATUS status;
+
+	if (lp_parm_bool(-1, "messaging", "dgm", false)) {
+		status = messaging_dgm_init(msg_ctx, msg_ctx,
+					    &msg_ctx->local);
+		if (NT_STATUS_IS_OK(status)) {
+			return status;
+		}
+		DEBUG(1, ("messaging_dgm_init failed: %s\n",
+			  nt_errstr(status)));
+	}
+
+	status = messaging_tdb_init(msg_ctx, msg_ctx, &msg_ctx->local);
+	if (!NT_STATUS_IS_OK(status)) {
+		DEBUG(0, ("messaging_tdb_init failed: %s\n",
+			  nt_errstr(status)));
+	}
+	return status;
+}
+
 struct messaging_context *messaging_init(TALLOC_CTX *mem_ctx, 
 					 struct server_id server_id, 
 					 struct event_context *ev)
@@ -197,11 +255,9 @@ struct messaging_context *messaging_init(TALLOC_CTX *mem_ctx,
 	ctx->id = server_id;
 	ctx->event_ctx = ev;
 
-	status = messaging_tdb_init(ctx, ctx, &ctx->local);
+	status = messaging_local_init(ctx);
 
 	if (!NT_STATUS_IS_OK(status)) {
-		DEBUG(0, ("messaging_tdb_init failed: %s\n",
-			  nt_errstr(status)));
 		TALLOC_FREE(ctx);
 		return NULL;
 	}
@@ -239,10 +295,8 @@ NTSTATUS messaging_reinit(struct messaging_context *msg_ctx)
 
 	TALLOC_FREE(msg_ctx->local);
 
-	status = messaging_tdb_init(msg_ctx, msg_ctx, &msg_ctx->local);
+	status = messaging_local_init(msg_ctx);
 	if (!NT_STATUS_IS_OK(status)) {
-		DEBUG(0, ("messaging_tdb_init failed: %s\n",
-			  nt_errstr(status)));
 		return status;
 	}
 
@@ -359,6 +413,78 @@ NTSTATUS messaging_send_buf(struct messaging_context *msg_ctx,
 	return messaging_send(msg_ctx, server, msg_type, &blob);
 }
 
+/*
+  Send the same message to a group of servers, one status per server.
+  Backends that can do it send to all local servers at once.
+*/
+NTSTATUS messaging_send_multi(struct messaging_context *msg_ctx,
+			      const struct server_id *pids, int num_pids,
+			      uint32_t msg_type, const DATA_BLOB *data,
+			      NTSTATUS *statuses)
+{
+	TALLOC_CTX *frame;
+	struct server_id *local_pids;
+	NTSTATUS *local_statuses;
+	int *local_idx;
+	int i, num_local;
+	NTSTATUS status;
+
+	if (num_pids == 0) {
+		return NT_STATUS_OK;
+	}
+
+	frame = talloc_stackframe();
+
+	local_pids = TALLOC_ARRAY(frame, struct server_id, num_pids);
+	local_statuses = TALLOC_ARRAY(frame, NTSTATUS, num_pids);
+	local_idx = TALLOC_ARRAY(frame, int, num_pids);
+	if ((local_pids == NULL) || (local_statuses == NULL)
+	    || (local_idx == NULL)) {
+		TALLOC_FREE(frame);
+		return NT_STATUS_NO_MEMORY;
+	}
+
+	num_local = 0;
+
+	for (i=0; i<num_pids; i++) {
+#ifdef CLUSTER_SUPPORT
+		if (!procid_is_local(&pids[i])) {
+			statuses[i] = msg_ctx->remote->send_fn(
+				msg_ctx, pids[i], msg_type, data,
+				msg_ctx->remote);
+			continue;
+		}
+#endif
+		local_pids[num_local] = pids[i];
+		local_idx[num_local] = i;
+		num_local += 1;
+	}
+
+	status = NT_STATUS_NOT_SUPPORTED;
+
+	if ((num_local > 1) && (msg_ctx->local->send_multi_fn != NULL)) {
+		status = msg_ctx->local->send_multi_fn(
+			msg_ctx, local_pids, num_local, msg_type, data,
+			local_statuses, msg_ctx->local);
+		if (!NT_STATUS_IS_OK(status)) {
+			DEBUG(10, ("send_multi_fn failed: %s\n",
+				   nt_errstr(status)));
+		}
+	}
+
+	for (i=0; i<num_local; i++) {
+		if (!NT_STATUS_IS_OK(status)) {
+			local_statuses[i] = msg_ctx->local->send_fn(
+				msg_ctx, local_pids[i], msg_type, data,
+				msg_ctx->local);
+		}
+		statuses[local_idx[i]] = local_statuses[i];
+	}
+
+	TALLOC_FREE(frame);
+	return NT_STATUS_OK;
+}
+
 /*
   Dispatch one messsaging_rec
 */
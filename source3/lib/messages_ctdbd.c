@@ -140,6 +140,7 @@ NTSTATUS messaging_ctdbd_init(struct messaging_context *msg_ctx,
 	set_my_vnn(ctdbd_vnn(ctx->conn));
 
 	result->send_fn = messaging_ctdb_send;
+	result->send_multi_fn = NULL;
 	result->private_data = (void *)ctx;
 
 	*presult = result;
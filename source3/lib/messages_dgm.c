@@ -0,0 +1,496 @@
+/*
+   Unix SMB/CIFS implementation.
+   Samba internal messaging functions, unix datagram transport
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   Every process using this backend binds a unix datagram socket named
+   after its pid in lock_path("msg"). A message is a marshalled
+   messaging_rec sent straight to that socket: no messages.tdb record
+   and no signal.
+
+   Whatever can't go that way is handed to the messages.tdb backend,
+   which this backend keeps for receiving as well. That covers
+   receivers without a socket (they don't use this backend), messages
+   larger than MESSAGING_DGM_MAX and receivers whose socket buffer is
+   full. Under that kind of load messages to one process may be
+   delivered out of order.
+
+   Where sendmmsg() is available, a message for a group of processes
+   is marshalled once and sent to all of them with one system call.
+*/
+
+#include "includes.h"
+#include "librpc/gen_ndr/messaging.h"
+#include "librpc/gen_ndr/ndr_messaging.h"
+
+/* Largest marshalled message we send as a datagram */
+#define MESSAGING_DGM_MAX (64*1024)
+
+struct messaging_dgm_context {
+	struct messaging_context *msg_ctx;
+	struct messaging_backend *tdb;	/* for everything else */
+	pid_t pid;			/* we created the socket file */
+	int sock;
+	char *path;
+	struct fd_event *fde;
+	uint8_t buf[MESSAGING_DGM_MAX];
+};
+
+static NTSTATUS messaging_dgm_send(struct messaging_context *msg_ctx,
+				   struct server_id pid, int msg_type,
+				   const DATA_BLOB *data,
+				   struct messaging_backend *backend);
+#ifdef HAVE_SENDMMSG
+static NTSTATUS messaging_dgm_send_multi(struct messaging_context *msg_ctx,
+					 const struct server_id *pids,
+					 int num_pids, int msg_type,
+					 const DATA_BLOB *data,
+					 NTSTATUS *statuses,
+					 struct messaging_backend *backend);
+#endif
+
+/****************************************************************************
+ Name of the socket of a process.
+****************************************************************************/
+
+static bool messaging_dgm_addr(pid_t pid, struct sockaddr_un *sunaddr)
+{
+	int len;
+
+	ZERO_STRUCTP(sunaddr);
+	sunaddr->sun_family = AF_UNIX;
+
+	len = snprintf(sunaddr->sun_path, sizeof(sunaddr->sun_path),
+		       "%s/%u", lock_path("msg"), (unsigned)pid);
+
+	return ((len > 0) && (len < sizeof(sunaddr->sun_path)));
+}
+
+static int messaging_dgm_destructor(struct messaging_dgm_context *ctx)
+{
+	TALLOC_FREE(ctx->fde);
+
+	if (ctx->sock != -1) {
+		close(ctx->sock);
+		ctx->sock = -1;
+	}
+
+	/* After a fork the socket file still belongs to the parent */
+	if ((ctx->path != NULL) && (ctx->pid == getpid())) {
+		unlink(ctx->path);
+	}
+
+	return 0;
+}
+
+/****************************************************************************
+ Receive and dispatch everything queued on our socket.
+****************************************************************************/
+
+static void messaging_dgm_read_handler(struct event_context *ev,
+				       struct fd_event *fde,
+				       uint16_t flags,
+				       void *private_data)
+{
+	struct messaging_dgm_context *ctx = talloc_get_type_abort(
+		private_data, struct messaging_dgm_context);
+
+	while (true) {
+		struct messaging_rec rec;
+		enum ndr_err_code ndr_err;
+		DATA_BLOB blob;
+		TALLOC_CTX *frame;
+		ssize_t received;
+
+		received = recv(ctx->sock, ctx->buf, sizeof(ctx->buf), 0);
+		if (received == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		frame = talloc_stackframe();
+		blob = data_blob_const(ctx->buf, received);
+
+		ndr_err = ndr_pull_struct_blob(
+			&blob, frame, NULL, &rec,
+			(ndr_pull_flags_fn_t)ndr_pull_messaging_rec);
+		if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
+			DEBUG(1, ("messaging_dgm_read_handler: invalid "
+				  "message of %d bytes\n", (int)received));
+			TALLOC_FREE(frame);
+			continue;
+		}
+
+		if (rec.msg_version != MESSAGE_VERSION) {
+			DEBUG(1, ("messaging_dgm_read_handler: message "
+				  "version %u, expected %u\n",
+				  (unsigned)rec.msg_version,
+				  (unsigned)MESSAGE_VERSION));
+			TALLOC_FREE(frame);
+			continue;
+		}
+
+		messaging_dispatch_rec(ctx->msg_ctx, &rec);
+		TALLOC_FREE(frame);
+	}
+}
+
+/****************************************************************************
+ Initialise the datagram messaging backend.
+****************************************************************************/
+
+NTSTATUS messaging_dgm_init(struct messaging_context *msg_ctx,
+			    TALLOC_CTX *mem_ctx,
+			    struct messaging_backend **presult)
+{
+	struct messaging_backend *result;
+	struct messaging_dgm_context *ctx;
+	struct sockaddr_un sunaddr;
+	const char *dir;
+	SMB_STRUCT_STAT st;
+	NTSTATUS status;
+
+	if (!(result = TALLOC_P(mem_ctx, struct messaging_backend))) {
+		DEBUG(0, ("talloc failed\n"));
+		return NT_STATUS_NO_MEMORY;
+	}
+
+	ctx = TALLOC_ZERO_P(result, struct messaging_dgm_context);
+	if (!ctx) {
+		DEBUG(0, ("talloc failed\n"));
+		TALLOC_FREE(result);
+		return NT_STATUS_NO_MEMORY;
+	}
+	result->private_data = ctx;
+	result->send_fn = messaging_dgm_send;
+#ifdef HAVE_SENDMMSG
+	result->send_multi_fn = messaging_dgm_send_multi;
+#else
+	result->send_multi_fn = NULL;
+#endif
+
+	ctx->msg_ctx = msg_ctx;
+	ctx->pid = getpid();
+	ctx->sock = -1;
+	talloc_set_destructor(ctx, messaging_dgm_destructor);
+
+	status = messaging_tdb_init(msg_ctx, ctx, &ctx->tdb);
+	if (!NT_STATUS_IS_OK(status)) {
+		TALLOC_FREE(result);
+		return status;
+	}
+
+	dir = lock_path("msg");
+
+	if ((mkdir(dir, 0700) == -1) && (errno != EEXIST)) {
+		status = map_nt_error_from_unix(errno);
+		DEBUG(0, ("Could not create %s: %s\n", dir, strerror(errno)));
+		TALLOC_FREE(result);
+		return status;
+	}
+
+	/* Anyone who can put a socket here can send us messages */
+	if ((sys_lstat(dir, &st) == -1) || !S_ISDIR(st.st_mode)
+	    || (st.st_uid != sec_initial_uid())
+	    || ((st.st_mode & 0077) != 0)) {
+		DEBUG(0, ("invalid permissions on directory %s\n", dir));
+		TALLOC_FREE(result);
+		return NT_STATUS_ACCESS_DENIED;
+	}
+
+	if (!messaging_dgm_addr(ctx->pid, &sunaddr)) {
+		DEBUG(0, ("socket name in %s too long\n", dir));
+		TALLOC_FREE(result);
+		return NT_STATUS_NAME_TOO_LONG;
+	}
+
+	ctx->sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (ctx->sock == -1) {
+		status = map_nt_error_from_unix(errno);
+		DEBUG(0, ("socket failed: %s\n", strerror(errno)));
+		TALLOC_FREE(result);
+		return status;
+	}
+	set_blocking(ctx->sock, false);
+
+	/* A leftover from a dead process with our pid */
+	unlink(sunaddr.sun_path);
+
+	if (bind(ctx->sock, (struct sockaddr *)&sunaddr,
+		 sizeof(sunaddr)) == -1) {
+		status = map_nt_error_from_unix(errno);
+		DEBUG(0, ("bind to %s failed: %s\n", sunaddr.sun_path,
+			  strerror(errno)));
+		TALLOC_FREE(result);
+		return status;
+	}
+
+	ctx->path = talloc_strdup(ctx, sunaddr.sun_path);
+	if (ctx->path == NULL) {
+		unlink(sunaddr.sun_path);
+		TALLOC_FREE(result);
+		return NT_STATUS_NO_MEMORY;
+	}
+
+	ctx->fde = event_add_fd(msg_ctx->event_ctx, ctx, ctx->sock,
+				EVENT_FD_READ, messaging_dgm_read_handler,
+				ctx);
+	if (ctx->fde == NULL) {
+		TALLOC_FREE(result);
+		return NT_STATUS_NO_MEMORY;
+	}
+
+	*presult = result;
+	return NT_STATUS_OK;
+}
+
+/****************************************************************************
+ Send a message to a particular pid.
+****************************************************************************/
+
+static NTSTATUS messaging_dgm_send(struct messaging_context *msg_ctx,
+				   struct server_id pid, int msg_type,
+				   const DATA_BLOB *data,
+				   struct messaging_backend *backend)
+{
+	struct messaging_dgm_context *ctx = talloc_get_type(
+		backend->private_data, struct messaging_dgm_context);
+	struct messaging_rec rec;
+	struct sockaddr_un sunaddr;
+	enum ndr_err_code ndr_err;
+	DATA_BLOB blob;
+	TALLOC_CTX *frame;
+	uid_t euid;
+	ssize_t sent;
+	int err;
+
+	/* NULL pointer means implicit length zero. */
+	if (!data->data) {
+		SMB_ASSERT(data->length == 0);
+	}
+
+	SMB_ASSERT(procid_to_pid(&pid) > 0);
+
+	if ((data->length > MESSAGING_DGM_MAX)
+	    || !messaging_dgm_addr(procid_to_pid(&pid), &sunaddr)) {
+		goto use_tdb;
+	}
+
+	frame = talloc_stackframe();
+
+	rec.msg_version = MESSAGE_VERSION;
+	rec.msg_type = msg_type & MSG_TYPE_MASK;
+	rec.dest = pid;
+	rec.src = procid_self();
+	rec.buf = *data;
+
+	ndr_err = ndr_push_struct_blob(
+		&blob, frame, NULL, &rec,
+		(ndr_push_flags_fn_t)ndr_push_messaging_rec);
+	if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
+		TALLOC_FREE(frame);
+		return ndr_map_error2ntstatus(ndr_err);
+	}
+
+	if (blob.length > MESSAGING_DGM_MAX) {
+		TALLOC_FREE(frame);
+		goto use_tdb;
+	}
+
+	euid = geteuid();
+	if (euid != 0) {
+		/* The socket directory is only accessible for root */
+		save_re_uid();
+		set_effective_uid(0);
+	}
+
+	sent = sendto(ctx->sock, blob.data, blob.length, 0,
+		      (struct sockaddr *)&sunaddr, sizeof(sunaddr));
+	err = errno;
+
+	if ((sent == -1) && (err == ECONNREFUSED)) {
+		/* Nobody is bound to it anymore */
+		unlink(sunaddr.sun_path);
+	}
+
+	if (euid != 0) {
+		restore_re_uid_fromroot();
+	}
+
+	TALLOC_FREE(frame);
+
+	if (sent == blob.length) {
+		return NT_STATUS_OK;
+	}
+
+	if ((sent == -1) && (err == EAGAIN || err == EWOULDBLOCK)
+	    && (msg_type & MSG_FLAG_LOWPRIORITY)) {
+		DEBUG(5, ("Dropping message for PID %s\n",
+			  procid_str_static(&pid)));
+		return NT_STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	DEBUG(10, ("messaging_dgm_send: sendto %s failed: %s\n",
+		   sunaddr.sun_path, strerror(err)));
+
+ use_tdb:
+	/*
+	 * The messages.tdb backend also finds out if the process is
+	 * gone altogether.
+	 */
+	return ctx->tdb->send_fn(msg_ctx, pid, msg_type, data, ctx->tdb);
+}
+
+#ifdef HAVE_SENDMMSG
+
+/****************************************************************************
+ Send a message to a group of pids with one system call.
+****************************************************************************/
+
+static NTSTATUS messaging_dgm_send_multi(struct messaging_context *msg_ctx,
+					 const struct server_id *pids,
+					 int num_pids, int msg_type,
+					 const DATA_BLOB *data,
+					 NTSTATUS *statuses,
+					 struct messaging_backend *backend)
+{
+	struct messaging_dgm_context *ctx = talloc_get_type(
+		backend->private_data, struct messaging_dgm_context);
+	struct messaging_rec rec;
+	enum ndr_err_code ndr_err;
+	struct sockaddr_un *addrs;
+	struct mmsghdr *msgs;
+	struct iovec iov;
+	DATA_BLOB blob;
+	TALLOC_CTX *frame;
+	uid_t euid;
+	bool *failed;
+	int *idx;
+	int i, num_msgs;
+
+	/* NULL pointer means implicit length zero. */
+	if (!data->data) {
+		SMB_ASSERT(data->length == 0);
+	}
+
+	if (data->length > MESSAGING_DGM_MAX) {
+		return NT_STATUS_BUFFER_TOO_SMALL;
+	}
+
+	frame = talloc_stackframe();
+
+	ZERO_STRUCT(rec);
+	rec.msg_version = MESSAGE_VERSION;
+	rec.msg_type = msg_type & MSG_TYPE_MASK;
+	rec.src = procid_self();
+	rec.buf = *data;
+
+	ndr_err = ndr_push_struct_blob(
+		&blob, frame, NULL, &rec,
+		(ndr_push_flags_fn_t)ndr_push_messaging_rec);
+	if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
+		TALLOC_FREE(frame);
+		return ndr_map_error2ntstatus(ndr_err);
+	}
+
+	if (blob.length > MESSAGING_DGM_MAX) {
+		TALLOC_FREE(frame);
+		return NT_STATUS_BUFFER_TOO_SMALL;
+	}
+
+	addrs = TALLOC_ARRAY(frame, struct sockaddr_un, num_pids);
+	msgs = TALLOC_ZERO_ARRAY(frame, struct mmsghdr, num_pids);
+	failed = TALLOC_ARRAY(frame, bool, num_pids);
+	idx = TALLOC_ARRAY(frame, int, num_pids);
+	if ((addrs == NULL) || (msgs == NULL) || (failed == NULL)
+	    || (idx == NULL)) {
+		TALLOC_FREE(frame);
+		return NT_STATUS_NO_MEMORY;
+	}
+
+	iov.iov_base = blob.data;
+	iov.iov_len = blob.length;
+
+	num_msgs = 0;
+
+	for (i=0; i<num_pids; i++) {
+		SMB_ASSERT(procid_to_pid(&pids[i]) > 0);
+
+		statuses[i] = NT_STATUS_OK;
+		failed[i] = true;
+
+		if (!messaging_dgm_addr(procid_to_pid(&pids[i]),
+					&addrs[num_msgs])) {
+			continue;
+		}
+		msgs[num_msgs].msg_hdr.msg_name = &addrs[num_msgs];
+		msgs[num_msgs].msg_hdr.msg_namelen = sizeof(addrs[num_msgs]);
+		msgs[num_msgs].msg_hdr.msg_iov = &iov;
+		msgs[num_msgs].msg_hdr.msg_iovlen = 1;
+		idx[num_msgs] = i;
+		failed[i] = false;
+		num_msgs += 1;
+	}
+
+	euid = geteuid();
+	if (euid != 0) {
+		/* The socket directory is only accessible for root */
+		save_re_uid();
+		set_effective_uid(0);
+	}
+
+	i = 0;
+	while (i < num_msgs) {
+		int sent = sendmmsg(ctx->sock, &msgs[i], num_msgs - i, 0);
+
+		if (sent > 0) {
+			i += sent;
+			continue;
+		}
+		if ((sent == -1) && (errno == EINTR)) {
+			continue;
+		}
+
+		/*
+		 * sendmmsg stops at the first receiver it can't send
+		 * to. That one is tried again on its own below.
+		 */
+		if ((sent == -1) && (errno == ECONNREFUSED)) {
+			unlink(addrs[i].sun_path);
+		}
+		failed[idx[i]] = true;
+		i += 1;
+	}
+
+	if (euid != 0) {
+		restore_re_uid_fromroot();
+	}
+
+	for (i=0; i<num_pids; i++) {
+		if (failed[i]) {
+			statuses[i] = messaging_dgm_send(
+				msg_ctx, pids[i], msg_type, data, backend);
+		}
+	}
+
+	TALLOC_FREE(frame);
+	return NT_STATUS_OK;
+}
+
+#endif /* HAVE_SENDMMSG */
@@ -57,7 +57,7 @@ static NTSTATUS messaging_tdb_send(struct messaging_context *msg_ctx,
 				   struct server_id pid, int msg_type,
 				   const DATA_BLOB *data,
 				   struct messaging_backend *backend);
-static void message_dispatch(struct messaging_context *msg_ctx);
+static void message_dispatch(struct messaging_tdb_context *ctx);
 
 static void messaging_tdb_signal_handler(struct tevent_context *ev_ctx,
 					 struct tevent_signal *se,
@@ -72,7 +72,7 @@ static void messaging_tdb_signal_handler(struct tevent_context *ev_ctx,
 	DEBUG(10, ("messaging_tdb_signal_handler: sig[%d] count[%d] msgs[%d]\n",
 		   signum, count, ctx->received_messages));
 
-	message_dispatch(ctx->msg_ctx);
+	message_dispatch(ctx);
 }
 
 /****************************************************************************
@@ -99,6 +99,7 @@ NTSTATUS messaging_tdb_init(struct messaging_context *msg_ctx,
 	}
 	result->private_data = ctx;
 	result->send_fn = messaging_tdb_send;
+	result->send_multi_fn = NULL;
 
 	ctx->msg_ctx = msg_ctx;
 
@@ -430,10 +431,9 @@ static NTSTATUS retrieve_all_messages(TDB_CONTEXT *msg_tdb,
  messages on an *odd* byte boundary.
 ****************************************************************************/
 
-static void message_dispatch(struct messaging_context *msg_ctx)
+static void message_dispatch(struct messaging_tdb_context *ctx)
 {
-	struct messaging_tdb_context *ctx = talloc_get_type(msg_ctx->local->private_data,
-					    struct messaging_tdb_context);
+	struct messaging_context *msg_ctx = ctx->msg_ctx;
 	struct messaging_array *msg_array = NULL;
 	struct tdb_wrap *tdb = ctx->tdb;
 	NTSTATUS status;
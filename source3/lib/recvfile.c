@@ -131,15 +131,88 @@ static ssize_t default_sys_recvfile(int fromfd,
 
 #if defined(HAVE_LINUX_SPLICE)
 
+/*
+ * Read end of the pipe smbd parks signed writeX payloads in,
+ * -1 if there is none.
+ */
+static int parked_pipe_fd = -1;
+
+/*****************************************************************
+ Tell sys_recvfile() that fd is the read end of a pipe that will
+ hold parked payloads, -1 when that pipe is closed again.
+*****************************************************************/
+
+void sys_recvfile_set_pipe(int fd)
+{
+	parked_pipe_fd = fd;
+}
+
+/*
+ * Move count bytes that are already parked in a pipe into
+ * the file.
+ */
+
+static ssize_t sys_recvfile_from_pipe(int fromfd,
+			int tofd,
+			SMB_OFF_T offset,
+			size_t count)
+{
+	size_t total_written = 0;
+	loff_t splice_offset = offset;
+	loff_t *poffset = NULL;
+
+	if (offset != (SMB_OFF_T)-1) {
+		poffset = &splice_offset;
+	}
+
+	while (total_written < count) {
+		ssize_t thistime;
+
+		thistime = splice(fromfd, NULL, tofd, poffset,
+				  count - total_written,
+				  SPLICE_F_MOVE);
+		if (thistime == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (total_written == 0 &&
+			    (errno == EBADF || errno == EINVAL)) {
+				return default_sys_recvfile(
+					fromfd, tofd, offset, count);
+			}
+			break;
+		}
+		if (thistime == 0) {
+			break;
+		}
+		total_written += thistime;
+	}
+
+	if (total_written < count) {
+		int saved_errno = errno;
+		if (drain_socket(fromfd, count-total_written) !=
+				count-total_written) {
+			return -1;
+		}
+		errno = saved_errno;
+	}
+
+	return total_written;
+}
+
 /*
  * Try and use the Linux system call to do this.
  * Remember we only return -1 if the socket read
  * failed. Else we return the number of bytes
  * actually written. We always read count bytes
  * from the network in the case of return != -1.
+ *
+ * fromfd may also be the pipe registered with
+ * sys_recvfile_set_pipe() that already holds count
+ * bytes, which we always splice straight into the
+ * file.
  */
 
-
 ssize_t sys_recvfile(int fromfd,
 			int tofd,
 			SMB_OFF_T offset,
@@ -147,8 +220,10 @@ ssize_t sys_recvfile(int fromfd,
 {
 	static int pipefd[2] = { -1, -1 };
 	static bool try_splice_call = false;
+	size_t total_read = 0;
 	size_t total_written = 0;
 	loff_t splice_offset = offset;
+	loff_t *poffset = NULL;
 
 	DEBUG(10,("sys_recvfile: from = %d, to = %d, "
 		"offset=%.0f, count = %lu\n",
@@ -159,6 +234,10 @@ ssize_t sys_recvfile(int fromfd,
 		return 0;
 	}
 
+	if ((fromfd == parked_pipe_fd) && (tofd != -1)) {
+		return sys_recvfile_from_pipe(fromfd, tofd, offset, count);
+	}
+
 	/*
 	 * Older Linux kernels have splice for sendfile,
 	 * but it fails for recvfile. Ensure we only try
@@ -166,28 +245,33 @@ ssize_t sys_recvfile(int fromfd,
 	 * implementation if recvfile splice fails. JRA.
 	 */
 
-	if (!try_splice_call) {
+	if (!try_splice_call || tofd == -1) {
 		return default_sys_recvfile(fromfd,
 				tofd,
 				offset,
 				count);
 	}
 
+	if (offset != (SMB_OFF_T)-1) {
+		poffset = &splice_offset;
+	}
+
 	if ((pipefd[0] == -1) && (pipe(pipefd) == -1)) {
 		try_splice_call = false;
 		return default_sys_recvfile(fromfd, tofd, offset, count);
 	}
 
-	while (count > 0) {
-		int nread, to_write;
+	while (total_read < count) {
+		ssize_t nread, to_write;
 
 		nread = splice(fromfd, NULL, pipefd[1], NULL,
-			       MIN(count, 16384), SPLICE_F_MOVE);
+			       MIN(count - total_read, 16384),
+			       SPLICE_F_MOVE|SPLICE_F_MORE);
 		if (nread == -1) {
 			if (errno == EINTR) {
 				continue;
 			}
-			if (total_written == 0 &&
+			if (total_read == 0 &&
 			    (errno == EBADF || errno == EINVAL)) {
 				try_splice_call = false;
 				return default_sys_recvfile(fromfd, tofd,
@@ -195,28 +279,51 @@ ssize_t sys_recvfile(int fromfd,
 			}
 			break;
 		}
+		if (nread == 0) {
+			/* EOF on the socket. */
+			return -1;
+		}
+
+		total_read += nread;
 
 		to_write = nread;
 		while (to_write > 0) {
-			int thistime;
+			ssize_t thistime;
 			thistime = splice(pipefd[0], NULL, tofd,
-					  &splice_offset, to_write,
+					  poffset, to_write,
 					  SPLICE_F_MOVE);
 			if (thistime == -1) {
+				int saved_errno;
+
+				if (errno == EINTR) {
+					continue;
+				}
+				/*
+				 * Don't leave stale data in our pipe,
+				 * it would end up in the next file.
+				 */
+				saved_errno = errno;
+				if (drain_socket(pipefd[0], to_write) !=
+						to_write) {
+					close(pipefd[0]);
+					close(pipefd[1]);
+					pipefd[0] = pipefd[1] = -1;
+				}
+				total_written += nread - to_write;
+				errno = saved_errno;
 				goto done;
 			}
 			to_write -= thistime;
 		}
 
 		total_written += nread;
-		count -= nread;
 	}
 
  done:
-	if (total_written < count) {
+	if (total_read < count) {
 		int saved_errno = errno;
-		if (drain_socket(fromfd, count-total_written) !=
-				count-total_written) {
+		if (drain_socket(fromfd, count-total_read) !=
+				count-total_read) {
 			/* socket is dead. */
 			return -1;
 		}
@@ -225,6 +332,93 @@ ssize_t sys_recvfile(int fromfd,
 
 	return total_written;
 }
+
+/*
+ * Is there room for another splice into the pipe? Pipes fill up by
+ * pages, not bytes, so a pipe that has room for count bytes in theory
+ * can still run full on a socket handing us small pieces.
+ */
+
+static bool pipe_has_room(int pipefd)
+{
+	fd_set wfds;
+	struct timeval tv;
+
+	FD_ZERO(&wfds);
+	FD_SET(pipefd, &wfds);
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+
+	return (sys_select_intr(pipefd+1, NULL, &wfds, NULL, &tv) == 1);
+}
+
+/*****************************************************************
+ Move up to count bytes from the socket into a pipe without
+ copying them through user space. We wait for the socket like a
+ normal read would, but never block on a full pipe: if the pipe
+ fills up early we return the number of bytes parked so far and
+ leave the rest on the socket.
+ Returns -1 on socket error or EOF.
+*****************************************************************/
+
+ssize_t sys_recvfile_park(int fromfd, int pipefd, size_t count)
+{
+	size_t total = 0;
+
+	while (total < count) {
+		ssize_t nread;
+
+		if (!pipe_has_room(pipefd)) {
+			break;
+		}
+
+		/*
+		 * No SPLICE_F_NONBLOCK: older kernels also apply it to
+		 * the socket side, and we would give up on every payload
+		 * that has not fully arrived yet.
+		 */
+		nread = splice(fromfd, NULL, pipefd, NULL, count - total,
+			       SPLICE_F_MOVE);
+		if (nread == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				/* Pipe is full. */
+				break;
+			}
+			if (total == 0 &&
+			    (errno == EBADF || errno == EINVAL)) {
+				/* No splice from sockets, nothing lost. */
+				break;
+			}
+			return -1;
+		}
+		if (nread == 0) {
+			return -1;
+		}
+		total += nread;
+	}
+
+	return (ssize_t)total;
+}
+
+/*****************************************************************
+ Duplicate the first count bytes of a pipe into another pipe
+ without consuming them. Returns the number of bytes duplicated.
+*****************************************************************/
+
+ssize_t sys_pipe_tee(int pipefd, int teefd, size_t count)
+{
+	ssize_t ret;
+
+	do {
+		ret = tee(pipefd, teefd, count, SPLICE_F_NONBLOCK);
+	} while (ret == -1 && errno == EINTR);
+
+	return ret;
+}
+
 #else
 
 /*****************************************************************
@@ -238,6 +432,21 @@ ssize_t sys_recvfile(int fromfd,
 {
 	return default_sys_recvfile(fromfd, tofd, offset, count);
 }
+
+void sys_recvfile_set_pipe(int fd)
+{
+}
+
+ssize_t sys_recvfile_park(int fromfd, int pipefd, size_t count)
+{
+	return 0;
+}
+
+ssize_t sys_pipe_tee(int pipefd, int teefd, size_t count)
+{
+	errno = ENOSYS;
+	return -1;
+}
 #endif
 
 /*****************************************************************
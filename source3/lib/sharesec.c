@@ -47,13 +47,16 @@ static bool share_info_db_init(void)
 	}
 
 	share_db = db_open(NULL, state_path("share_info.tdb"), 0,
-				 TDB_DEFAULT, O_RDWR|O_CREAT, 0600);
+				 TDB_SEQNUM, O_RDWR|O_CREAT, 0600);
 	if (share_db == NULL) {
 		DEBUG(0,("Failed to open share info database %s (%s)\n",
 			state_path("share_info.tdb"), strerror(errno) ));
 		return False;
 	}
 
+	/* Security descriptors are read on every tree connect */
+	share_db = db_open_cache(NULL, share_db);
+
 	vers_id = dbwrap_fetch_int32(share_db, vstring);
 	if (vers_id == SHARE_DATABASE_VERSION_V2) {
 		return true;
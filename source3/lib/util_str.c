@@ -24,6 +24,10 @@
 
 #include "includes.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 const char toupper_ascii_fast_table[128] = {
 	0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0x8, 0x9, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf,
 	0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
@@ -35,6 +39,122 @@ const char toupper_ascii_fast_table[128] = {
 	0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x7b, 0x7c, 0x7d, 0x7e, 0x7f
 };
 
+/*
+ * Get the next character of a UTF-8 CH_UNIX string as the one or two UTF-16
+ * units push_ucs2() would store for it. Returns the number of bytes used, 0
+ * if the character can't be converted.
+ */
+
+static size_t strcase_next_ucs2(const char *s, smb_ucs2_t u[2], int *num)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	codepoint_t c;
+	size_t size;
+
+	if (!(p[0] & 0x80)) {
+		SSVAL(&u[0], 0, p[0]);
+		*num = 1;
+		return 1;
+	}
+
+	if ((p[0] >= 0xc2) && (p[0] <= 0xdf) && ((p[1] & 0xc0) == 0x80)) {
+		/* 2-byte UTF-8, most accented and non-latin letters */
+		SSVAL(&u[0], 0, ((p[0] & 0x1f) << 6) | (p[1] & 0x3f));
+		*num = 1;
+		return 2;
+	}
+
+	c = next_codepoint(s, &size);
+	if (c == INVALID_CODEPOINT) {
+		return 0;
+	}
+
+	if (c < 0x10000) {
+		SSVAL(&u[0], 0, c);
+		*num = 1;
+	} else {
+		c -= 0x10000;
+		SSVAL(&u[0], 0, 0xd800 | (c >> 10));
+		SSVAL(&u[1], 0, 0xdc00 | (c & 0x3ff));
+		*num = 2;
+	}
+	return size;
+}
+
+/*
+ * Compare the multibyte rest of two strings without converting them: gives
+ * the same result as strncasecmp_w() on the push_ucs2() versions, len
+ * counts UTF-16 units. Returns false if we can't do it, the caller has to
+ * convert the strings then.
+ */
+
+static bool strcasecmp_noconv(const char *s, const char *t, size_t len,
+			      int *result)
+{
+	smb_ucs2_t us[2], ut[2];
+	int ns = 0, nt = 0, is = 0, it = 0;
+	size_t n;
+
+#ifdef BROKEN_UNICODE_COMPOSE_CHARACTERS
+	/* iconv has to compose the characters for us */
+	return false;
+#endif
+
+	if (!unix_charset_is_utf8()) {
+		return false;
+	}
+
+	for (n = 0; n < len; n++) {
+		smb_ucs2_t a, b;
+
+		if ((is == ns) && (it == nt) && !(*s & 0x80) && !(*t & 0x80)) {
+			/* Both 7-bit, fold without looking at the tables */
+			if ((*t != 0) &&
+			    (toupper_ascii_fast_table[(unsigned char)*s] ==
+			     toupper_ascii_fast_table[(unsigned char)*t])) {
+				s++;
+				t++;
+				continue;
+			}
+			SSVAL(&a, 0, (unsigned char)*s);
+			SSVAL(&b, 0, (unsigned char)*t);
+			*result = tolower_w(a) - tolower_w(b);
+			return true;
+		}
+
+		if (is == ns) {
+			size_t size = strcase_next_ucs2(s, us, &ns);
+			if (size == 0) {
+				return false;
+			}
+			s += size;
+			is = 0;
+		}
+		if (it == nt) {
+			size_t size = strcase_next_ucs2(t, ut, &nt);
+			if (size == 0) {
+				return false;
+			}
+			t += size;
+			it = 0;
+		}
+
+		a = us[is++];
+		b = ut[it++];
+
+		if ((a == b) && (b != 0)) {
+			continue;
+		}
+		if ((b == 0) || (toupper_w(a) != toupper_w(b))) {
+			*result = tolower_w(a) - tolower_w(b);
+			return true;
+		}
+	}
+
+	*result = 0;
+	return true;
+}
+
 /**
  * Case insensitive string compararison.
  *
@@ -50,8 +170,9 @@ const char toupper_ascii_fast_table[128] = {
  * In particular it should speed comparisons to literal ascii strings
  * or comparisons of strings that are "obviously" different.
  *
- * If we find a non-ascii character we fall back to converting via
- * iconv.
+ * If we find a non-ascii character and the unix charset is UTF-8 we
+ * go on character by character, folding with the UCS2 case tables.
+ * Otherwise we fall back to converting via iconv.
  *
  * This should never be slower than convering the whole thing, and
  * often faster.
@@ -96,6 +217,10 @@ int StrCaseCmp(const char *s, const char *t)
 			return +1;
 	}
 
+	if (strcasecmp_noconv(ps, pt, (size_t)-1, &ret)) {
+		return ret;
+	}
+
 	if (!push_ucs2_talloc(NULL, &buffer_s, ps, &size)) {
 		return strcmp(ps, pt);
 		/* Not quite the right answer, but finding the right one
@@ -157,6 +282,10 @@ int StrnCaseCmp(const char *s, const char *t, size_t len)
 		return 0;
 	}
 
+	if (strcasecmp_noconv(ps, pt, len-n, &ret)) {
+		return ret;
+	}
+
 	if (!push_ucs2_talloc(NULL, &buffer_s, ps, &size)) {
 		return strncmp(ps, pt, len-n);
 		/* Not quite the right answer, but finding the right one
@@ -1385,6 +1514,37 @@ char *strstr_m(const char *src, const char *findstr)
 	return retp;
 }
 
+#ifdef __SSE2__
+
+/*
+ * Change the case of the 7-bit prefix of s 16 bytes at a time. Returns the
+ * number of bytes done, the caller does the rest.
+ */
+
+static size_t strcase_ascii_sse2(char *s, size_t len, bool upper)
+{
+	const __m128i first = _mm_set1_epi8(upper ? 'a'-1 : 'A'-1);
+	const __m128i last = _mm_set1_epi8(upper ? 'z'+1 : 'Z'+1);
+	const __m128i bit = _mm_set1_epi8(0x20);
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s+i));
+		__m128i letters;
+
+		if (_mm_movemask_epi8(v) != 0) {
+			break;
+		}
+		letters = _mm_and_si128(_mm_cmpgt_epi8(v, first),
+					_mm_cmplt_epi8(v, last));
+		v = _mm_xor_si128(v, _mm_and_si128(letters, bit));
+		_mm_storeu_si128((__m128i *)(s+i), v);
+	}
+	return i;
+}
+
+#endif
+
 /**
  Convert a string to lower case.
 **/
@@ -1393,12 +1553,19 @@ void strlower_m(char *s)
 {
 	size_t len;
 	int errno_save;
+	const char *start = s;
 
 	/* this is quite a common operation, so we want it to be
 	   fast. We optimise for the ascii case, knowing that all our
 	   supported multi-byte character sets are ascii-compatible
 	   (ie. they match for the first 128 chars) */
 
+	len = strlen(s);
+
+#ifdef __SSE2__
+	s += strcase_ascii_sse2(s, len, false);
+#endif
+
 	while (*s && !(((unsigned char)s[0]) & 0x80)) {
 		*s = tolower_ascii((unsigned char)*s);
 		s++;
@@ -1409,7 +1576,7 @@ void strlower_m(char *s)
 
 	/* I assume that lowercased string takes the same number of bytes
 	 * as source string even in UTF-8 encoding. (VIV) */
-	len = strlen(s) + 1;
+	len = len - (s - start) + 1;
 	errno_save = errno;
 	errno = 0;
 	unix_strlower(s,len,s,len);
@@ -1427,12 +1594,19 @@ void strupper_m(char *s)
 {
 	size_t len;
 	int errno_save;
+	const char *start = s;
 
 	/* this is quite a common operation, so we want it to be
 	   fast. We optimise for the ascii case, knowing that all our
 	   supported multi-byte character sets are ascii-compatible
 	   (ie. they match for the first 128 chars) */
 
+	len = strlen(s);
+
+#ifdef __SSE2__
+	s += strcase_ascii_sse2(s, len, true);
+#endif
+
 	while (*s && !(((unsigned char)s[0]) & 0x80)) {
 		*s = toupper_ascii_fast((unsigned char)*s);
 		s++;
@@ -1443,7 +1617,7 @@ void strupper_m(char *s)
 
 	/* I assume that lowercased string takes the same number of bytes
 	 * as source string even in multibyte encoding. (VIV) */
-	len = strlen(s) + 1;
+	len = len - (s - start) + 1;
 	errno_save = errno;
 	errno = 0;
 	unix_strupper(s,len,s,len);
@@ -330,6 +330,38 @@ smb_ucs2_t tolower_w( smb_ucs2_t val )
 	return lowcase_table[SVAL(&val,0)];
 }
 
+/*******************************************************************
+ Convert a codepoint to upper case. The tables only cover the BMP.
+********************************************************************/
+
+codepoint_t toupper_m(codepoint_t val)
+{
+	smb_ucs2_t v;
+
+	if (val >= 0x10000) {
+		return val;
+	}
+	SSVAL(&v, 0, val);
+	v = toupper_w(v);
+	return SVAL(&v, 0);
+}
+
+/*******************************************************************
+ Convert a codepoint to lower case.
+********************************************************************/
+
+codepoint_t tolower_m(codepoint_t val)
+{
+	smb_ucs2_t v;
+
+	if (val >= 0x10000) {
+		return val;
+	}
+	SSVAL(&v, 0, val);
+	v = tolower_w(v);
+	return SVAL(&v, 0);
+}
+
 /*******************************************************************
  Determine if a character is lowercase.
 ********************************************************************/
@@ -22,6 +22,8 @@ enum messaging_type
 	MSG_REQ_DMALLOC_MARK=0x000B,
 	MSG_REQ_DMALLOC_LOG_CHANGED=0x000C,
 	MSG_SHUTDOWN=0x000D,
+	MSG_REQ_MEMCACHE_STATS=0x000E,
+	MSG_MEMCACHE_STATS=0x000F,
 	MSG_FORCE_ELECTION=0x0101,
 	MSG_WINS_NEW_ENTRY=0x0102,
 	MSG_SEND_PACKET=0x0103,
@@ -50,6 +52,8 @@ enum messaging_type
 	MSG_SMB_BRL_VALIDATE=0x0311,
 	MSG_SMB_RELEASE_IP=0x0312,
 	MSG_SMB_CLOSE_FILE=0x0313,
+	MSG_SMB_ASYNC_LEVEL2_BREAKS=0x0314,
+	MSG_PVFS_NOTIFY_BATCH=0x0315,
 	MSG_WINBIND_FINISHED=0x0401,
 	MSG_WINBIND_FORGET_STATE=0x0402,
 	MSG_WINBIND_ONLINE=0x0403,
@@ -77,6 +81,8 @@ enum messaging_type
 #define MSG_REQ_DMALLOC_MARK ( 0x000B )
 #define MSG_REQ_DMALLOC_LOG_CHANGED ( 0x000C )
 #define MSG_SHUTDOWN ( 0x000D )
+#define MSG_REQ_MEMCACHE_STATS ( 0x000E )
+#define MSG_MEMCACHE_STATS ( 0x000F )
 #define MSG_FORCE_ELECTION ( 0x0101 )
 #define MSG_WINS_NEW_ENTRY ( 0x0102 )
 #define MSG_SEND_PACKET ( 0x0103 )
@@ -105,6 +111,8 @@ enum messaging_type
 #define MSG_SMB_BRL_VALIDATE ( 0x0311 )
 #define MSG_SMB_RELEASE_IP ( 0x0312 )
 #define MSG_SMB_CLOSE_FILE ( 0x0313 )
+#define MSG_SMB_ASYNC_LEVEL2_BREAKS ( 0x0314 )
+#define MSG_PVFS_NOTIFY_BATCH ( 0x0315 )
 #define MSG_WINBIND_FINISHED ( 0x0401 )
 #define MSG_WINBIND_FORGET_STATE ( 0x0402 )
 #define MSG_WINBIND_ONLINE ( 0x0403 )
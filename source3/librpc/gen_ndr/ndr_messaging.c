@@ -35,6 +35,8 @@ _PUBLIC_ void ndr_print_messaging_type(struct ndr_print *ndr, const char *name,
 		case MSG_REQ_DMALLOC_MARK: val = "MSG_REQ_DMALLOC_MARK"; break;
 		case MSG_REQ_DMALLOC_LOG_CHANGED: val = "MSG_REQ_DMALLOC_LOG_CHANGED"; break;
 		case MSG_SHUTDOWN: val = "MSG_SHUTDOWN"; break;
+		case MSG_REQ_MEMCACHE_STATS: val = "MSG_REQ_MEMCACHE_STATS"; break;
+		case MSG_MEMCACHE_STATS: val = "MSG_MEMCACHE_STATS"; break;
 		case MSG_FORCE_ELECTION: val = "MSG_FORCE_ELECTION"; break;
 		case MSG_WINS_NEW_ENTRY: val = "MSG_WINS_NEW_ENTRY"; break;
 		case MSG_SEND_PACKET: val = "MSG_SEND_PACKET"; break;
@@ -63,6 +65,8 @@ _PUBLIC_ void ndr_print_messaging_type(struct ndr_print *ndr, const char *name,
 		case MSG_SMB_BRL_VALIDATE: val = "MSG_SMB_BRL_VALIDATE"; break;
 		case MSG_SMB_RELEASE_IP: val = "MSG_SMB_RELEASE_IP"; break;
 		case MSG_SMB_CLOSE_FILE: val = "MSG_SMB_CLOSE_FILE"; break;
+		case MSG_SMB_ASYNC_LEVEL2_BREAKS: val = "MSG_SMB_ASYNC_LEVEL2_BREAKS"; break;
+		case MSG_PVFS_NOTIFY_BATCH: val = "MSG_PVFS_NOTIFY_BATCH"; break;
 		case MSG_WINBIND_FINISHED: val = "MSG_WINBIND_FINISHED"; break;
 		case MSG_WINBIND_FORGET_STATE: val = "MSG_WINBIND_FORGET_STATE"; break;
 		case MSG_WINBIND_ONLINE: val = "MSG_WINBIND_ONLINE"; break;
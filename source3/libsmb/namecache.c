@@ -153,8 +153,8 @@ bool namecache_store(const char *name,
 		return false;
 	}
 
-	/* set the entry */
-	ret = gencache_set(key, value_string, expiry);
+	/* set the entry, other processes can live without it for a bit */
+	ret = gencache_set_writebehind(key, value_string, expiry);
 	SAFE_FREE(key);
 	SAFE_FREE(value_string);
 	return ret;
@@ -322,7 +322,7 @@ bool namecache_status_store(const char *keyname, int keyname_type,
 		return False;
 
 	expiry = time(NULL) + lp_name_cache_timeout();
-	ret = gencache_set(key, srvname, expiry);
+	ret = gencache_set_writebehind(key, srvname, expiry);
 
 	if (ret) {
 		DEBUG(5, ("namecache_status_store: entry %s -> %s\n",
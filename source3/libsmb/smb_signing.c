@@ -97,13 +97,11 @@ static bool smb_signing_good(struct smb_signing_state *si,
 	return false;
 }
 
-static void smb_signing_md5(const DATA_BLOB *mac_key,
-			    const uint8_t *buf, uint32_t seq_number,
-			    uint8_t calc_md5_mac[16])
+static void smb_signing_md5_start(const DATA_BLOB *mac_key,
+				  const uint8_t *buf, uint32_t seq_number,
+				  struct MD5Context *md5_ctx)
 {
-	const size_t offset_end_of_sig = (smb_ss_field + 8);
 	uint8_t sequence_buf[8];
-	struct MD5Context md5_ctx;
 
 	/*
 	 * Firstly put the sequence number into the first 4 bytes.
@@ -122,16 +120,26 @@ static void smb_signing_md5(const DATA_BLOB *mac_key,
 
 	   This makes for a bit of fussing about, but it's not too bad.
 	*/
-	MD5Init(&md5_ctx);
+	MD5Init(md5_ctx);
 
 	/* intialise with the key */
-	MD5Update(&md5_ctx, mac_key->data, mac_key->length);
+	MD5Update(md5_ctx, mac_key->data, mac_key->length);
 
 	/* copy in the first bit of the SMB header */
-	MD5Update(&md5_ctx, buf + 4, smb_ss_field - 4);
+	MD5Update(md5_ctx, buf + 4, smb_ss_field - 4);
 
 	/* copy in the sequence number, instead of the signature */
-	MD5Update(&md5_ctx, sequence_buf, sizeof(sequence_buf));
+	MD5Update(md5_ctx, sequence_buf, sizeof(sequence_buf));
+}
+
+static void smb_signing_md5(const DATA_BLOB *mac_key,
+			    const uint8_t *buf, uint32_t seq_number,
+			    uint8_t calc_md5_mac[16])
+{
+	const size_t offset_end_of_sig = (smb_ss_field + 8);
+	struct MD5Context md5_ctx;
+
+	smb_signing_md5_start(mac_key, buf, seq_number, &md5_ctx);
 
 	/* copy in the rest of the packet in, skipping the signature */
 	MD5Update(&md5_ctx, buf + offset_end_of_sig, 
@@ -271,6 +279,78 @@ bool smb_signing_check_pdu(struct smb_signing_state *si,
 	return smb_signing_good(si, good, seqnum);
 }
 
+/*
+ * Check the signature of a PDU of which only the first hdr_len bytes
+ * are in memory. smb_len(inbuf) has to describe the whole PDU, the
+ * remaining bytes are fetched through pull_fn. Used to verify large
+ * writes whose payload is kept out of user space.
+ */
+
+bool smb_signing_check_pdu_pull(struct smb_signing_state *si,
+				const uint8_t *inbuf, size_t hdr_len,
+				smb_signing_pull_fn pull_fn,
+				void *private_data,
+				uint32_t seqnum)
+{
+	const size_t offset_end_of_sig = (smb_ss_field + 8);
+	struct MD5Context md5_ctx;
+	uint8_t calc_md5_mac[16];
+	uint8_t chunk[8192];
+	size_t pdu_len = smb_len(inbuf) + 4;
+	size_t left;
+	bool good;
+
+	if (si->mac_key.length == 0) {
+		return true;
+	}
+
+	if ((hdr_len < offset_end_of_sig) || (hdr_len > pdu_len)) {
+		DEBUG(1,("smb_signing_check_pdu_pull: Can't check signature "
+			 "on short header! hdr_len = %u, smb_len = %u\n",
+			 (unsigned int)hdr_len, smb_len(inbuf)));
+		return false;
+	}
+
+	smb_signing_md5_start(&si->mac_key, inbuf, seqnum, &md5_ctx);
+
+	MD5Update(&md5_ctx, inbuf + offset_end_of_sig,
+		  hdr_len - offset_end_of_sig);
+
+	left = pdu_len - hdr_len;
+	while (left > 0) {
+		size_t thistime = MIN(left, sizeof(chunk));
+
+		if (!pull_fn(private_data, chunk, thistime)) {
+			DEBUG(1,("smb_signing_check_pdu_pull: could not "
+				 "fetch %u bytes of payload\n",
+				 (unsigned int)thistime));
+			return false;
+		}
+		MD5Update(&md5_ctx, chunk, thistime);
+		left -= thistime;
+	}
+
+	MD5Final(calc_md5_mac, &md5_ctx);
+
+	good = (memcmp(&inbuf[smb_ss_field], calc_md5_mac, 8) == 0);
+
+	if (!good) {
+		DEBUG(5, ("smb_signing_check_pdu_pull: BAD SIG: wanted SMB "
+			  "signature of\n"));
+		dump_data(5, calc_md5_mac, 8);
+
+		DEBUG(5, ("smb_signing_check_pdu_pull: BAD SIG: got SMB "
+			  "signature of\n"));
+		dump_data(5, &inbuf[smb_ss_field], 8);
+	} else {
+		DEBUG(10, ("smb_signing_check_pdu_pull: seq %u: "
+			   "got good SMB signature\n",
+			   (unsigned int)seqnum));
+	}
+
+	return smb_signing_good(si, good, seqnum);
+}
+
 bool smb_signing_set_bsrspyl(struct smb_signing_state *si)
 {
 	if (!si->negotiated) {
@@ -35,6 +35,9 @@
 
 static struct db_context *brlock_db;
 
+/* brlock.tdb keeps a sequence number we can trust to see every change. */
+static bool brlock_seqnum;
+
 /****************************************************************************
  Debug info at level 10 for lock struct.
 ****************************************************************************/
@@ -213,6 +216,21 @@ static bool brl_conflict_other(const struct lock_struct *lck1, const struct lock
 	return brl_overlap(lck1, lck2);
 } 
 
+/****************************************************************************
+ Tell a process with a pending lock on this file to retry it. The file id
+ lets it retry only the requests waiting on this file.
+****************************************************************************/
+
+static void brl_send_unlock_msg(struct messaging_context *msg_ctx,
+				struct byte_range_lock *br_lck,
+				struct server_id pid)
+{
+	uint8 msg[24];
+
+	push_file_id_24((char *)msg, &br_lck->key);
+	messaging_send_buf(msg_ctx, pid, MSG_SMB_UNLOCK, msg, sizeof(msg));
+}
+
 /****************************************************************************
  Check if an unlock overlaps a pending lock.
 ****************************************************************************/
@@ -269,13 +287,17 @@ void brl_init(bool read_only)
 	}
 	brlock_db = db_open(NULL, lock_path("brlock.tdb"),
 			    lp_open_files_db_hash_size(),
-			    TDB_DEFAULT|TDB_VOLATILE|TDB_CLEAR_IF_FIRST,
+			    TDB_DEFAULT|TDB_VOLATILE|TDB_CLEAR_IF_FIRST|
+			    TDB_SEQNUM,
 			    read_only?O_RDONLY:(O_RDWR|O_CREAT), 0644 );
 	if (!brlock_db) {
 		DEBUG(0,("Failed to open byte range locking database %s\n",
 			lock_path("brlock.tdb")));
 		return;
 	}
+
+	/* In a cluster the local copy does not see other nodes' changes. */
+	brlock_seqnum = !lp_clustering();
 }
 
 /****************************************************************************
@@ -305,6 +327,435 @@ static int lock_compare(const struct lock_struct *lck1,
 }
 #endif
 
+/****************************************************************************
+ The lock array is kept sorted by start offset, and an implicit interval
+ tree is laid over it: the node for the index range [lo,hi) is the middle
+ entry, and max_end[mid] is the highest end offset of any lock in [lo,hi).
+ The max_end array is stored in the record after the locks, so conflict
+ checks visit only the locks that can overlap a range, and read-only
+ tests can walk the record in the database without copying it.
+****************************************************************************/
+
+/* Below this many locks a linear scan is cheaper than building the index. */
+#define BRL_INDEX_MIN_LOCKS 16
+
+/* Bytes per lock in a record, and in br_lck->lock_data. */
+#define BRL_RECORD_ENTRY_SIZE (sizeof(struct lock_struct) + sizeof(br_off))
+
+struct brl_index {
+	const uint8 *locks;	/* Sorted lock_structs, maybe unaligned. */
+	const uint8 *max_end;	/* One br_off per lock. */
+	unsigned int num_locks;
+};
+
+typedef bool (*brl_overlap_fn)(const struct lock_struct *lock,
+			       void *private_data);
+
+/****************************************************************************
+ End offset of a lock, saturating at the top of the 64 bit space. Windows
+ locks may wrap, so this is only used to find candidates - the caller does
+ the exact overlap check.
+****************************************************************************/
+
+static br_off brl_end(const struct lock_struct *lock)
+{
+	br_off end = lock->start + lock->size;
+
+	if (end < lock->start) {
+		return (br_off)-1;
+	}
+	return end;
+}
+
+/****************************************************************************
+ Index of the first lock starting after start. New locks go here so that
+ locks with equal start stay in the order they were added.
+****************************************************************************/
+
+static unsigned int brl_insert_pos(const struct lock_struct *locks,
+				   unsigned int num_locks, br_off start)
+{
+	unsigned int lo = 0, hi = num_locks;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (locks[mid].start <= start) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/****************************************************************************
+ Index of the first lock starting at or after start.
+****************************************************************************/
+
+static unsigned int brl_find_pos(const struct lock_struct *locks,
+				 unsigned int num_locks, br_off start)
+{
+	unsigned int lo = 0, hi = num_locks;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (locks[mid].start < start) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/****************************************************************************
+ Restore the sort order after a POSIX split or merge. The array is nearly
+ sorted so an insertion sort is linear in practice, and it is stable.
+****************************************************************************/
+
+static void brl_sort_locks(struct lock_struct *locks, unsigned int num_locks)
+{
+	unsigned int i;
+
+	for (i = 1; i < num_locks; i++) {
+		struct lock_struct tmp;
+		unsigned int j = i;
+
+		if (locks[i-1].start <= locks[i].start) {
+			continue;
+		}
+		tmp = locks[i];
+		while (j > 0 && locks[j-1].start > tmp.start) {
+			locks[j] = locks[j-1];
+			j--;
+		}
+		locks[j] = tmp;
+	}
+}
+
+static br_off brl_index_fill(const struct lock_struct *locks, br_off *max_end,
+			     unsigned int lo, unsigned int hi)
+{
+	unsigned int mid;
+	br_off m, sub;
+
+	if (lo >= hi) {
+		return 0;
+	}
+
+	mid = lo + (hi - lo) / 2;
+	m = brl_end(&locks[mid]);
+
+	sub = brl_index_fill(locks, max_end, lo, mid);
+	if (sub > m) {
+		m = sub;
+	}
+	sub = brl_index_fill(locks, max_end, mid + 1, hi);
+	if (sub > m) {
+		m = sub;
+	}
+
+	max_end[mid] = m;
+	return m;
+}
+
+/****************************************************************************
+ (Re)build the interval index that follows a lock array. The array must
+ have been allocated with BRL_RECORD_ENTRY_SIZE bytes per lock.
+****************************************************************************/
+
+static void brl_index_build(struct lock_struct *locks, unsigned int num_locks)
+{
+	brl_index_fill(locks, (br_off *)&locks[num_locks], 0, num_locks);
+}
+
+/****************************************************************************
+ The lock array changed - the index has to be rebuilt before use.
+****************************************************************************/
+
+static void brl_index_invalidate(struct byte_range_lock *br_lck)
+{
+	br_lck->index_valid = False;
+}
+
+/****************************************************************************
+ Walk the part of the index in [lo,hi) that can overlap [start,end]. The
+ entries are copied out as the record may not be aligned.
+****************************************************************************/
+
+static bool brl_index_walk(const struct brl_index *idx,
+			   unsigned int lo, unsigned int hi,
+			   br_off start, br_off end,
+			   brl_overlap_fn fn, void *private_data)
+{
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		struct lock_struct lock;
+		br_off max_end;
+
+		memcpy(&max_end, idx->max_end + mid * sizeof(br_off),
+		       sizeof(max_end));
+		if (max_end < start) {
+			/* Nothing in this subtree reaches us. */
+			return False;
+		}
+		if (brl_index_walk(idx, lo, mid, start, end,
+				   fn, private_data)) {
+			return True;
+		}
+
+		memcpy(&lock, idx->locks + mid * sizeof(struct lock_struct),
+		       sizeof(lock));
+		if (lock.start > end) {
+			/* This lock and everything right of it start later. */
+			return False;
+		}
+		if (brl_end(&lock) >= start && fn(&lock, private_data)) {
+			return True;
+		}
+		lo = mid + 1;
+	}
+	return False;
+}
+
+struct brl_parse_state {
+	br_off start;
+	br_off end;
+	brl_overlap_fn fn;
+	void *private_data;
+	bool have_record;
+	bool found;
+};
+
+static int brl_parse_overlaps(TDB_DATA key, TDB_DATA data, void *private_data)
+{
+	struct brl_parse_state *state = (struct brl_parse_state *)private_data;
+	struct brl_index idx;
+
+	idx.num_locks = data.dsize / BRL_RECORD_ENTRY_SIZE;
+	idx.locks = data.dptr;
+	idx.max_end = data.dptr + idx.num_locks * sizeof(struct lock_struct);
+
+	state->have_record = True;
+	state->found = brl_index_walk(&idx, 0, idx.num_locks,
+				      state->start, state->end,
+				      state->fn, state->private_data);
+	return 0;
+}
+
+/****************************************************************************
+ Call fn on every lock whose range touches or overlaps [start, start+size).
+ This is a superset of the locks brl_overlap() and brl_pending_overlap()
+ accept, so callers apply their own exact test. Stops and returns True as
+ soon as fn returns True.
+
+ A read-only byte_range_lock has nothing loaded - the record is walked in
+ the database. If the file had no record the last time we looked and
+ nobody has changed brlock.tdb since, we do not look again: every lock
+ change bumps the tdb sequence number, so a read or write on a file that
+ nobody locks never touches a brlock record.
+****************************************************************************/
+
+static bool brl_for_overlaps(struct byte_range_lock *br_lck,
+			     br_off start, br_off size,
+			     brl_overlap_fn fn, void *private_data)
+{
+	struct lock_struct range;
+	struct brl_index idx;
+	br_off end;
+	unsigned int i;
+
+	range.start = start;
+	range.size = size;
+	end = brl_end(&range);
+
+	if (br_lck->read_only) {
+		files_struct *fsp = br_lck->fsp;
+		struct brl_parse_state state;
+		TDB_DATA key;
+		int seqnum = 0;
+
+		if (brlock_seqnum) {
+			/* Read this before the record, so a lock added
+			   after we look is seen next time. */
+			seqnum = brlock_db->get_seqnum(brlock_db);
+			if (fsp->brl_unlocked &&
+			    fsp->brl_unlocked_seqnum == seqnum) {
+				return False;
+			}
+		}
+
+		state.start = start;
+		state.end = end;
+		state.fn = fn;
+		state.private_data = private_data;
+		state.have_record = False;
+		state.found = False;
+
+		key.dptr = (uint8 *)&br_lck->key;
+		key.dsize = sizeof(struct file_id);
+
+		brlock_db->parse_record(brlock_db, key, brl_parse_overlaps,
+					&state);
+
+		fsp->brl_unlocked = brlock_seqnum && !state.have_record;
+		fsp->brl_unlocked_seqnum = seqnum;
+		return state.found;
+	}
+
+	if (br_lck->num_locks < BRL_INDEX_MIN_LOCKS) {
+		for (i = 0; i < br_lck->num_locks; i++) {
+			struct lock_struct *lock = &br_lck->lock_data[i];
+			if (lock->start > end) {
+				break;
+			}
+			if (brl_end(lock) >= start &&
+			    fn(lock, private_data)) {
+				return True;
+			}
+		}
+		return False;
+	}
+
+	if (!br_lck->index_valid) {
+		/* Whoever stores the record needs it next anyway. */
+		brl_index_build(br_lck->lock_data, br_lck->num_locks);
+		br_lck->index_valid = True;
+	}
+
+	idx.locks = (const uint8 *)br_lck->lock_data;
+	idx.max_end = (const uint8 *)&br_lck->lock_data[br_lck->num_locks];
+	idx.num_locks = br_lck->num_locks;
+
+	return brl_index_walk(&idx, 0, idx.num_locks, start, end,
+			      fn, private_data);
+}
+
+/****************************************************************************
+ Overlap callbacks shared by the lock and test paths.
+****************************************************************************/
+
+struct brl_conflict_state {
+	const struct lock_struct *plock;
+	struct lock_struct conflict;
+	bool signal_pending_read;
+};
+
+static bool brl_conflict_cb(const struct lock_struct *lock,
+			    void *private_data)
+{
+	struct brl_conflict_state *state =
+		(struct brl_conflict_state *)private_data;
+
+	if (brl_conflict(lock, state->plock)) {
+		state->conflict = *lock;
+		return True;
+	}
+	return False;
+}
+
+static bool brl_conflict_other_cb(const struct lock_struct *lock,
+				  void *private_data)
+{
+	struct brl_conflict_state *state =
+		(struct brl_conflict_state *)private_data;
+
+	if (brl_conflict_other(lock, state->plock)) {
+		state->conflict = *lock;
+		return True;
+	}
+	return False;
+}
+
+static bool brl_conflict_any_cb(const struct lock_struct *lock,
+				void *private_data)
+{
+	struct brl_conflict_state *state =
+		(struct brl_conflict_state *)private_data;
+	bool conflict;
+
+	if (lock->lock_flav == WINDOWS_LOCK) {
+		conflict = brl_conflict(lock, state->plock);
+	} else {
+		conflict = brl_conflict_posix(lock, state->plock);
+	}
+	if (conflict) {
+		state->conflict = *lock;
+		return True;
+	}
+	return False;
+}
+
+/* As brl_conflict_any_cb, but also note pending reads a downgrade frees. */
+
+static bool brl_conflict_posix_cb(const struct lock_struct *lock,
+				  void *private_data)
+{
+	struct brl_conflict_state *state =
+		(struct brl_conflict_state *)private_data;
+
+	if (lock->lock_type == PENDING_READ_LOCK &&
+	    brl_pending_overlap(state->plock, lock)) {
+		state->signal_pending_read = True;
+	}
+	return brl_conflict_any_cb(lock, private_data);
+}
+
+struct brl_wake_state {
+	struct messaging_context *msg_ctx;
+	struct byte_range_lock *br_lck;
+	const struct lock_struct *plock;
+	bool pending_read_only;
+	const char *fn_name;
+};
+
+static bool brl_wake_pending_cb(const struct lock_struct *pend_lock,
+				void *private_data)
+{
+	struct brl_wake_state *state = (struct brl_wake_state *)private_data;
+
+	/* Ignore non-pending locks. */
+	if (!IS_PENDING_LOCK(pend_lock->lock_type)) {
+		return False;
+	}
+	if (state->pending_read_only &&
+	    pend_lock->lock_type != PENDING_READ_LOCK) {
+		return False;
+	}
+
+	if (brl_pending_overlap(state->plock, pend_lock)) {
+		DEBUG(10,("%s: sending unlock message to pid %s\n",
+			  state->fn_name,
+			  procid_str_static(&pend_lock->context.pid )));
+
+		brl_send_unlock_msg(state->msg_ctx, state->br_lck,
+				    pend_lock->context.pid);
+	}
+	return False;
+}
+
+/****************************************************************************
+ Send unlock messages to any pending waiters that overlap plock.
+****************************************************************************/
+
+static void brl_wake_pending(struct messaging_context *msg_ctx,
+			     struct byte_range_lock *br_lck,
+			     const struct lock_struct *plock,
+			     bool pending_read_only,
+			     const char *fn_name)
+{
+	struct brl_wake_state state;
+
+	state.msg_ctx = msg_ctx;
+	state.br_lck = br_lck;
+	state.plock = plock;
+	state.pending_read_only = pending_read_only;
+	state.fn_name = fn_name;
+
+	brl_for_overlaps(br_lck, plock->start, plock->size,
+			 brl_wake_pending_cb, &state);
+}
+
 /****************************************************************************
  Lock a range of bytes - Windows lock semantics.
 ****************************************************************************/
@@ -312,26 +763,22 @@ static int lock_compare(const struct lock_struct *lck1,
 NTSTATUS brl_lock_windows_default(struct byte_range_lock *br_lck,
     struct lock_struct *plock, bool blocking_lock)
 {
-	unsigned int i;
+	unsigned int pos;
 	files_struct *fsp = br_lck->fsp;
 	struct lock_struct *locks = br_lck->lock_data;
+	struct brl_conflict_state state;
 	NTSTATUS status;
 
 	SMB_ASSERT(plock->lock_type != UNLOCK_LOCK);
 
-	for (i=0; i < br_lck->num_locks; i++) {
-		/* Do any Windows or POSIX locks conflict ? */
-		if (brl_conflict(&locks[i], plock)) {
-			/* Remember who blocked us. */
-			plock->context.smbpid = locks[i].context.smbpid;
-			return brl_lock_failed(fsp,plock,blocking_lock);
-		}
-#if ZERO_ZERO
-		if (plock->start == 0 && plock->size == 0 && 
-				locks[i].size == 0) {
-			break;
-		}
-#endif
+	/* Do any Windows or POSIX locks conflict ? */
+	ZERO_STRUCT(state);
+	state.plock = plock;
+	if (brl_for_overlaps(br_lck, plock->start, plock->size,
+			     brl_conflict_cb, &state)) {
+		/* Remember who blocked us. */
+		plock->context.smbpid = state.conflict.context.smbpid;
+		return brl_lock_failed(fsp,plock,blocking_lock);
 	}
 
 	if (!IS_PENDING_LOCK(plock->lock_type)) {
@@ -367,16 +814,24 @@ NTSTATUS brl_lock_windows_default(struct byte_range_lock *br_lck,
 	}
 
 	/* no conflicts - add it to the list of locks */
-	locks = (struct lock_struct *)SMB_REALLOC(locks, (br_lck->num_locks + 1) * sizeof(*locks));
+	locks = (struct lock_struct *)SMB_REALLOC(locks,
+		(br_lck->num_locks + 1) * BRL_RECORD_ENTRY_SIZE);
 	if (!locks) {
 		status = NT_STATUS_NO_MEMORY;
 		goto fail;
 	}
 
-	memcpy(&locks[br_lck->num_locks], plock, sizeof(struct lock_struct));
+	/* Keep the array sorted by start. */
+	pos = brl_insert_pos(locks, br_lck->num_locks, plock->start);
+	if (pos < br_lck->num_locks) {
+		memmove(&locks[pos+1], &locks[pos],
+			sizeof(*locks)*(br_lck->num_locks - pos));
+	}
+	memcpy(&locks[pos], plock, sizeof(struct lock_struct));
 	br_lck->num_locks += 1;
 	br_lck->lock_data = locks;
 	br_lck->modified = True;
+	brl_index_invalidate(br_lck);
 
 	return NT_STATUS_OK;
  fail:
@@ -609,8 +1064,8 @@ static NTSTATUS brl_lock_posix(struct messaging_context *msg_ctx,
 	unsigned int i, count, posix_count;
 	struct lock_struct *locks = br_lck->lock_data;
 	struct lock_struct *tp;
+	struct brl_conflict_state state;
 	bool lock_was_added = False;
-	bool signal_pending_read = False;
 	bool break_oplocks = false;
 	NTSTATUS status;
 
@@ -625,11 +1080,27 @@ static NTSTATUS brl_lock_posix(struct messaging_context *msg_ctx,
 		return NT_STATUS_INVALID_PARAMETER;
 	}
 
+	/* Do any Windows flavour locks conflict ? POSIX conflict
+	   semantics are different - we can't block ourselves. If we
+	   have a pending read lock, a lock downgrade should trigger
+	   a lock re-evaluation. */
+
+	ZERO_STRUCT(state);
+	state.plock = plock;
+	if (brl_for_overlaps(br_lck, plock->start, plock->size,
+			     brl_conflict_posix_cb, &state)) {
+		/* No games with error messages. */
+		/* Remember who blocked us. */
+		plock->context.smbpid = state.conflict.context.smbpid;
+		return NT_STATUS_FILE_LOCK_CONFLICT;
+	}
+
 	/* The worst case scenario here is we have to split an
 	   existing POSIX lock range into two, and add our lock,
 	   so we need at most 2 more entries. */
 
-	tp = SMB_MALLOC_ARRAY(struct lock_struct, (br_lck->num_locks + 2));
+	tp = (struct lock_struct *)SMB_MALLOC(
+		(br_lck->num_locks + 2) * BRL_RECORD_ENTRY_SIZE);
 	if (!tp) {
 		return NT_STATUS_NO_MEMORY;
 	}
@@ -638,38 +1109,13 @@ static NTSTATUS brl_lock_posix(struct messaging_context *msg_ctx,
 	for (i=0; i < br_lck->num_locks; i++) {
 		struct lock_struct *curr_lock = &locks[i];
 
-		/* If we have a pending read lock, a lock downgrade should
-		   trigger a lock re-evaluation. */
-		if (curr_lock->lock_type == PENDING_READ_LOCK &&
-				brl_pending_overlap(plock, curr_lock)) {
-			signal_pending_read = True;
-		}
-
 		if (curr_lock->lock_flav == WINDOWS_LOCK) {
-			/* Do any Windows flavour locks conflict ? */
-			if (brl_conflict(curr_lock, plock)) {
-				/* No games with error messages. */
-				SAFE_FREE(tp);
-				/* Remember who blocked us. */
-				plock->context.smbpid = curr_lock->context.smbpid;
-				return NT_STATUS_FILE_LOCK_CONFLICT;
-			}
 			/* Just copy the Windows lock into the new array. */
 			memcpy(&tp[count], curr_lock, sizeof(struct lock_struct));
 			count++;
 		} else {
 			unsigned int tmp_count = 0;
 
-			/* POSIX conflict semantics are different. */
-			if (brl_conflict_posix(curr_lock, plock)) {
-				/* Can't block ourselves with POSIX locks. */
-				/* No games with error messages. */
-				SAFE_FREE(tp);
-				/* Remember who blocked us. */
-				plock->context.smbpid = curr_lock->context.smbpid;
-				return NT_STATUS_FILE_LOCK_CONFLICT;
-			}
-
 			/* Work out overlaps. */
 			tmp_count += brlock_posix_split_merge(&tp[count], curr_lock, plock, &lock_was_added);
 			posix_count += tmp_count;
@@ -697,6 +1143,9 @@ static NTSTATUS brl_lock_posix(struct messaging_context *msg_ctx,
 		count++;
 	}
 
+	/* Splits and merges can move ranges past their neighbours. */
+	brl_sort_locks(tp, count);
+
 	/* We can get the POSIX lock, now see if it needs to
 	   be mapped into a lower level POSIX one, and if so can
 	   we get it ? */
@@ -730,7 +1179,8 @@ static NTSTATUS brl_lock_posix(struct messaging_context *msg_ctx,
 	}
 
 	/* Realloc so we don't leak entries per lock call. */
-	tp = (struct lock_struct *)SMB_REALLOC(tp, count * sizeof(*locks));
+	tp = (struct lock_struct *)SMB_REALLOC(tp,
+		count * BRL_RECORD_ENTRY_SIZE);
 	if (!tp) {
 		status = NT_STATUS_NO_MEMORY;
 		goto fail;
@@ -738,31 +1188,16 @@ static NTSTATUS brl_lock_posix(struct messaging_context *msg_ctx,
 	br_lck->num_locks = count;
 	SAFE_FREE(br_lck->lock_data);
 	br_lck->lock_data = tp;
-	locks = tp;
 	br_lck->modified = True;
+	brl_index_invalidate(br_lck);
 
 	/* A successful downgrade from write to read lock can trigger a lock
 	   re-evalutation where waiting readers can now proceed. */
 
-	if (signal_pending_read) {
+	if (state.signal_pending_read) {
 		/* Send unlock messages to any pending read waiters that overlap. */
-		for (i=0; i < br_lck->num_locks; i++) {
-			struct lock_struct *pend_lock = &locks[i];
-
-			/* Ignore non-pending locks. */
-			if (!IS_PENDING_LOCK(pend_lock->lock_type)) {
-				continue;
-			}
-
-			if (pend_lock->lock_type == PENDING_READ_LOCK &&
-					brl_pending_overlap(plock, pend_lock)) {
-				DEBUG(10,("brl_lock_posix: sending unlock message to pid %s\n",
-					procid_str_static(&pend_lock->context.pid )));
-
-				messaging_send(msg_ctx, pend_lock->context.pid,
-					       MSG_SMB_UNLOCK, &data_blob_null);
-			}
-		}
+		brl_wake_pending(msg_ctx, br_lck, plock, True,
+				 "brl_lock_posix");
 	}
 
 	return NT_STATUS_OK;
@@ -840,7 +1275,7 @@ bool brl_unlock_windows_default(struct messaging_context *msg_ctx,
 			       struct byte_range_lock *br_lck,
 			       const struct lock_struct *plock)
 {
-	unsigned int i, j;
+	unsigned int i;
 	struct lock_struct *locks = br_lck->lock_data;
 	enum brl_type deleted_lock_type = READ_LOCK; /* shut the compiler up.... */
 
@@ -872,7 +1307,10 @@ bool brl_unlock_windows_default(struct messaging_context *msg_ctx,
 	}
 #endif
 
-	for (i = 0; i < br_lck->num_locks; i++) {
+	/* The array is sorted, so only look at locks with the same start. */
+	for (i = brl_find_pos(locks, br_lck->num_locks, plock->start);
+	     i < br_lck->num_locks && locks[i].start == plock->start;
+	     i++) {
 		struct lock_struct *lock = &locks[i];
 
 		/* Only remove our own locks that match in start, size, and flavour. */
@@ -886,7 +1324,7 @@ bool brl_unlock_windows_default(struct messaging_context *msg_ctx,
 		}
 	}
 
-	if (i == br_lck->num_locks) {
+	if (i == br_lck->num_locks || locks[i].start != plock->start) {
 		/* we didn't find it */
 		return False;
 	}
@@ -903,6 +1341,7 @@ bool brl_unlock_windows_default(struct messaging_context *msg_ctx,
 
 	br_lck->num_locks -= 1;
 	br_lck->modified = True;
+	brl_index_invalidate(br_lck);
 
 	/* Unlock the underlying POSIX regions. */
 	if(lp_posix_locking(br_lck->fsp->conn->params)) {
@@ -916,23 +1355,7 @@ bool brl_unlock_windows_default(struct messaging_context *msg_ctx,
 	}
 
 	/* Send unlock messages to any pending waiters that overlap. */
-	for (j=0; j < br_lck->num_locks; j++) {
-		struct lock_struct *pend_lock = &locks[j];
-
-		/* Ignore non-pending locks. */
-		if (!IS_PENDING_LOCK(pend_lock->lock_type)) {
-			continue;
-		}
-
-		/* We could send specific lock info here... */
-		if (brl_pending_overlap(plock, pend_lock)) {
-			DEBUG(10,("brl_unlock: sending unlock message to pid %s\n",
-				procid_str_static(&pend_lock->context.pid )));
-
-			messaging_send(msg_ctx, pend_lock->context.pid,
-				       MSG_SMB_UNLOCK, &data_blob_null);
-		}
-	}
+	brl_wake_pending(msg_ctx, br_lck, plock, False, "brl_unlock");
 
 	contend_level2_oplocks_end(br_lck->fsp, LEVEL2_CONTEND_WINDOWS_BRL);
 	return True;
@@ -946,7 +1369,7 @@ static bool brl_unlock_posix(struct messaging_context *msg_ctx,
 			     struct byte_range_lock *br_lck,
 			     const struct lock_struct *plock)
 {
-	unsigned int i, j, count, posix_count;
+	unsigned int i, count, posix_count;
 	struct lock_struct *tp;
 	struct lock_struct *locks = br_lck->lock_data;
 	bool overlap_found = False;
@@ -967,7 +1390,8 @@ static bool brl_unlock_posix(struct messaging_context *msg_ctx,
 	   existing POSIX lock range into two, so we need at most
 	   1 more entry. */
 
-	tp = SMB_MALLOC_ARRAY(struct lock_struct, (br_lck->num_locks + 1));
+	tp = (struct lock_struct *)SMB_MALLOC(
+		(br_lck->num_locks + 1) * BRL_RECORD_ENTRY_SIZE);
 	if (!tp) {
 		DEBUG(10,("brl_unlock_posix: malloc fail\n"));
 		return False;
@@ -1059,6 +1483,9 @@ static bool brl_unlock_posix(struct messaging_context *msg_ctx,
 		return True;
 	}
 
+	/* The tail of a truncated lock can move past its neighbours. */
+	brl_sort_locks(tp, count);
+
 	/* Unlock any POSIX regions. */
 	if(lp_posix_locking(br_lck->fsp->conn->params)) {
 		release_posix_lock_posix_flavour(br_lck->fsp,
@@ -1071,7 +1498,8 @@ static bool brl_unlock_posix(struct messaging_context *msg_ctx,
 
 	/* Realloc so we don't leak entries per unlock call. */
 	if (count) {
-		tp = (struct lock_struct *)SMB_REALLOC(tp, count * sizeof(*locks));
+		tp = (struct lock_struct *)SMB_REALLOC(tp,
+			count * BRL_RECORD_ENTRY_SIZE);
 		if (!tp) {
 			DEBUG(10,("brl_unlock_posix: realloc fail\n"));
 			return False;
@@ -1089,29 +1517,12 @@ static bool brl_unlock_posix(struct messaging_context *msg_ctx,
 
 	br_lck->num_locks = count;
 	SAFE_FREE(br_lck->lock_data);
-	locks = tp;
 	br_lck->lock_data = tp;
 	br_lck->modified = True;
+	brl_index_invalidate(br_lck);
 
 	/* Send unlock messages to any pending waiters that overlap. */
-
-	for (j=0; j < br_lck->num_locks; j++) {
-		struct lock_struct *pend_lock = &locks[j];
-
-		/* Ignore non-pending locks. */
-		if (!IS_PENDING_LOCK(pend_lock->lock_type)) {
-			continue;
-		}
-
-		/* We could send specific lock info here... */
-		if (brl_pending_overlap(plock, pend_lock)) {
-			DEBUG(10,("brl_unlock: sending unlock message to pid %s\n",
-				procid_str_static(&pend_lock->context.pid )));
-
-			messaging_send(msg_ctx, pend_lock->context.pid,
-				       MSG_SMB_UNLOCK, &data_blob_null);
-		}
-	}
+	brl_wake_pending(msg_ctx, br_lck, plock, False, "brl_unlock");
 
 	return True;
 }
@@ -1161,9 +1572,8 @@ bool brl_locktest(struct byte_range_lock *br_lck,
 		enum brl_flavour lock_flav)
 {
 	bool ret = True;
-	unsigned int i;
 	struct lock_struct lock;
-	const struct lock_struct *locks = br_lck->lock_data;
+	struct brl_conflict_state state;
 	files_struct *fsp = br_lck->fsp;
 
 	lock.context.smbpid = smbpid;
@@ -1175,14 +1585,15 @@ bool brl_locktest(struct byte_range_lock *br_lck,
 	lock.lock_type = lock_type;
 	lock.lock_flav = lock_flav;
 
-	/* Make sure existing locks don't conflict */
-	for (i=0; i < br_lck->num_locks; i++) {
-		/*
-		 * Our own locks don't conflict.
-		 */
-		if (brl_conflict_other(&locks[i], &lock)) {
-			return False;
-		}
+	/*
+	 * Make sure existing locks don't conflict.
+	 * Our own locks don't conflict.
+	 */
+	ZERO_STRUCT(state);
+	state.plock = &lock;
+	if (brl_for_overlaps(br_lck, start, size,
+			     brl_conflict_other_cb, &state)) {
+		return False;
 	}
 
 	/*
@@ -1218,9 +1629,8 @@ NTSTATUS brl_lockquery(struct byte_range_lock *br_lck,
 		enum brl_type *plock_type,
 		enum brl_flavour lock_flav)
 {
-	unsigned int i;
 	struct lock_struct lock;
-	const struct lock_struct *locks = br_lck->lock_data;
+	struct brl_conflict_state state;
 	files_struct *fsp = br_lck->fsp;
 
 	lock.context.smbpid = *psmbpid;
@@ -1233,23 +1643,17 @@ NTSTATUS brl_lockquery(struct byte_range_lock *br_lck,
 	lock.lock_flav = lock_flav;
 
 	/* Make sure existing locks don't conflict */
-	for (i=0; i < br_lck->num_locks; i++) {
-		const struct lock_struct *exlock = &locks[i];
-		bool conflict = False;
-
-		if (exlock->lock_flav == WINDOWS_LOCK) {
-			conflict = brl_conflict(exlock, &lock);
-		} else {	
-			conflict = brl_conflict_posix(exlock, &lock);
-		}
+	ZERO_STRUCT(state);
+	state.plock = &lock;
+	if (brl_for_overlaps(br_lck, lock.start, lock.size,
+			     brl_conflict_any_cb, &state)) {
+		const struct lock_struct *exlock = &state.conflict;
 
-		if (conflict) {
-			*psmbpid = exlock->context.smbpid;
-        		*pstart = exlock->start;
-		        *psize = exlock->size;
-        		*plock_type = exlock->lock_type;
-			return NT_STATUS_LOCK_NOT_GRANTED;
-		}
+		*psmbpid = exlock->context.smbpid;
+		*pstart = exlock->start;
+		*psize = exlock->size;
+		*plock_type = exlock->lock_type;
+		return NT_STATUS_LOCK_NOT_GRANTED;
 	}
 
 	/*
@@ -1315,7 +1719,9 @@ bool brl_lock_cancel_default(struct byte_range_lock *br_lck,
 
 	SMB_ASSERT(plock);
 
-	for (i = 0; i < br_lck->num_locks; i++) {
+	for (i = brl_find_pos(locks, br_lck->num_locks, plock->start);
+	     i < br_lck->num_locks && locks[i].start == plock->start;
+	     i++) {
 		struct lock_struct *lock = &locks[i];
 
 		/* For pending locks we *always* care about the fnum. */
@@ -1329,7 +1735,7 @@ bool brl_lock_cancel_default(struct byte_range_lock *br_lck,
 		}
 	}
 
-	if (i == br_lck->num_locks) {
+	if (i == br_lck->num_locks || locks[i].start != plock->start) {
 		/* Didn't find it. */
 		return False;
 	}
@@ -1342,6 +1748,7 @@ bool brl_lock_cancel_default(struct byte_range_lock *br_lck,
 
 	br_lck->num_locks -= 1;
 	br_lck->modified = True;
+	brl_index_invalidate(br_lck);
 	return True;
 }
 
@@ -1357,9 +1764,10 @@ void brl_close_fnum(struct messaging_context *msg_ctx,
 	files_struct *fsp = br_lck->fsp;
 	uint16 tid = fsp->conn->cnum;
 	int fnum = fsp->fnum;
-	unsigned int i, j, dcount=0;
+	unsigned int i, j, num_pending = 0, num_kept = 0;
 	int num_deleted_windows_locks = 0;
 	struct lock_struct *locks = br_lck->lock_data;
+	struct lock_struct *pending = NULL;
 	struct server_id pid = procid_self();
 	bool unlock_individually = False;
 	bool posix_level2_contention_ended = false;
@@ -1423,7 +1831,36 @@ void brl_close_fnum(struct messaging_context *msg_ctx,
 
 	/* We can bulk delete - any POSIX locks will be removed when the fd closes. */
 
-	/* Remove any existing locks for this fnum (or any fnum if they're POSIX). */
+	/* Remember the pending locks we may have to wake. Most files have
+	   none, which saves looking at every lock for every deleted one. */
+
+	for (i=0; i < br_lck->num_locks; i++) {
+		struct lock_struct *pend_lock = &locks[i];
+
+		if (!IS_PENDING_LOCK(pend_lock->lock_type)) {
+			continue;
+		}
+
+		/* Optimisation - don't send to this fnum as we're
+		   closing it. */
+		if (pend_lock->context.tid == tid &&
+		    procid_equal(&pend_lock->context.pid, &pid) &&
+		    pend_lock->fnum == fnum) {
+			continue;
+		}
+
+		if (pending == NULL) {
+			pending = TALLOC_ARRAY(br_lck, struct lock_struct,
+					       br_lck->num_locks - i);
+			if (pending == NULL) {
+				smb_panic("brl_close_fnum: talloc failed");
+			}
+		}
+		pending[num_pending++] = *pend_lock;
+	}
+
+	/* Remove any existing locks for this fnum (or any fnum if they're
+	   POSIX), compacting the array in place so it stays sorted. */
 
 	for (i=0; i < br_lck->num_locks; i++) {
 		struct lock_struct *lock = &locks[i];
@@ -1447,43 +1884,32 @@ void brl_close_fnum(struct messaging_context *msg_ctx,
 			}
 		}
 
-		if (del_this_lock) {
-			/* Send unlock messages to any pending waiters that overlap. */
-			for (j=0; j < br_lck->num_locks; j++) {
-				struct lock_struct *pend_lock = &locks[j];
-
-				/* Ignore our own or non-pending locks. */
-				if (!IS_PENDING_LOCK(pend_lock->lock_type)) {
-					continue;
-				}
-
-				/* Optimisation - don't send to this fnum as we're
-				   closing it. */
-				if (pend_lock->context.tid == tid &&
-				    procid_equal(&pend_lock->context.pid, &pid) &&
-				    pend_lock->fnum == fnum) {
-					continue;
-				}
-
-				/* We could send specific lock info here... */
-				if (brl_pending_overlap(lock, pend_lock)) {
-					messaging_send(msg_ctx, pend_lock->context.pid,
-						       MSG_SMB_UNLOCK, &data_blob_null);
-				}
+		if (!del_this_lock) {
+			if (num_kept != i) {
+				locks[num_kept] = *lock;
 			}
+			num_kept++;
+			continue;
+		}
 
-			/* found it - delete it */
-			if (br_lck->num_locks > 1 && i < br_lck->num_locks - 1) {
-				memmove(&locks[i], &locks[i+1], 
-					sizeof(*locks)*((br_lck->num_locks-1) - i));
+		/* Send unlock messages to any pending waiters that overlap. */
+		for (j=0; j < num_pending; j++) {
+			struct lock_struct *pend_lock = &pending[j];
+
+			if (brl_pending_overlap(lock, pend_lock)) {
+				brl_send_unlock_msg(msg_ctx, br_lck,
+						    pend_lock->context.pid);
 			}
-			br_lck->num_locks--;
-			br_lck->modified = True;
-			i--;
-			dcount++;
 		}
 	}
 
+	if (num_kept != br_lck->num_locks) {
+		br_lck->num_locks = num_kept;
+		br_lck->modified = True;
+		brl_index_invalidate(br_lck);
+	}
+	TALLOC_FREE(pending);
+
 	if(lp_posix_locking(fsp->conn->params) && num_deleted_windows_locks) {
 		/* Reduce the Windows lock POSIX reference count on this dev/ino pair. */
 		reduce_windows_lock_ref_count(fsp, num_deleted_windows_locks);
@@ -1514,7 +1940,9 @@ static bool validate_lock_entries(unsigned int *pnum_entries, struct lock_struct
 		struct lock_struct *new_lock_data = NULL;
 
 		if (num_valid_entries) {
-			new_lock_data = SMB_MALLOC_ARRAY(struct lock_struct, num_valid_entries);
+			/* Leave room for the index. */
+			new_lock_data = (struct lock_struct *)SMB_MALLOC(
+				num_valid_entries * BRL_RECORD_ENTRY_SIZE);
 			if (!new_lock_data) {
 				DEBUG(3, ("malloc fail\n"));
 				return False;
@@ -1574,7 +2002,7 @@ static int traverse_fn(struct db_record *rec, void *state)
 	}
 
 	key = (struct file_id *)rec->key.dptr;
-	orig_num_locks = num_locks = rec->value.dsize/sizeof(*locks);
+	orig_num_locks = num_locks = rec->value.dsize/BRL_RECORD_ENTRY_SIZE;
 
 	/* Ensure the lock db is clean of entries from invalid processes. */
 
@@ -1586,8 +2014,9 @@ static int traverse_fn(struct db_record *rec, void *state)
 	if (orig_num_locks != num_locks) {
 		if (num_locks) {
 			TDB_DATA data;
+			brl_index_build(locks, num_locks);
 			data.dptr = (uint8_t *)locks;
-			data.dsize = num_locks*sizeof(struct lock_struct);
+			data.dsize = num_locks * BRL_RECORD_ENTRY_SIZE;
 			rec->store(rec, data, TDB_REPLACE);
 		} else {
 			rec->delete_rec(rec);
@@ -1659,8 +2088,12 @@ static int byte_range_lock_destructor(struct byte_range_lock *br_lck)
 		TDB_DATA data;
 		NTSTATUS status;
 
+		if (!br_lck->index_valid) {
+			brl_index_build(br_lck->lock_data, br_lck->num_locks);
+		}
+
 		data.dptr = (uint8 *)br_lck->lock_data;
-		data.dsize = br_lck->num_locks * sizeof(struct lock_struct);
+		data.dsize = br_lck->num_locks * BRL_RECORD_ENTRY_SIZE;
 
 		status = br_lck->record->store(br_lck->record, data,
 					       TDB_REPLACE);
@@ -1708,43 +2141,45 @@ static struct byte_range_lock *brl_get_locks_internal(TALLOC_CTX *mem_ctx,
 		read_only = False;
 	}
 
+	br_lck->read_only = read_only;
+	br_lck->lock_data = NULL;
+	br_lck->index_valid = False;
+	br_lck->record = NULL;
+
 	if (read_only) {
-		if (brlock_db->fetch(brlock_db, br_lck, key, &data) == -1) {
-			DEBUG(3, ("Could not fetch byte range lock record\n"));
-			TALLOC_FREE(br_lck);
-			return NULL;
-		}
-		br_lck->record = NULL;
+		/* Nothing to load - brl_locktest() and brl_lockquery()
+		   walk the record's index in the database. */
+		talloc_set_destructor(br_lck, byte_range_lock_destructor);
+		return br_lck;
 	}
-	else {
-		br_lck->record = brlock_db->fetch_locked(brlock_db, br_lck, key);
 
-		if (br_lck->record == NULL) {
-			DEBUG(3, ("Could not lock byte range lock entry\n"));
-			TALLOC_FREE(br_lck);
-			return NULL;
-		}
+	br_lck->record = brlock_db->fetch_locked(brlock_db, br_lck, key);
 
-		data = br_lck->record->value;
+	if (br_lck->record == NULL) {
+		DEBUG(3, ("Could not lock byte range lock entry\n"));
+		TALLOC_FREE(br_lck);
+		return NULL;
 	}
 
-	br_lck->read_only = read_only;
-	br_lck->lock_data = NULL;
+	data = br_lck->record->value;
 
 	talloc_set_destructor(br_lck, byte_range_lock_destructor);
 
-	br_lck->num_locks = data.dsize / sizeof(struct lock_struct);
+	br_lck->num_locks = data.dsize / BRL_RECORD_ENTRY_SIZE;
 
 	if (br_lck->num_locks != 0) {
-		br_lck->lock_data = SMB_MALLOC_ARRAY(struct lock_struct,
-						     br_lck->num_locks);
+		/* Take the index along with the locks. */
+		br_lck->lock_data = (struct lock_struct *)SMB_MALLOC(
+			br_lck->num_locks * BRL_RECORD_ENTRY_SIZE);
 		if (br_lck->lock_data == NULL) {
 			DEBUG(0, ("malloc failed\n"));
 			TALLOC_FREE(br_lck);
 			return NULL;
 		}
 
-		memcpy(br_lck->lock_data, data.dptr, data.dsize);
+		memcpy(br_lck->lock_data, data.dptr,
+		       br_lck->num_locks * BRL_RECORD_ENTRY_SIZE);
+		br_lck->index_valid = True;
 	}
 	
 	if (!fsp->lockdb_clean) {
@@ -1764,6 +2199,7 @@ static struct byte_range_lock *brl_get_locks_internal(TALLOC_CTX *mem_ctx,
 		/* Ensure invalid locks are cleaned up in the destructor. */
 		if (orig_num_locks != br_lck->num_locks) {
 			br_lck->modified = True;
+			brl_index_invalidate(br_lck);
 		}
 
 		/* Mark the lockdb as "clean" as seen from this open file. */
@@ -527,6 +527,9 @@ static void print_share_mode_table(struct locking_data *data)
 static bool parse_share_modes(TDB_DATA dbuf, struct share_mode_lock *lck)
 {
 	struct locking_data data;
+	struct server_id last_pid;
+	bool checked_pid = False;
+	bool last_exists = False;
 	int i;
 
 	if (dbuf.dsize < sizeof(struct locking_data)) {
@@ -560,21 +563,31 @@ static bool parse_share_modes(TDB_DATA dbuf, struct share_mode_lock *lck)
 	lck->share_modes = NULL;
 	
 	if (lck->num_share_modes != 0) {
+		uint8 *entries = dbuf.dptr + sizeof(struct locking_data);
 
 		if (dbuf.dsize < (sizeof(struct locking_data) +
 				  (lck->num_share_modes *
 				   sizeof(struct share_mode_entry)))) {
 			smb_panic("parse_share_modes: buffer too short");
 		}
-				  
-		lck->share_modes = (struct share_mode_entry *)
-			TALLOC_MEMDUP(lck,
-				      dbuf.dptr+sizeof(struct locking_data),
-				      lck->num_share_modes *
-				      sizeof(struct share_mode_entry));
-
-		if (lck->share_modes == NULL) {
-			smb_panic("parse_share_modes: talloc failed");
+
+		/*
+		 * The entries are used where they are in the record, so
+		 * that changing one doesn't need the record rebuilt. The
+		 * buffer is our own copy, only its alignment can stop us.
+		 */
+
+		if (((uintptr_t)entries % sizeof(uint64_t)) == 0) {
+			lck->share_modes = (struct share_mode_entry *)entries;
+		} else {
+			lck->share_modes = (struct share_mode_entry *)
+				TALLOC_MEMDUP(lck, entries,
+					      lck->num_share_modes *
+					      sizeof(struct share_mode_entry));
+			if (lck->share_modes == NULL) {
+				smb_panic("parse_share_modes: talloc failed");
+			}
+			lck->relayout = True;
 		}
 	}
 
@@ -636,7 +649,8 @@ static bool parse_share_modes(TDB_DATA dbuf, struct share_mode_lock *lck)
 		strlen(lck->servicepath) + 1;
 
 	/*
-	 * Ensure that each entry has a real process attached.
+	 * Ensure that each entry has a real process attached. One
+	 * process often has many entries, only ask once in a row.
 	 */
 
 	for (i = 0; i < lck->num_share_modes; i++) {
@@ -647,7 +661,17 @@ static bool parse_share_modes(TDB_DATA dbuf, struct share_mode_lock *lck)
 		}
 		DEBUG(10,("parse_share_modes: %s\n",
 			str ? str : ""));
-		if (!process_exists(entry_p->pid)) {
+		if (is_unused_share_mode_entry(entry_p) ||
+		    procid_is_me(&entry_p->pid)) {
+			TALLOC_FREE(str);
+			continue;
+		}
+		if (!checked_pid || !procid_equal(&last_pid, &entry_p->pid)) {
+			last_pid = entry_p->pid;
+			last_exists = process_exists(entry_p->pid);
+			checked_pid = True;
+		}
+		if (!last_exists) {
 			DEBUG(10,("parse_share_modes: deleted %s\n",
 				str ? str : ""));
 			entry_p->op_type = UNUSED_SHARE_MODE_ENTRY;
@@ -687,7 +711,7 @@ static TDB_DATA unparse_share_modes(struct share_mode_lock *lck)
 			(sizeof(uid_t) + sizeof(gid_t) + (lck->delete_token->ngroups*sizeof(gid_t))) : 0);
 
 	result.dsize = sizeof(*data) +
-		lck->num_share_modes * sizeof(struct share_mode_entry) +
+		num_valid * sizeof(struct share_mode_entry) +
 		delete_token_size +
 		sp_len + 1 +
 		strlen(lck->filename) + 1;
@@ -699,7 +723,7 @@ static TDB_DATA unparse_share_modes(struct share_mode_lock *lck)
 
 	data = (struct locking_data *)result.dptr;
 	ZERO_STRUCTP(data);
-	data->u.s.num_share_mode_entries = lck->num_share_modes;
+	data->u.s.num_share_mode_entries = num_valid;
 	data->u.s.delete_on_close = lck->delete_on_close;
 	data->u.s.old_write_time = lck->old_write_time;
 	data->u.s.changed_write_time = lck->changed_write_time;
@@ -715,10 +739,16 @@ static TDB_DATA unparse_share_modes(struct share_mode_lock *lck)
 		  (unsigned int)data->u.s.delete_token_size,
 		  data->u.s.num_share_mode_entries));
 
-	memcpy(result.dptr + sizeof(*data), lck->share_modes,
-	       sizeof(struct share_mode_entry)*lck->num_share_modes);
-	offset = sizeof(*data) +
-		sizeof(struct share_mode_entry)*lck->num_share_modes;
+	/* Leave out the unused entries. */
+	offset = sizeof(*data);
+	for (i=0; i<lck->num_share_modes; i++) {
+		if (is_unused_share_mode_entry(&lck->share_modes[i])) {
+			continue;
+		}
+		memcpy(result.dptr + offset, &lck->share_modes[i],
+		       sizeof(struct share_mode_entry));
+		offset += sizeof(struct share_mode_entry);
+	}
 
 	/* Store any delete on close token. */
 	if (lck->delete_token) {
@@ -750,6 +780,49 @@ static TDB_DATA unparse_share_modes(struct share_mode_lock *lck)
 	return result;
 }
 
+/*******************************************************************
+ If only entries and fixed size fields changed, the record we fetched
+ can be stored again as it is, after updating its header. Return False
+ if it has to be rebuilt by unparse_share_modes().
+********************************************************************/
+
+static bool update_share_modes_in_place(struct share_mode_lock *lck,
+					TDB_DATA *pdata)
+{
+	struct locking_data data;
+	int i, num_valid = 0;
+
+	if (lck->relayout || lck->fresh) {
+		return False;
+	}
+
+	for (i=0; i<lck->num_share_modes; i++) {
+		if (!is_unused_share_mode_entry(&lck->share_modes[i])) {
+			num_valid += 1;
+		}
+	}
+
+	if (num_valid == 0) {
+		pdata->dptr = NULL;
+		pdata->dsize = 0;
+		return True;
+	}
+
+	/* Too many dead entries, compact them away. */
+	if (num_valid < lck->num_share_modes / 2) {
+		return False;
+	}
+
+	memcpy(&data, lck->record->value.dptr, sizeof(data));
+	data.u.s.delete_on_close = lck->delete_on_close;
+	data.u.s.old_write_time = lck->old_write_time;
+	data.u.s.changed_write_time = lck->changed_write_time;
+	memcpy(lck->record->value.dptr, &data, sizeof(data));
+
+	*pdata = lck->record->value;
+	return True;
+}
+
 static int share_mode_lock_destructor(struct share_mode_lock *lck)
 {
 	NTSTATUS status;
@@ -759,7 +832,9 @@ static int share_mode_lock_destructor(struct share_mode_lock *lck)
 		return 0;
 	}
 
-	data = unparse_share_modes(lck);
+	if (!update_share_modes_in_place(lck, &data)) {
+		data = unparse_share_modes(lck);
+	}
 
 	if (data.dptr == NULL) {
 		if (!lck->fresh) {
@@ -807,6 +882,7 @@ static bool fill_share_mode_lock(struct share_mode_lock *lck,
 	ZERO_STRUCT(lck->changed_write_time);
 	lck->fresh = False;
 	lck->modified = False;
+	lck->relayout = False;
 
 	lck->fresh = (share_mode_data.dptr == NULL);
 
@@ -932,6 +1008,7 @@ bool rename_share_filename(struct messaging_context *msg_ctx,
 		return False;
 	}
 	lck->modified = True;
+	lck->relayout = True;
 
 	sp_len = strlen(lck->servicepath);
 	fn_len = strlen(lck->filename);
@@ -1094,6 +1171,18 @@ static void add_share_mode_entry(struct share_mode_lock *lck,
 
 	if (i == lck->num_share_modes) {
 		/* No unused entry found */
+		if (!lck->relayout && (lck->share_modes != NULL)) {
+			/* Still in the record buffer, can't grow it there. */
+			lck->share_modes = (struct share_mode_entry *)
+				TALLOC_MEMDUP(lck, lck->share_modes,
+					      lck->num_share_modes *
+					      sizeof(struct share_mode_entry));
+			if (lck->share_modes == NULL) {
+				smb_panic("add_share_mode_entry: "
+					  "talloc failed");
+			}
+		}
+		lck->relayout = True;
 		ADD_TO_ARRAY(lck, struct share_mode_entry, *entry,
 			     &lck->share_modes, &lck->num_share_modes);
 	}
@@ -1250,6 +1339,10 @@ bool downgrade_share_oplock(struct share_mode_lock *lck, files_struct *fsp)
 		return False;
 	}
 
+	if (e->op_type == LEVEL_II_OPLOCK) {
+		return True;
+	}
+
 	e->op_type = LEVEL_II_OPLOCK;
 	lck->modified = True;
 	return True;
@@ -1354,6 +1447,7 @@ void set_delete_on_close_token(struct share_mode_lock *lck, const UNIX_USER_TOKE
 	/* Copy the new token (can be NULL). */
 	lck->delete_token = copy_unix_token(lck, tok);
 	lck->modified = True;
+	lck->relayout = True;
 }
 
 /****************************************************************************
@@ -296,7 +296,7 @@ static NTSTATUS onefs_open_file(files_struct *fsp,
 	}
 
 	fsp->mode = psbuf->st_mode;
-	fsp->file_id = vfs_file_id_from_sbuf(conn, psbuf);
+	file_set_file_id(fsp, vfs_file_id_from_sbuf(conn, psbuf));
 	fsp->vuid = req ? req->vuid : UID_FIELD_INVALID;
 	fsp->file_pid = req ? req->smbpid : 0;
 	fsp->can_lock = True;
@@ -805,7 +805,7 @@ NTSTATUS onefs_open_file_ntcreate(connection_struct *conn,
 
 	DEBUG(10, ("fsp = %p\n", fsp));
 
-	fsp->file_id = vfs_file_id_from_sbuf(conn, psbuf);
+	file_set_file_id(fsp, vfs_file_id_from_sbuf(conn, psbuf));
 	fsp->share_access = share_access;
 	fsp->fh->private_options = create_options;
 	fsp->access_mask = open_access_mask; /* We change this to the
@@ -1540,7 +1540,7 @@ static NTSTATUS onefs_open_directory(connection_struct *conn,
 
 	/* Setup the files_struct for it. */
 	fsp->mode = psbuf->st_mode;
-	fsp->file_id = vfs_file_id_from_sbuf(conn, psbuf);
+	file_set_file_id(fsp, vfs_file_id_from_sbuf(conn, psbuf));
 	fsp->vuid = req ? req->vuid : UID_FIELD_INVALID;
 	fsp->file_pid = req ? req->smbpid : 0;
 	fsp->can_lock = False;
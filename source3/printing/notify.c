@@ -116,7 +116,10 @@ again:
 }
 
 /*******************************************************************
- Send the batched messages - on a per-printer basis.
+ Send the batched messages - on a per-printer basis. All listeners of a
+ printer get the same message, so it goes out as one group send. With a
+ timeout the listeners are sent to one at a time instead, so that a
+ backend without a group path can't hold us up for longer than that.
 *******************************************************************/
 
 static void print_notify_send_messages_to_printer(struct messaging_context *msg_ctx,
@@ -130,6 +133,9 @@ static void print_notify_send_messages_to_printer(struct messaging_context *msg_
 	size_t i;
 	pid_t *pid_list = NULL;
 	struct timeval end_time = timeval_zero();
+	struct server_id *pids;
+	NTSTATUS *statuses;
+	DATA_BLOB blob;
 
 	/* Count the space needed to send the messages. */
 	for (pq = notify_queue_head; pq; pq = pq->next) {
@@ -183,18 +189,35 @@ static void print_notify_send_messages_to_printer(struct messaging_context *msg_
 
 	if (timeout != 0) {
 		end_time = timeval_current_ofs(timeout, 0);
-	}
 
-	for (i = 0; i < num_pids; i++) {
-		messaging_send_buf(msg_ctx,
-				   pid_to_procid(pid_list[i]),
-				   MSG_PRINTER_NOTIFY2 | MSG_FLAG_LOWPRIORITY,
-				   (uint8 *)buf, offset);
+		for (i = 0; i < num_pids; i++) {
+			messaging_send_buf(msg_ctx,
+					   pid_to_procid(pid_list[i]),
+					   MSG_PRINTER_NOTIFY2 | MSG_FLAG_LOWPRIORITY,
+					   (uint8 *)buf, offset);
 
-		if ((timeout != 0) && timeval_expired(&end_time)) {
-			break;
+			if (timeval_expired(&end_time)) {
+				break;
+			}
 		}
+		return;
+	}
+
+	pids = TALLOC_ARRAY(send_ctx, struct server_id, num_pids);
+	statuses = TALLOC_ARRAY(send_ctx, NTSTATUS, num_pids);
+	if ((num_pids != 0) && ((pids == NULL) || (statuses == NULL))) {
+		DEBUG(0,("print_notify_send_messages: Out of memory\n"));
+		return;
+	}
+
+	for (i = 0; i < num_pids; i++) {
+		pids[i] = pid_to_procid(pid_list[i]);
 	}
+
+	blob = data_blob_const(buf, offset);
+	messaging_send_multi(msg_ctx, pids, num_pids,
+			     MSG_PRINTER_NOTIFY2 | MSG_FLAG_LOWPRIORITY,
+			     &blob, statuses);
 }
 
 /*******************************************************************
@@ -76,7 +76,7 @@ NTSTATUS print_fsp_open(struct smb_request *req, connection_struct *conn,
 	fsp->wcp = NULL;
 	SMB_VFS_FSTAT(fsp, psbuf);
 	fsp->mode = psbuf->st_mode;
-	fsp->file_id = vfs_file_id_from_sbuf(conn, psbuf);
+	file_set_file_id(fsp, vfs_file_id_from_sbuf(conn, psbuf));
 
 	return NT_STATUS_OK;
 }
@@ -47,12 +47,16 @@ struct aio_extra {
 	SMB_STRUCT_AIOCB acb;
 	files_struct *fsp;
 	struct smb_request *req;
+	unsigned int mid;
 	char *outbuf;
+	void *private_data;
 	int (*handle_completion)(struct aio_extra *ex);
 };
 
 static int handle_aio_read_complete(struct aio_extra *aio_ex);
 static int handle_aio_write_complete(struct aio_extra *aio_ex);
+static int handle_aio_write_cache_complete(struct aio_extra *aio_ex);
+static void cancel_aio_write_cache_flush(files_struct *fsp);
 
 static int aio_extra_destructor(struct aio_extra *aio_ex)
 {
@@ -89,15 +93,16 @@ static struct aio_extra *create_aio_extra(files_struct *fsp, size_t buflen)
 }
 
 /****************************************************************************
- Given the mid find the extended aio struct containing it.
+ Given the mid find the extended aio struct containing it. Write cache
+ flushes have no request and use ids above the 16 bit mid space.
 *****************************************************************************/
 
-static struct aio_extra *find_aio_ex(uint16 mid)
+static struct aio_extra *find_aio_ex(unsigned int mid)
 {
 	struct aio_extra *p;
 
 	for( p = aio_list_head; p; p = p->next) {
-		if (mid == p->req->mid) {
+		if (mid == p->mid) {
 			return p;
 		}
 	}
@@ -139,9 +144,8 @@ bool schedule_aio_read_and_X(connection_struct *conn,
 		return False;
 	}
 
-	/* Only do this on non-chained and non-chaining reads not using the
-	 * write cache. */
-        if (req_is_in_chain(req) || (lp_write_cache_size(SNUM(conn)) != 0)) {
+	/* Only do this on non-chained and non-chaining reads. */
+        if (req_is_in_chain(req)) {
 		return False;
 	}
 
@@ -152,6 +156,13 @@ bool schedule_aio_read_and_X(connection_struct *conn,
 		return False;
 	}
 
+	/* The read goes straight to disk, so any cached data it
+	 * covers must be there first. */
+	if (write_cache_sync_range(fsp, startpos, smb_maxcnt,
+				   READ_FLUSH) == -1) {
+		return False;
+	}
+
 	/* The following is safe from integer wrap as we've already checked
 	   smb_maxcnt is 128k or less. Wct is 12 for read replies */
 
@@ -162,6 +173,7 @@ bool schedule_aio_read_and_X(connection_struct *conn,
 		return False;
 	}
 	aio_ex->handle_completion = handle_aio_read_complete;
+	aio_ex->mid = req->mid;
 
 	construct_reply_common_req(req, aio_ex->outbuf);
 	srv_set_message(aio_ex->outbuf, 12, 0, True);
@@ -234,9 +246,16 @@ bool schedule_aio_write_and_X(connection_struct *conn,
 		return False;
 	}
 
-	/* Only do this on non-chained and non-chaining reads not using the
-	 * write cache. */
-        if (req_is_in_chain(req) || (lp_write_cache_size(SNUM(conn)) != 0)) {
+	/* Only do this on non-chained and non-chaining writes. */
+        if (req_is_in_chain(req)) {
+		return False;
+	}
+
+	/* Small writes under an exclusive oplock are better merged in the
+	 * write cache, which sets itself up on the first write. */
+	if (EXCLUSIVE_OPLOCK_TYPE(fsp->oplock_type) &&
+	    (fsp->wcp != NULL || !fsp->modified) &&
+	    (numtowrite <= (size_t)lp_write_cache_size(SNUM(conn)))) {
 		return False;
 	}
 
@@ -253,6 +272,13 @@ bool schedule_aio_write_and_X(connection_struct *conn,
 		return False;
 	}
 
+	/* Don't let a later write behind of older cached data land
+	 * on top of this write. */
+	if (write_cache_sync_range(fsp, startpos, numtowrite,
+				   WRITE_FLUSH) == -1) {
+		return False;
+	}
+
 	bufsize = smb_size + 6*2;
 
 	if (!(aio_ex = create_aio_extra(fsp, bufsize))) {
@@ -260,6 +286,7 @@ bool schedule_aio_write_and_X(connection_struct *conn,
 		return False;
 	}
 	aio_ex->handle_completion = handle_aio_write_complete;
+	aio_ex->mid = req->mid;
 
 	construct_reply_common_req(req, aio_ex->outbuf);
 	srv_set_message(aio_ex->outbuf, 6, 0, True);
@@ -322,6 +349,71 @@ bool schedule_aio_write_and_X(connection_struct *conn,
 	return True;
 }
 
+/****************************************************************************
+ Write one write cache extent behind using aio. The aio record takes over
+ the extent buffer so it stays valid even if the file is closed under us.
+ Returns False if the caller must write the extent synchronously.
+*****************************************************************************/
+
+bool schedule_aio_write_cache_flush(files_struct *fsp,
+				    struct write_cache_extent *ext)
+{
+	struct aio_extra *aio_ex;
+	SMB_STRUCT_AIOCB *a;
+	int ret;
+
+	if (fsp->base_fsp != NULL || aio_signal_event == NULL) {
+		return False;
+	}
+
+	if (outstanding_aio_calls >= aio_pending_size) {
+		DEBUG(10,("schedule_aio_write_cache_flush: Already have %d "
+			  "aio activities outstanding.\n",
+			  outstanding_aio_calls ));
+		return False;
+	}
+
+	if (!(aio_ex = create_aio_extra(fsp, 0))) {
+		DEBUG(0,("schedule_aio_write_cache_flush: malloc fail.\n"));
+		return False;
+	}
+	aio_ex->handle_completion = handle_aio_write_cache_complete;
+	aio_ex->private_data = ext;
+
+	/* Keep clear of the 16 bit mid space used by client requests. */
+	aio_ex->mid = 0x10000 + (aio_write_cache_flush_id++ & 0xffff);
+
+	a = &aio_ex->acb;
+
+	a->aio_fildes = fsp->fh->fd;
+	a->aio_buf = ext->data;
+	a->aio_nbytes = ext->data_size;
+	a->aio_offset = ext->offset;
+	a->aio_sigevent.sigev_notify = SIGEV_SIGNAL;
+	a->aio_sigevent.sigev_signo  = RT_SIGNAL_AIO;
+	a->aio_sigevent.sigev_value.sival_int = aio_ex->mid;
+
+	become_root();
+	ret = SMB_VFS_AIO_WRITE(fsp, a);
+	unbecome_root();
+
+	if (ret == -1) {
+		DEBUG(3,("schedule_aio_write_cache_flush: aio_write failed. "
+			 "Error %s\n", strerror(errno) ));
+		TALLOC_FREE(aio_ex);
+		return False;
+	}
+
+	talloc_steal(aio_ex, ext->data);
+	outstanding_aio_calls++;
+
+	DEBUG(10,("schedule_aio_write_cache_flush: scheduled write behind "
+		  "for file %s, offset %.0f, len = %u\n",
+		  fsp->fsp_name, (double)ext->offset,
+		  (unsigned int)ext->data_size ));
+
+	return True;
+}
 
 /****************************************************************************
  Complete the read and return the data or error back to the client.
@@ -487,6 +579,29 @@ static int handle_aio_write_complete(struct aio_extra *aio_ex)
 	return ret;
 }
 
+/****************************************************************************
+ A write cache extent reached the disk (or failed to). There's no client
+ to answer, just let the write cache drop the extent.
+*****************************************************************************/
+
+static int handle_aio_write_cache_complete(struct aio_extra *aio_ex)
+{
+	files_struct *fsp = aio_ex->fsp;
+	ssize_t nwritten = SMB_VFS_AIO_RETURN(fsp, &aio_ex->acb);
+	int err = 0;
+
+	if (nwritten == -1) {
+		err = errno;
+	} else if (nwritten != (ssize_t)aio_ex->acb.aio_nbytes) {
+		err = EIO;
+	}
+
+	write_cache_flush_done(fsp,
+			       (struct write_cache_extent *)aio_ex->private_data,
+			       err);
+	return err;
+}
+
 /****************************************************************************
  Handle any aio completion. Returns True if finished (and sets *perr if err
  was non-zero), False if not.
@@ -505,7 +620,7 @@ static bool handle_aio_completed(struct aio_extra *aio_ex, int *perr)
 	if (SMB_VFS_AIO_ERROR(aio_ex->fsp, &aio_ex->acb) == EINPROGRESS) {
 		DEBUG(10,( "handle_aio_completed: operation mid %u still in "
 			   "process for file %s\n",
-			   aio_ex->req->mid, aio_ex->fsp->fsp_name ));
+			   aio_ex->mid, aio_ex->fsp->fsp_name ));
 		return False;
 	}
 
@@ -538,10 +653,12 @@ void smbd_aio_complete_mid(unsigned int mid)
 
 	fsp = aio_ex->fsp;
 	if (fsp == NULL) {
-		/* file was closed whilst I/O was outstanding. Just
-		 * ignore. */
+		/* file was closed whilst I/O was outstanding. Nobody
+		 * wants the result, but the record has to go. */
 		DEBUG( 3,( "smbd_aio_complete_mid: file closed whilst "
 			   "aio outstanding (mid[%u]).\n", mid));
+		outstanding_aio_calls--;
+		TALLOC_FREE(aio_ex);
 		return;
 	}
 
@@ -549,6 +666,7 @@ void smbd_aio_complete_mid(unsigned int mid)
 		return;
 	}
 
+	outstanding_aio_calls--;
 	TALLOC_FREE(aio_ex);
 }
 
@@ -571,7 +689,20 @@ static void smbd_aio_signal_handler(struct tevent_context *ev_ctx,
 
 #define SMB_TIME_FOR_AIO_COMPLETE_WAIT 29
 
-int wait_for_aio_completion(files_struct *fsp)
+static bool aio_wait_match(struct aio_extra *aio_ex, files_struct *fsp,
+			   bool write_cache_only)
+{
+	if (aio_ex->fsp != fsp) {
+		return False;
+	}
+	if (write_cache_only &&
+	    aio_ex->handle_completion != handle_aio_write_cache_complete) {
+		return False;
+	}
+	return True;
+}
+
+static int wait_for_aio_records(files_struct *fsp, bool write_cache_only)
 {
 	struct aio_extra *aio_ex;
 	const SMB_STRUCT_AIOCB **aiocb_list;
@@ -587,7 +718,7 @@ int wait_for_aio_completion(files_struct *fsp)
 
 		aio_completion_count = 0;
 		for( aio_ex = aio_list_head; aio_ex; aio_ex = aio_ex->next) {
-			if (aio_ex->fsp == fsp) {
+			if (aio_wait_match(aio_ex, fsp, write_cache_only)) {
 				aio_completion_count++;
 			}
 		}
@@ -608,7 +739,7 @@ int wait_for_aio_completion(files_struct *fsp)
 		for( i = 0, aio_ex = aio_list_head;
 		     aio_ex;
 		     aio_ex = aio_ex->next) {
-			if (aio_ex->fsp == fsp) {
+			if (aio_wait_match(aio_ex, fsp, write_cache_only)) {
 				aiocb_list[i++] = &aio_ex->acb;
 			}
 		}
@@ -633,7 +764,10 @@ int wait_for_aio_completion(files_struct *fsp)
 				 "%d seconds\n", aio_completion_count,
 				 seconds_left));
 			/* Timeout. */
-			cancel_aio_by_fsp(fsp);
+			cancel_aio_write_cache_flush(fsp);
+			if (!write_cache_only) {
+				cancel_aio_by_fsp(fsp);
+			}
 			SAFE_FREE(aiocb_list);
 			return EIO;
 		}
@@ -641,7 +775,7 @@ int wait_for_aio_completion(files_struct *fsp)
 		/* One or more events might have completed - process them if
 		 * so. */
 		for( i = 0; i < aio_completion_count; i++) {
-			uint16 mid = aiocb_list[i]->aio_sigevent.sigev_value.sival_int;
+			unsigned int mid = aiocb_list[i]->aio_sigevent.sigev_value.sival_int;
 
 			aio_ex = find_aio_ex(mid);
 
@@ -655,6 +789,7 @@ int wait_for_aio_completion(files_struct *fsp)
 			if (!handle_aio_completed(aio_ex, &err)) {
 				continue;
 			}
+			outstanding_aio_calls--;
 			TALLOC_FREE(aio_ex);
 		}
 
@@ -672,8 +807,61 @@ int wait_for_aio_completion(files_struct *fsp)
 	return EIO;
 }
 
+int wait_for_aio_completion(files_struct *fsp)
+{
+	return wait_for_aio_records(fsp, False);
+}
+
+/****************************************************************************
+ Wait for the write cache extents of a file that are being written behind,
+ leaving any client aio alone.
+*****************************************************************************/
+
+int wait_for_aio_write_cache_flush(files_struct *fsp)
+{
+	return wait_for_aio_records(fsp, True);
+}
+
+/****************************************************************************
+ Cancel the write cache write behinds of a file. Whatever could be cancelled
+ (or finished meanwhile) is completed right here, so its error ends up in
+ the write cache. A write that is still going keeps its buffer, we fail its
+ extent now and free the record once the completion signal arrives.
+*****************************************************************************/
+
+static void cancel_aio_write_cache_flush(files_struct *fsp)
+{
+	struct aio_extra *aio_ex, *next;
+
+	for( aio_ex = aio_list_head; aio_ex; aio_ex = next) {
+		int err = 0;
+
+		next = aio_ex->next;
+
+		if (!aio_wait_match(aio_ex, fsp, True)) {
+			continue;
+		}
+
+		SMB_VFS_AIO_CANCEL(fsp, &aio_ex->acb);
+
+		if (handle_aio_completed(aio_ex, &err)) {
+			outstanding_aio_calls--;
+			TALLOC_FREE(aio_ex);
+			continue;
+		}
+
+		write_cache_flush_done(
+			fsp, (struct write_cache_extent *)aio_ex->private_data,
+			EIO);
+		aio_ex->private_data = NULL;
+		aio_ex->fsp = NULL;
+	}
+}
+
 /****************************************************************************
  Cancel any outstanding aio requests. The client doesn't care about the reply.
+ Write cache write behinds are left alone, the client was told that data is
+ written. flush_write_cache() waits for them.
 *****************************************************************************/
 
 void cancel_aio_by_fsp(files_struct *fsp)
@@ -681,6 +869,10 @@ void cancel_aio_by_fsp(files_struct *fsp)
 	struct aio_extra *aio_ex;
 
 	for( aio_ex = aio_list_head; aio_ex; aio_ex = aio_ex->next) {
+		if (aio_ex->handle_completion ==
+		    handle_aio_write_cache_complete) {
+			continue;
+		}
 		if (aio_ex->fsp == fsp) {
 			/* Don't delete the aio_extra record as we may have
 			   completed and don't yet know it. Just do the
@@ -733,6 +925,12 @@ bool schedule_aio_write_and_X(connection_struct *conn,
 	return False;
 }
 
+bool schedule_aio_write_cache_flush(files_struct *fsp,
+				    struct write_cache_extent *ext)
+{
+	return False;
+}
+
 void cancel_aio_by_fsp(files_struct *fsp)
 {
 }
@@ -742,6 +940,11 @@ int wait_for_aio_completion(files_struct *fsp)
 	return ENOSYS;
 }
 
+int wait_for_aio_write_cache_flush(files_struct *fsp)
+{
+	return 0;
+}
+
 void smbd_aio_complete_mid(unsigned int mid);
 
 #endif
@@ -33,6 +33,10 @@ static void received_unlock_msg(struct messaging_context *msg,
 				struct server_id server_id,
 				DATA_BLOB *data);
 
+static bool recalc_brl_timeout(void);
+static void process_blocking_lock_queue_internal(const struct file_id *id,
+						 bool timeouts_only);
+
 static void brl_timeout_fn(struct event_context *event_ctx,
 			   struct timed_event *te,
 			   struct timeval now,
@@ -44,7 +48,12 @@ static void brl_timeout_fn(struct event_context *event_ctx,
 	change_to_root_user();	/* TODO: Possibly run all timed events as
 				 * root */
 
-	process_blocking_lock_queue();
+	/*
+	 * Unlocks wake their waiters with a message, the timer is only
+	 * for requests that expire and for POSIX locks, which don't.
+	 */
+	process_blocking_lock_queue_internal(NULL, true);
+	recalc_brl_timeout();
 }
 
 /****************************************************************************
@@ -620,7 +629,9 @@ bool blocking_lock_was_deferred(int mid)
 }
 
 /****************************************************************************
-  Set a flag as an unlock request affects one of our pending locks.
+ An unlock affects one of our pending locks. brlock sends the file id of
+ the unlocked file, only the requests waiting on it can have changed.
+ Anyone else sends an empty message to have everything retried.
 *****************************************************************************/
 
 static void received_unlock_msg(struct messaging_context *msg,
@@ -629,6 +640,16 @@ static void received_unlock_msg(struct messaging_context *msg,
 				struct server_id server_id,
 				DATA_BLOB *data)
 {
+	struct file_id id;
+
+	if ((data->data != NULL) && (data->length == 24)) {
+		pull_file_id_24((char *)data->data, &id);
+		DEBUG(10,("received_unlock_msg for file %s\n",
+			  file_id_string_tos(&id)));
+		process_blocking_lock_queue_internal(&id, false);
+		return;
+	}
+
 	DEBUG(10,("received_unlock_msg\n"));
 	process_blocking_lock_queue();
 }
@@ -638,6 +659,18 @@ static void received_unlock_msg(struct messaging_context *msg,
 *****************************************************************************/
 
 void process_blocking_lock_queue(void)
+{
+	process_blocking_lock_queue_internal(NULL, false);
+}
+
+/****************************************************************************
+ Retry the requests waiting on file id, or all of them if id is NULL. With
+ timeouts_only, only retry the ones that have expired and the ones blocked
+ by a POSIX lock, nobody tells us when those go away.
+*****************************************************************************/
+
+static void process_blocking_lock_queue_internal(const struct file_id *id,
+						 bool timeouts_only)
 {
 	struct timeval tv_curr = timeval_current();
 	struct blocking_lock_record *blr, *next = NULL;
@@ -651,6 +684,17 @@ void process_blocking_lock_queue(void)
 
 		next = blr->next;
 
+		if ((id != NULL) && !file_id_equal(&blr->fsp->file_id, id)) {
+			continue;
+		}
+
+		if (timeouts_only &&
+		    (blr->blocking_pid != 0xFFFFFFFF) &&
+		    (timeval_is_zero(&blr->expire_time) ||
+		     timeval_compare(&blr->expire_time, &tv_curr) > 0)) {
+			continue;
+		}
+
 		/*
 		 * Go through the remaining locks and try and obtain them.
 		 * The call returns True if all locks were obtained successfully
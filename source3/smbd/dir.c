@@ -35,6 +35,16 @@
 struct name_cache_entry {
 	char *name;
 	long offset;
+	unsigned int file_number; /* After reading it, 0 if unknown. */
+};
+
+/* An entry read ahead of the client, see dir_prefetch_fill(). */
+
+struct dir_prefetch_entry {
+	char *name;
+	long offset;
+	SMB_INO_T ino;
+	SMB_STRUCT_STAT st;
 };
 
 struct smb_Dir {
@@ -46,10 +56,33 @@ struct smb_Dir {
 	struct name_cache_entry *name_cache;
 	unsigned int name_cache_index;
 	unsigned int file_number;
+	/* Set after a seek to an offset we can't place, see dir_recount(). */
+	bool file_number_unknown;
+
+	/* Read ahead buffer, only used when prefetch_size != 0. */
+	unsigned int prefetch_size;
+	unsigned int prefetch_count;
+	unsigned int prefetch_index;
+	long prefetch_start;
+	unsigned int prefetch_start_file_number;
+	time_t prefetch_time;
+	struct dir_prefetch_entry *prefetch;
+	char *prefetch_mask;
+
+	/*
+	 * Set by dptr_reopen(): the client still has the old handle's
+	 * offset for the position we reopened at, this is ours. Only
+	 * good for the first seek, after that the client has ours.
+	 */
+	bool reopened;
+	long reopen_old_offset;
+	long reopen_new_offset;
 };
 
 struct dptr_struct {
 	struct dptr_struct *next, *prev;
+	/* Least recently used order of dptrs holding an open dir_hnd. */
+	struct dptr_struct *open_next, *open_prev;
 	int dnum;
 	uint16 spid;
 	struct connection_struct *conn;
@@ -60,11 +93,20 @@ struct dptr_struct {
 	char *path;
 	bool has_wild; /* Set to true if the wcard entry has MS wildcard characters in it. */
 	bool did_stat; /* Optimisation for non-wcard searches. */
+
+	/* Where an idled dir_hnd was, see dptr_idle(). */
+	long idle_offset;
+	unsigned int idle_file_number;
+	unsigned int idle_name_cache_index;
+	struct name_cache_entry *idle_name_cache;
 };
 
 
 #define INVALID_DPTR_KEY (-3)
 
+static void dir_prefetch_start(struct smb_Dir *dirp, const char *mask);
+static void dir_recount(struct smb_Dir *dirp);
+
 /****************************************************************************
  Make a dir struct.
 ****************************************************************************/
@@ -124,18 +166,77 @@ void init_dptrs(void)
 
 	if (!dptr_bmap)
 		exit_server("out of memory in init_dptrs");
+
+	dptr_table = SMB_CALLOC_ARRAY(struct dptr_struct *,
+				      MAX_DIRECTORY_HANDLES);
+
+	if (!dptr_table)
+		exit_server("out of memory in init_dptrs");
+}
+
+/****************************************************************************
+ Maintain the list of dptrs with an open directory, most recently used
+ first, so the one to idle is always at the tail.
+****************************************************************************/
+
+static void dptr_open_add(struct dptr_struct *dptr)
+{
+	dptr->open_prev = NULL;
+	dptr->open_next = dptr_open_head;
+	if (dptr_open_head) {
+		dptr_open_head->open_prev = dptr;
+	} else {
+		dptr_open_tail = dptr;
+	}
+	dptr_open_head = dptr;
+}
+
+static void dptr_open_remove(struct dptr_struct *dptr)
+{
+	if (dptr->open_prev) {
+		dptr->open_prev->open_next = dptr->open_next;
+	} else {
+		dptr_open_head = dptr->open_next;
+	}
+	if (dptr->open_next) {
+		dptr->open_next->open_prev = dptr->open_prev;
+	} else {
+		dptr_open_tail = dptr->open_prev;
+	}
+	dptr->open_next = dptr->open_prev = NULL;
 }
 
 /****************************************************************************
  Idle a dptr - the directory is closed but the control info is kept.
+ Remember the position and the names already returned so the search
+ carries on from the same place when it is reopened.
 ****************************************************************************/
 
 static void dptr_idle(struct dptr_struct *dptr)
 {
-	if (dptr->dir_hnd) {
-		DEBUG(4,("Idling dptr dnum %d\n",dptr->dnum));
-		TALLOC_FREE(dptr->dir_hnd);
+	struct smb_Dir *dirp = dptr->dir_hnd;
+
+	if (!dirp) {
+		return;
+	}
+
+	DEBUG(4,("Idling dptr dnum %d\n",dptr->dnum));
+
+	dptr_open_remove(dptr);
+
+	if (dirp->file_number_unknown
+	    && (dirp->offset != END_OF_DIRECTORY_OFFSET)) {
+		/* dptr_reread() needs to know how far to read. */
+		dir_recount(dirp);
 	}
+
+	dptr->idle_offset = dirp->offset;
+	dptr->idle_file_number = dirp->file_number;
+	dptr->idle_name_cache_index = dirp->name_cache_index;
+	TALLOC_FREE(dptr->idle_name_cache);
+	dptr->idle_name_cache = talloc_move(NULL, &dirp->name_cache);
+
+	TALLOC_FREE(dptr->dir_hnd);
 }
 
 /****************************************************************************
@@ -144,29 +245,104 @@ static void dptr_idle(struct dptr_struct *dptr)
 
 static void dptr_idleoldest(void)
 {
-	struct dptr_struct *dptr;
+	if (!dptr_open_tail) {
+		DEBUG(0,("No dptrs available to idle ?\n"));
+		return;
+	}
 
-	/*
-	 * Go to the end of the list.
-	 */
-	for(dptr = dirptrs; dptr && dptr->next; dptr = dptr->next)
-		;
+	dptr_idle(dptr_open_tail);
+}
 
-	if(!dptr) {
-		DEBUG(0,("No dptrs available to idle ?\n"));
+/****************************************************************************
+ Read a freshly opened handle up to the position a dptr was idled at. The
+ idled offset is a telldir() cookie of the old handle, which is no good
+ for seeking another one (hashed offsets, NFS). On the way, give the names
+ we remembered the offsets of the new handle.
+****************************************************************************/
+
+static void dptr_reread(struct dptr_struct *dptr, struct smb_Dir *dirp)
+{
+	long offset = START_OF_DIRECTORY_OFFSET;
+	const char *name;
+	unsigned int i;
+
+	if (dptr->idle_offset == END_OF_DIRECTORY_OFFSET) {
+		SeekDir(dirp, END_OF_DIRECTORY_OFFSET);
+		dirp->file_number = dptr->idle_file_number;
+		for (i = 0; dirp->name_cache && (i < dirp->name_cache_size);
+		     i++) {
+			TALLOC_FREE(dirp->name_cache[i].name);
+		}
 		return;
 	}
 
-	/*
-	 * Idle the oldest pointer.
-	 */
+	for (i = 0; dirp->name_cache && (i < dirp->name_cache_size); i++) {
+		dirp->name_cache[i].offset = END_OF_DIRECTORY_OFFSET;
+		dirp->name_cache[i].file_number = 0;
+	}
 
-	for(; dptr; dptr = dptr->prev) {
-		if (dptr->dir_hnd) {
-			dptr_idle(dptr);
-			return;
+	while ((dirp->file_number < dptr->idle_file_number)
+	       && ((name = ReadDirName(dirp, &offset, NULL)) != NULL)) {
+		for (i = 0; dirp->name_cache && (i < dirp->name_cache_size);
+		     i++) {
+			struct name_cache_entry *e = &dirp->name_cache[i];
+			if (e->name && (strcmp(e->name, name) == 0)) {
+				e->offset = offset;
+				e->file_number = dirp->file_number;
+			}
+		}
+	}
+
+	/* Forget names that are gone, we have no offset for them. */
+	for (i = 0; dirp->name_cache && (i < dirp->name_cache_size); i++) {
+		struct name_cache_entry *e = &dirp->name_cache[i];
+		if (e->offset == END_OF_DIRECTORY_OFFSET) {
+			TALLOC_FREE(e->name);
 		}
 	}
+
+	dirp->reopened = True;
+	dirp->reopen_old_offset = dptr->idle_offset;
+	dirp->reopen_new_offset = dirp->offset;
+}
+
+/****************************************************************************
+ Reopen an idled dptr at the position it was idled at.
+****************************************************************************/
+
+static bool dptr_reopen(struct dptr_struct *dptr)
+{
+	struct smb_Dir *dirp;
+
+	if (dirhandles_open >= MAX_OPEN_DIRECTORIES)
+		dptr_idleoldest();
+
+	DEBUG(4,("dptr_get: Reopening dptr key %d\n",dptr->dnum));
+
+	dirp = OpenDir(NULL, dptr->conn, dptr->path, dptr->wcard, dptr->attr);
+	if (!dirp) {
+		DEBUG(4,("dptr_get: Failed to open %s (%s)\n",dptr->path,
+			strerror(errno)));
+		return False;
+	}
+
+	if (dptr->has_wild) {
+		dir_prefetch_start(dirp, dptr->wcard);
+	}
+
+	if (dptr->idle_name_cache &&
+	    (dirp->name_cache_size == talloc_array_length(
+		    dptr->idle_name_cache))) {
+		dirp->name_cache = talloc_move(dirp, &dptr->idle_name_cache);
+		dirp->name_cache_index = dptr->idle_name_cache_index;
+	}
+	TALLOC_FREE(dptr->idle_name_cache);
+
+	dptr_reread(dptr, dirp);
+
+	dptr->dir_hnd = dirp;
+	dptr_open_add(dptr);
+	return True;
 }
 
 /****************************************************************************
@@ -177,25 +353,29 @@ static struct dptr_struct *dptr_get(int key, bool forclose)
 {
 	struct dptr_struct *dptr;
 
-	for(dptr = dirptrs; dptr; dptr = dptr->next) {
-		if(dptr->dnum == key) {
-			if (!forclose && !dptr->dir_hnd) {
-				if (dirhandles_open >= MAX_OPEN_DIRECTORIES)
-					dptr_idleoldest();
-				DEBUG(4,("dptr_get: Reopening dptr key %d\n",key));
-				if (!(dptr->dir_hnd = OpenDir(
-					      NULL, dptr->conn, dptr->path,
-					      dptr->wcard, dptr->attr))) {
-					DEBUG(4,("dptr_get: Failed to open %s (%s)\n",dptr->path,
-						strerror(errno)));
-					return False;
-				}
-			}
-			DLIST_PROMOTE(dirptrs,dptr);
+	if ((key < 1) || (key > MAX_DIRECTORY_HANDLES)) {
+		return NULL;
+	}
+
+	dptr = dptr_table[key - 1];
+	if (!dptr) {
+		return NULL;
+	}
+
+	if (!dptr->dir_hnd) {
+		if (forclose) {
 			return dptr;
 		}
+		if (!dptr_reopen(dptr)) {
+			return NULL;
+		}
+	} else if (dptr != dptr_open_head) {
+		dptr_open_remove(dptr);
+		dptr_open_add(dptr);
 	}
-	return(NULL);
+
+	DLIST_PROMOTE(dirptrs,dptr);
+	return dptr;
 }
 
 /****************************************************************************
@@ -243,6 +423,10 @@ static void dptr_close_internal(struct dptr_struct *dptr)
 	DEBUG(4,("closing dptr key %d\n",dptr->dnum));
 
 	DLIST_REMOVE(dirptrs, dptr);
+	if (dptr->dir_hnd) {
+		dptr_open_remove(dptr);
+	}
+	dptr_table[dptr->dnum - 1] = NULL;
 
 	/*
 	 * Free the dnum in the bitmap. Remember the dnum value is always 
@@ -257,6 +441,7 @@ static void dptr_close_internal(struct dptr_struct *dptr)
 	bitmap_clear(dptr_bmap, dptr->dnum - 1);
 
 	TALLOC_FREE(dptr->dir_hnd);
+	TALLOC_FREE(dptr->idle_name_cache);
 
 	/* Lanman 2 specific code */
 	SAFE_FREE(dptr->wcard);
@@ -407,6 +592,11 @@ NTSTATUS dptr_create(connection_struct *conn, const char *path, bool old_handle,
 		return map_nt_error_from_unix(errno);
 	}
 
+	if (wcard_has_wild) {
+		/* Wildcard searches stat every match, read ahead. */
+		dir_prefetch_start(dir_hnd, wcard);
+	}
+
 	string_set(&conn->dirpath,path);
 
 	if (dirhandles_open >= MAX_OPEN_DIRECTORIES) {
@@ -507,6 +697,8 @@ NTSTATUS dptr_create(connection_struct *conn, const char *path, bool old_handle,
 	dptr->attr = attr;
 
 	DLIST_ADD(dirptrs, dptr);
+	dptr_table[dptr->dnum - 1] = dptr;
+	dptr_open_add(dptr);
 
 	DEBUG(3,("creating new dirptr %d for path %s, expect_close = %d\n",
 		dptr->dnum,path,expect_close));  
@@ -524,6 +716,9 @@ NTSTATUS dptr_create(connection_struct *conn, const char *path, bool old_handle,
 int dptr_CloseDir(struct dptr_struct *dptr)
 {
 	DLIST_REMOVE(dirptrs, dptr);
+	if (dptr->dir_hnd) {
+		dptr_open_remove(dptr);
+	}
 	TALLOC_FREE(dptr->dir_hnd);
 	return 0;
 }
@@ -1109,6 +1304,214 @@ struct smb_Dir *OpenDir(TALLOC_CTX *mem_ctx, connection_struct *conn,
 	return NULL;
 }
 
+/*******************************************************************
+ Throw away the read ahead buffer. The underlying directory handle is
+ left wherever the last fill put it, callers must seek or rewind.
+********************************************************************/
+
+static void dir_prefetch_drop(struct smb_Dir *dirp)
+{
+	dirp->prefetch_count = 0;
+	dirp->prefetch_index = 0;
+	TALLOC_FREE(dirp->prefetch);
+}
+
+/*******************************************************************
+ Turn on read ahead for a wildcard search. Only entries that can match
+ mask get stat'ed in a batch, the rest are left for the caller.
+********************************************************************/
+
+static void dir_prefetch_start(struct smb_Dir *dirp, const char *mask)
+{
+	dirp->prefetch_size = DIR_PREFETCH_MIN;
+	TALLOC_FREE(dirp->prefetch_mask);
+	if ((strcmp(mask, "*") != 0) && (strcmp(mask, "*.*") != 0)) {
+		/* On allocation failure we just stat everything. */
+		dirp->prefetch_mask = talloc_strdup(dirp, mask);
+	}
+}
+
+/*******************************************************************
+ Is a read ahead entry worth a stat? This has to be a superset of what
+ the search code matches, so match case insensitively and against the
+ mangled name as well. Vetoed files are never returned.
+********************************************************************/
+
+static bool dir_prefetch_wanted(struct smb_Dir *dirp, const char *name)
+{
+	const char *mask = dirp->prefetch_mask;
+
+	if (IS_VETO_PATH(dirp->conn, name)) {
+		return False;
+	}
+	if (mask == NULL) {
+		return True;
+	}
+	return (mask_match_search(name, mask, False) ||
+		mangle_mask_match(dirp->conn, name, mask));
+}
+
+static int dir_prefetch_ino_cmp(struct dir_prefetch_entry **e1,
+				struct dir_prefetch_entry **e2)
+{
+	if ((*e1)->ino == (*e2)->ino) {
+		return 0;
+	}
+	return ((*e1)->ino < (*e2)->ino) ? -1 : 1;
+}
+
+/*******************************************************************
+ Read a batch of entries ahead of the client. If the caller wants stat
+ information, stat the entries that can match the search mask and that
+ readdir didn't give us a stat for in one go, sorted by inode number so that a cold inode table is read mostly in order.
+ The batch grows while the client keeps reading, so a search that
+ only wants the first match doesn't stat the whole directory.
+********************************************************************/
+
+static bool dir_prefetch_fill(struct smb_Dir *dirp, bool want_stat)
+{
+	connection_struct *conn = dirp->conn;
+	struct dir_prefetch_entry **sorted = NULL;
+	SMB_STRUCT_DIRENT *de;
+	unsigned int i, num_stat = 0;
+
+	if (dirp->prefetch != NULL) {
+		dirp->prefetch_size = MIN(dirp->prefetch_size * 2,
+					  DIR_PREFETCH_MAX);
+	}
+	dir_prefetch_drop(dirp);
+
+	dirp->prefetch = TALLOC_ZERO_ARRAY(dirp, struct dir_prefetch_entry,
+					   dirp->prefetch_size);
+	if (dirp->prefetch == NULL) {
+		return False;
+	}
+	dirp->prefetch_start = dirp->offset;
+	dirp->prefetch_start_file_number = dirp->file_number;
+
+	while (dirp->prefetch_count < dirp->prefetch_size) {
+		struct dir_prefetch_entry *e =
+			&dirp->prefetch[dirp->prefetch_count];
+
+		de = SMB_VFS_READDIR(conn, dirp->dir, &e->st);
+		if (de == NULL) {
+			break;
+		}
+		/* Ignore . and .. - ReadDirName returns them itself. */
+		if (ISDOT(de->d_name) || ISDOTDOT(de->d_name)) {
+			continue;
+		}
+		e->name = talloc_strdup(dirp->prefetch, de->d_name);
+		if (e->name == NULL) {
+			break;
+		}
+		e->offset = SMB_VFS_TELLDIR(conn, dirp->dir);
+		e->ino = (SMB_INO_T)de->d_ino;
+		if (!VALID_STAT(e->st)) {
+			num_stat++;
+		}
+		dirp->prefetch_count++;
+	}
+
+	dirp->prefetch_time = time(NULL);
+
+	if (!want_stat || (num_stat == 0)) {
+		return (dirp->prefetch_count != 0);
+	}
+
+	sorted = TALLOC_ARRAY(talloc_tos(), struct dir_prefetch_entry *,
+			      num_stat);
+	if (sorted == NULL) {
+		return (dirp->prefetch_count != 0);
+	}
+
+	num_stat = 0;
+	for (i = 0; i < dirp->prefetch_count; i++) {
+		struct dir_prefetch_entry *e = &dirp->prefetch[i];
+
+		if (!VALID_STAT(e->st) && dir_prefetch_wanted(dirp, e->name)) {
+			sorted[num_stat++] = e;
+		}
+	}
+	qsort(sorted, num_stat, sizeof(sorted[0]),
+	      QSORT_CAST dir_prefetch_ino_cmp);
+
+	for (i = 0; i < num_stat; i++) {
+		char *path = talloc_asprintf(talloc_tos(), "%s/%s",
+					     dirp->dir_path, sorted[i]->name);
+		if ((path == NULL)
+		    || (SMB_VFS_STAT(conn, path, &sorted[i]->st) != 0)) {
+			/* Leave it to the caller to find out why. */
+			SET_STAT_INVALID(sorted[i]->st);
+		}
+		TALLOC_FREE(path);
+	}
+
+	DEBUG(10,("dir_prefetch_fill: read %u entries of %s, stat'ed %u\n",
+		  dirp->prefetch_count, dirp->dir_path, num_stat));
+
+	TALLOC_FREE(sorted);
+	return True;
+}
+
+/*******************************************************************
+ ReadDirName() from the read ahead buffer.
+********************************************************************/
+
+static const char *dir_prefetch_next(struct smb_Dir *dirp, long *poffset,
+				     SMB_STRUCT_STAT *sbuf)
+{
+	struct dir_prefetch_entry *e;
+
+	if ((dirp->prefetch_index >= dirp->prefetch_count)
+	    && !dir_prefetch_fill(dirp, (sbuf != NULL))) {
+		*poffset = dirp->offset = END_OF_DIRECTORY_OFFSET;
+		return NULL;
+	}
+
+	e = &dirp->prefetch[dirp->prefetch_index++];
+
+	if (sbuf != NULL) {
+		/* Don't hand out stat information the client waited on. */
+		if (dirp->prefetch_time + DIR_PREFETCH_MAX_AGE < time(NULL)) {
+			SET_STAT_INVALID(*sbuf);
+		} else {
+			*sbuf = e->st;
+		}
+	}
+
+	*poffset = dirp->offset = e->offset;
+	dirp->file_number++;
+	return e->name;
+}
+
+/*******************************************************************
+ Move around inside the read ahead buffer instead of the directory.
+********************************************************************/
+
+static bool dir_prefetch_seek(struct smb_Dir *dirp, long offset)
+{
+	unsigned int i;
+
+	if (dirp->prefetch_count == 0) {
+		return False;
+	}
+	if (offset == dirp->prefetch_start) {
+		dirp->prefetch_index = 0;
+		dirp->file_number = dirp->prefetch_start_file_number;
+		return True;
+	}
+	for (i = 0; i < dirp->prefetch_count; i++) {
+		if (dirp->prefetch[i].offset == offset) {
+			dirp->prefetch_index = i + 1;
+			dirp->file_number =
+				dirp->prefetch_start_file_number + i + 1;
+			return True;
+		}
+	}
+	return False;
+}
+
 /*******************************************************************
  Read from a directory.
  Return directory entry, current offset, and optional stat information.
@@ -1142,6 +1545,10 @@ const char *ReadDirName(struct smb_Dir *dirp, long *poffset,
 		SeekDir(dirp, *poffset);
 	}
 
+	if (dirp->prefetch_size != 0) {
+		return dir_prefetch_next(dirp, poffset, sbuf);
+	}
+
 	while ((n = vfs_readdirname(conn, dirp->dir, sbuf))) {
 		/* Ignore . and .. - we've already returned them. */
 		if (*n == '.') {
@@ -1163,20 +1570,72 @@ const char *ReadDirName(struct smb_Dir *dirp, long *poffset,
 
 void RewindDir(struct smb_Dir *dirp, long *poffset)
 {
+	dir_prefetch_drop(dirp);
 	SMB_VFS_REWINDDIR(dirp->conn, dirp->dir);
 	dirp->file_number = 0;
+	dirp->file_number_unknown = False;
 	dirp->offset = START_OF_DIRECTORY_OFFSET;
 	*poffset = START_OF_DIRECTORY_OFFSET;
 }
 
+/*******************************************************************
+ We seeked the directory itself to offset. If the name cache knows how
+ many entries come before it we still know our position, otherwise
+ dir_recount() has to find out should we need it.
+********************************************************************/
+
+static void dir_name_cache_file_number(struct smb_Dir *dirp, long offset)
+{
+	unsigned int i;
+
+	for (i = 0; dirp->name_cache && (i < dirp->name_cache_size); i++) {
+		struct name_cache_entry *e = &dirp->name_cache[i];
+		if (e->name && (e->offset == offset) && (e->file_number != 0)) {
+			dirp->file_number = e->file_number;
+			dirp->file_number_unknown = False;
+			return;
+		}
+	}
+	dirp->file_number_unknown = True;
+}
+
+/*******************************************************************
+ Count the entries before the current offset by reading up to it again
+ from the start. Only needed after a seek to an offset we had no
+ position for.
+********************************************************************/
+
+static void dir_recount(struct smb_Dir *dirp)
+{
+	long target = dirp->offset;
+	long offset = START_OF_DIRECTORY_OFFSET;
+
+	RewindDir(dirp, &offset);
+	while ((offset != target)
+	       && (ReadDirName(dirp, &offset, NULL) != NULL)) {
+		;
+	}
+}
+
 /*******************************************************************
  Seek a dir.
 ********************************************************************/
 
 void SeekDir(struct smb_Dir *dirp, long offset)
 {
+	if (dirp->reopened) {
+		if (offset == dirp->reopen_old_offset) {
+			offset = dirp->reopen_new_offset;
+		}
+		dirp->reopened = False;
+	}
+
 	if (offset != dirp->offset) {
-		if (offset == START_OF_DIRECTORY_OFFSET) {
+		if ((offset != START_OF_DIRECTORY_OFFSET)
+		    && (offset != END_OF_DIRECTORY_OFFSET)
+		    && dir_prefetch_seek(dirp, offset)) {
+			; /* Still inside what we read ahead. */
+		} else if (offset == START_OF_DIRECTORY_OFFSET) {
 			RewindDir(dirp, &offset);
 			/*
 			 * Ok we should really set the file number here
@@ -1196,7 +1655,9 @@ void SeekDir(struct smb_Dir *dirp, long offset)
 		} else if (offset == END_OF_DIRECTORY_OFFSET) {
 			; /* Don't seek in this case. */
 		} else {
+			dir_prefetch_drop(dirp);
 			SMB_VFS_SEEKDIR(dirp->conn, dirp->dir, offset);
+			dir_name_cache_file_number(dirp, offset);
 		}
 		dirp->offset = offset;
 	}
@@ -1236,8 +1697,12 @@ void DirCacheAdd(struct smb_Dir *dirp, const char *name, long offset)
 					dirp->name_cache_size;
 	e = &dirp->name_cache[dirp->name_cache_index];
 	TALLOC_FREE(e->name);
-	e->name = talloc_strdup(dirp, name);
+	e->name = talloc_strdup(dirp->name_cache, name);
 	e->offset = offset;
+	e->file_number = 0;
+	if ((offset == dirp->offset) && !dirp->file_number_unknown) {
+		e->file_number = dirp->file_number;
+	}
 }
 
 /*******************************************************************
@@ -1272,8 +1737,10 @@ bool SearchDir(struct smb_Dir *dirp, const char *name, long *poffset)
 	}
 
 	/* Not found in the name cache. Rewind directory and start from scratch. */
+	dir_prefetch_drop(dirp);
 	SMB_VFS_REWINDDIR(conn, dirp->dir);
 	dirp->file_number = 0;
+	dirp->file_number_unknown = False;
 	*poffset = START_OF_DIRECTORY_OFFSET;
 	while ((entry = ReadDirName(dirp, poffset, NULL))) {
 		if (conn->case_sensitive ? (strcmp(entry, name) == 0) : strequal(entry, name)) {
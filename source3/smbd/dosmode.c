@@ -184,12 +184,88 @@ static uint32 dos_mode_from_sbuf(connection_struct *conn, const char *path, SMB_
 	return result;
 }
 
+/****************************************************************************
+ Cache of the DOS attribute EA, so that directory listings and stat replies
+ don't do a getxattr for every file. An entry is only used while the
+ file's inode and ctime are unchanged, writing the EA moves the ctime.
+****************************************************************************/
+
+struct dos_attr_cache_entry {
+	SMB_INO_T ino;
+	struct timespec ctime;
+	bool present;
+	uint32 dosattr;
+};
+
+static bool dos_attr_cache_lookup(connection_struct *conn,
+				  const SMB_STRUCT_STAT *sbuf,
+				  struct dos_attr_cache_entry *entry)
+{
+	struct file_id id = vfs_file_id_from_sbuf(conn, sbuf);
+	struct timespec ctime = get_ctimespec(sbuf);
+	DATA_BLOB val;
+
+	if (!memcache_lookup(smbd_memcache(), DOS_ATTR_CACHE,
+			     data_blob_const(&id, sizeof(id)), &val)
+	    || (val.length != sizeof(*entry))) {
+		return False;
+	}
+	memcpy(entry, val.data, sizeof(*entry));
+
+	if ((entry->ino != sbuf->st_ino)
+	    || (timespec_compare(&entry->ctime, &ctime) != 0)) {
+		memcache_delete(smbd_memcache(), DOS_ATTR_CACHE,
+				data_blob_const(&id, sizeof(id)));
+		return False;
+	}
+	return True;
+}
+
+static void dos_attr_cache_add(connection_struct *conn,
+			       const SMB_STRUCT_STAT *sbuf,
+			       bool present, uint32 dosattr)
+{
+	struct file_id id = vfs_file_id_from_sbuf(conn, sbuf);
+	struct dos_attr_cache_entry entry;
+
+	ZERO_STRUCT(entry);
+	entry.ino = sbuf->st_ino;
+	entry.ctime = get_ctimespec(sbuf);
+	entry.present = present;
+	entry.dosattr = dosattr;
+
+	/* A change in the same clock tick would not move the ctime. */
+	if (entry.ctime.tv_sec >= time(NULL) - 1) {
+		return;
+	}
+
+	memcache_add(smbd_memcache(), DOS_ATTR_CACHE,
+		     data_blob_const(&id, sizeof(id)),
+		     data_blob_const(&entry, sizeof(entry)));
+}
+
+static void dos_attr_cache_delete(connection_struct *conn,
+				  const SMB_STRUCT_STAT *sbuf)
+{
+	struct file_id id;
+
+	if (!VALID_STAT(*sbuf)) {
+		return;
+	}
+	id = vfs_file_id_from_sbuf(conn, sbuf);
+	memcache_delete(smbd_memcache(), DOS_ATTR_CACHE,
+			data_blob_const(&id, sizeof(id)));
+}
+
 /****************************************************************************
  Get DOS attributes from an EA.
 ****************************************************************************/
 
 static bool get_ea_dos_attribute(connection_struct *conn, const char *path,SMB_STRUCT_STAT *sbuf, uint32 *pattr)
 {
+	struct dos_attr_cache_entry entry;
+	SMB_STRUCT_STAT st;
+	const SMB_STRUCT_STAT *cache_st = sbuf;
 	ssize_t sizeret;
 	fstring attrstr;
 	unsigned int dosattr;
@@ -201,6 +277,26 @@ static bool get_ea_dos_attribute(connection_struct *conn, const char *path,SMB_S
 	/* Don't reset pattr to zero as we may already have filename-based attributes we
 	   need to preserve. */
 
+	/*
+	 * Validate the cache against the caller's stat, it was taken
+	 * before the getxattr so a change in between moves the ctime
+	 * past the one we store. Only stat ourselves if we have none.
+	 */
+	if (!VALID_STAT(*sbuf)) {
+		cache_st = (SMB_VFS_STAT(conn, path, &st) == 0) ? &st : NULL;
+	}
+
+	if ((cache_st != NULL)
+	    && dos_attr_cache_lookup(conn, cache_st, &entry)) {
+		if (!entry.present) {
+			return False;
+		}
+		dosattr = entry.dosattr;
+		DEBUG(10,("get_ea_dos_attribute: %s cached 0x%x\n", path,
+			  dosattr));
+		goto done;
+	}
+
 	sizeret = SMB_VFS_GETXATTR(conn, path, SAMBA_XATTR_DOS_ATTRIB, attrstr, sizeof(attrstr));
 	if (sizeret == -1) {
 		if (errno == ENOSYS
@@ -212,6 +308,8 @@ static bool get_ea_dos_attribute(connection_struct *conn, const char *path,SMB_S
 			DEBUG(1,("get_ea_dos_attributes: Cannot get attribute from EA on file %s: Error = %s\n",
 				path, strerror(errno) ));
 			set_store_dos_attributes(SNUM(conn), False);
+		} else if ((cache_st != NULL) && (errno == ENOATTR)) {
+			dos_attr_cache_add(conn, cache_st, False, 0);
 		}
 		return False;
 	}
@@ -225,6 +323,12 @@ static bool get_ea_dos_attribute(connection_struct *conn, const char *path,SMB_S
                 return False;
         }
 
+	if (cache_st != NULL) {
+		dos_attr_cache_add(conn, cache_st, True, dosattr);
+	}
+
+ done:
+
 	if (S_ISDIR(sbuf->st_mode)) {
 		dosattr |= aDIR;
 	}
@@ -257,6 +361,8 @@ static bool set_ea_dos_attribute(connection_struct *conn, const char *path, SMB_
 		return False;
 	}
 
+	dos_attr_cache_delete(conn, sbuf);
+
 	snprintf(attrstr, sizeof(attrstr)-1, "0x%x", dosmode & SAMBA_ATTRIBUTES_MASK);
 	if (SMB_VFS_SETXATTR(conn, path, SAMBA_XATTR_DOS_ATTRIB, attrstr, strlen(attrstr), 0) == -1) {
 		if((errno != EPERM) && (errno != EACCES)) {
@@ -31,20 +31,68 @@ static bool setup_write_cache(files_struct *, SMB_OFF_T);
 static bool read_from_write_cache(files_struct *fsp,char *data,SMB_OFF_T pos,size_t n)
 {
 	write_cache *wcp = fsp->wcp;
+	struct write_cache_extent *ext;
 
 	if(!wcp) {
 		return False;
 	}
 
-	if( n > wcp->data_size || pos < wcp->offset || pos + n > wcp->offset + wcp->data_size) {
-		return False;
+	for (ext = wcp->extents; ext; ext = ext->next) {
+		if (ext->offset > pos) {
+			break;
+		}
+		if (pos + n <= ext->offset + ext->data_size) {
+			memcpy(data, ext->data + (pos - ext->offset), n);
+			DO_PROFILE_INC(writecache_read_hits);
+			return True;
+		}
 	}
 
-	memcpy(data, wcp->data + (pos - wcp->offset), n);
+	return False;
+}
 
-	DO_PROFILE_INC(writecache_read_hits);
+/****************************************************************************
+ Lay cached data over what a read got from disk. ret is what the disk
+ read returned, the cache may hold data past it.
+****************************************************************************/
 
-	return True;
+static ssize_t overlay_write_cache(files_struct *fsp, char *data,
+				   SMB_OFF_T pos, size_t n, ssize_t ret)
+{
+	write_cache *wcp = fsp->wcp;
+	struct write_cache_extent *ext;
+
+	if (!wcp) {
+		return ret;
+	}
+
+	for (ext = wcp->extents; ext; ext = ext->next) {
+		SMB_OFF_T from, to;
+
+		if (ext->offset >= pos + (SMB_OFF_T)n) {
+			break;
+		}
+		if (ext->offset + (SMB_OFF_T)ext->data_size <= pos) {
+			continue;
+		}
+
+		from = MAX(pos, ext->offset);
+		to = MIN(pos + (SMB_OFF_T)n,
+			 ext->offset + (SMB_OFF_T)ext->data_size);
+
+		if (from - pos > ret) {
+			memset(data + ret, '\0', (from - pos) - ret);
+		}
+		memcpy(data + (from - pos), ext->data + (from - ext->offset),
+		       to - from);
+		if (to - pos > ret) {
+			ret = to - pos;
+		}
+
+		DO_PROFILE_INC(writecache_read_hits);
+	}
+
+	return ret;
 }
 
 /****************************************************************************
@@ -70,8 +118,6 @@ ssize_t read_file(files_struct *fsp,char *data,SMB_OFF_T pos,size_t n)
 		return n;
 	}
 
-	flush_write_cache(fsp, READ_FLUSH);
-
 	fsp->fh->pos = pos;
 
 	if (n > 0) {
@@ -99,6 +145,12 @@ tryagain:
 		if (readret > 0) {
 			ret += readret;
 		}
+
+		/*
+		 * Disk is missing anything still in the write cache.
+		 */
+
+		ret = overlay_write_cache(fsp, data, pos, n, ret);
 	}
 
 	DEBUG(10,("read_file (%s): pos = %.0f, size = %lu, returned %lu\n",
@@ -155,12 +207,12 @@ static ssize_t real_write_file(struct smb_request *req,
  Updates size on disk but doesn't flush the cache.
 ****************************************************************************/
 
-static int wcp_file_size_change(files_struct *fsp)
+static int wcp_file_size_change(files_struct *fsp, SMB_OFF_T file_size)
 {
 	int ret;
 	write_cache *wcp = fsp->wcp;
 
-	wcp->file_size = wcp->offset + wcp->data_size;
+	wcp->file_size = file_size;
 	ret = SMB_VFS_FTRUNCATE(fsp, wcp->file_size);
 	if (ret == -1) {
 		DEBUG(0,("wcp_file_size_change (%s): ftruncate of size %.0f error %s\n",
@@ -169,6 +221,332 @@ static int wcp_file_size_change(files_struct *fsp)
 	return ret;
 }
 
+/****************************************************************************
+ Does any cached extent overlap the given range ? If flushing_only is set
+ only look at extents being written behind.
+****************************************************************************/
+
+static bool wcp_overlaps(write_cache *wcp, SMB_OFF_T pos, size_t n,
+			 bool flushing_only)
+{
+	struct write_cache_extent *ext;
+
+	for (ext = wcp->extents; ext; ext = ext->next) {
+		if (ext->offset >= pos + (SMB_OFF_T)n) {
+			break;
+		}
+		if (flushing_only && !ext->flushing) {
+			continue;
+		}
+		if (ext->offset + (SMB_OFF_T)ext->data_size > pos) {
+			return True;
+		}
+	}
+	return False;
+}
+
+/****************************************************************************
+ Unlink an extent from the write cache.
+****************************************************************************/
+
+static void wcp_detach_extent(write_cache *wcp, struct write_cache_extent *ext)
+{
+	DLIST_REMOVE(wcp->extents, ext);
+	wcp->num_extents--;
+	wcp->data_size -= ext->data_size;
+	if (ext->flushing) {
+		wcp->flush_size -= ext->data_size;
+	}
+	if (wcp->data_size == 0) {
+		DO_PROFILE_DEC(writecache_num_write_caches);
+	}
+}
+
+static void wcp_remove_extent(write_cache *wcp, struct write_cache_extent *ext)
+{
+	wcp_detach_extent(wcp, ext);
+	TALLOC_FREE(ext);
+}
+
+/****************************************************************************
+ Synchronously write a cached extent to disk and drop it from the cache.
+ The extent is unlinked first as the write may recurse into
+ flush_write_cache() (strict allocate), callers must rescan the list.
+****************************************************************************/
+
+static ssize_t wcp_write_extent(files_struct *fsp,
+				struct write_cache_extent *ext)
+{
+	write_cache *wcp = fsp->wcp;
+	ssize_t ret;
+
+	DEBUG(9,("flushing write cache: fd = %d, off=%.0f, size=%u\n",
+		fsp->fh->fd, (double)ext->offset, (unsigned int)ext->data_size));
+
+#ifdef WITH_PROFILE
+	if(ext->data_size == wcp->alloc_size) {
+		DO_PROFILE_INC(writecache_num_perfect_writes);
+	}
+#endif
+
+	wcp_detach_extent(wcp, ext);
+
+	ret = real_write_file(NULL, fsp, ext->data, ext->offset,
+			      ext->data_size);
+
+	/*
+	 * Ensure file size if kept up to date if write extends file.
+	 */
+
+	if ((ret != -1) && (ext->offset + ret > wcp->file_size)) {
+		wcp->file_size = ext->offset + ret;
+	}
+
+	TALLOC_FREE(ext);
+	return ret;
+}
+
+/****************************************************************************
+ Copy a write into the cache, merging it with every extent it overlaps
+ or abuts so the extent list stays sorted and disjoint. Extents being
+ written behind are never touched - the caller has flushed any that
+ overlap.
+****************************************************************************/
+
+static int wcp_insert(files_struct *fsp, const char *data, SMB_OFF_T pos,
+		      size_t n)
+{
+	write_cache *wcp = fsp->wcp;
+	struct write_cache_extent *ext, *next;
+	struct write_cache_extent *first = NULL, *last = NULL;
+	SMB_OFF_T start = pos;
+	SMB_OFF_T end = pos + n;
+	size_t old_size = 0;
+	size_t len;
+
+	for (ext = wcp->extents; ext; ext = ext->next) {
+		SMB_OFF_T ext_end = ext->offset + ext->data_size;
+
+		if (ext->offset > pos + (SMB_OFF_T)n) {
+			break;
+		}
+		if (ext_end < pos || ext->flushing) {
+			continue;
+		}
+		if (first == NULL) {
+			first = ext;
+		}
+		last = ext;
+		start = MIN(start, ext->offset);
+		end = MAX(end, ext_end);
+	}
+
+	len = end - start;
+
+	if (len > wcp->alloc_size) {
+		/*
+		 * Merging would build an extent bigger than the
+		 * whole cache. Write out what this write overlaps and
+		 * cache it on its own.
+		 */
+		ext = wcp->extents;
+		while (ext) {
+			if (!ext->flushing &&
+			    ext->offset < pos + (SMB_OFF_T)n &&
+			    ext->offset + (SMB_OFF_T)ext->data_size > pos) {
+				DO_PROFILE_INC(writecache_flushed_writes[WRITE_FLUSH]);
+				if (wcp_write_extent(fsp, ext) == -1) {
+					return -1;
+				}
+				ext = wcp->extents;
+				continue;
+			}
+			ext = ext->next;
+		}
+		first = NULL;
+		start = pos;
+		len = n;
+	}
+
+	if (first == NULL) {
+		struct write_cache_extent *prev = NULL;
+
+		for (ext = wcp->extents; ext && ext->offset < pos;
+		     ext = ext->next) {
+			prev = ext;
+		}
+
+		ext = TALLOC_ZERO_P(wcp, struct write_cache_extent);
+		if (ext == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		ext->alloc_size = len;
+		ext->data = TALLOC_ARRAY(ext, char, ext->alloc_size);
+		if (ext->data == NULL) {
+			TALLOC_FREE(ext);
+			errno = ENOMEM;
+			return -1;
+		}
+		ext->offset = start;
+		DLIST_ADD_AFTER(wcp->extents, ext, prev);
+		wcp->num_extents++;
+		if (wcp->data_size == 0) {
+			DO_PROFILE_INC(writecache_num_write_caches);
+		}
+		DO_PROFILE_INC(writecache_init_writes);
+		first = ext;
+	} else {
+		if (first->alloc_size < len) {
+			/* Leave room for the next sequential write. */
+			size_t alloc_size = MIN(wcp->alloc_size,
+						MAX(len, 2 * first->alloc_size));
+			char *p = TALLOC_REALLOC_ARRAY(first, first->data,
+						       char, alloc_size);
+			if (p == NULL) {
+				errno = ENOMEM;
+				return -1;
+			}
+			first->data = p;
+			first->alloc_size = alloc_size;
+		}
+		if (first->offset > start) {
+			memmove(first->data + (first->offset - start),
+				first->data, first->data_size);
+		}
+		old_size = first->data_size;
+
+		for (ext = first->next; ext && first != last; ext = next) {
+			bool done = (ext == last);
+
+			next = ext->next;
+			memcpy(first->data + (ext->offset - start),
+			       ext->data, ext->data_size);
+			wcp_remove_extent(wcp, ext);
+			if (done) {
+				break;
+			}
+		}
+		DO_PROFILE_INC(writecache_abutted_writes);
+	}
+
+	memcpy(first->data + (pos - start), data, n);
+	first->offset = start;
+	first->data_size = len;
+	wcp->data_size += len - old_size;
+
+	return 0;
+}
+
+/****************************************************************************
+ The cache is full. Hand every dirty extent to aio to be written behind,
+ writing it synchronously if it's too small for aio or aio can't take it.
+****************************************************************************/
+
+static int write_behind_cache(files_struct *fsp)
+{
+	write_cache *wcp = fsp->wcp;
+	struct write_cache_extent *ext;
+	size_t min_aio_write_size = lp_aio_write_size(SNUM(fsp->conn));
+
+	ext = wcp->extents;
+	while (ext) {
+		if (ext->flushing) {
+			ext = ext->next;
+			continue;
+		}
+
+		DO_PROFILE_INC(writecache_flushed_writes[WRITE_FLUSH]);
+
+		/*
+		 * Same size rule as client writes - an aio costs more
+		 * than a small pwrite. Strict allocate needs
+		 * vfs_fill_sparse before the write.
+		 */
+		if (min_aio_write_size &&
+		    ext->data_size >= min_aio_write_size &&
+		    !lp_strict_allocate(SNUM(fsp->conn)) &&
+		    schedule_aio_write_cache_flush(fsp, ext)) {
+			ext->flushing = True;
+			wcp->flush_size += ext->data_size;
+			ext = ext->next;
+			continue;
+		}
+
+		if (wcp_write_extent(fsp, ext) == -1) {
+			return -1;
+		}
+		ext = wcp->extents;
+	}
+	return 0;
+}
+
+/****************************************************************************
+ A write behind of a cache extent has finished. Called from the aio code.
+****************************************************************************/
+
+void write_cache_flush_done(files_struct *fsp, struct write_cache_extent *ext,
+			    int err)
+{
+	write_cache *wcp = fsp->wcp;
+	struct write_cache_extent *p;
+
+	if (wcp == NULL) {
+		return;
+	}
+
+	for (p = wcp->extents; p; p = p->next) {
+		if (p == ext) {
+			break;
+		}
+	}
+	if (p == NULL) {
+		DEBUG(3,("write_cache_flush_done: file %s: unknown extent\n",
+			 fsp->fsp_name ));
+		return;
+	}
+
+	if (err) {
+		DEBUG(0,("write_cache_flush_done: write behind failed ! "
+			 "File %s is corrupt ! Error %s\n",
+			 fsp->fsp_name, strerror(err) ));
+		wcp->flush_error = err;
+	} else if (ext->offset + (SMB_OFF_T)ext->data_size > wcp->file_size) {
+		wcp->file_size = ext->offset + ext->data_size;
+	}
+
+	DEBUG(10,("write_cache_flush_done: file %s off=%.0f size=%u\n",
+		  fsp->fsp_name, (double)ext->offset,
+		  (unsigned int)ext->data_size ));
+
+	wcp_remove_extent(wcp, ext);
+}
+
+/****************************************************************************
+ An async read or write is about to go straight to disk. Make sure any
+ cached data it covers gets there first.
+****************************************************************************/
+
+int write_cache_sync_range(files_struct *fsp, SMB_OFF_T pos, size_t n,
+			   enum flush_reason_enum reason)
+{
+	write_cache *wcp = fsp->wcp;
+
+	if (wcp == NULL) {
+		return 0;
+	}
+
+	if (wcp_overlaps(wcp, pos, n, False) &&
+	    flush_write_cache(fsp, reason) == -1) {
+		return -1;
+	}
+
+	if (reason == WRITE_FLUSH && pos + (SMB_OFF_T)n > wcp->file_size) {
+		wcp->file_size = pos + n;
+	}
+	return 0;
+}
+
 static void update_write_time_handler(struct event_context *ctx,
 				      struct timed_event *te,
 				      struct timeval now,
@@ -253,7 +631,6 @@ ssize_t write_file(struct smb_request *req,
 {
 	write_cache *wcp = fsp->wcp;
 	ssize_t total_written = 0;
-	int write_path = -1;
 
 	if (fsp->print_file) {
 		uint32 jobid;
@@ -361,368 +738,23 @@ nonop=%u allocated=%u active=%u direct=%u perfect=%u readhits=%u\n",
 		return total_written;
 	}
 
-	DEBUG(9,("write_file (%s)(fd=%d pos=%.0f size=%u) wcp->offset=%.0f wcp->data_size=%u\n",
-		fsp->fsp_name, fsp->fh->fd, (double)pos, (unsigned int)n, (double)wcp->offset, (unsigned int)wcp->data_size));
+	DEBUG(9,("write_file (%s)(fd=%d pos=%.0f size=%u) extents=%u data_size=%u\n",
+		fsp->fsp_name, fsp->fh->fd, (double)pos, (unsigned int)n,
+		wcp->num_extents, (unsigned int)wcp->data_size));
 
 	fsp->fh->pos = pos + n;
 
 	/*
-	 * If we have active cache and it isn't contiguous then we flush.
-	 * NOTE: There is a small problem with running out of disk ....
+	 * Data on its way to disk can't change under the aio, and
+	 * must not land on top of this write afterwards.
 	 */
 
-	if (wcp->data_size) {
-		bool cache_flush_needed = False;
-
-		if ((pos >= wcp->offset) && (pos <= wcp->offset + wcp->data_size)) {
-      
-			/* ASCII art.... JRA.
-
-      +--------------+-----
-      | Cached data  | Rest of allocated cache buffer....
-      +--------------+-----
-
-            +-------------------+
-            | Data to write     |
-            +-------------------+
-
-	    		*/
-
-			/*
-			 * Start of write overlaps or abutts the existing data.
-			 */
-
-			size_t data_used = MIN((wcp->alloc_size - (pos - wcp->offset)), n);
-
-			memcpy(wcp->data + (pos - wcp->offset), data, data_used);
-
-			/*
-			 * Update the current buffer size with the new data.
-			 */
-
-			if(pos + data_used > wcp->offset + wcp->data_size) {
-				wcp->data_size = pos + data_used - wcp->offset;
-			}
-
-			/*
-			 * Update the file size if changed.
-			 */
-
-			if (wcp->offset + wcp->data_size > wcp->file_size) {
-				if (wcp_file_size_change(fsp) == -1) {
-					return -1;
-				}
-			}
-
-			/*
-			 * If we used all the data then
-			 * return here.
-			 */
-
-			if(n == data_used) {
-				return n;
-			} else {
-				cache_flush_needed = True;
-			}
-			/*
-			 * Move the start of data forward by the amount used,
-			 * cut down the amount left by the same amount.
-			 */
-
-			data += data_used;
-			pos += data_used;
-			n -= data_used;
-
-			DO_PROFILE_INC(writecache_abutted_writes);
-			total_written = data_used;
-
-			write_path = 1;
-
-		} else if ((pos < wcp->offset) && (pos + n > wcp->offset) && 
-					(pos + n <= wcp->offset + wcp->alloc_size)) {
-
-			/* ASCII art.... JRA.
-
-                        +---------------+
-                        | Cache buffer  |
-                        +---------------+
-
-            +-------------------+
-            | Data to write     |
-            +-------------------+
-
-	    		*/
-
-			/*
-			 * End of write overlaps the existing data.
-			 */
-
-			size_t data_used = pos + n - wcp->offset;
-
-			memcpy(wcp->data, data + n - data_used, data_used);
-
-			/*
-			 * Update the current buffer size with the new data.
-			 */
-
-			if(pos + n > wcp->offset + wcp->data_size) {
-				wcp->data_size = pos + n - wcp->offset;
-			}
-
-			/*
-			 * Update the file size if changed.
-			 */
-
-			if (wcp->offset + wcp->data_size > wcp->file_size) {
-				if (wcp_file_size_change(fsp) == -1) {
-					return -1;
-				}
-			}
-
-			/*
-			 * We don't need to move the start of data, but we
-			 * cut down the amount left by the amount used.
-			 */
-
-			n -= data_used;
-
-			/*
-			 * We cannot have used all the data here.
-			 */
-
-			cache_flush_needed = True;
-
-			DO_PROFILE_INC(writecache_abutted_writes);
-			total_written = data_used;
-
-			write_path = 2;
-
-		} else if ( (pos >= wcp->file_size) && 
-					(wcp->offset + wcp->data_size == wcp->file_size) &&
-					(pos > wcp->offset + wcp->data_size) && 
-					(pos < wcp->offset + wcp->alloc_size) ) {
-
-			/* ASCII art.... JRA.
-
-                       End of file ---->|
-
-                        +---------------+---------------+
-                        | Cached data   | Cache buffer  |
-                        +---------------+---------------+
-
-                                              +-------------------+
-                                              | Data to write     |
-                                              +-------------------+
-
-	    		*/
-
-			/*
-			 * Non-contiguous write part of which fits within
-			 * the cache buffer and is extending the file
-			 * and the cache contents reflect the current
-			 * data up to the current end of the file.
-			 */
-
-			size_t data_used;
-
-			if(pos + n <= wcp->offset + wcp->alloc_size) {
-				data_used = n;
-			} else {
-				data_used = wcp->offset + wcp->alloc_size - pos;
-			}
-
-			/*
-			 * Fill in the non-continuous area with zeros.
-			 */
-
-			memset(wcp->data + wcp->data_size, '\0',
-				pos - (wcp->offset + wcp->data_size) );
-
-			memcpy(wcp->data + (pos - wcp->offset), data, data_used);
-
-			/*
-			 * Update the current buffer size with the new data.
-			 */
-
-			if(pos + data_used > wcp->offset + wcp->data_size) {
-				wcp->data_size = pos + data_used - wcp->offset;
-			}
-
-			/*
-			 * Update the file size if changed.
-			 */
-
-			if (wcp->offset + wcp->data_size > wcp->file_size) {
-				if (wcp_file_size_change(fsp) == -1) {
-					return -1;
-				}
-			}
-
-			/*
-			 * If we used all the data then
-			 * return here.
-			 */
-
-			if(n == data_used) {
-				return n;
-			} else {
-				cache_flush_needed = True;
-			}
-
-			/*
-			 * Move the start of data forward by the amount used,
-			 * cut down the amount left by the same amount.
-			 */
-
-			data += data_used;
-			pos += data_used;
-			n -= data_used;
-
-			DO_PROFILE_INC(writecache_abutted_writes);
-			total_written = data_used;
-
-			write_path = 3;
-
-                } else if ( (pos >= wcp->file_size) &&
-			    (n == 1) &&
-			    (wcp->file_size == wcp->offset + wcp->data_size) &&
-			    (pos < wcp->file_size + wcp->alloc_size)) {
-
-                        /*
-
-                End of file ---->|
-
-                 +---------------+---------------+
-                 | Cached data   | Cache buffer  |
-                 +---------------+---------------+
-
-                                 |<------- allocated size ---------------->|
-
-                                                         +--------+
-                                                         | 1 Byte |
-                                                         +--------+
-
-			MS-Office seems to do this a lot to determine if there's enough
-			space on the filesystem to write a new file.
-
-			Change to :
-
-                End of file ---->|
-                                 +-----------------------+--------+
-                                 | Zeroed Cached data    | 1 Byte |
-                                 +-----------------------+--------+
-                        */
-
-			flush_write_cache(fsp, WRITE_FLUSH);
-			wcp->offset = wcp->file_size;
-			wcp->data_size = pos - wcp->file_size + 1;
-			memset(wcp->data, '\0', wcp->data_size);
-			memcpy(wcp->data + wcp->data_size-1, data, 1);
-
-			/*
-			 * Update the file size if changed.
-			 */
-
-			if (wcp->offset + wcp->data_size > wcp->file_size) {
-				if (wcp_file_size_change(fsp) == -1) {
-					return -1;
-				}
-			}
-
-			return n;
-
-		} else {
-
-			/* ASCII art..... JRA.
-
-   Case 1).
-
-                        +---------------+---------------+
-                        | Cached data   | Cache buffer  |
-                        +---------------+---------------+
-
-                                                              +-------------------+
-                                                              | Data to write     |
-                                                              +-------------------+
-
-   Case 2).
-
-                           +---------------+---------------+
-                           | Cached data   | Cache buffer  |
-                           +---------------+---------------+
-
-   +-------------------+
-   | Data to write     |
-   +-------------------+
-
-    Case 3).
-
-                           +---------------+---------------+
-                           | Cached data   | Cache buffer  |
-                           +---------------+---------------+
-
-                  +-----------------------------------------------------+
-                  | Data to write                                       |
-                  +-----------------------------------------------------+
-
-		  */
-
- 			/*
-			 * Write is bigger than buffer, or there is no overlap on the
-			 * low or high ends.
-			 */
-
-			DEBUG(9,("write_file: non cacheable write : fd = %d, pos = %.0f, len = %u, current cache pos = %.0f \
-len = %u\n",fsp->fh->fd, (double)pos, (unsigned int)n, (double)wcp->offset, (unsigned int)wcp->data_size ));
-
-			/*
-			 * If write would fit in the cache, and is larger than
-			 * the data already in the cache, flush the cache and
-			 * preferentially copy the data new data into it. Otherwise
-			 * just write the data directly.
-			 */
-
-			if ( n <= wcp->alloc_size && n > wcp->data_size) {
-				cache_flush_needed = True;
-			} else {
-				ssize_t ret = real_write_file(NULL,fsp, data, pos, n);
-
-				/*
-				 * If the write overlaps the entire cache, then
-				 * discard the current contents of the cache.
-				 * Fix from Rasmus Borup Hansen rbh@math.ku.dk.
-				 */
-
-				if ((pos <= wcp->offset) &&
-						(pos + n >= wcp->offset + wcp->data_size) ) {
-					DEBUG(9,("write_file: discarding overwritten write \
-cache: fd = %d, off=%.0f, size=%u\n", fsp->fh->fd, (double)wcp->offset, (unsigned int)wcp->data_size ));
-					wcp->data_size = 0;
-				}
-
-				DO_PROFILE_INC(writecache_direct_writes);
-				if (ret == -1) {
-					return ret;
-				}
-
-				if (pos + ret > wcp->file_size) {
-					wcp->file_size = pos + ret;
-				}
-
-				return ret;
-			}
-
-			write_path = 4;
-
-		}
-
-		if (cache_flush_needed) {
-			DEBUG(3,("WRITE_FLUSH:%d: due to noncontinuous write: fd = %d, size = %.0f, pos = %.0f, \
-n = %u, wcp->offset=%.0f, wcp->data_size=%u\n",
-				write_path, fsp->fh->fd, (double)wcp->file_size, (double)pos, (unsigned int)n,
-				(double)wcp->offset, (unsigned int)wcp->data_size ));
-
-			flush_write_cache(fsp, WRITE_FLUSH);
+	if (wcp->flush_size && wcp_overlaps(wcp, pos, n, True)) {
+		DEBUG(9,("write_file: write overlaps write behind: fd = %d, "
+			 "pos = %.0f, len = %u\n",
+			 fsp->fh->fd, (double)pos, (unsigned int)n ));
+		if (flush_write_cache(fsp, WRITE_FLUSH) == -1) {
+			return -1;
 		}
 	}
 
@@ -731,56 +763,62 @@ n = %u, wcp->offset=%.0f, wcp->data_size=%u\n",
 	 * size, write it all out.
 	 */
 
-	if (n > wcp->alloc_size ) {
-		ssize_t ret = real_write_file(NULL,fsp, data, pos, n);
+	if (n > wcp->alloc_size) {
+		ssize_t ret;
+
+		if (wcp_overlaps(wcp, pos, n, False) &&
+		    flush_write_cache(fsp, WRITE_FLUSH) == -1) {
+			return -1;
+		}
+
+		ret = real_write_file(NULL, fsp, data, pos, n);
 		if (ret == -1) {
 			return -1;
 		}
 
 		if (pos + ret > wcp->file_size) {
-			wcp->file_size = pos + n;
+			wcp->file_size = pos + ret;
 		}
 
 		DO_PROFILE_INC(writecache_direct_writes);
-		return total_written + n;
+		return ret;
 	}
 
 	/*
-	 * If there's any data left, cache it.
+	 * Otherwise cache it, merged with whatever it touches.
 	 */
 
-	if (n) {
-#ifdef WITH_PROFILE
-		if (wcp->data_size) {
-			DO_PROFILE_INC(writecache_abutted_writes);
-		} else {
-			DO_PROFILE_INC(writecache_init_writes);
-		}
-#endif
-		memcpy(wcp->data+wcp->data_size, data, n);
-		if (wcp->data_size == 0) {
-			wcp->offset = pos;
-			DO_PROFILE_INC(writecache_num_write_caches);
-		}
-		wcp->data_size += n;
+	if (wcp_insert(fsp, data, pos, n) == -1) {
+		return -1;
+	}
 
-		/*
-		 * Update the file size if changed.
-		 */
+	/*
+	 * Update the file size if changed.
+	 */
 
-		if (wcp->offset + wcp->data_size > wcp->file_size) {
-			if (wcp_file_size_change(fsp) == -1) {
-				return -1;
-			}
+	if (pos + (SMB_OFF_T)n > wcp->file_size) {
+		if (wcp_file_size_change(fsp, pos + n) == -1) {
+			return -1;
 		}
-		DEBUG(9,("wcp->offset = %.0f wcp->data_size = %u cache return %u\n",
-			(double)wcp->offset, (unsigned int)wcp->data_size, (unsigned int)n));
+	}
+
+	/*
+	 * Start writing behind once we hold a cache full of
+	 * dirty data or too many extents to search quickly.
+	 */
 
-		total_written += n;
-		return total_written; /* .... that's a write :) */
+	if ((wcp->data_size - wcp->flush_size >= wcp->alloc_size) ||
+	    (wcp->num_extents > MAX_WRITE_CACHE_EXTENTS)) {
+		if (write_behind_cache(fsp) == -1) {
+			return -1;
+		}
 	}
-  
-	return total_written;
+
+	DEBUG(9,("write_file: cached %u bytes, extents=%u data_size=%u\n",
+		(unsigned int)n, wcp->num_extents,
+		(unsigned int)wcp->data_size));
+
+	return n; /* .... that's a write :) */
 }
 
 /****************************************************************************
@@ -804,8 +842,7 @@ void delete_write_cache(files_struct *fsp)
 
 	SMB_ASSERT(wcp->data_size == 0);
 
-	SAFE_FREE(wcp->data);
-	SAFE_FREE(fsp->wcp);
+	TALLOC_FREE(fsp->wcp);
 
 	DEBUG(10,("delete_write_cache: File %s deleted write cache\n", fsp->fsp_name ));
 }
@@ -827,23 +864,18 @@ static bool setup_write_cache(files_struct *fsp, SMB_OFF_T file_size)
 		return False;
 	}
 
-	if((wcp = SMB_MALLOC_P(write_cache)) == NULL) {
+	if((wcp = TALLOC_ZERO_P(NULL, write_cache)) == NULL) {
 		DEBUG(0,("setup_write_cache: malloc fail.\n"));
 		return False;
 	}
 
+	/*
+	 * Extent buffers are allocated as writes arrive, alloc_size
+	 * only bounds how much dirty data we hold.
+	 */
+
 	wcp->file_size = file_size;
-	wcp->offset = 0;
 	wcp->alloc_size = alloc_size;
-	wcp->data_size = 0;
-	if((wcp->data = (char *)SMB_MALLOC(wcp->alloc_size)) == NULL) {
-		DEBUG(0,("setup_write_cache: malloc fail for buffer size %u.\n",
-			(unsigned int)wcp->alloc_size ));
-		SAFE_FREE(wcp);
-		return False;
-	}
-
-	memset(wcp->data, '\0', wcp->alloc_size );
 
 	fsp->wcp = wcp;
 	DO_PROFILE_INC(writecache_allocated_write_caches);
@@ -879,44 +911,72 @@ void set_filelen_write_cache(files_struct *fsp, SMB_OFF_T file_size)
 }
 
 /*******************************************************************
- Flush a write cache struct to disk.
+ Flush a write cache struct to disk. Writes out every dirty extent
+ and waits for any write behind still in flight.
 ********************************************************************/
 
 ssize_t flush_write_cache(files_struct *fsp, enum flush_reason_enum reason)
 {
 	write_cache *wcp = fsp->wcp;
-	size_t data_size;
-	ssize_t ret;
+	struct write_cache_extent *ext, *next;
+	ssize_t total = 0;
+	int err = 0;
 
-	if(!wcp || !wcp->data_size) {
+	if(!wcp || (!wcp->data_size && !wcp->flush_error)) {
 		return 0;
 	}
 
-	data_size = wcp->data_size;
-	wcp->data_size = 0;
+	if (wcp->data_size) {
+		DO_PROFILE_INC(writecache_flushed_writes[reason]);
+	}
 
-	DO_PROFILE_DEC_INC(writecache_num_write_caches,writecache_flushed_writes[reason]);
+	ext = wcp->extents;
+	while (ext) {
+		ssize_t ret;
 
-	DEBUG(9,("flushing write cache: fd = %d, off=%.0f, size=%u\n",
-		fsp->fh->fd, (double)wcp->offset, (unsigned int)data_size));
+		if (ext->flushing) {
+			ext = ext->next;
+			continue;
+		}
 
-#ifdef WITH_PROFILE
-	if(data_size == wcp->alloc_size) {
-		DO_PROFILE_INC(writecache_num_perfect_writes);
+		ret = wcp_write_extent(fsp, ext);
+		if (ret == -1) {
+			err = errno;
+		} else {
+			total += ret;
+		}
+		ext = wcp->extents;
 	}
-#endif
 
-	ret = real_write_file(NULL, fsp, wcp->data, wcp->offset, data_size);
+	if (wcp->flush_size) {
+		int ret = wait_for_aio_write_cache_flush(fsp);
 
-	/*
-	 * Ensure file size if kept up to date if write extends file.
-	 */
+		/*
+		 * A timed out wait has already failed the extents it
+		 * cancelled. Anything still here is forgotten, the aio
+		 * owns the buffer.
+		 */
+
+		for (ext = wcp->extents; ext; ext = next) {
+			next = ext->next;
+			wcp_remove_extent(wcp, ext);
+		}
+		if (ret) {
+			err = ret;
+		}
+	}
 
-	if ((ret != -1) && (wcp->offset + ret > wcp->file_size)) {
-		wcp->file_size = wcp->offset + ret;
+	if (wcp->flush_error) {
+		err = wcp->flush_error;
+		wcp->flush_error = 0;
 	}
 
-	return ret;
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	return total;
 }
 
 /*******************************************************************
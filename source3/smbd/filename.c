@@ -35,7 +35,16 @@ static NTSTATUS build_stream_path(TALLOC_CTX *mem_ctx,
 				  char **path);
 static int get_real_filename_mangled(connection_struct *conn, const char *path,
 				     const char *name, TALLOC_CTX *mem_ctx,
-				     char **found_name);
+				     char **found_name,
+				     const SMB_STRUCT_STAT *dir_st);
+static int get_real_filename_dir(connection_struct *conn, const char *path,
+				 const char *name, TALLOC_CTX *mem_ctx,
+				 char **found_name,
+				 const SMB_STRUCT_STAT *dir_st);
+static bool dir_name_index_answer(connection_struct *conn, const char *path,
+				  const char *name, TALLOC_CTX *mem_ctx,
+				  char **found_name,
+				  const SMB_STRUCT_STAT *dir_st, int *ret);
 
 /****************************************************************************
  Mangle the 2nd name and check if it is then equal to the first name.
@@ -296,7 +305,7 @@ NTSTATUS unix_convert(TALLOC_CTX *ctx,
 				goto fail;
 			}
 		}
-		stat_cache_add(orig_path, name, conn->case_sensitive);
+		stat_cache_add(conn, orig_path, name);
 		DEBUG(5,("conversion finished %s -> %s\n",orig_path, name));
 		*pst = st;
 		goto done;
@@ -435,26 +444,47 @@ NTSTATUS unix_convert(TALLOC_CTX *ctx,
 
 		} else {
 			char *found_name = NULL;
+			SMB_STRUCT_STAT dir_st;
+			bool known_missing = False;
 
 			/* Stat failed - ensure we don't use it. */
 			SET_STAT_INVALID(st);
+			SET_STAT_INVALID(dir_st);
+
+			/*
+			 * Don't scan the directory again for a name we
+			 * already know isn't there (desktop.ini and
+			 * friends).
+			 */
+
+			if (!name_has_wildcard) {
+				known_missing = stat_cache_lookup_negative(
+					conn, dirpath, start, &dir_st);
+			}
 
 			/*
 			 * Reset errno so we can detect
 			 * directory open errors.
 			 */
-			errno = 0;
+			errno = known_missing ? ENOENT : 0;
 
 			/*
 			 * Try to find this part of the path in the directory.
 			 */
 
-			if (name_has_wildcard ||
+			if (name_has_wildcard || known_missing ||
 			    (get_real_filename_mangled(
 				     conn, dirpath, start,
-				     talloc_tos(), &found_name) == -1)) {
+				     talloc_tos(), &found_name,
+				     &dir_st) == -1)) {
 				char *unmangled;
 
+				if (!name_has_wildcard && !known_missing &&
+				    ((errno == 0) || (errno == ENOENT))) {
+					stat_cache_add_negative(
+						conn, dirpath, start, &dir_st);
+				}
+
 				if (end) {
 					/*
 					 * An intermediate part of the name
@@ -678,8 +708,7 @@ NTSTATUS unix_convert(TALLOC_CTX *ctx,
 		 */
 
 		if(!component_was_mangled && !name_has_wildcard) {
-			stat_cache_add(orig_path, dirpath,
-					conn->case_sensitive);
+			stat_cache_add(conn, orig_path, dirpath);
 		}
 
 		/*
@@ -696,7 +725,7 @@ NTSTATUS unix_convert(TALLOC_CTX *ctx,
 	 */
 
 	if(!component_was_mangled && !name_has_wildcard) {
-		stat_cache_add(orig_path, name, conn->case_sensitive);
+		stat_cache_add(conn, orig_path, name);
 	}
 
 	/*
@@ -789,15 +818,19 @@ static bool fname_equal(const char *name1, const char *name2,
 
 /****************************************************************************
  Scan a directory to find a filename, matching without case sensitivity.
- If the name looks like a mangled name then try via the mangling functions
+ If the name looks like a mangled name then try via the mangling functions.
+ dir_st is the stat of path if the caller has one, else invalid.
 ****************************************************************************/
 
 static int get_real_filename_mangled(connection_struct *conn, const char *path,
 				     const char *name, TALLOC_CTX *mem_ctx,
-				     char **found_name)
+				     char **found_name,
+				     const SMB_STRUCT_STAT *dir_st)
 {
 	bool mangled;
 	char *unmangled_name = NULL;
+	bool scan_here = False;
+	int ret;
 
 	mangled = mangle_is_mangled(name, conn->params);
 
@@ -831,6 +864,7 @@ static int get_real_filename_mangled(connection_struct *conn, const char *path,
 	 */
 
 	if (mangled && !conn->case_sensitive) {
+		scan_here = True;
 		mangled = !mangle_lookup_name_from_8_3(talloc_tos(), name,
 						       &unmangled_name,
 						       conn->params);
@@ -838,28 +872,360 @@ static int get_real_filename_mangled(connection_struct *conn, const char *path,
 			/* Name is now unmangled. */
 			name = unmangled_name;
 		}
-		return get_real_filename(conn, path, name, mem_ctx,
-					 found_name);
+	}
+
+	if (scan_here) {
+		return get_real_filename_dir(conn, path, name, mem_ctx,
+					     found_name, dir_st);
+	}
+
+	/*
+	 * A name index built by an earlier scan of this directory answers
+	 * for it while it is unchanged, no need to go down the VFS.
+	 */
+	if (!conn->case_sensitive && lp_stat_cache() && VALID_STAT(*dir_st)
+	    && dir_name_index_answer(conn, path, name, mem_ctx, found_name,
+				     dir_st, &ret)) {
+		return ret;
 	}
 
 	return SMB_VFS_GET_REAL_FILENAME(conn, path, name, mem_ctx,
 					 found_name);
 }
 
+/****************************************************************************
+ A case-folded hash of the names in one large directory, so that misses
+ in get_real_filename() don't have to read the whole directory. It is
+ trusted while the directory's mtime, device and inode are unchanged.
+ Names only differing in case all match, we return the one the directory
+ scan would have found first.
+****************************************************************************/
+
+struct dir_name_entry {
+	struct dir_name_entry *next;
+	const char *name;
+	unsigned int pos;	/* Position in the directory listing. */
+	char folded[1];
+};
+
+struct dir_name_index {
+	struct dir_name_index *prev, *next;
+	char *path;
+	struct timespec mtime;
+	SMB_DEV_T dev;
+	SMB_INO_T ino;
+	unsigned int num_entries;
+	unsigned int num_buckets;
+	struct dir_name_entry **buckets;
+	size_t size;		/* Bytes used, see DIR_NAME_INDEX_MAX_BYTES. */
+};
+
+static unsigned int dir_name_hash(const char *folded)
+{
+	unsigned int value = 5381;
+
+	while (*folded) {
+		value = ((value << 5) + value) ^ (unsigned char)*folded++;
+	}
+	return value;
+}
+
+static struct dir_name_index *dir_name_index_new(connection_struct *conn,
+						 const char *path,
+						 const SMB_STRUCT_STAT *dir_st)
+{
+	struct dir_name_index *idx;
+
+	idx = TALLOC_ZERO_P(conn, struct dir_name_index);
+	if (idx == NULL) {
+		return NULL;
+	}
+	idx->path = talloc_strdup(idx, path);
+	idx->num_buckets = DIR_NAME_INDEX_MIN_ENTRIES;
+	idx->buckets = TALLOC_ZERO_ARRAY(idx, struct dir_name_entry *,
+					 idx->num_buckets);
+	if ((idx->path == NULL) || (idx->buckets == NULL)) {
+		TALLOC_FREE(idx);
+		return NULL;
+	}
+	idx->mtime = get_mtimespec(dir_st);
+	idx->dev = dir_st->st_dev;
+	idx->ino = dir_st->st_ino;
+	idx->size = sizeof(*idx) + strlen(path) + 1
+		+ idx->num_buckets * sizeof(struct dir_name_entry *);
+	return idx;
+}
+
+static bool dir_name_index_grow(struct dir_name_index *idx)
+{
+	struct dir_name_entry **buckets, *e, *next;
+	unsigned int i, num_buckets = idx->num_buckets * 4;
+
+	buckets = TALLOC_ZERO_ARRAY(idx, struct dir_name_entry *, num_buckets);
+	if (buckets == NULL) {
+		return False;
+	}
+	for (i = 0; i < idx->num_buckets; i++) {
+		for (e = idx->buckets[i]; e != NULL; e = next) {
+			unsigned int b = dir_name_hash(e->folded) % num_buckets;
+			next = e->next;
+			e->next = buckets[b];
+			buckets[b] = e;
+		}
+	}
+	TALLOC_FREE(idx->buckets);
+	idx->buckets = buckets;
+	idx->size += (num_buckets - idx->num_buckets)
+		* sizeof(struct dir_name_entry *);
+	idx->num_buckets = num_buckets;
+	return True;
+}
+
+static bool dir_name_index_add(struct dir_name_index *idx, const char *name)
+{
+	struct dir_name_entry *e;
+	size_t flen, nlen;
+	unsigned int b;
+	char *folded;
+
+	if (idx->size > DIR_NAME_INDEX_MAX_BYTES) {
+		/* Too big to be worth keeping. */
+		return False;
+	}
+
+	if ((idx->num_entries >= idx->num_buckets * 2)
+	    && !dir_name_index_grow(idx)) {
+		return False;
+	}
+
+	folded = talloc_strdup_upper(talloc_tos(), name);
+	if (folded == NULL) {
+		return False;
+	}
+	flen = strlen(folded);
+	nlen = strlen(name);
+
+	/* Both strings live in the same allocation as the entry. */
+	e = (struct dir_name_entry *)talloc_size(
+		idx, sizeof(struct dir_name_entry) + flen + nlen + 1);
+	if (e == NULL) {
+		TALLOC_FREE(folded);
+		return False;
+	}
+	memcpy(e->folded, folded, flen + 1);
+	e->name = e->folded + flen + 1;
+	memcpy(discard_const_p(char, e->name), name, nlen + 1);
+	TALLOC_FREE(folded);
+
+	e->pos = idx->num_entries;
+	idx->size += sizeof(struct dir_name_entry) + flen + nlen + 1;
+
+	b = dir_name_hash(e->folded) % idx->num_buckets;
+	e->next = idx->buckets[b];
+	idx->buckets[b] = e;
+	idx->num_entries++;
+	return True;
+}
+
+static const char *dir_name_index_lookup(struct dir_name_index *idx,
+					 const char *name)
+{
+	struct dir_name_entry *e;
+	struct dir_name_entry *found = NULL;
+	char *folded;
+
+	folded = talloc_strdup_upper(talloc_tos(), name);
+	if (folded == NULL) {
+		return NULL;
+	}
+	for (e = idx->buckets[dir_name_hash(folded) % idx->num_buckets];
+	     e != NULL; e = e->next) {
+		if ((strcmp(e->folded, folded) == 0)
+		    && fname_equal(name, e->name, False)
+		    && ((found == NULL) || (e->pos < found->pos))) {
+			found = e;
+		}
+	}
+	TALLOC_FREE(folded);
+	return (found != NULL) ? found->name : NULL;
+}
+
+/****************************************************************************
+ Find the index for path, dropping it if the directory changed.
+****************************************************************************/
+
+static struct dir_name_index *dir_name_index_find(connection_struct *conn,
+						  const char *path,
+						  const SMB_STRUCT_STAT *dir_st)
+{
+	struct dir_name_index *idx;
+	struct timespec mtime = get_mtimespec(dir_st);
+
+	for (idx = conn->dir_name_indexes; idx != NULL; idx = idx->next) {
+		if (strcmp(idx->path, path) == 0) {
+			break;
+		}
+	}
+	if (idx == NULL) {
+		return NULL;
+	}
+
+	if ((timespec_compare(&idx->mtime, &mtime) != 0)
+	    || (idx->dev != dir_st->st_dev) || (idx->ino != dir_st->st_ino)) {
+		DEBUG(10,("dir_name_index_find: %s changed\n", path));
+		DLIST_REMOVE(conn->dir_name_indexes, idx);
+		TALLOC_FREE(idx);
+		return NULL;
+	}
+
+	DLIST_PROMOTE(conn->dir_name_indexes, idx);
+	return idx;
+}
+
+/****************************************************************************
+ Keep a freshly built index if the directory was big enough to need one,
+ dropping the least recently used indexes while we have more than
+ MAX_DIR_NAME_INDEXES or they use more than DIR_NAME_INDEX_MAX_BYTES.
+****************************************************************************/
+
+static void dir_name_index_store(connection_struct *conn,
+				 struct dir_name_index *idx)
+{
+	struct dir_name_index *last;
+	unsigned int count;
+	size_t size;
+
+	if (idx->num_entries < DIR_NAME_INDEX_MIN_ENTRIES) {
+		TALLOC_FREE(idx);
+		return;
+	}
+
+	DEBUG(5,("dir_name_index_store: indexed %u names in %s, %u bytes\n",
+		 idx->num_entries, idx->path, (unsigned int)idx->size));
+
+	DLIST_ADD(conn->dir_name_indexes, idx);
+
+	while (True) {
+		count = 0;
+		size = 0;
+		for (last = conn->dir_name_indexes; ; last = last->next) {
+			count++;
+			size += last->size;
+			if (last->next == NULL) {
+				break;
+			}
+		}
+		if ((last == idx) || ((count <= MAX_DIR_NAME_INDEXES)
+				      && (size <= DIR_NAME_INDEX_MAX_BYTES))) {
+			break;
+		}
+		DLIST_REMOVE(conn->dir_name_indexes, last);
+		TALLOC_FREE(last);
+	}
+}
+
+/****************************************************************************
+ Look name up in the index of path if there is a current one. Returns
+ False if there is none, else *ret is what get_real_filename() returns.
+****************************************************************************/
+
+static bool dir_name_index_answer(connection_struct *conn, const char *path,
+				  const char *name, TALLOC_CTX *mem_ctx,
+				  char **found_name,
+				  const SMB_STRUCT_STAT *dir_st, int *ret)
+{
+	struct dir_name_index *idx;
+	const char *dname;
+
+	idx = dir_name_index_find(conn, path, dir_st);
+	if (idx == NULL) {
+		return False;
+	}
+
+	*ret = -1;
+	dname = dir_name_index_lookup(idx, name);
+	if (dname == NULL) {
+		errno = ENOENT;
+		return True;
+	}
+	*found_name = talloc_strdup(mem_ctx, dname);
+	if (*found_name == NULL) {
+		errno = ENOMEM;
+		return True;
+	}
+	*ret = 0;
+	return True;
+}
+
 int get_real_filename(connection_struct *conn, const char *path,
 		      const char *name, TALLOC_CTX *mem_ctx,
 		      char **found_name)
+{
+	return get_real_filename_dir(conn, path, name, mem_ctx, found_name,
+				     NULL);
+}
+
+/****************************************************************************
+ get_real_filename() for callers that have already stat'ed path, pass
+ that as dir_st so we don't stat it again. NULL or invalid if not.
+****************************************************************************/
+
+static int get_real_filename_dir(connection_struct *conn, const char *path,
+				 const char *name, TALLOC_CTX *mem_ctx,
+				 char **found_name,
+				 const SMB_STRUCT_STAT *dir_st_in)
 {
 	struct smb_Dir *cur_dir;
+	struct dir_name_index *idx = NULL;
+	struct dir_name_index *new_idx = NULL;
+	SMB_STRUCT_STAT dir_st;
 	const char *dname;
+	char *found = NULL;
 	bool mangled;
-	char *unmangled_name = NULL;
 	long curpos;
 
+	mangled = mangle_is_mangled(name, conn->params);
+
+	/*
+	 * Only a case-insensitive search can use the index. Don't build
+	 * one for a directory modified within the last second, a change
+	 * in that same second would not move its mtime.
+	 */
+
+	SET_STAT_INVALID(dir_st);
+
+	if (!conn->case_sensitive && lp_stat_cache()) {
+		if ((dir_st_in != NULL) && VALID_STAT(*dir_st_in)) {
+			dir_st = *dir_st_in;
+		} else if (SMB_VFS_STAT(conn, path, &dir_st) != 0) {
+			SET_STAT_INVALID(dir_st);
+		}
+	}
+
+	/*
+	 * Mangled names have to be compared entry by entry, an earlier
+	 * entry with the same 8.3 name would win over what we have indexed.
+	 */
+
+	if (VALID_STAT(dir_st)) {
+		int ret;
+
+		if (!mangled
+		    && dir_name_index_answer(conn, path, name, mem_ctx,
+					     found_name, &dir_st, &ret)) {
+			return ret;
+		}
+		idx = dir_name_index_find(conn, path, &dir_st);
+		if ((idx == NULL)
+		    && (get_mtimespec(&dir_st).tv_sec < time(NULL) - 1)) {
+			new_idx = dir_name_index_new(conn, path, &dir_st);
+		}
+	}
+
 	/* open the directory */
 	if (!(cur_dir = OpenDir(talloc_tos(), conn, path, NULL, 0))) {
 		DEBUG(3,("scan dir didn't open dir [%s]\n",path));
-		TALLOC_FREE(unmangled_name);
+		TALLOC_FREE(new_idx);
 		return -1;
 	}
 
@@ -872,6 +1238,15 @@ int get_real_filename(connection_struct *conn, const char *path,
 			continue;
 		}
 
+		if ((new_idx != NULL) && !dir_name_index_add(new_idx, dname)) {
+			TALLOC_FREE(new_idx);
+		}
+
+		if (found != NULL) {
+			/* Only still reading to complete the index. */
+			continue;
+		}
+
 		/*
 		 * At this point dname is the unmangled name.
 		 * name is either mangled or not, depending on the state
@@ -886,21 +1261,32 @@ int get_real_filename(connection_struct *conn, const char *path,
 		if ((mangled && mangled_equal(name,dname,conn->params)) ||
 			fname_equal(name, dname, conn->case_sensitive)) {
 			/* we've found the file, change it's name and return */
-			*found_name = talloc_strdup(mem_ctx, dname);
-			TALLOC_FREE(unmangled_name);
-			TALLOC_FREE(cur_dir);
-			if (!*found_name) {
+			found = talloc_strdup(mem_ctx, dname);
+			if (found == NULL) {
+				TALLOC_FREE(new_idx);
+				TALLOC_FREE(cur_dir);
 				errno = ENOMEM;
 				return -1;
 			}
-			return 0;
+			if (new_idx == NULL) {
+				break;
+			}
 		}
 	}
 
-	TALLOC_FREE(unmangled_name);
 	TALLOC_FREE(cur_dir);
-	errno = ENOENT;
-	return -1;
+
+	if (new_idx != NULL) {
+		dir_name_index_store(conn, new_idx);
+	}
+
+	if (found == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	*found_name = found;
+	return 0;
 }
 
 static NTSTATUS build_stream_path(TALLOC_CTX *mem_ctx,
@@ -977,7 +1363,7 @@ static NTSTATUS build_stream_path(TALLOC_CTX *mem_ctx,
 	SET_STAT_INVALID(*pst);
 
 	if (SMB_VFS_STAT(conn, result, pst) == 0) {
-		stat_cache_add(orig_path, result, conn->case_sensitive);
+		stat_cache_add(conn, orig_path, result);
 	}
 
 	*path = result;
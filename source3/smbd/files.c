@@ -35,6 +35,55 @@ static unsigned long get_gen_count(void)
 	return file_gen_counter;
 }
 
+/****************************************************************************
+ Hash chains by file_id, so that finding the opens of a file doesn't walk
+ every open file in the process.
+****************************************************************************/
+
+static unsigned int file_id_hash(const struct file_id *id)
+{
+	uint64_t h = id->inode * 0x9E3779B1 + id->devid + id->extid;
+
+	return (unsigned int)(h ^ (h >> 32)) & (file_id_table_size - 1);
+}
+
+static void file_id_table_add(files_struct *fsp)
+{
+	files_struct **head = &file_id_table[file_id_hash(&fsp->file_id)];
+
+	fsp->id_prev = NULL;
+	fsp->id_next = *head;
+	if (*head != NULL) {
+		(*head)->id_prev = fsp;
+	}
+	*head = fsp;
+}
+
+static void file_id_table_remove(files_struct *fsp)
+{
+	if (fsp->id_prev != NULL) {
+		fsp->id_prev->id_next = fsp->id_next;
+	} else {
+		file_id_table[file_id_hash(&fsp->file_id)] = fsp->id_next;
+	}
+	if (fsp->id_next != NULL) {
+		fsp->id_next->id_prev = fsp->id_prev;
+	}
+	fsp->id_next = fsp->id_prev = NULL;
+}
+
+/****************************************************************************
+ Change the file_id of an fsp. Always use this rather than assigning
+ fsp->file_id, the lookup tables depend on it.
+****************************************************************************/
+
+void file_set_file_id(files_struct *fsp, struct file_id id)
+{
+	file_id_table_remove(fsp);
+	fsp->file_id = id;
+	file_id_table_add(fsp);
+}
+
 /****************************************************************************
  Find first available file slot.
 ****************************************************************************/
@@ -98,6 +147,14 @@ NTSTATUS file_new(struct smb_request *req, connection_struct *conn,
 	string_set(&fsp->fsp_name,"");
 	
 	DLIST_ADD(Files, fsp);
+	file_fnum_table[i] = fsp;
+	file_id_table_add(fsp);
+
+	fsp->conn_next = conn->files;
+	if (conn->files != NULL) {
+		conn->files->conn_prev = fsp;
+	}
+	conn->files = fsp;
 
 	DEBUG(5,("allocated file structure %d, fnum = %d (%d used)\n",
 		 i, fsp->fnum, files_used));
@@ -106,13 +163,6 @@ NTSTATUS file_new(struct smb_request *req, connection_struct *conn,
 		req->chain_fsp = fsp;
 	}
 
-	/* A new fsp invalidates the positive and
-	  negative fsp_fi_cache as the new fsp is pushed
-	  at the start of the list and we search from
-	  a cache hit to the *end* of the list. */
-
-	ZERO_STRUCT(fsp_fi_cache);
-
 	conn->num_files_open++;
 
 	*result = fsp;
@@ -127,11 +177,9 @@ void file_close_conn(connection_struct *conn)
 {
 	files_struct *fsp, *next;
 	
-	for (fsp=Files;fsp;fsp=next) {
-		next = fsp->next;
-		if (fsp->conn == conn) {
-			close_file(NULL, fsp, SHUTDOWN_CLOSE);
-		}
+	for (fsp=conn->files;fsp;fsp=next) {
+		next = fsp->conn_next;
+		close_file(NULL, fsp, SHUTDOWN_CLOSE);
 	}
 }
 
@@ -186,6 +234,24 @@ open files, %d are available.\n", request_max_open_files, real_max_open_files));
 	if (!file_bmap) {
 		exit_server("out of memory in file_init");
 	}
+
+	file_fnum_table = SMB_CALLOC_ARRAY(files_struct *,
+					   real_max_open_files);
+
+	for (file_id_table_size = 1;
+	     file_id_table_size < (unsigned int)real_max_open_files;
+	     file_id_table_size <<= 1) {
+		;
+	}
+	file_id_table = SMB_CALLOC_ARRAY(files_struct *, file_id_table_size);
+
+	/* No fd can be larger than the limit we set. */
+	file_fd_hint_size = real_lim;
+	file_fd_hint = SMB_CALLOC_ARRAY(uint16, file_fd_hint_size);
+
+	if (!file_fnum_table || !file_id_table || !file_fd_hint) {
+		exit_server("out of memory in file_init");
+	}
 }
 
 /****************************************************************************
@@ -226,13 +292,25 @@ void file_dump_open_table(void)
 
 files_struct *file_find_fd(int fd)
 {
-	int count=0;
 	files_struct *fsp;
+	bool hint = ((fd >= 0) && (fd < file_fd_hint_size));
 
-	for (fsp=Files;fsp;fsp=fsp->next,count++) {
+	/*
+	 * fds change under the fsp in too many places to index them,
+	 * so remember the fnum we last found an fd under and check it.
+	 */
+
+	if (hint && (file_fd_hint[fd] != 0)) {
+		fsp = file_fnum(file_fd_hint[fd]);
+		if ((fsp != NULL) && (fsp->fh->fd == fd)) {
+			return fsp;
+		}
+	}
+
+	for (fsp=Files;fsp;fsp=fsp->next) {
 		if (fsp->fh->fd == fd) {
-			if (count > 10) {
-				DLIST_PROMOTE(Files, fsp);
+			if (hint) {
+				file_fd_hint[fd] = fsp->fnum;
 			}
 			return fsp;
 		}
@@ -247,16 +325,12 @@ files_struct *file_find_fd(int fd)
 
 files_struct *file_find_dif(struct file_id id, unsigned long gen_id)
 {
-	int count=0;
 	files_struct *fsp;
 
-	for (fsp=Files;fsp;fsp=fsp->next,count++) {
+	for (fsp=file_id_table[file_id_hash(&id)];fsp;fsp=fsp->id_next) {
 		/* We can have a fsp->fh->fd == -1 here as it could be a stat open. */
 		if (file_id_equal(&fsp->file_id, &id) &&
 		    fsp->fh->gen_id == gen_id ) {
-			if (count > 10) {
-				DLIST_PROMOTE(Files, fsp);
-			}
 			/* Paranoia check. */
 			if ((fsp->fh->fd == -1) &&
 			    (fsp->oplock_type != NO_OPLOCK) &&
@@ -293,31 +367,18 @@ files_struct *file_find_fsp(files_struct *orig_fsp)
 
 /****************************************************************************
  Find the first fsp given a device and inode.
- We use a singleton cache here to speed up searching from getfilepathinfo
- calls.
 ****************************************************************************/
 
 files_struct *file_find_di_first(struct file_id id)
 {
 	files_struct *fsp;
 
-	if (file_id_equal(&fsp_fi_cache.id, &id)) {
-		/* Positive or negative cache hit. */
-		return fsp_fi_cache.fsp;
-	}
-
-	fsp_fi_cache.id = id;
-
-	for (fsp=Files;fsp;fsp=fsp->next) {
+	for (fsp=file_id_table[file_id_hash(&id)];fsp;fsp=fsp->id_next) {
 		if (file_id_equal(&fsp->file_id, &id)) {
-			/* Setup positive cache. */
-			fsp_fi_cache.fsp = fsp;
 			return fsp;
 		}
 	}
 
-	/* Setup negative cache. */
-	fsp_fi_cache.fsp = NULL;
 	return NULL;
 }
 
@@ -329,7 +390,7 @@ files_struct *file_find_di_next(files_struct *start_fsp)
 {
 	files_struct *fsp;
 
-	for (fsp = start_fsp->next;fsp;fsp=fsp->next) {
+	for (fsp = start_fsp->id_next;fsp;fsp=fsp->id_next) {
 		if (file_id_equal(&fsp->file_id, &start_fsp->file_id)) {
 			return fsp;
 		}
@@ -406,9 +467,9 @@ void file_sync_all(connection_struct *conn)
 {
 	files_struct *fsp, *next;
 
-	for (fsp=Files;fsp;fsp=next) {
-		next=fsp->next;
-		if ((conn == fsp->conn) && (fsp->fh->fd != -1)) {
+	for (fsp=conn->files;fsp;fsp=next) {
+		next=fsp->conn_next;
+		if (fsp->fh->fd != -1) {
 			sync_file(conn, fsp, True /* write through */);
 		}
 	}
@@ -421,6 +482,17 @@ void file_sync_all(connection_struct *conn)
 void file_free(struct smb_request *req, files_struct *fsp)
 {
 	DLIST_REMOVE(Files, fsp);
+	file_fnum_table[fsp->fnum - FILE_HANDLE_OFFSET] = NULL;
+	file_id_table_remove(fsp);
+
+	if (fsp->conn_prev != NULL) {
+		fsp->conn_prev->conn_next = fsp->conn_next;
+	} else {
+		fsp->conn->files = fsp->conn_next;
+	}
+	if (fsp->conn_next != NULL) {
+		fsp->conn_next->conn_prev = fsp->conn_prev;
+	}
 
 	string_free(&fsp->fsp_name);
 
@@ -459,11 +531,6 @@ void file_free(struct smb_request *req, files_struct *fsp)
 		req->chain_fsp = NULL;
 	}
 
-	/* Closing a file can invalidate the positive cache. */
-	if (fsp == fsp_fi_cache.fsp) {
-		ZERO_STRUCT(fsp_fi_cache);
-	}
-
 	/* Drop all remaining extensions. */
 	while (fsp->vfs_extension) {
 		vfs_remove_fsp_extension(fsp->vfs_extension->owner, fsp);
@@ -482,18 +549,12 @@ void file_free(struct smb_request *req, files_struct *fsp)
 
 files_struct *file_fnum(uint16 fnum)
 {
-	files_struct *fsp;
-	int count=0;
+	int i = (int)fnum - FILE_HANDLE_OFFSET;
 
-	for (fsp=Files;fsp;fsp=fsp->next, count++) {
-		if (fsp->fnum == fnum) {
-			if (count > 10) {
-				DLIST_PROMOTE(Files, fsp);
-			}
-			return fsp;
-		}
+	if (!VALID_FNUM(i)) {
+		return NULL;
 	}
-	return NULL;
+	return file_fnum_table[i];
 }
 
 /****************************************************************************
@@ -528,7 +589,7 @@ void dup_file_fsp(struct smb_request *req, files_struct *from,
 	to->fh = from->fh;
 	to->fh->ref_count++;
 
-	to->file_id = from->file_id;
+	file_set_file_id(to, from->file_id);
 	to->initial_allocation_size = from->initial_allocation_size;
 	to->mode = from->mode;
 	to->file_pid = from->file_pid;
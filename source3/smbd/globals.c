@@ -25,6 +25,7 @@ struct aio_extra *aio_list_head = NULL;
 struct tevent_signal *aio_signal_event = NULL;
 int aio_pending_size = 0;
 int outstanding_aio_calls = 0;
+unsigned int aio_write_cache_flush_id = 0;
 #endif
 
 /* dlink list we store pending lock records on. */
@@ -53,6 +54,9 @@ bool dfree_broken = false;
 
 struct bitmap *dptr_bmap = NULL;
 struct dptr_struct *dirptrs = NULL;
+struct dptr_struct **dptr_table = NULL;
+struct dptr_struct *dptr_open_head = NULL;
+struct dptr_struct *dptr_open_tail = NULL;
 int dirhandles_open = 0;
 
 /* how many write cache buffers have been allocated */
@@ -62,14 +66,11 @@ int real_max_open_files = 0;
 struct bitmap *file_bmap = NULL;
 files_struct *Files = NULL;
 int files_used = 0;
-struct fsp_singleton_cache fsp_fi_cache = {
-	.fsp = NULL,
-	.id = {
-		.devid = 0,
-		.inode = 0,
-		.extid = 0
-	}
-};
+files_struct **file_fnum_table = NULL;
+files_struct **file_id_table = NULL;
+unsigned int file_id_table_size = 0;
+uint16 *file_fd_hint = NULL;
+int file_fd_hint_size = 0;
 unsigned long file_gen_counter = 0;
 int first_file = 0;
 
@@ -175,6 +176,8 @@ int32_t exclusive_oplocks_open = 0;
 int32_t level_II_oplocks_open = 0;
 bool global_client_failed_oplock_break = false;
 struct kernel_oplocks *koplocks = NULL;
+struct level2_break_batch *level2_break_batches = NULL;
+struct timed_event *level2_break_batch_event = NULL;
 
 struct notify_mid_map *notify_changes_by_mid = NULL;
 
@@ -23,6 +23,7 @@ extern struct aio_extra *aio_list_head;
 extern struct tevent_signal *aio_signal_event;
 extern int aio_pending_size;
 extern int outstanding_aio_calls;
+extern unsigned int aio_write_cache_flush_id;
 #endif
 
 /* dlink list we store pending lock records on. */
@@ -52,6 +53,9 @@ extern bool dfree_broken;
 extern struct bitmap *dptr_bmap;
 //struct dptr_struct;
 extern struct dptr_struct *dirptrs;
+extern struct dptr_struct **dptr_table;
+extern struct dptr_struct *dptr_open_head;
+extern struct dptr_struct *dptr_open_tail;
 extern int dirhandles_open;
 
 /* how many write cache buffers have been allocated */
@@ -61,12 +65,12 @@ extern int real_max_open_files;
 extern struct bitmap *file_bmap;
 extern files_struct *Files;
 extern int files_used;
-/* A singleton cache to speed up searching by dev/inode. */
-struct fsp_singleton_cache {
-	files_struct *fsp;
-	struct file_id id;
-};
-extern struct fsp_singleton_cache fsp_fi_cache;
+/* Lookup tables for Files, see smbd/files.c. */
+extern files_struct **file_fnum_table;
+extern files_struct **file_id_table;
+extern unsigned int file_id_table_size;
+extern uint16 *file_fd_hint;
+extern int file_fd_hint_size;
 extern unsigned long file_gen_counter;
 extern int first_file;
 
@@ -186,6 +190,9 @@ extern int32_t exclusive_oplocks_open;
 extern int32_t level_II_oplocks_open;
 extern bool global_client_failed_oplock_break;
 extern struct kernel_oplocks *koplocks;
+struct level2_break_batch;
+extern struct level2_break_batch *level2_break_batches;
+extern struct timed_event *level2_break_batch_event;
 
 extern struct notify_mid_map *notify_changes_by_mid;
 
@@ -203,6 +210,19 @@ struct smbd_server_connection {
 	struct fd_event *fde;
 	uint64_t num_requests;
 	struct smb_signing_state *signing_state;
+	struct {
+		/*
+		 * Signed writeX payloads wait in pipe_fd until the MAC
+		 * has been checked against the tee(2) copy in hash_fd.
+		 */
+		int pipe_fd[2];
+		int hash_fd[2];
+		size_t pipe_size;
+		bool pipe_failed;
+		size_t parked;
+		uint8_t *hdr;
+		size_t hdr_len;
+	} recvfile;
 };
 extern struct smbd_server_connection *smbd_server_conn;
 
@@ -21,6 +21,11 @@
   this is the change notify database. It implements mechanisms for
   storing current change notify waiters in a tdb, and checking if a
   given event matches any of the stored notify waiiters.
+
+  The recursive database has one record per watched directory, keyed
+  by its path, so that a change only has to look at the records for the
+  directories above it. Every process keeps the records it has looked
+  at in a memcache that is flushed when the database seqnum changes.
 */
 
 #include "includes.h"
@@ -32,10 +37,12 @@ struct notify_context {
 	struct server_id server;
 	struct messaging_context *messaging_ctx;
 	struct notify_list *list;
-	struct notify_array *array;
+	struct memcache *cache;
 	int seqnum;
 	struct sys_notify_context *sys_notify_ctx;
-	TDB_DATA key;
+	struct event_context *ev;
+	struct notify_batch *batches;
+	struct timed_event *batch_event;
 };
 
 
@@ -44,28 +51,58 @@ struct notify_list {
 	void *private_data;
 	void (*callback)(void *, const struct notify_event *);
 	void *sys_notify_handle;
-	int depth;
+	char *path;	/* our record in db_recursive, NULL if none */
 };
 
-#define NOTIFY_KEY "notify array"
+/*
+  events for other watchers are held for NOTIFY_BATCH_MSEC and then
+  sent as one message per destination process. An event already queued
+  for a watch is not queued again. A watch with NOTIFY_BATCH_WATCH_MAX
+  events queued gets a single event with an empty path instead, which
+  tells the client to enumerate the directory.
+*/
+struct notify_batch {
+	struct notify_batch *next, *prev;
+	struct server_id server;
+	int num_events;
+	struct notify_event events[NOTIFY_BATCH_MAX];
+};
 
 #define NOTIFY_ENABLE		"notify:enable"
 #define NOTIFY_ENABLE_DEFAULT	True
 
-static NTSTATUS notify_remove_all(struct notify_context *notify,
-				  const struct server_id *server);
+/* bytes of db_recursive records cached per notify context */
+#define NOTIFY_CACHE_SIZE	(64*1024)
+
+static NTSTATUS notify_del_entries(struct notify_context *notify,
+				   const char *path,
+				   const struct server_id *server,
+				   void *private_data);
 static void notify_handler(struct messaging_context *msg_ctx, void *private_data, 
 			   uint32_t msg_type, struct server_id server_id, DATA_BLOB *data);
+static void notify_batch_handler(struct messaging_context *msg_ctx,
+				 void *private_data, uint32_t msg_type,
+				 struct server_id server_id, DATA_BLOB *data);
+static void notify_flush(struct notify_context *notify);
 
 /*
   destroy the notify context
 */
 static int notify_destructor(struct notify_context *notify)
 {
+	struct notify_list *listel;
+
+	notify_flush(notify);
+
 	messaging_deregister(notify->messaging_ctx, MSG_PVFS_NOTIFY, notify);
+	messaging_deregister(notify->messaging_ctx, MSG_PVFS_NOTIFY_BATCH,
+			     notify);
 
-	if (notify->list != NULL) {
-		notify_remove_all(notify, &notify->server);
+	for (listel=notify->list;listel;listel=listel->next) {
+		if (listel->path != NULL) {
+			notify_del_entries(notify, listel->path,
+					   &notify->server, NULL);
+		}
 	}
 
 	return 0;
@@ -108,13 +145,20 @@ struct notify_context *notify_init(TALLOC_CTX *mem_ctx, struct server_id server,
 		return NULL;
 	}
 
+	notify->cache = memcache_init(notify, NOTIFY_CACHE_SIZE);
+	if (notify->cache == NULL) {
+		talloc_free(notify);
+		return NULL;
+	}
+
 	notify->server = server;
 	notify->messaging_ctx = messaging_ctx;
 	notify->list = NULL;
-	notify->array = NULL;
+	notify->ev = ev;
+	notify->batches = NULL;
+	notify->batch_event = NULL;
 	notify->seqnum = notify->db_recursive->get_seqnum(
 		notify->db_recursive);
-	notify->key = string_term_tdb_data(NOTIFY_KEY);
 
 	talloc_set_destructor(notify, notify_destructor);
 
@@ -122,6 +166,8 @@ struct notify_context *notify_init(TALLOC_CTX *mem_ctx, struct server_id server,
 	   message type */
 	messaging_register(notify->messaging_ctx, notify, 
 			   MSG_PVFS_NOTIFY, notify_handler);
+	messaging_register(notify->messaging_ctx, notify,
+			   MSG_PVFS_NOTIFY_BATCH, notify_batch_handler);
 
 	notify->sys_notify_ctx = sys_notify_context_create(conn, notify, ev);
 
@@ -129,138 +175,137 @@ struct notify_context *notify_init(TALLOC_CTX *mem_ctx, struct server_id server,
 }
 
 /*
-  lock and fetch the record
+  unmarshall the watchers of one directory. An empty record gives an
+  empty array.
 */
-static NTSTATUS notify_fetch_locked(struct notify_context *notify, struct db_record **rec)
+static NTSTATUS notify_pull_array(TALLOC_CTX *mem_ctx, TDB_DATA dbuf,
+				  struct notify_entry_array **parray)
 {
-	*rec = notify->db_recursive->fetch_locked(notify->db_recursive,
-						  notify, notify->key);
-	if (*rec == NULL) {
-		return NT_STATUS_INTERNAL_DB_CORRUPTION;
+	struct notify_entry_array *array;
+	DATA_BLOB blob;
+
+	array = talloc_zero(mem_ctx, struct notify_entry_array);
+	NT_STATUS_HAVE_NO_MEMORY(array);
+
+	blob.data = (uint8_t *)dbuf.dptr;
+	blob.length = dbuf.dsize;
+
+	if (blob.length > 0) {
+		enum ndr_err_code ndr_err;
+		ndr_err = ndr_pull_struct_blob(
+			&blob, array, NULL, array,
+			(ndr_pull_flags_fn_t)ndr_pull_notify_entry_array);
+		if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
+			DEBUG(10, ("ndr_pull_notify_entry_array failed: %s\n",
+				   ndr_errstr(ndr_err)));
+			TALLOC_FREE(array);
+			return ndr_map_error2ntstatus(ndr_err);
+		}
+		if (DEBUGLEVEL >= 10) {
+			DEBUG(10, ("notify_pull_array:\n"));
+			NDR_PRINT_DEBUG(notify_entry_array, array);
+		}
 	}
+
+	*parray = array;
 	return NT_STATUS_OK;
 }
 
 /*
-  load the notify array
+  save the watchers of one directory, deleting the record if there
+  are none left
 */
-static NTSTATUS notify_load(struct notify_context *notify, struct db_record *rec)
+static NTSTATUS notify_store_array(struct db_record *rec,
+				   struct notify_entry_array *array)
 {
 	TDB_DATA dbuf;
 	DATA_BLOB blob;
+	enum ndr_err_code ndr_err;
 	NTSTATUS status;
-	int seqnum;
-
-	seqnum = notify->db_recursive->get_seqnum(notify->db_recursive);
-
-	if (seqnum == notify->seqnum && notify->array != NULL) {
-		return NT_STATUS_OK;
-	}
 
-	notify->seqnum = seqnum;
-
-	talloc_free(notify->array);
-	notify->array = TALLOC_ZERO_P(notify, struct notify_array);
-	NT_STATUS_HAVE_NO_MEMORY(notify->array);
-
-	if (!rec) {
-		if (notify->db_recursive->fetch(notify->db_recursive, notify,
-						notify->key, &dbuf) != 0) {
-			return NT_STATUS_INTERNAL_DB_CORRUPTION;
-		}
-	} else {
-		dbuf = rec->value;
+	if (array->num_entries == 0) {
+		return rec->delete_rec(rec);
 	}
 
-	blob.data = (uint8 *)dbuf.dptr;
-	blob.length = dbuf.dsize;
-
-	status = NT_STATUS_OK;
-	if (blob.length > 0) {
-		enum ndr_err_code ndr_err;
-		ndr_err = ndr_pull_struct_blob(&blob, notify->array, NULL, notify->array,
-					       (ndr_pull_flags_fn_t)ndr_pull_notify_array);
-		if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
-			status = ndr_map_error2ntstatus(ndr_err);
-		}
+	ndr_err = ndr_push_struct_blob(
+		&blob, rec, NULL, array,
+		(ndr_push_flags_fn_t)ndr_push_notify_entry_array);
+	if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
+		DEBUG(10, ("ndr_push_notify_entry_array failed: %s\n",
+			   ndr_errstr(ndr_err)));
+		return ndr_map_error2ntstatus(ndr_err);
 	}
 
 	if (DEBUGLEVEL >= 10) {
-		DEBUG(10, ("notify_load:\n"));
-		NDR_PRINT_DEBUG(notify_array, notify->array);
+		DEBUG(10, ("notify_store_array:\n"));
+		NDR_PRINT_DEBUG(notify_entry_array, array);
 	}
 
-	if (!rec) {
-		talloc_free(dbuf.dptr);
-	}
+	dbuf.dptr = blob.data;
+	dbuf.dsize = blob.length;
 
+	status = rec->store(rec, dbuf, TDB_REPLACE);
+	TALLOC_FREE(blob.data);
 	return status;
 }
 
 /*
-  compare notify entries for sorting
+  forget the cached records if anyone has changed db_recursive since we
+  last looked
 */
-static int notify_compare(const void *p1, const void *p2)
+static void notify_check_seqnum(struct notify_context *notify)
 {
-	const struct notify_entry *e1 = (const struct notify_entry *)p1;
-	const struct notify_entry *e2 = (const struct notify_entry *)p2;
-	return strcmp(e1->path, e2->path);
+	int seqnum;
+
+	seqnum = notify->db_recursive->get_seqnum(notify->db_recursive);
+	if (seqnum != notify->seqnum) {
+		memcache_flush(notify->cache, NOTIFY_ARRAY_CACHE);
+		notify->seqnum = seqnum;
+	}
 }
 
 /*
-  save the notify array
+  find the watchers of a directory. The array belongs to the cache and
+  is valid until the next notify_lookup() or notify_check_seqnum().
+  Directories nobody watches are cached as empty arrays.
 */
-static NTSTATUS notify_save(struct notify_context *notify, struct db_record *rec)
+static struct notify_entry_array *notify_lookup(struct notify_context *notify,
+						const char *path)
 {
+	struct notify_entry_array *array, *tmp;
+	DATA_BLOB key = data_blob_const(path, strlen(path));
 	TDB_DATA dbuf;
-	DATA_BLOB blob;
 	NTSTATUS status;
-	enum ndr_err_code ndr_err;
-	TALLOC_CTX *tmp_ctx;
 
-	/* if possible, remove some depth arrays */
-	while (notify->array->num_depths > 0 &&
-	       notify->array->depth[notify->array->num_depths-1].num_entries == 0) {
-		notify->array->num_depths--;
+	array = (struct notify_entry_array *)memcache_lookup_talloc(
+		notify->cache, NOTIFY_ARRAY_CACHE, key);
+	if (array != NULL) {
+		return array;
 	}
 
-	/* we might just be able to delete the record */
-	if (notify->array->num_depths == 0) {
-		return rec->delete_rec(rec);
-	}
-
-	tmp_ctx = talloc_new(notify);
-	NT_STATUS_HAVE_NO_MEMORY(tmp_ctx);
-
-	ndr_err = ndr_push_struct_blob(&blob, tmp_ctx, NULL, notify->array,
-				      (ndr_push_flags_fn_t)ndr_push_notify_array);
-	if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
-		talloc_free(tmp_ctx);
-		return ndr_map_error2ntstatus(ndr_err);
+	if (notify->db_recursive->fetch(notify->db_recursive, talloc_tos(),
+					string_term_tdb_data(path),
+					&dbuf) != 0) {
+		return NULL;
 	}
 
-	if (DEBUGLEVEL >= 10) {
-		DEBUG(10, ("notify_save:\n"));
-		NDR_PRINT_DEBUG(notify_array, notify->array);
+	status = notify_pull_array(notify, dbuf, &array);
+	TALLOC_FREE(dbuf.dptr);
+	if (!NT_STATUS_IS_OK(status)) {
+		return NULL;
 	}
 
-	dbuf.dptr = blob.data;
-	dbuf.dsize = blob.length;
-
-	status = rec->store(rec, dbuf, TDB_REPLACE);
-	talloc_free(tmp_ctx);
-
-	return status;
+	tmp = array;
+	memcache_add_talloc(notify->cache, NOTIFY_ARRAY_CACHE, key, &tmp);
+	return array;
 }
 
 
 /*
-  handle incoming notify messages
+  pass one marshalled notify_event on to its watcher
 */
-static void notify_handler(struct messaging_context *msg_ctx, void *private_data, 
-			   uint32_t msg_type, struct server_id server_id, DATA_BLOB *data)
+static void notify_dispatch(struct notify_context *notify, DATA_BLOB *data)
 {
-	struct notify_context *notify = talloc_get_type(private_data, struct notify_context);
 	enum ndr_err_code ndr_err;
 	struct notify_event ev;
 	TALLOC_CTX *tmp_ctx = talloc_new(notify);
@@ -277,6 +322,11 @@ static void notify_handler(struct messaging_context *msg_ctx, void *private_data
 		return;
 	}
 
+	/* the sender dropped events for this watch */
+	if (ev.path[0] == '\0') {
+		ev.path = NULL;
+	}
+
 	for (listel=notify->list;listel;listel=listel->next) {
 		if (listel->private_data == ev.private_data) {
 			listel->callback(listel->private_data, &ev);
@@ -287,6 +337,44 @@ static void notify_handler(struct messaging_context *msg_ctx, void *private_data
 	talloc_free(tmp_ctx);	
 }
 
+/*
+  handle incoming notify messages
+*/
+static void notify_handler(struct messaging_context *msg_ctx, void *private_data, 
+			   uint32_t msg_type, struct server_id server_id, DATA_BLOB *data)
+{
+	struct notify_context *notify = talloc_get_type(private_data, struct notify_context);
+
+	notify_dispatch(notify, data);
+}
+
+/*
+  handle a batch of notify messages, each one prefixed by its length
+*/
+static void notify_batch_handler(struct messaging_context *msg_ctx,
+				 void *private_data, uint32_t msg_type,
+				 struct server_id server_id, DATA_BLOB *data)
+{
+	struct notify_context *notify = talloc_get_type(private_data, struct notify_context);
+	size_t ofs = 0;
+
+	while (ofs + 4 <= data->length) {
+		DATA_BLOB blob;
+		uint32_t len = IVAL(data->data, ofs);
+
+		ofs += 4;
+		if (len > data->length - ofs) {
+			DEBUG(0, ("notify_batch_handler: invalid length %u\n",
+				  (unsigned)len));
+			return;
+		}
+		blob = data_blob_const(data->data + ofs, len);
+		ofs += len;
+
+		notify_dispatch(notify, &blob);
+	}
+}
+
 /*
   callback from sys_notify telling us about changes from the OS
 */
@@ -301,58 +389,47 @@ static void sys_notify_callback(struct sys_notify_context *ctx,
 }
 
 /*
-  add an entry to the notify array
+  add an entry to the record of the directory it watches
 */
-static NTSTATUS notify_add_array(struct notify_context *notify, struct db_record *rec,
-				 struct notify_entry *e,
-				 void *private_data, int depth)
+static NTSTATUS notify_add_recursive(struct notify_context *notify,
+				     struct notify_entry *e,
+				     void *private_data)
 {
-	int i;
-	struct notify_depth *d;
-	struct notify_entry *ee;
+	struct notify_entry_array *array;
+	struct db_record *rec;
+	NTSTATUS status;
 
-	/* possibly expand the depths array */
-	if (depth >= notify->array->num_depths) {
-		d = talloc_realloc(notify->array, notify->array->depth, 
-				   struct notify_depth, depth+1);
-		NT_STATUS_HAVE_NO_MEMORY(d);
-		for (i=notify->array->num_depths;i<=depth;i++) {
-			ZERO_STRUCT(d[i]);
-		}
-		notify->array->depth = d;
-		notify->array->num_depths = depth+1;
+	rec = notify->db_recursive->fetch_locked(
+		notify->db_recursive, talloc_tos(),
+		string_term_tdb_data(e->path));
+	if (rec == NULL) {
+		DEBUG(10, ("notify_add_recursive: fetch_locked for %s "
+			   "failed\n", e->path));
+		return NT_STATUS_INTERNAL_DB_CORRUPTION;
 	}
-	d = &notify->array->depth[depth];
-
-	/* expand the entries array */
-	ee = talloc_realloc(notify->array->depth, d->entries, struct notify_entry,
-			    d->num_entries+1);
-	NT_STATUS_HAVE_NO_MEMORY(ee);
-	d->entries = ee;
 
-	d->entries[d->num_entries] = *e;
-	d->entries[d->num_entries].private_data = private_data;
-	d->entries[d->num_entries].server = notify->server;
-	d->entries[d->num_entries].path_len = strlen(e->path);
-	d->num_entries++;
-
-	d->max_mask |= e->filter;
-	d->max_mask_subdir |= e->subdir_filter;
-
-	if (d->num_entries > 1) {
-		qsort(d->entries, d->num_entries, sizeof(d->entries[0]), notify_compare);
+	status = notify_pull_array(rec, rec->value, &array);
+	if (!NT_STATUS_IS_OK(status)) {
+		TALLOC_FREE(rec);
+		return status;
 	}
 
-	/* recalculate the maximum masks */
-	d->max_mask = 0;
-	d->max_mask_subdir = 0;
-
-	for (i=0;i<d->num_entries;i++) {
-		d->max_mask |= d->entries[i].filter;
-		d->max_mask_subdir |= d->entries[i].subdir_filter;
+	array->entries = talloc_realloc(array, array->entries,
+					struct notify_entry,
+					array->num_entries+1);
+	if (array->entries == NULL) {
+		TALLOC_FREE(rec);
+		return NT_STATUS_NO_MEMORY;
 	}
+	array->entries[array->num_entries] = *e;
+	array->entries[array->num_entries].private_data = private_data;
+	array->entries[array->num_entries].server = notify->server;
+	array->entries[array->num_entries].path_len = strlen(e->path);
+	array->num_entries += 1;
 
-	return notify_save(notify, rec);
+	status = notify_store_array(rec, array);
+	TALLOC_FREE(rec);
+	return status;
 }
 
 /*
@@ -444,7 +521,6 @@ static void notify_add_onelevel(struct notify_context *notify,
 	return;
 }
 
-
 /*
   add a notify watch. This is called when a notify is first setup on a open
   directory handle.
@@ -454,40 +530,26 @@ NTSTATUS notify_add(struct notify_context *notify, struct notify_entry *e0,
 		    void *private_data)
 {
 	struct notify_entry e = *e0;
-	NTSTATUS status;
+	NTSTATUS status = NT_STATUS_OK;
 	char *tmp_path = NULL;
 	struct notify_list *listel;
 	size_t len;
-	int depth;
-	struct db_record *rec;
 
 	/* see if change notify is enabled at all */
 	if (notify == NULL) {
 		return NT_STATUS_NOT_IMPLEMENTED;
 	}
 
-	status = notify_fetch_locked(notify, &rec);
-	NT_STATUS_NOT_OK_RETURN(status);
-
-	status = notify_load(notify, rec);
-	if (!NT_STATUS_IS_OK(status)) {
-		talloc_free(rec);
-		return status;
-	}
-
 	/* cope with /. on the end of the path */
 	len = strlen(e.path);
 	if (len > 1 && e.path[len-1] == '.' && e.path[len-2] == '/') {
 		tmp_path = talloc_strndup(notify, e.path, len-2);
 		if (tmp_path == NULL) {
-			status = NT_STATUS_NO_MEMORY;
-			goto done;
+			return NT_STATUS_NO_MEMORY;
 		}
 		e.path = tmp_path;
 	}
 
-	depth = count_chars(e.path, '/');
-
 	listel = TALLOC_ZERO_P(notify, struct notify_list);
 	if (listel == NULL) {
 		status = NT_STATUS_NO_MEMORY;
@@ -496,7 +558,6 @@ NTSTATUS notify_add(struct notify_context *notify, struct notify_entry *e0,
 
 	listel->private_data = private_data;
 	listel->callback = callback;
-	listel->depth = depth;
 	DLIST_ADD(notify->list, listel);
 
 	/* ignore failures from sys_notify */
@@ -520,14 +581,16 @@ NTSTATUS notify_add(struct notify_context *notify, struct notify_entry *e0,
 
 	/* if the system notify handler couldn't handle some of the
 	   filter bits, or couldn't handle a request for recursion
-	   then we need to install it in the array used for the
+	   then we need to install it in the database used for the
 	   intra-samba notify handling */
 	if (e.filter != 0 || e.subdir_filter != 0) {
-		status = notify_add_array(notify, rec, &e, private_data, depth);
+		status = notify_add_recursive(notify, &e, private_data);
+		if (NT_STATUS_IS_OK(status)) {
+			listel->path = talloc_strdup(listel, e.path);
+		}
 	}
 
 done:
-	talloc_free(rec);
 	talloc_free(tmp_path);
 
 	return status;
@@ -629,16 +692,67 @@ NTSTATUS notify_remove_onelevel(struct notify_context *notify,
 	return NT_STATUS_OK;
 }
 
+/*
+  remove entries of a messaging server from the record of a
+  directory. With private_data == NULL all entries of the server go.
+*/
+static NTSTATUS notify_del_entries(struct notify_context *notify,
+				   const char *path,
+				   const struct server_id *server,
+				   void *private_data)
+{
+	struct notify_entry_array *array;
+	struct db_record *rec;
+	NTSTATUS status;
+	int i, del_count = 0;
+
+	rec = notify->db_recursive->fetch_locked(
+		notify->db_recursive, talloc_tos(),
+		string_term_tdb_data(path));
+	if (rec == NULL) {
+		DEBUG(10, ("notify_del_entries: fetch_locked for %s "
+			   "failed\n", path));
+		return NT_STATUS_INTERNAL_DB_CORRUPTION;
+	}
+
+	status = notify_pull_array(rec, rec->value, &array);
+	if (!NT_STATUS_IS_OK(status)) {
+		TALLOC_FREE(rec);
+		return status;
+	}
+
+	for (i=0; i<array->num_entries; i++) {
+		struct notify_entry *e = &array->entries[i];
+		if (!cluster_id_equal(server, &e->server)) {
+			continue;
+		}
+		if ((private_data != NULL) &&
+		    (private_data != e->private_data)) {
+			continue;
+		}
+		array->entries[i] = array->entries[array->num_entries-1];
+		array->num_entries -= 1;
+		del_count += 1;
+		i -= 1;
+	}
+
+	if (del_count == 0) {
+		TALLOC_FREE(rec);
+		return NT_STATUS_OBJECT_NAME_NOT_FOUND;
+	}
+
+	status = notify_store_array(rec, array);
+	TALLOC_FREE(rec);
+	return status;
+}
+
 /*
   remove a notify watch. Called when the directory handle is closed
 */
 NTSTATUS notify_remove(struct notify_context *notify, void *private_data)
 {
-	NTSTATUS status;
+	NTSTATUS status = NT_STATUS_OK;
 	struct notify_list *listel;
-	int i, depth;
-	struct notify_depth *d;
-	struct db_record *rec;
 
 	/* see if change notify is enabled at all */
 	if (notify == NULL) {
@@ -655,126 +769,188 @@ NTSTATUS notify_remove(struct notify_context *notify, void *private_data)
 		return NT_STATUS_OBJECT_NAME_NOT_FOUND;
 	}
 
-	depth = listel->depth;
+	if (listel->path != NULL) {
+		status = notify_del_entries(notify, listel->path,
+					    &notify->server, private_data);
+	}
 
 	talloc_free(listel);
 
-	status = notify_fetch_locked(notify, &rec);
-	NT_STATUS_NOT_OK_RETURN(status);
+	return status;
+}
 
-	status = notify_load(notify, rec);
-	if (!NT_STATUS_IS_OK(status)) {
-		talloc_free(rec);
-		return status;
-	}
 
-	if (depth >= notify->array->num_depths) {
-		talloc_free(rec);
-		return NT_STATUS_OBJECT_NAME_NOT_FOUND;
-	}
+/*
+  send the events queued for one messaging server
+*/
+static void notify_send_batch(struct notify_context *notify,
+			      struct notify_batch *batch)
+{
+	DATA_BLOB data = data_blob_null;
+	uint32_t msg_type = MSG_PVFS_NOTIFY_BATCH;
+	int i;
 
-	/* we only have to search at the depth of this element */
-	d = &notify->array->depth[depth];
+	for (i=0; i<batch->num_events; i++) {
+		DATA_BLOB blob;
+		uint8_t len[4];
+		enum ndr_err_code ndr_err;
+
+		ndr_err = ndr_push_struct_blob(
+			&blob, batch, NULL, &batch->events[i],
+			(ndr_push_flags_fn_t)ndr_push_notify_event);
+		if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
+			continue;
+		}
 
-	for (i=0;i<d->num_entries;i++) {
-		if (private_data == d->entries[i].private_data &&
-		    cluster_id_equal(&notify->server, &d->entries[i].server)) {
+		if (batch->num_events == 1) {
+			msg_type = MSG_PVFS_NOTIFY;
+			data = blob;
 			break;
 		}
-	}
-	if (i == d->num_entries) {
-		talloc_free(rec);
-		return NT_STATUS_OBJECT_NAME_NOT_FOUND;
+
+		SIVAL(len, 0, blob.length);
+		if (!data_blob_append(batch, &data, len, sizeof(len)) ||
+		    !data_blob_append(batch, &data, blob.data, blob.length)) {
+			DEBUG(0, ("notify_send_batch: out of memory\n"));
+			break;
+		}
+		data_blob_free(&blob);
 	}
 
-	if (i < d->num_entries-1) {
-		memmove(&d->entries[i], &d->entries[i+1], 
-			sizeof(d->entries[i])*(d->num_entries-(i+1)));
+	if (data.length > 0) {
+		messaging_send(notify->messaging_ctx, batch->server,
+			       msg_type, &data);
+		DO_PROFILE_INC(notify_batches_sent);
+		DO_PROFILE_ADD(notify_events_sent, batch->num_events);
 	}
-	d->num_entries--;
 
-	status = notify_save(notify, rec);
+	DLIST_REMOVE(notify->batches, batch);
+	TALLOC_FREE(batch);
+}
 
-	talloc_free(rec);
+/*
+  send everything we have queued
+*/
+static void notify_flush(struct notify_context *notify)
+{
+	TALLOC_FREE(notify->batch_event);
 
-	return status;
+	while (notify->batches != NULL) {
+		notify_send_batch(notify, notify->batches);
+	}
+}
+
+static void notify_batch_timeout(struct event_context *ev,
+				 struct timed_event *te,
+				 struct timeval now,
+				 void *private_data)
+{
+	struct notify_context *notify = talloc_get_type_abort(
+		private_data, struct notify_context);
+
+	notify_flush(notify);
 }
 
 /*
-  remove all notify watches for a messaging server
+  send a notify message to another messaging server. The event is
+  queued and goes out with the next batch for that server.
 */
-static NTSTATUS notify_remove_all(struct notify_context *notify,
-				  const struct server_id *server)
+static NTSTATUS notify_send(struct notify_context *notify, struct notify_entry *e,
+			    const char *path, uint32_t action)
 {
-	NTSTATUS status;
-	int i, depth, del_count=0;
-	struct db_record *rec;
-
-	status = notify_fetch_locked(notify, &rec);
-	NT_STATUS_NOT_OK_RETURN(status);
+	struct notify_batch *batch;
+	struct notify_event *ev, *last = NULL;
+	int i, num_watch = 0;
 
-	status = notify_load(notify, rec);
-	if (!NT_STATUS_IS_OK(status)) {
-		talloc_free(rec);
-		return status;
+	for (batch=notify->batches; batch; batch=batch->next) {
+		if (cluster_id_equal(&batch->server, &e->server)) {
+			break;
+		}
 	}
 
-	/* we have to search for all entries across all depths, looking for matches
-	   for the server id */
-	for (depth=0;depth<notify->array->num_depths;depth++) {
-		struct notify_depth *d = &notify->array->depth[depth];
-		for (i=0;i<d->num_entries;i++) {
-			if (cluster_id_equal(server, &d->entries[i].server)) {
-				if (i < d->num_entries-1) {
-					memmove(&d->entries[i], &d->entries[i+1], 
-						sizeof(d->entries[i])*(d->num_entries-(i+1)));
-				}
-				i--;
-				d->num_entries--;
-				del_count++;
-			}
+	if (batch == NULL) {
+		/* Messaging would tell us the same, but only at flush time */
+		if (!process_exists(e->server)) {
+			return NT_STATUS_INVALID_HANDLE;
 		}
+		batch = talloc(notify, struct notify_batch);
+		if (batch == NULL) {
+			return NT_STATUS_NO_MEMORY;
+		}
+		batch->server = e->server;
+		batch->num_events = 0;
+		DLIST_ADD(notify->batches, batch);
 	}
 
-	if (del_count > 0) {
-		status = notify_save(notify, rec);
+	for (i=0; i<batch->num_events; i++) {
+		ev = &batch->events[i];
+		if (ev->private_data != e->private_data) {
+			continue;
+		}
+		if (ev->path[0] == '\0') {
+			/* this watch has overflowed already */
+			DO_PROFILE_INC(notify_events_dropped);
+			return NT_STATUS_OK;
+		}
+		if (strcmp(ev->path, path) == 0) {
+			last = ev;
+		}
+		num_watch += 1;
 	}
 
-	talloc_free(rec);
-
-	return status;
-}
+	/*
+	 * Only a repeat of the latest event for this path can go, merging
+	 * with an older one would reorder e.g. ADDED, REMOVED, ADDED.
+	 */
+	if ((last != NULL) && (last->action == action) &&
+	    (action != NOTIFY_ACTION_OLD_NAME) &&
+	    (action != NOTIFY_ACTION_NEW_NAME)) {
+		DO_PROFILE_INC(notify_events_merged);
+		return NT_STATUS_OK;
+	}
 
+	if (num_watch >= NOTIFY_BATCH_WATCH_MAX) {
+		int j = 0;
 
-/*
-  send a notify message to another messaging server
-*/
-static NTSTATUS notify_send(struct notify_context *notify, struct notify_entry *e,
-			    const char *path, uint32_t action)
-{
-	struct notify_event ev;
-	DATA_BLOB data;
-	NTSTATUS status;
-	enum ndr_err_code ndr_err;
-	TALLOC_CTX *tmp_ctx;
+		/* replace all events of this watch by one empty path */
+		for (i=0; i<batch->num_events; i++) {
+			ev = &batch->events[i];
+			if (ev->private_data == e->private_data) {
+				continue;
+			}
+			batch->events[j++] = *ev;
+		}
+		batch->num_events = j;
+		DO_PROFILE_ADD(notify_events_dropped, num_watch + 1);
+		path = "";
+		action = 0;
+	}
 
-	ev.action = action;
-	ev.path = path;
-	ev.private_data = e->private_data;
+	ev = &batch->events[batch->num_events];
+	ev->action = action;
+	ev->private_data = e->private_data;
+	ev->path = talloc_strdup(batch, path);
+	if (ev->path == NULL) {
+		return NT_STATUS_NO_MEMORY;
+	}
+	batch->num_events += 1;
 
-	tmp_ctx = talloc_new(notify);
+	if (batch->num_events == NOTIFY_BATCH_MAX) {
+		notify_send_batch(notify, batch);
+		return NT_STATUS_OK;
+	}
 
-	ndr_err = ndr_push_struct_blob(&data, tmp_ctx, NULL, &ev,
-				       (ndr_push_flags_fn_t)ndr_push_notify_event);
-	if (!NDR_ERR_CODE_IS_SUCCESS(ndr_err)) {
-		talloc_free(tmp_ctx);
-		return ndr_map_error2ntstatus(ndr_err);
+	if (notify->batch_event == NULL) {
+		notify->batch_event = event_add_timed(
+			notify->ev, notify,
+			timeval_current_ofs(0, NOTIFY_BATCH_MSEC * 1000),
+			notify_batch_timeout, notify);
+		if (notify->batch_event == NULL) {
+			notify_flush(notify);
+		}
 	}
 
-	status = messaging_send(notify->messaging_ctx, e->server, 
-				MSG_PVFS_NOTIFY, &data);
-	talloc_free(tmp_ctx);
-	return status;
+	return NT_STATUS_OK;
 }
 
 void notify_onelevel(struct notify_context *notify, uint32_t action,
@@ -867,16 +1043,18 @@ void notify_onelevel(struct notify_context *notify, uint32_t action,
 /*
   trigger a notify message for anyone waiting on a matching event
 
-  This function is called a lot, and needs to be very fast. The unusual data structure
-  and traversal is designed to be fast in the average case, even for large numbers of
-  notifies
+  This function is called a lot, and needs to be very fast. We only
+  look at the records of the directories along the given path, and
+  those normally come out of our cache.
 */
 void notify_trigger(struct notify_context *notify,
 		    uint32_t action, uint32_t filter, const char *path)
 {
 	NTSTATUS status;
-	int depth;
 	const char *p, *next_p;
+	char *dir;
+	struct server_id dead;
+	bool have_dead = false;
 
 	DEBUG(10, ("notify_trigger called action=0x%x, filter=0x%x, "
 		   "path=%s\n", (unsigned)action, (unsigned)filter, path));
@@ -886,72 +1064,34 @@ void notify_trigger(struct notify_context *notify,
 		return;
 	}
 
- again:
-	status = notify_load(notify, NULL);
-	if (!NT_STATUS_IS_OK(status)) {
+	notify_check_seqnum(notify);
+
+	dir = talloc_strdup(talloc_tos(), path);
+	if (dir == NULL) {
 		return;
 	}
 
-	/* loop along the given path, working with each directory depth separately */
-	for (depth=0,p=path;
-	     p && depth < notify->array->num_depths;
-	     p=next_p,depth++) {
+	/* loop along the given path, looking at each parent directory */
+	for (p=path; p; p=next_p) {
 		int p_len = p - path;
-		int min_i, max_i, i;
-		struct notify_depth *d = &notify->array->depth[depth];
+		struct notify_entry_array *array;
+		int i;
 		next_p = strchr(p+1, '/');
 
-		/* see if there are any entries at this depth */
-		if (d->num_entries == 0) continue;
+		dir[p_len] = '\0';
+		array = notify_lookup(notify, dir);
+		dir[p_len] = path[p_len];
 
-		/* try to skip based on the maximum mask. If next_p is
-		 NULL then we know it will be a 'this directory'
-		 match, otherwise it must be a subdir match */
-		if (next_p != NULL) {
-			if (0 == (filter & d->max_mask_subdir)) {
-				continue;
-			}
-		} else {
-			if (0 == (filter & d->max_mask)) {
-				continue;
-			}
-		}
-
-		/* we know there is an entry here worth looking
-		 for. Use a bisection search to find the first entry
-		 with a matching path */
-		min_i = 0;
-		max_i = d->num_entries-1;
-
-		while (min_i < max_i) {
-			struct notify_entry *e;
-			int cmp;
-			i = (min_i+max_i)/2;
-			e = &d->entries[i];
-			cmp = strncmp(path, e->path, p_len);
-			if (cmp == 0) {
-				if (p_len == e->path_len) {
-					max_i = i;
-				} else {
-					max_i = i-1;
-				}
-			} else if (cmp < 0) {
-				max_i = i-1;
-			} else {
-				min_i = i+1;
-			}
-		}
-
-		if (min_i != max_i) {
-			/* none match */
+		if (array == NULL) {
 			continue;
 		}
 
-		/* we now know that the entries start at min_i */
-		for (i=min_i;i<d->num_entries;i++) {
-			struct notify_entry *e = &d->entries[i];
-			if (p_len != e->path_len ||
-			    strncmp(path, e->path, p_len) != 0) break;
+		for (i=0; i<array->num_entries; i++) {
+			struct notify_entry *e = &array->entries[i];
+
+			/* If next_p is NULL then this is a 'this
+			   directory' match, otherwise it must be a
+			   subdir match */
 			if (next_p != NULL) {
 				if (0 == (filter & e->subdir_filter)) {
 					continue;
@@ -961,19 +1101,26 @@ void notify_trigger(struct notify_context *notify,
 					continue;
 				}
 			}
-			status = notify_send(notify, e,	path + e->path_len + 1,
+			if (have_dead && cluster_id_equal(&dead, &e->server)) {
+				continue;
+			}
+
+			status = notify_send(notify, e,	path + p_len + 1,
 					     action);
 
 			if (NT_STATUS_EQUAL(
 				    status, NT_STATUS_INVALID_HANDLE)) {
-				struct server_id server = e->server;
-
 				DEBUG(10, ("Deleting notify entries for "
 					   "process %s because it's gone\n",
 					   procid_str_static(&e->server)));
-				notify_remove_all(notify, &server);
-				goto again;
+				dead = e->server;
+				have_dead = true;
+				dir[p_len] = '\0';
+				notify_del_entries(notify, dir, &dead, NULL);
+				dir[p_len] = path[p_len];
 			}
 		}
 	}
+
+	TALLOC_FREE(dir);
 }
@@ -406,15 +406,37 @@ void break_level2_to_none_async(files_struct *fsp)
  the client for LEVEL2.
 *******************************************************************/
 
+static void async_level2_break(struct server_id src, char *buf)
+{
+	struct share_mode_entry msg;
+	files_struct *fsp;
+
+	/* De-linearize incoming message. */
+	message_to_share_mode_entry(&msg, buf);
+
+	DEBUG(10, ("Got oplock async level 2 break message from pid %s: "
+		   "%s/%lu\n", procid_str(debug_ctx(), &src),
+		   file_id_string_tos(&msg.id), msg.share_file_id));
+
+	fsp = initial_break_processing(msg.id, msg.share_file_id);
+
+	if (fsp == NULL) {
+		/* We hit a race here. Break messages are sent, and before we
+		 * get to process this message, we have closed the file. 
+		 * No need to reply as this is an async message. */
+		DEBUG(3, ("process_oplock_async_level2_break_message: Did not find fsp, ignoring\n"));
+		return;
+	}
+
+	break_level2_to_none_async(fsp);
+}
+
 void process_oplock_async_level2_break_message(struct messaging_context *msg_ctx,
 						      void *private_data,
 						      uint32_t msg_type,
 						      struct server_id src,
 						      DATA_BLOB *data)
 {
-	struct share_mode_entry msg;
-	files_struct *fsp;
-
 	if (data->data == NULL) {
 		DEBUG(0, ("Got NULL buffer\n"));
 		return;
@@ -425,24 +447,40 @@ void process_oplock_async_level2_break_message(struct messaging_context *msg_ctx
 		return;
 	}
 
-	/* De-linearize incoming message. */
-	message_to_share_mode_entry(&msg, (char *)data->data);
+	async_level2_break(src, (char *)data->data);
+}
 
-	DEBUG(10, ("Got oplock async level 2 break message from pid %s: "
-		   "%s/%lu\n", procid_str(debug_ctx(), &src),
-		   file_id_string_tos(&msg.id), msg.share_file_id));
+/*******************************************************************
+ The same for a batch of level2 breaks, see queue_level2_break().
+*******************************************************************/
 
-	fsp = initial_break_processing(msg.id, msg.share_file_id);
+static void process_oplock_async_level2_breaks_message(struct messaging_context *msg_ctx,
+						       void *private_data,
+						       uint32_t msg_type,
+						       struct server_id src,
+						       DATA_BLOB *data)
+{
+	size_t ofs;
 
-	if (fsp == NULL) {
-		/* We hit a race here. Break messages are sent, and before we
-		 * get to process this message, we have closed the file. 
-		 * No need to reply as this is an async message. */
-		DEBUG(3, ("process_oplock_async_level2_break_message: Did not find fsp, ignoring\n"));
+	if (data->data == NULL) {
+		DEBUG(0, ("Got NULL buffer\n"));
 		return;
 	}
 
-	break_level2_to_none_async(fsp);
+	if ((data->length == 0) ||
+	    (data->length % MSG_SMB_SHARE_MODE_ENTRY_SIZE) != 0) {
+		DEBUG(0, ("Got invalid msg len %d\n", (int)data->length));
+		return;
+	}
+
+	DEBUG(10, ("Got %d oplock async level 2 breaks from pid %s\n",
+		   (int)(data->length / MSG_SMB_SHARE_MODE_ENTRY_SIZE),
+		   procid_str(debug_ctx(), &src)));
+
+	for (ofs = 0; ofs < data->length;
+	     ofs += MSG_SMB_SHARE_MODE_ENTRY_SIZE) {
+		async_level2_break(src, (char *)data->data + ofs);
+	}
 }
 
 /*******************************************************************
@@ -713,6 +751,134 @@ static void process_open_retry_message(struct messaging_context *msg_ctx,
 	schedule_deferred_open_smb_message(msg.op_mid);
 }
 
+/****************************************************************************
+ Level2 breaks to other smbds are queued per destination process for
+ LEVEL2_BREAK_BATCH_MSEC and then sent as one message. Smbds on other
+ cluster nodes get one message per break, they may be an older version.
+ A break already queued for the same open is not queued twice, so a
+ burst of writes to a file with many level2 holders costs one message
+ per holder process.
+****************************************************************************/
+
+struct level2_break_batch {
+	struct level2_break_batch *next, *prev;
+	struct server_id pid;
+	size_t num_entries;
+	char buf[LEVEL2_BREAK_BATCH_MAX * MSG_SMB_SHARE_MODE_ENTRY_SIZE];
+};
+
+static void send_level2_break_batch(struct level2_break_batch *batch)
+{
+	size_t i;
+
+	DEBUG(10, ("send_level2_break_batch: sending %d breaks to pid %s\n",
+		   (int)batch->num_entries,
+		   procid_str(debug_ctx(), &batch->pid)));
+
+	if ((batch->num_entries > 1) && procid_is_local(&batch->pid)) {
+		messaging_send_buf(smbd_messaging_context(), batch->pid,
+				   MSG_SMB_ASYNC_LEVEL2_BREAKS,
+				   (uint8 *)batch->buf,
+				   batch->num_entries *
+				   MSG_SMB_SHARE_MODE_ENTRY_SIZE);
+	} else {
+		/*
+		 * A cluster peer may run an smbd that doesn't know
+		 * MSG_SMB_ASYNC_LEVEL2_BREAKS, send it one at a time.
+		 */
+		for (i = 0; i < batch->num_entries; i++) {
+			messaging_send_buf(
+				smbd_messaging_context(), batch->pid,
+				MSG_SMB_ASYNC_LEVEL2_BREAK,
+				(uint8 *)batch->buf +
+				i * MSG_SMB_SHARE_MODE_ENTRY_SIZE,
+				MSG_SMB_SHARE_MODE_ENTRY_SIZE);
+		}
+	}
+
+	DLIST_REMOVE(level2_break_batches, batch);
+	TALLOC_FREE(batch);
+}
+
+/****************************************************************************
+ Send all queued level2 breaks now.
+****************************************************************************/
+
+void flush_level2_breaks(void)
+{
+	TALLOC_FREE(level2_break_batch_event);
+
+	while (level2_break_batches != NULL) {
+		send_level2_break_batch(level2_break_batches);
+	}
+}
+
+static void level2_break_batch_handler(struct event_context *ctx,
+				       struct timed_event *te,
+				       struct timeval now,
+				       void *private_data)
+{
+	flush_level2_breaks();
+}
+
+static void queue_level2_break(const struct share_mode_entry *e)
+{
+	struct level2_break_batch *batch;
+	char msg[MSG_SMB_SHARE_MODE_ENTRY_SIZE];
+	size_t i;
+
+	share_mode_entry_to_message(msg, e);
+
+	for (batch = level2_break_batches; batch; batch = batch->next) {
+		if (procid_equal(&batch->pid, &e->pid)) {
+			break;
+		}
+	}
+
+	if (batch == NULL) {
+		batch = TALLOC_P(NULL, struct level2_break_batch);
+		if (batch == NULL) {
+			/* Can't batch, send it on its own. */
+			messaging_send_buf(smbd_messaging_context(), e->pid,
+					   MSG_SMB_ASYNC_LEVEL2_BREAK,
+					   (uint8 *)msg,
+					   MSG_SMB_SHARE_MODE_ENTRY_SIZE);
+			return;
+		}
+		batch->pid = e->pid;
+		batch->num_entries = 0;
+		DLIST_ADD(level2_break_batches, batch);
+	}
+
+	/* Only the file id and share_file_id identify the open. */
+	for (i = 0; i < batch->num_entries; i++) {
+		char *q = batch->buf + i * MSG_SMB_SHARE_MODE_ENTRY_SIZE;
+		if ((memcmp(q+28, msg+28, 24) == 0) &&
+		    (IVAL(q,52) == IVAL(msg,52))) {
+			return;
+		}
+	}
+
+	memcpy(batch->buf + batch->num_entries * MSG_SMB_SHARE_MODE_ENTRY_SIZE,
+	       msg, MSG_SMB_SHARE_MODE_ENTRY_SIZE);
+	batch->num_entries++;
+
+	if (batch->num_entries == LEVEL2_BREAK_BATCH_MAX) {
+		send_level2_break_batch(batch);
+		return;
+	}
+
+	if (level2_break_batch_event == NULL) {
+		level2_break_batch_event = event_add_timed(
+			smbd_event_context(), NULL,
+			timeval_current_ofs(0, LEVEL2_BREAK_BATCH_MSEC * 1000),
+			level2_break_batch_handler, NULL);
+		if (level2_break_batch_event == NULL) {
+			flush_level2_breaks();
+		}
+	}
+}
+
 /****************************************************************************
  This function is called on any file modification or lock request. If a file
  is level 2 oplocked then it must tell all other level 2 holders to break to
@@ -749,7 +915,6 @@ static void contend_level2_oplocks_begin_default(files_struct *fsp,
 
 	for(i = 0; i < lck->num_share_modes; i++) {
 		struct share_mode_entry *share_entry = &lck->share_modes[i];
-		char msg[MSG_SMB_SHARE_MODE_ENTRY_SIZE];
 
 		if (!is_valid_share_mode_entry(share_entry)) {
 			continue;
@@ -783,8 +948,6 @@ static void contend_level2_oplocks_begin_default(files_struct *fsp,
 			abort();
 		}
 
-		share_mode_entry_to_message(msg, share_entry);
-
 		/*
 		 * Deal with a race condition when breaking level2
  		 * oplocks. Don't send all the messages and release
@@ -801,11 +964,7 @@ static void contend_level2_oplocks_begin_default(files_struct *fsp,
 			wait_before_sending_break();
 			break_level2_to_none_async(fsp);
 		} else {
-			messaging_send_buf(smbd_messaging_context(),
-					share_entry->pid,
-					MSG_SMB_ASYNC_LEVEL2_BREAK,
-					(uint8 *)msg,
-					MSG_SMB_SHARE_MODE_ENTRY_SIZE);
+			queue_level2_break(share_entry);
 		}
 	}
 
@@ -893,6 +1052,8 @@ bool init_oplocks(struct messaging_context *msg_ctx)
 			   process_oplock_break_message);
 	messaging_register(msg_ctx, NULL, MSG_SMB_ASYNC_LEVEL2_BREAK,
 			   process_oplock_async_level2_break_message);
+	messaging_register(msg_ctx, NULL, MSG_SMB_ASYNC_LEVEL2_BREAKS,
+			   process_oplock_async_level2_breaks_message);
 	messaging_register(msg_ctx, NULL, MSG_SMB_BREAK_RESPONSE,
 			   process_oplock_break_response);
 	messaging_register(msg_ctx, NULL, MSG_SMB_KERNEL_BREAK,
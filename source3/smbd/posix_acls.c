@@ -3229,12 +3229,106 @@ static NTSTATUS posix_get_nt_acl_common(struct connection_struct *conn,
 	return NT_STATUS_OK;
 }
 
+/****************************************************************************
+ Cache of the security descriptors built from the POSIX ACLs, so repeated
+ access checks and security queries don't re-read the ACLs and the
+ inheritance EA. One descriptor is kept per file, for the share and
+ security_info it was built for, and only used while the file's inode and
+ ctime are unchanged. Any chown, chmod, ACL or EA change moves the ctime.
+ Both callers validate against a stat taken just before the lookup, never
+ a stat passed in from elsewhere.
+****************************************************************************/
+
+struct nt_acl_cache_hdr {
+	SMB_INO_T ino;
+	struct timespec ctime;
+	int snum;
+	uint32_t security_info;
+};
+
+static bool nt_acl_cache_lookup(struct connection_struct *conn,
+				const SMB_STRUCT_STAT *sbuf,
+				uint32_t security_info,
+				SEC_DESC **ppdesc)
+{
+	struct file_id id = vfs_file_id_from_sbuf(conn, sbuf);
+	struct timespec ctime = get_ctimespec(sbuf);
+	struct nt_acl_cache_hdr hdr;
+	DATA_BLOB val;
+
+	if (!memcache_lookup(smbd_memcache(), NT_ACL_CACHE,
+			     data_blob_const(&id, sizeof(id)), &val)
+	    || (val.length < sizeof(hdr))) {
+		return False;
+	}
+	memcpy(&hdr, val.data, sizeof(hdr));
+
+	if ((hdr.ino != sbuf->st_ino)
+	    || (timespec_compare(&hdr.ctime, &ctime) != 0)) {
+		memcache_delete(smbd_memcache(), NT_ACL_CACHE,
+				data_blob_const(&id, sizeof(id)));
+		return False;
+	}
+	if ((hdr.snum != SNUM(conn)) || (hdr.security_info != security_info)) {
+		return False;
+	}
+
+	if (!NT_STATUS_IS_OK(unmarshall_sec_desc(talloc_tos(),
+						 val.data + sizeof(hdr),
+						 val.length - sizeof(hdr),
+						 ppdesc))) {
+		*ppdesc = NULL;
+		return False;
+	}
+	return True;
+}
+
+static void nt_acl_cache_add(struct connection_struct *conn,
+			     const SMB_STRUCT_STAT *sbuf,
+			     uint32_t security_info,
+			     SEC_DESC *psd)
+{
+	struct file_id id = vfs_file_id_from_sbuf(conn, sbuf);
+	struct nt_acl_cache_hdr hdr;
+	uint8 *data = NULL;
+	uint8 *buf;
+	size_t len = 0;
+
+	ZERO_STRUCT(hdr);
+	hdr.ino = sbuf->st_ino;
+	hdr.ctime = get_ctimespec(sbuf);
+	hdr.snum = SNUM(conn);
+	hdr.security_info = security_info;
+
+	/* A change in the same clock tick would not move the ctime. */
+	if (hdr.ctime.tv_sec >= time(NULL) - 1) {
+		return;
+	}
+
+	if (!NT_STATUS_IS_OK(marshall_sec_desc(talloc_tos(), psd,
+					       &data, &len))) {
+		return;
+	}
+
+	buf = TALLOC_ARRAY(talloc_tos(), uint8, sizeof(hdr) + len);
+	if (buf != NULL) {
+		memcpy(buf, &hdr, sizeof(hdr));
+		memcpy(buf + sizeof(hdr), data, len);
+		memcache_add(smbd_memcache(), NT_ACL_CACHE,
+			     data_blob_const(&id, sizeof(id)),
+			     data_blob_const(buf, sizeof(hdr) + len));
+	}
+	TALLOC_FREE(buf);
+	TALLOC_FREE(data);
+}
+
 NTSTATUS posix_fget_nt_acl(struct files_struct *fsp, uint32_t security_info,
 			   SEC_DESC **ppdesc)
 {
 	SMB_STRUCT_STAT sbuf;
 	SMB_ACL_T posix_acl = NULL;
 	struct pai_val *pal;
+	NTSTATUS status;
 
 	*ppdesc = NULL;
 
@@ -3251,13 +3345,24 @@ NTSTATUS posix_fget_nt_acl(struct files_struct *fsp, uint32_t security_info,
 		return map_nt_error_from_unix(errno);
 	}
 
+	if (nt_acl_cache_lookup(fsp->conn, &sbuf, security_info, ppdesc)) {
+		DEBUG(10,("posix_fget_nt_acl: cached for file %s\n",
+			  fsp->fsp_name));
+		return NT_STATUS_OK;
+	}
+
 	/* Get the ACL from the fd. */
 	posix_acl = SMB_VFS_SYS_ACL_GET_FD(fsp);
 
 	pal = fload_inherited_info(fsp);
 
-	return posix_get_nt_acl_common(fsp->conn, fsp->fsp_name, &sbuf, pal,
-				       posix_acl, NULL, security_info, ppdesc);
+	status = posix_get_nt_acl_common(fsp->conn, fsp->fsp_name, &sbuf, pal,
+					 posix_acl, NULL, security_info,
+					 ppdesc);
+	if (NT_STATUS_IS_OK(status) && (*ppdesc != NULL)) {
+		nt_acl_cache_add(fsp->conn, &sbuf, security_info, *ppdesc);
+	}
+	return status;
 }
 
 NTSTATUS posix_get_nt_acl(struct connection_struct *conn, const char *name,
@@ -3267,6 +3372,7 @@ NTSTATUS posix_get_nt_acl(struct connection_struct *conn, const char *name,
 	SMB_ACL_T posix_acl = NULL;
 	SMB_ACL_T def_acl = NULL;
 	struct pai_val *pal;
+	NTSTATUS status;
 
 	*ppdesc = NULL;
 
@@ -3277,6 +3383,11 @@ NTSTATUS posix_get_nt_acl(struct connection_struct *conn, const char *name,
 		return map_nt_error_from_unix(errno);
 	}
 
+	if (nt_acl_cache_lookup(conn, &sbuf, security_info, ppdesc)) {
+		DEBUG(10,("posix_get_nt_acl: cached for file %s\n", name));
+		return NT_STATUS_OK;
+	}
+
 	/* Get the ACL from the path. */
 	posix_acl = SMB_VFS_SYS_ACL_GET_FILE(conn, name, SMB_ACL_TYPE_ACCESS);
 
@@ -3288,8 +3399,12 @@ NTSTATUS posix_get_nt_acl(struct connection_struct *conn, const char *name,
 
 	pal = load_inherited_info(conn, name);
 
-	return posix_get_nt_acl_common(conn, name, &sbuf, pal, posix_acl,
-				       def_acl, security_info, ppdesc);
+	status = posix_get_nt_acl_common(conn, name, &sbuf, pal, posix_acl,
+					 def_acl, security_info, ppdesc);
+	if (NT_STATUS_IS_OK(status) && (*ppdesc != NULL)) {
+		nt_acl_cache_add(conn, &sbuf, security_info, *ppdesc);
+	}
+	return status;
 }
 
 /****************************************************************************
@@ -3598,6 +3713,10 @@ NTSTATUS set_nt_acl(files_struct *fsp, uint32 security_info_sent, const SEC_DESC
 		return NT_STATUS_MEDIA_WRITE_PROTECTED;
 	}
 
+	/* Whatever we change below, don't hand out the old descriptor. */
+	memcache_delete(smbd_memcache(), NT_ACL_CACHE,
+			data_blob_const(&fsp->file_id, sizeof(fsp->file_id)));
+
 	/*
 	 * Get the current state of the file.
 	 */
@@ -147,6 +147,197 @@ static NTSTATUS read_packet_remainder(int fd, char *buffer,
 				(2*14) + /* word count (including bcc) */ \
 				1 /* pad byte */)
 
+/*
+ * Signed writeX calls can't go straight from the socket to the disk:
+ * the MAC covers the payload and has to be checked first. We park the
+ * payload in a pipe (socket->pipe is a zero-copy splice), tee(2) it
+ * into a second pipe from which the MAC is calculated, and only after
+ * the MAC is good is the parked payload spliced into the file.
+ */
+
+#define SMBD_RECVFILE_PIPE_SIZE (1024*1024)
+
+#if defined(HAVE_LINUX_SPLICE)
+static void smbd_recvfile_close_pipes(struct smbd_server_connection *conn)
+{
+	int i;
+
+	sys_recvfile_set_pipe(-1);
+
+	for (i=0; i<2; i++) {
+		if (conn->recvfile.pipe_fd[i] != -1) {
+			close(conn->recvfile.pipe_fd[i]);
+			conn->recvfile.pipe_fd[i] = -1;
+		}
+		if (conn->recvfile.hash_fd[i] != -1) {
+			close(conn->recvfile.hash_fd[i]);
+			conn->recvfile.hash_fd[i] = -1;
+		}
+	}
+	conn->recvfile.pipe_size = 0;
+}
+#endif
+
+static bool smbd_recvfile_setup_pipes(struct smbd_server_connection *conn)
+{
+#if defined(HAVE_LINUX_SPLICE)
+	int size = -1;
+
+	if (conn->recvfile.pipe_size != 0) {
+		return true;
+	}
+	if (conn->recvfile.pipe_failed) {
+		return false;
+	}
+
+	if ((pipe(conn->recvfile.pipe_fd) == -1) ||
+	    (pipe(conn->recvfile.hash_fd) == -1)) {
+		DEBUG(1, ("smbd_recvfile_setup_pipes: pipe failed: %s\n",
+			  strerror(errno)));
+		goto fail;
+	}
+
+#if defined(F_SETPIPE_SZ) && defined(F_GETPIPE_SZ)
+	fcntl(conn->recvfile.pipe_fd[1], F_SETPIPE_SZ,
+	      SMBD_RECVFILE_PIPE_SIZE);
+	fcntl(conn->recvfile.hash_fd[1], F_SETPIPE_SZ,
+	      SMBD_RECVFILE_PIPE_SIZE);
+	size = MIN(fcntl(conn->recvfile.pipe_fd[1], F_GETPIPE_SZ),
+		   fcntl(conn->recvfile.hash_fd[1], F_GETPIPE_SZ));
+#endif
+	if (size <= 0) {
+		/* The traditional Linux pipe size. */
+		size = 65536;
+	}
+
+	conn->recvfile.pipe_size = size;
+	sys_recvfile_set_pipe(conn->recvfile.pipe_fd[0]);
+
+	DEBUG(10, ("smbd_recvfile_setup_pipes: pipe size %d\n", size));
+	return true;
+
+ fail:
+	smbd_recvfile_close_pipes(conn);
+	conn->recvfile.pipe_failed = true;
+#endif
+	return false;
+}
+
+/****************************************************************************
+ Can a writeX payload of "count" bytes on a signed connection be parked?
+****************************************************************************/
+
+static bool smbd_recvfile_can_park(struct smbd_server_connection *conn,
+				   size_t count)
+{
+	if (!smbd_recvfile_setup_pipes(conn)) {
+		return false;
+	}
+	return count <= conn->recvfile.pipe_size;
+}
+
+/****************************************************************************
+ Move a signed writeX payload from the socket into our pipe and tee it
+ for the MAC check. *complete is only set if all of it made it into both
+ pipes, otherwise the caller has to pull the *parked bytes back out of
+ the pipe and read the rest from the socket.
+****************************************************************************/
+
+static NTSTATUS smbd_recvfile_park(struct smbd_server_connection *conn,
+				   int fd, size_t count,
+				   size_t *parked, bool *complete)
+{
+	ssize_t ret;
+
+	*parked = 0;
+	*complete = false;
+
+	ret = sys_recvfile_park(fd, conn->recvfile.pipe_fd[1], count);
+	if (ret == -1) {
+		return map_nt_error_from_unix(errno);
+	}
+	*parked = ret;
+
+	if (*parked != count) {
+		DEBUG(10, ("smbd_recvfile_park: parked only %u of %u "
+			   "bytes\n", (unsigned int)*parked,
+			   (unsigned int)count));
+		return NT_STATUS_OK;
+	}
+
+	ret = sys_pipe_tee(conn->recvfile.pipe_fd[0],
+			   conn->recvfile.hash_fd[1], count);
+	if (ret != (ssize_t)count) {
+		DEBUG(10, ("smbd_recvfile_park: tee returned %d: %s\n",
+			   (int)ret, ret == -1 ? strerror(errno) : ""));
+		if ((ret > 0) &&
+		    (drain_socket(conn->recvfile.hash_fd[0], ret) != ret)) {
+			smb_panic("smbd_recvfile_park: could not empty "
+				  "hash pipe");
+		}
+		return NT_STATUS_OK;
+	}
+
+	*complete = true;
+	return NT_STATUS_OK;
+}
+
+static bool smbd_recvfile_read_pipe(int fd, char *buf, size_t len)
+{
+	size_t nread = 0;
+
+	while (nread < len) {
+		ssize_t ret = sys_read(fd, buf + nread, len - nread);
+		if (ret <= 0) {
+			DEBUG(1, ("smbd_recvfile_read_pipe: read returned "
+				  "%d: %s\n", (int)ret, strerror(errno)));
+			return false;
+		}
+		nread += ret;
+	}
+	return true;
+}
+
+static bool smbd_recvfile_pull(void *private_data, uint8_t *buf, size_t len)
+{
+	struct smbd_server_connection *conn =
+		(struct smbd_server_connection *)private_data;
+
+	return smbd_recvfile_read_pipe(conn->recvfile.hash_fd[0],
+				       (char *)buf, len);
+}
+
+/****************************************************************************
+ Check the signature of a writeX whose payload is parked in our pipe.
+****************************************************************************/
+
+static bool smbd_recvfile_check_sign_mac(struct smbd_server_connection *conn,
+					 uint32_t *seqnum)
+{
+	bool ok;
+
+	ok = srv_check_sign_mac_pull(conn, (const char *)conn->recvfile.hdr,
+				     conn->recvfile.hdr_len,
+				     smbd_recvfile_pull, conn, seqnum);
+	TALLOC_FREE(conn->recvfile.hdr);
+	conn->recvfile.hdr_len = 0;
+	return ok;
+}
+
+/****************************************************************************
+ Return the fd the unread part of the current request has to be taken
+ from. That's the client socket unless the payload was parked.
+****************************************************************************/
+
+int smbd_unread_fd(void)
+{
+	if ((smbd_server_conn != NULL) &&
+	    (smbd_server_conn->recvfile.parked != 0)) {
+		return smbd_server_conn->recvfile.pipe_fd[0];
+	}
+	return smbd_server_fd();
+}
+
 static NTSTATUS receive_smb_raw_talloc_partial_read(TALLOC_CTX *mem_ctx,
 						    const char lenbuf[4],
 						    int fd, char **buffer,
@@ -158,6 +349,7 @@ static NTSTATUS receive_smb_raw_talloc_partial_read(TALLOC_CTX *mem_ctx,
 	char writeX_header[4 + STANDARD_WRITE_AND_X_HEADER_SIZE];
 	ssize_t len = smb_len_large(lenbuf); /* Could be a UNIX large writeX. */
 	ssize_t toread;
+	size_t parked = 0;
 	NTSTATUS status;
 
 	memcpy(writeX_header, lenbuf, 4);
@@ -185,7 +377,39 @@ static NTSTATUS receive_smb_raw_talloc_partial_read(TALLOC_CTX *mem_ctx,
 		uint16_t doff = SVAL(writeX_header,smb_vwv11);
 		ssize_t newlen;
 
-		if (doff > STANDARD_WRITE_AND_X_HEADER_SIZE) {
+		if (srv_is_signing_active(smbd_server_conn)) {
+			bool complete;
+
+			if (doff != STANDARD_WRITE_AND_X_HEADER_SIZE) {
+				/* Padding is signed too, don't bother. */
+				goto read_all;
+			}
+
+			status = smbd_recvfile_park(
+				smbd_server_conn, fd,
+				len - STANDARD_WRITE_AND_X_HEADER_SIZE,
+				&parked, &complete);
+			if (!NT_STATUS_IS_OK(status)) {
+				return status;
+			}
+			if (!complete) {
+				goto read_all;
+			}
+
+			/*
+			 * Keep the unmodified header for the MAC check
+			 * in receive_smb_talloc().
+			 */
+			smbd_server_conn->recvfile.hdr = (uint8_t *)TALLOC_MEMDUP(
+				smbd_server_conn, writeX_header,
+				sizeof(writeX_header));
+			if (smbd_server_conn->recvfile.hdr == NULL) {
+				return NT_STATUS_NO_MEMORY;
+			}
+			smbd_server_conn->recvfile.hdr_len =
+				sizeof(writeX_header);
+			smbd_server_conn->recvfile.parked = parked;
+		} else if (doff > STANDARD_WRITE_AND_X_HEADER_SIZE) {
 			size_t drain = doff - STANDARD_WRITE_AND_X_HEADER_SIZE;
 			if (drain_socket(smbd_server_fd(), drain) != drain) {
 	                        smb_panic("receive_smb_raw_talloc_partial_read:"
@@ -217,6 +441,8 @@ static NTSTATUS receive_smb_raw_talloc_partial_read(TALLOC_CTX *mem_ctx,
 		return NT_STATUS_OK;
 	}
 
+ read_all:
+
 	if (!valid_packet_size(len)) {
 		return NT_STATUS_INVALID_PARAMETER;
 	}
@@ -240,10 +466,22 @@ static NTSTATUS receive_smb_raw_talloc_partial_read(TALLOC_CTX *mem_ctx,
 		4 + STANDARD_WRITE_AND_X_HEADER_SIZE);
 	toread = len - STANDARD_WRITE_AND_X_HEADER_SIZE;
 
+	if (parked != 0) {
+		/* Pull back what we already moved into the pipe. */
+		if (!smbd_recvfile_read_pipe(
+			    smbd_server_conn->recvfile.pipe_fd[0],
+			    (*buffer) + 4 + STANDARD_WRITE_AND_X_HEADER_SIZE,
+			    parked)) {
+			smb_panic("receive_smb_raw_talloc_partial_read: "
+				  "failed to empty recvfile pipe");
+		}
+		toread -= parked;
+	}
+
 	if(toread > 0) {
 		status = read_packet_remainder(
-			fd, (*buffer) + 4 + STANDARD_WRITE_AND_X_HEADER_SIZE,
-			timeout, toread);
+			fd, (*buffer) + 4 + STANDARD_WRITE_AND_X_HEADER_SIZE
+			+ parked, timeout, toread);
 
 		if (!NT_STATUS_IS_OK(status)) {
 			DEBUG(10, ("receive_smb_raw_talloc_partial_read: %s\n",
@@ -276,7 +514,10 @@ static NTSTATUS receive_smb_raw_talloc(TALLOC_CTX *mem_ctx, int fd,
 	if (CVAL(lenbuf,0) == 0 && min_recv_size &&
 	    (smb_len_large(lenbuf) > /* Could be a UNIX large writeX. */
 		(min_recv_size + STANDARD_WRITE_AND_X_HEADER_SIZE)) &&
-	    !srv_is_signing_active(smbd_server_conn)) {
+	    (!srv_is_signing_active(smbd_server_conn) ||
+	     smbd_recvfile_can_park(smbd_server_conn,
+			smb_len_large(lenbuf) -
+			STANDARD_WRITE_AND_X_HEADER_SIZE))) {
 
 		return receive_smb_raw_talloc_partial_read(
 			mem_ctx, lenbuf, fd, buffer, timeout, p_unread, plen);
@@ -338,7 +579,13 @@ static NTSTATUS receive_smb_talloc(TALLOC_CTX *mem_ctx,	int fd,
 	}
 
 	/* Check the incoming SMB signature. */
-	if (!srv_check_sign_mac(smbd_server_conn, *buffer, seqnum)) {
+	if (smbd_server_conn->recvfile.hdr != NULL) {
+		if (!smbd_recvfile_check_sign_mac(smbd_server_conn, seqnum)) {
+			DEBUG(0, ("receive_smb: SMB Signature verification "
+				  "failed on incoming writeX!\n"));
+			return NT_STATUS_INVALID_NETWORK_RESPONSE;
+		}
+	} else if (!srv_check_sign_mac(smbd_server_conn, *buffer, seqnum)) {
 		DEBUG(0, ("receive_smb: SMB Signature verification failed on "
 			  "incoming packet!\n"));
 		return NT_STATUS_INVALID_NETWORK_RESPONSE;
@@ -1394,12 +1641,13 @@ static void construct_reply(char *inbuf, int size, size_t unread_bytes,
 
 	if (req->unread_bytes) {
 		/* writeX failed. drain socket. */
-		if (drain_socket(smbd_server_fd(), req->unread_bytes) !=
+		if (drain_socket(smbd_unread_fd(), req->unread_bytes) !=
 				req->unread_bytes) {
 			smb_panic("failed to drain pending bytes");
 		}
 		req->unread_bytes = 0;
 	}
+	smbd_server_conn->recvfile.parked = 0;
 
 	if (req->outbuf == NULL) {
 		return;
@@ -1973,6 +2221,9 @@ static bool housekeeping_fn(const struct timeval *now, void *private_data)
 	/* Change machine password if neccessary. */
 	attempt_machine_password_change();
 
+	/* Get rid of expired gencache entries. */
+	gencache_housekeeping();
+
         /*
 	 * Force a log file check.
 	 */
@@ -1994,6 +2245,10 @@ void smbd_process(void)
 	if (!smbd_server_conn) {
 		exit_server("failed to create smbd_server_connection");
 	}
+	smbd_server_conn->recvfile.pipe_fd[0] = -1;
+	smbd_server_conn->recvfile.pipe_fd[1] = -1;
+	smbd_server_conn->recvfile.hash_fd[0] = -1;
+	smbd_server_conn->recvfile.hash_fd[1] = -1;
 
 	/* Ensure child is set to blocking mode */
 	set_blocking(smbd_server_fd(),True);
@@ -72,11 +72,25 @@ struct messaging_context *smbd_messaging_context(void)
 struct memcache *smbd_memcache(void)
 {
 	if (!smbd_memcache_ctx) {
+		size_t max_size = lp_max_stat_cache_size()*1024;
+
 		smbd_memcache_ctx = memcache_init(talloc_autofree_context(),
-						  lp_max_stat_cache_size()*1024);
-	}
-	if (!smbd_memcache_ctx) {
-		smb_panic("Could not init smbd memcache");
+						  max_size);
+		if (!smbd_memcache_ctx) {
+			smb_panic("Could not init smbd memcache");
+		}
+
+		/*
+		 * The per-file caches churn with every directory listing,
+		 * don't let them push out the id mapping caches.
+		 */
+		max_size /= SMBD_MEMCACHE_FILE_CACHE_DIVISOR;
+		memcache_set_budget(smbd_memcache_ctx, DOS_ATTR_CACHE,
+				    max_size);
+		memcache_set_budget(smbd_memcache_ctx, NT_ACL_CACHE,
+				    max_size);
+		memcache_set_budget(smbd_memcache_ctx, MANGLE_HASH2_CACHE,
+				    max_size);
 	}
 
 	return smbd_memcache_ctx;
@@ -113,6 +127,28 @@ static void smb_stat_cache_delete(struct messaging_context *msg,
 	stat_cache_delete(name);
 }
 
+/*******************************************************************
+ Send back the memcache statistics.
+ ********************************************************************/
+
+static void msg_memcache_stats(struct messaging_context *msg,
+			       void *private_data,
+			       uint32_t msg_type,
+			       struct server_id server_id,
+			       DATA_BLOB *data)
+{
+	char *report;
+
+	report = memcache_report(talloc_tos(), smbd_memcache());
+	if (report == NULL) {
+		return;
+	}
+
+	messaging_send_buf(msg, server_id, MSG_MEMCACHE_STATS,
+			   (uint8 *)report, strlen(report)+1);
+	TALLOC_FREE(report);
+}
+
 /****************************************************************************
   Send a SIGTERM to our process group.
 *****************************************************************************/
@@ -629,6 +665,8 @@ static bool open_sockets_smbd(struct smbd_parent_context *parent,
 			   MSG_SMB_CONF_UPDATED, smb_conf_updated);
 	messaging_register(smbd_messaging_context(), NULL,
 			   MSG_SMB_STAT_CACHE_DELETE, smb_stat_cache_delete);
+	messaging_register(smbd_messaging_context(), NULL,
+			   MSG_REQ_MEMCACHE_STATS, msg_memcache_stats);
 	brl_register_msgs(smbd_messaging_context());
 
 #ifdef CLUSTER_SUPPORT
@@ -785,6 +823,9 @@ static void exit_server_common(enum server_exit_reason how,
 
 	change_to_root_user();
 
+	/* Don't lose level2 breaks still waiting to be batched. */
+	flush_level2_breaks();
+
 	if (negprot_global_auth_context) {
 		(negprot_global_auth_context->free)(&negprot_global_auth_context);
 	}
@@ -1288,6 +1288,11 @@ void close_cnum(connection_struct *conn, uint16 vuid)
 				 conn->client_address,
 				 lp_servicename(SNUM(conn))));
 
+	DEBUG(3, ("stat cache for %s: lookups=%u hits=%u misses=%u "
+		  "negative_hits=%u\n", lp_servicename(SNUM(conn)),
+		  conn->stat_cache_lookups, conn->stat_cache_hits,
+		  conn->stat_cache_misses, conn->stat_cache_negative_hits));
+
 	/* Call VFS disconnect hook */    
 	SMB_VFS_DISCONNECT(conn);
 
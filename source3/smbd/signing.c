@@ -41,6 +41,30 @@ bool srv_check_sign_mac(struct smbd_server_connection *conn,
 				     *seqnum);
 }
 
+/***********************************************************
+ Called to validate an incoming packet from the client of
+ which only the header is in memory, the rest is fetched
+ with pull_fn.
+************************************************************/
+
+bool srv_check_sign_mac_pull(struct smbd_server_connection *conn,
+			     const char *inbuf, size_t hdr_len,
+			     smb_signing_pull_fn pull_fn,
+			     void *private_data,
+			     uint32_t *seqnum)
+{
+	/* Check if it's a non-session message. */
+	if(CVAL(inbuf,0)) {
+		return true;
+	}
+
+	*seqnum = smb_signing_next_seqnum(conn->signing_state, false);
+	return smb_signing_check_pdu_pull(conn->signing_state,
+					  (const uint8_t *)inbuf, hdr_len,
+					  pull_fn, private_data,
+					  *seqnum);
+}
+
 /***********************************************************
  Called to sign an outgoing packet to the client.
 ************************************************************/
@@ -21,11 +21,38 @@
 */
 
 #include "includes.h"
+#include "smbd/globals.h"
 
 /****************************************************************************
  Stat cache code used in unix_convert.
 *****************************************************************************/
 
+/*
+ * Each tree connect has its own cache, the names in it are relative to
+ * the share root. It is bounded by "max stat cache size" and created on
+ * first use.
+ */
+
+static struct memcache *stat_cache_ctx(connection_struct *conn)
+{
+	if (conn->stat_cache == NULL) {
+		conn->stat_cache = memcache_init(
+			conn, lp_max_stat_cache_size()*1024);
+	}
+	return conn->stat_cache;
+}
+
+/*
+ * A negative entry says "name" was not in "dirpath" when the directory
+ * looked like this. Any change to the directory changes its mtime.
+ */
+
+struct stat_cache_negative {
+	struct timespec mtime;
+	SMB_DEV_T dev;
+	SMB_INO_T ino;
+};
+
 /**
  * Add an entry into the stat cache.
  *
@@ -38,20 +65,26 @@
  *
  */
 
-void stat_cache_add( const char *full_orig_name,
-		char *translated_path,
-		bool case_sensitive)
+void stat_cache_add(connection_struct *conn,
+		    const char *full_orig_name,
+		    char *translated_path)
 {
 	size_t translated_path_length;
 	char *original_path;
 	size_t original_path_length;
 	char saved_char;
 	TALLOC_CTX *ctx = talloc_tos();
+	bool case_sensitive = conn->case_sensitive;
+	struct memcache *cache;
 
 	if (!lp_stat_cache()) {
 		return;
 	}
 
+	if ((cache = stat_cache_ctx(conn)) == NULL) {
+		return;
+	}
+
 	/*
 	 * Don't cache trivial valid directory entries such as . and ..
 	 */
@@ -127,7 +160,7 @@ void stat_cache_add( const char *full_orig_name,
 	 */
 
 	memcache_add(
-		smbd_memcache(), STAT_CACHE,
+		cache, STAT_CACHE,
 		data_blob_const(original_path, original_path_length),
 		data_blob_const(translated_path, translated_path_length + 1));
 
@@ -175,6 +208,7 @@ bool stat_cache_lookup(connection_struct *conn,
 	DATA_BLOB data_val;
 	char *name;
 	TALLOC_CTX *ctx = talloc_tos();
+	struct memcache *cache;
 
 	*pp_dirpath = NULL;
 	*pp_start = *pp_name;
@@ -183,10 +217,15 @@ bool stat_cache_lookup(connection_struct *conn,
 		return False;
 	}
 
+	if ((cache = stat_cache_ctx(conn)) == NULL) {
+		return False;
+	}
+
 	name = *pp_name;
 	namelen = strlen(name);
 
 	DO_PROFILE_INC(statcache_lookups);
+	conn->stat_cache_lookups++;
 
 	/*
 	 * Don't lookup trivial valid directory entries.
@@ -225,7 +264,7 @@ bool stat_cache_lookup(connection_struct *conn,
 		data_val = data_blob_null;
 
 		if (memcache_lookup(
-			    smbd_memcache(), STAT_CACHE,
+			    cache, STAT_CACHE,
 			    data_blob_const(chk_name, strlen(chk_name)),
 			    &data_val)) {
 			break;
@@ -241,6 +280,7 @@ bool stat_cache_lookup(connection_struct *conn,
 			 * We reached the end of the name - no match.
 			 */
 			DO_PROFILE_INC(statcache_misses);
+			conn->stat_cache_misses++;
 			TALLOC_FREE(chk_name);
 			return False;
 		}
@@ -259,6 +299,7 @@ bool stat_cache_lookup(connection_struct *conn,
 		if ((*chk_name == '\0')
 		    || ISDOT(chk_name) || ISDOTDOT(chk_name)) {
 			DO_PROFILE_INC(statcache_misses);
+			conn->stat_cache_misses++;
 			TALLOC_FREE(chk_name);
 			return False;
 		}
@@ -273,10 +314,11 @@ bool stat_cache_lookup(connection_struct *conn,
 	DEBUG(10,("stat_cache_lookup: lookup succeeded for name [%s] "
 		  "-> [%s]\n", chk_name, translated_path ));
 	DO_PROFILE_INC(statcache_hits);
+	conn->stat_cache_hits++;
 
 	if (SMB_VFS_STAT(conn, translated_path, pst) != 0) {
 		/* Discard this entry - it doesn't exist in the filesystem. */
-		memcache_delete(smbd_memcache(), STAT_CACHE,
+		memcache_delete(cache, STAT_CACHE,
 				data_blob_const(chk_name, strlen(chk_name)));
 		TALLOC_FREE(chk_name);
 		TALLOC_FREE(translated_path);
@@ -326,6 +368,162 @@ bool stat_cache_lookup(connection_struct *conn,
 	return (namelen == translated_path_length);
 }
 
+/****************************************************************************
+ Build the key of a negative entry: the real directory path plus the
+ name the client asked for, uppercased unless we're case sensitive.
+*****************************************************************************/
+
+static char *stat_cache_negative_key(TALLOC_CTX *ctx,
+				     connection_struct *conn,
+				     const char *dirpath,
+				     const char *name)
+{
+	char *key;
+	char *p;
+
+	key = talloc_asprintf(ctx, "%s/%s", dirpath, name);
+	if (key == NULL) {
+		return NULL;
+	}
+	if (!conn->case_sensitive) {
+		p = key + strlen(dirpath) + 1;
+		strupper_m(p);
+	}
+	return key;
+}
+
+/**
+ * Remember that a name is not in a directory.
+ *
+ * @param conn    The connection the lookup was done on.
+ * @param dirpath The real path of the directory, relative to the share.
+ * @param name    The component that wasn't found.
+ * @param dir_st  The stat of dirpath taken *before* the directory was
+ *                searched, so a racing create makes the entry stale.
+ */
+
+void stat_cache_add_negative(connection_struct *conn,
+			     const char *dirpath,
+			     const char *name,
+			     const SMB_STRUCT_STAT *dir_st)
+{
+	struct stat_cache_negative neg;
+	struct memcache *cache;
+	char *key;
+	int saved_errno = errno;
+
+	if (!lp_stat_cache() || !VALID_STAT(*dir_st)) {
+		return;
+	}
+
+	if ((*name == '\0') || ISDOT(name) || ISDOTDOT(name)) {
+		return;
+	}
+
+	ZERO_STRUCT(neg);
+	neg.mtime = get_mtimespec(dir_st);
+	neg.dev = dir_st->st_dev;
+	neg.ino = dir_st->st_ino;
+
+	/*
+	 * With coarse timestamps a change in the same second as the
+	 * one we stat'ed would not move the mtime. Wait until the
+	 * directory has been quiet for a moment.
+	 */
+
+	if (neg.mtime.tv_sec >= time(NULL) - 1) {
+		return;
+	}
+
+	if ((cache = stat_cache_ctx(conn)) == NULL) {
+		return;
+	}
+
+	key = stat_cache_negative_key(talloc_tos(), conn, dirpath, name);
+	if (key == NULL) {
+		return;
+	}
+
+	memcache_add(cache, STAT_CACHE_NEGATIVE,
+		     data_blob_const(key, strlen(key)),
+		     data_blob_const(&neg, sizeof(neg)));
+
+	DEBUG(10,("stat_cache_add_negative: %s\n", key));
+
+	TALLOC_FREE(key);
+	errno = saved_errno;
+}
+
+/**
+ * Look for a negative entry.
+ *
+ * @param conn    The connection to do the stat() with.
+ * @param dirpath The real path of the directory, relative to the share.
+ * @param name    The component we are looking for.
+ * @param dir_st  Filled in with the stat of dirpath, invalid if that fails.
+ *
+ * @return True if name is known not to exist in dirpath.
+ */
+
+bool stat_cache_lookup_negative(connection_struct *conn,
+				const char *dirpath,
+				const char *name,
+				SMB_STRUCT_STAT *dir_st)
+{
+	struct stat_cache_negative neg;
+	struct memcache *cache;
+	struct timespec mtime;
+	DATA_BLOB data_val;
+	char *key;
+	bool ret = False;
+
+	SET_STAT_INVALID(*dir_st);
+
+	if (!lp_stat_cache()) {
+		return False;
+	}
+
+	if (SMB_VFS_STAT(conn, (*dirpath != '\0') ? dirpath : ".",
+			 dir_st) != 0) {
+		SET_STAT_INVALID(*dir_st);
+		return False;
+	}
+
+	if ((cache = stat_cache_ctx(conn)) == NULL) {
+		return False;
+	}
+
+	key = stat_cache_negative_key(talloc_tos(), conn, dirpath, name);
+	if (key == NULL) {
+		return False;
+	}
+
+	if (!memcache_lookup(cache, STAT_CACHE_NEGATIVE,
+			     data_blob_const(key, strlen(key)), &data_val)
+	    || (data_val.length != sizeof(neg))) {
+		TALLOC_FREE(key);
+		return False;
+	}
+
+	memcpy(&neg, data_val.data, sizeof(neg));
+	mtime = get_mtimespec(dir_st);
+
+	if ((timespec_compare(&neg.mtime, &mtime) == 0) &&
+	    (neg.dev == dir_st->st_dev) && (neg.ino == dir_st->st_ino)) {
+		DEBUG(10,("stat_cache_lookup_negative: hit for %s\n", key));
+		DO_PROFILE_INC(statcache_negative_hits);
+		conn->stat_cache_negative_hits++;
+		ret = True;
+	} else {
+		/* The directory changed under us. */
+		memcache_delete(cache, STAT_CACHE_NEGATIVE,
+				data_blob_const(key, strlen(key)));
+	}
+
+	TALLOC_FREE(key);
+	return ret;
+}
+
 /***************************************************************************
  Tell all smbd's to delete an entry.
 **************************************************************************/
@@ -348,6 +546,7 @@ void send_stat_cache_delete_message(const char *name)
 void stat_cache_delete(const char *name)
 {
 	char *lname = talloc_strdup_upper(talloc_tos(), name);
+	connection_struct *conn;
 
 	if (!lname) {
 		return;
@@ -355,8 +554,15 @@ void stat_cache_delete(const char *name)
 	DEBUG(10,("stat_cache_delete: deleting name [%s] -> %s\n",
 			lname, name ));
 
-	memcache_delete(smbd_memcache(), STAT_CACHE,
-			data_blob_const(lname, talloc_get_size(lname)-1));
+	/* We don't know which share the name is relative to. */
+	for (conn = Connections; conn; conn = conn->next) {
+		if (conn->stat_cache == NULL) {
+			continue;
+		}
+		memcache_delete(conn->stat_cache, STAT_CACHE,
+				data_blob_const(lname,
+						talloc_get_size(lname)-1));
+	}
 	TALLOC_FREE(lname);
 }
 
@@ -382,10 +588,15 @@ unsigned int fast_string_hash(TDB_DATA *key)
 
 bool reset_stat_cache( void )
 {
+	connection_struct *conn;
+
 	if (!lp_stat_cache())
 		return True;
 
-	memcache_flush(smbd_memcache(), STAT_CACHE);
+	for (conn = Connections; conn; conn = conn->next) {
+		/* Pick up a changed "max stat cache size". */
+		TALLOC_FREE(conn->stat_cache);
+	}
 
 	return True;
 }
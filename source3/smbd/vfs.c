@@ -448,7 +448,7 @@ ssize_t vfs_write_data(struct smb_request *req,
 		/* VFS_RECVFILE must drain the socket
 		 * before returning. */
 		req->unread_bytes = 0;
-		return SMB_VFS_RECVFILE(smbd_server_fd(),
+		return SMB_VFS_RECVFILE(smbd_unread_fd(),
 					fsp,
 					(SMB_OFF_T)-1,
 					N);
@@ -481,7 +481,7 @@ ssize_t vfs_pwrite_data(struct smb_request *req,
 		/* VFS_RECVFILE must drain the socket
 		 * before returning. */
 		req->unread_bytes = 0;
-		return SMB_VFS_RECVFILE(smbd_server_fd(),
+		return SMB_VFS_RECVFILE(smbd_unread_fd(),
 					fsp,
 					offset,
 					N);
@@ -24,6 +24,9 @@
 
 static int pong_count;
 
+/* Receivers for the group send test */
+#define NUM_CHILDREN 16
+
 
 /****************************************************************************
 a useful function for testing the message system
@@ -49,7 +52,12 @@ static void pong_message(struct messaging_context *msg_ctx,
 	load_case_tables();
 
 	setup_logging(argv[0],True);
-	
+
+	if (is_default_dyn_CONFIGFILE()) {
+		if(getenv("SMB_CONF_PATH")) {
+			set_dyn_CONFIGFILE(getenv("SMB_CONF_PATH"));
+		}
+	}
 	lp_load(get_dyn_CONFIGFILE(),False,False,False,True);
 
 	if (!(evt_ctx = tevent_context_init(NULL)) ||
@@ -81,7 +89,7 @@ static void pong_message(struct messaging_context *msg_ctx,
 		}
 	}
 
-	/* Now test that the duplicate filtering code works. */
+	/* Now test that messages to ourselves arrive, each of them. */
 	pong_count = 0;
 
 	safe_strcpy(buf, "1234567890", sizeof(buf)-1);
@@ -93,15 +101,144 @@ static void pong_message(struct messaging_context *msg_ctx,
 				   (uint8 *)buf, 11);
 	}
 
-	for (i=0;i<n;i++) {
+	/* One wakeup may deliver several messages */
+	while (pong_count < 2*n) {
 		ret = tevent_loop_once(evt_ctx);
 		if (ret != 0) {
 			break;
 		}
 	}
 
-	if (pong_count != 2) {
-		fprintf(stderr, "Duplicate filter failed (%d).\n", pong_count);
+	if (pong_count != 2*n) {
+		fprintf(stderr, "Self ping test failed (%d).\n", pong_count);
+	}
+
+	/* Latency testing, one message in flight at a time */
+
+	pong_count = 0;
+
+	{
+		struct timeval tv = timeval_current();
+
+		for (i=0;i<n*100;i++) {
+			messaging_send_buf(msg_ctx, pid_to_procid(pid),
+					   MSG_PING, (uint8 *)buf, 11);
+			while (pong_count <= i) {
+				ret = tevent_loop_once(evt_ctx);
+				if (ret != 0) {
+					break;
+				}
+			}
+		}
+
+		printf("average round trip of %.1f usecs\n",
+		       timeval_elapsed(&tv) * 1000000 / (n*100));
+	}
+
+	/* Group sends to a number of child processes */
+
+	pong_count = 0;
+
+	{
+		struct server_id children[NUM_CHILDREN];
+		NTSTATUS statuses[NUM_CHILDREN];
+		struct timeval tv;
+		int j, mode, num_msgs = n*10;
+
+		for (i=0; i<NUM_CHILDREN; i++) {
+			pid_t child = sys_fork();
+
+			if (child == -1) {
+				fprintf(stderr, "fork failed: %s\n",
+					strerror(errno));
+				exit(1);
+			}
+			if (child == 0) {
+				/*
+				 * Start from scratch, an epoll handle
+				 * reopened after fork would still see the
+				 * parent's messaging socket.
+				 */
+				TALLOC_FREE(msg_ctx);
+				TALLOC_FREE(evt_ctx);
+				if (!(evt_ctx = tevent_context_init(NULL)) ||
+				    !(msg_ctx = messaging_init(
+					      NULL, server_id_self(),
+					      evt_ctx))) {
+					exit(1);
+				}
+				/* Tell the parent we're listening */
+				messaging_send(msg_ctx,
+					       pid_to_procid(getppid()),
+					       MSG_PONG, &data_blob_null);
+				while (tevent_loop_once(evt_ctx) == 0) {
+					;
+				}
+				exit(0);
+			}
+			children[i] = pid_to_procid(child);
+		}
+
+		while (pong_count < NUM_CHILDREN) {
+			ret = tevent_loop_once(evt_ctx);
+			if (ret != 0) {
+				break;
+			}
+		}
+
+		/* One message to all of them in flight at a time */
+
+		for (mode=0; mode<2; mode++) {
+			const char *name = (mode == 0) ? "one by one" : "group";
+			double sending = 0;
+
+			pong_count = 0;
+			tv = timeval_current();
+
+			for (j=0; j<num_msgs; j++) {
+				struct timeval start = timeval_current();
+
+				if (mode == 0) {
+					for (i=0; i<NUM_CHILDREN; i++) {
+						messaging_send(
+							msg_ctx, children[i],
+							MSG_PING,
+							&data_blob_null);
+					}
+				} else {
+					messaging_send_multi(
+						msg_ctx, children,
+						NUM_CHILDREN, MSG_PING,
+						&data_blob_null, statuses);
+				}
+
+				sending += timeval_elapsed(&start);
+
+				while (timeval_elapsed(&tv) < 30
+				       && pong_count < (j+1)*NUM_CHILDREN) {
+					ret = tevent_loop_once(evt_ctx);
+					if (ret != 0) {
+						break;
+					}
+				}
+			}
+
+			if (pong_count != num_msgs*NUM_CHILDREN) {
+				fprintf(stderr, "%s test failed! received %d, "
+					"sent %d\n", name, pong_count,
+					num_msgs*NUM_CHILDREN);
+			}
+
+			printf("%s send to %d processes: %.1f usecs, "
+			       "all replies after %.1f usecs\n", name,
+			       NUM_CHILDREN, sending * 1000000 / num_msgs,
+			       timeval_elapsed(&tv) * 1000000 / num_msgs);
+		}
+
+		for (i=0; i<NUM_CHILDREN; i++) {
+			kill(procid_to_pid(&children[i]), SIGTERM);
+			waitpid(procid_to_pid(&children[i]), NULL, 0);
+		}
 	}
 
 	/* Speed testing */
@@ -3,6 +3,9 @@
  * Copyright (C) 2003 by Andrew Bartlett
  *
  * Test harness for push_ucs2
+ *
+ * With a COUNT it also reports how long push_ucs2() and pull_ucs2() take
+ * for the string, to benchmark the conversion fast paths.
  */
 
 #include "includes.h"
@@ -28,6 +31,34 @@ static int check_push_ucs2(const char *orig)
 	return ret;
 }
 
+static void bench_ucs2(const char *orig, int count)
+{
+	smb_ucs2_t buf[1024];
+	char back[1024];
+	struct timeval start;
+	double secs;
+	size_t len = 0;
+	int i;
+
+	start = timeval_current();
+	for (i = 0; i < count; i++) {
+		len = push_ucs2(NULL, buf, orig, sizeof(buf),
+				STR_TERMINATE|STR_NOALIGN);
+	}
+	secs = timeval_elapsed(&start);
+	fprintf(stderr, "push_ucs2: %d calls in %.3f secs, %.1f ns/call\n",
+		count, secs, secs * 1e9 / count);
+
+	start = timeval_current();
+	for (i = 0; i < count; i++) {
+		pull_ucs2(NULL, back, buf, sizeof(back), len,
+			  STR_TERMINATE|STR_NOALIGN);
+	}
+	secs = timeval_elapsed(&start);
+	fprintf(stderr, "pull_ucs2: %d calls in %.3f secs, %.1f ns/call\n",
+		count, secs, secs * 1e9 / count);
+}
+
 int main(int argc, char *argv[])
 {
 	int i, ret = 0;
@@ -49,6 +80,9 @@ int main(int argc, char *argv[])
 	for (i = 0; ((i < count) && (!ret)); i++)
 		ret = check_push_ucs2(argv[1]);
 
+	if (count > 1)
+		bench_ucs2(argv[1], count);
+
 	printf("%d\n", ret);
 	
 	return 0;
@@ -2,6 +2,9 @@
  * Copyright (C) 2003 by Martin Pool
  *
  * Test harness for StrCaseCmp
+ *
+ * With ITERS it also reports how long a StrCaseCmp() call takes, to
+ * benchmark the case insensitive compare.
  */
 
 #include "includes.h"
@@ -10,6 +13,8 @@ int main(int argc, char *argv[])
 {
 	int i, ret;
 	int iters = 1;
+	struct timeval start;
+	double secs;
 	
 	/* Needed to initialize character set */
 	lp_load("/dev/null", True, False, False, True);
@@ -23,10 +28,16 @@ int main(int argc, char *argv[])
 	if (argc >= 4)
 		iters = atoi(argv[3]);
 
+	start = timeval_current();
 	for (i = 0; i < iters; i++)
 		ret = StrCaseCmp(argv[1], argv[2]);
+	secs = timeval_elapsed(&start);
 
 	printf("%d\n", ret);
+	if (iters > 1) {
+		fprintf(stderr, "StrCaseCmp: %d calls in %.3f secs, "
+			"%.1f ns/call\n", iters, secs, secs * 1e9 / iters);
+	}
 	
 	return 0;
 }
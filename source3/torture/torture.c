@@ -19,6 +19,10 @@
 
 #include "includes.h"
 #include "wbc_async.h"
+#ifdef CLUSTER_SUPPORT
+#include "ctdb.h"
+#include "ctdb_private.h"
+#endif
 
 extern char *optarg;
 extern int optind;
@@ -5233,280 +5237,3937 @@ static bool run_windows_write(int dummy)
 	return ret;
 }
 
-static bool run_cli_echo(int dummy)
-{
-	struct cli_state *cli;
-	NTSTATUS status;
-
-	printf("starting cli_echo test\n");
-	if (!torture_open_connection(&cli, 0)) {
-		return false;
-	}
-	cli_sockopt(cli, sockops);
+/*
+ * Large write/read throughput. Run against a server with and without
+ * "min receivefile size", and with client signing on and off, to
+ * compare the server receive paths. The data is verified on read back.
+ */
 
-	status = cli_echo(cli, 5, data_blob_const("hello", 5));
+struct bench_rw_state {
+	const char *buf;
+	size_t left;
+};
 
-	d_printf("cli_echo returned %s\n", nt_errstr(status));
+static size_t bench_rw_source(uint8_t *buf, size_t n, void *priv)
+{
+	struct bench_rw_state *state = (struct bench_rw_state *)priv;
+	size_t thistime = MIN(state->left, n);
 
-	torture_close_connection(cli);
-	return NT_STATUS_IS_OK(status);
+	memcpy(buf, state->buf, thistime);
+	state->buf += thistime;
+	state->left -= thistime;
+	return thistime;
 }
 
-static bool run_uid_regression_test(int dummy)
+static bool run_bench_readwrite(int dummy)
 {
-	static struct cli_state *cli;
-	int16_t old_vuid;
-	bool correct = True;
-
-	printf("starting uid regression test\n");
+	struct cli_state *cli1;
+	int fnum;
+	int i;
+	bool ret = false;
+	const char *fname = "\\bench_rw.dat";
+	char *buf = NULL;
+	char *rbuf = NULL;
+	double seconds;
+	double kbytes;
 
-	if (!torture_open_connection(&cli, 0)) {
+	printf("starting bench_readwrite test\n");
+	if (!torture_open_connection(&cli1, 0)) {
 		return False;
 	}
 
-	cli_sockopt(cli, sockops);
+	cli_sockopt(cli1, sockops);
 
-	/* Ok - now save then logoff our current user. */
-	old_vuid = cli->vuid;
+	printf("signing is %s\n", client_is_signing_on(cli1) ? "on" : "off");
 
-	if (!cli_ulogoff(cli)) {
-		d_printf("(%s) cli_ulogoff failed: %s\n",
-			__location__, cli_errstr(cli));
-		correct = false;
-		goto out;
+	buf = SMB_MALLOC_ARRAY(char, torture_blocksize);
+	rbuf = SMB_MALLOC_ARRAY(char, torture_blocksize);
+	if ((buf == NULL) || (rbuf == NULL)) {
+		printf("malloc failed\n");
+		goto fail;
 	}
 
-	cli->vuid = old_vuid;
+	cli_unlink(cli1, fname);
 
-	/* Try an operation. */
-	if (!NT_STATUS_IS_OK(cli_mkdir(cli, "\\uid_reg_test"))) {
-		/* We expect bad uid. */
-		if (!check_error(__LINE__, cli, ERRSRV, ERRbaduid,
-				NT_STATUS_NO_SUCH_USER)) {
-			return False;
-		}
-		goto out;
+	fnum = cli_open(cli1, fname, O_RDWR|O_CREAT|O_EXCL, DENY_NONE);
+	if (fnum == -1) {
+		printf("open failed (%s)\n", cli_errstr(cli1));
+		goto fail;
 	}
 
-	cli_rmdir(cli, "\\uid_reg_test");
+	for (i=0; i<torture_blocksize; i++) {
+		buf[i] = (char)(i * 7);
+	}
 
-  out:
+	kbytes = (double)torture_blocksize * torture_numops;
+	kbytes /= 1024;
 
-	torture_close_connection(cli);
-	return correct;
-}
+	start_timer();
 
-static bool run_local_substitute(int dummy)
-{
-	bool ok = true;
+	for (i=0; i<torture_numops; i++) {
+		struct bench_rw_state state;
+		NTSTATUS status;
 
-	ok &= subst_test("%U", "bla", "", -1, -1, "bla");
-	ok &= subst_test("%u%U", "bla", "", -1, -1, "blabla");
-	ok &= subst_test("%g", "", "", -1, -1, "NO_GROUP");
-	ok &= subst_test("%G", "", "", -1, -1, "NO_GROUP");
-	ok &= subst_test("%g", "", "", -1, 0, gidtoname(0));
-	ok &= subst_test("%G", "", "", -1, 0, gidtoname(0));
-	ok &= subst_test("%D%u", "u", "dom", -1, 0, "domu");
-	ok &= subst_test("%i %I", "", "", -1, -1, "0.0.0.0 0.0.0.0");
+		SCVAL(buf, 0, i);
+		state.buf = buf;
+		state.left = torture_blocksize;
 
-	/* Different captialization rules in sub_basic... */
+		status = cli_push(cli1, fnum, 0, (off_t)i * torture_blocksize,
+				  torture_blocksize, bench_rw_source, &state);
+		if (!NT_STATUS_IS_OK(status)) {
+			printf("cli_push returned: %s\n", nt_errstr(status));
+			goto close;
+		}
+	}
 
-	ok &=  (strcmp(talloc_sub_basic(talloc_tos(), "BLA", "dom", "%U%D"),
-		       "blaDOM") == 0);
+	seconds = end_timer();
+	printf("Wrote %d kbytes in %.2f seconds: %d kb/sec\n", (int)kbytes,
+	       seconds, (int)(kbytes/seconds));
 
-	return ok;
+	start_timer();
+
+	for (i=0; i<torture_numops; i++) {
+		if (cli_read(cli1, fnum, rbuf, (off_t)i * torture_blocksize,
+			     torture_blocksize) != torture_blocksize) {
+			printf("cli_read failed: %s\n", cli_errstr(cli1));
+			goto close;
+		}
+		SCVAL(buf, 0, i);
+		if (memcmp(buf, rbuf, torture_blocksize) != 0) {
+			printf("data mismatch in block %d\n", i);
+			goto close;
+		}
+	}
+
+	seconds = end_timer();
+	printf("Read %d kbytes in %.2f seconds: %d kb/sec\n", (int)kbytes,
+	       seconds, (int)(kbytes/seconds));
+
+	ret = true;
+ close:
+	cli_close(cli1, fnum);
+	cli_unlink(cli1, fname);
+ fail:
+	SAFE_FREE(buf);
+	SAFE_FREE(rbuf);
+	torture_close_connection(cli1);
+	return ret;
 }
 
-static bool run_local_gencache(int dummy)
+/*
+ * Small random writes under an exclusive oplock, the pattern the
+ * server "write cache size" cache is there for. Random reads are mixed
+ * in and checked against a local copy, as is the whole file at the end.
+ */
+
+static bool run_bench_smallwrite(int dummy)
 {
-	char *val;
-	time_t tm;
-	DATA_BLOB blob;
+	struct cli_state *cli1;
+	int fnum;
+	int i;
+	bool ret = false;
+	const char *fname = "\\bench_sw.dat";
+	char *shadow = NULL;
+	char *rbuf = NULL;
+	char wbuf[4096];
+	double seconds;
 
-	if (!gencache_init()) {
-		d_printf("%s: gencache_init() failed\n", __location__);
+	printf("starting bench_smallwrite test\n");
+	if (!torture_open_connection(&cli1, 0)) {
 		return False;
 	}
 
-	if (!gencache_set("foo", "bar", time(NULL) + 1000)) {
-		d_printf("%s: gencache_set() failed\n", __location__);
-		return False;
-	}
+	cli_sockopt(cli1, sockops);
 
-	if (!gencache_get("foo", &val, &tm)) {
-		d_printf("%s: gencache_get() failed\n", __location__);
-		return False;
+	shadow = SMB_CALLOC_ARRAY(char, torture_blocksize);
+	rbuf = SMB_MALLOC_ARRAY(char, torture_blocksize);
+	if ((shadow == NULL) || (rbuf == NULL)) {
+		printf("malloc failed\n");
+		goto fail;
 	}
 
-	if (strcmp(val, "bar") != 0) {
-		d_printf("%s: gencache_get() returned %s, expected %s\n",
-			 __location__, val, "bar");
-		SAFE_FREE(val);
-		return False;
+	cli_unlink(cli1, fname);
+
+	cli1->use_oplocks = True;
+	fnum = cli_open(cli1, fname, O_RDWR|O_CREAT|O_EXCL, DENY_NONE);
+	cli1->use_oplocks = False;
+	if (fnum == -1) {
+		printf("open failed (%s)\n", cli_errstr(cli1));
+		goto fail;
 	}
 
-	SAFE_FREE(val);
+	srandom(1);
 
-	if (!gencache_del("foo")) {
-		d_printf("%s: gencache_del() failed\n", __location__);
-		return False;
-	}
-	if (gencache_del("foo")) {
-		d_printf("%s: second gencache_del() succeeded\n",
-			 __location__);
-		return False;
-	}
-			
-	if (gencache_get("foo", &val, &tm)) {
-		d_printf("%s: gencache_get() on deleted entry "
-			 "succeeded\n", __location__);
-		return False;
-	}
+	start_timer();
 
-	blob = data_blob_string_const_null("bar");
-	tm = time(NULL);
+	for (i=0; i<torture_numops; i++) {
+		size_t len = ((unsigned)sys_random() % sizeof(wbuf)) + 1;
+		off_t ofs = (unsigned)sys_random() % (torture_blocksize - len);
+		int j;
 
-	if (!gencache_set_data_blob("foo", &blob, tm)) {
-		d_printf("%s: gencache_set_data_blob() failed\n", __location__);
-		return False;
-	}
+		for (j=0; j<len; j++) {
+			wbuf[j] = (char)sys_random();
+		}
+		memcpy(shadow + ofs, wbuf, len);
 
-	data_blob_free(&blob);
+		if (cli_write(cli1, fnum, 0, wbuf, ofs, len) != len) {
+			printf("cli_write failed: %s\n", cli_errstr(cli1));
+			goto close;
+		}
 
-	if (!gencache_get_data_blob("foo", &blob, NULL)) {
-		d_printf("%s: gencache_get_data_blob() failed\n", __location__);
-		return False;
-	}
+		if ((i % 16) == 15) {
+			len = ((unsigned)sys_random() % sizeof(wbuf)) + 1;
+			ofs = (unsigned)sys_random() % (torture_blocksize - len);
 
-	if (strcmp((const char *)blob.data, "bar") != 0) {
-		d_printf("%s: gencache_get_data_blob() returned %s, expected %s\n",
-			 __location__, (const char *)blob.data, "bar");
-		data_blob_free(&blob);
-		return False;
+			if (cli_read(cli1, fnum, rbuf, ofs, len) != len) {
+				printf("cli_read failed: %s\n",
+				       cli_errstr(cli1));
+				goto close;
+			}
+			if (memcmp(rbuf, shadow + ofs, len) != 0) {
+				printf("data mismatch reading %u bytes at "
+				       "%u after write %d\n", (unsigned)len,
+				       (unsigned)ofs, i);
+				goto close;
+			}
+		}
 	}
 
-	data_blob_free(&blob);
+	seconds = end_timer();
+	printf("%d small writes in %.2f seconds: %d ops/sec\n",
+	       torture_numops, seconds, (int)(torture_numops/seconds));
 
-	if (!gencache_del("foo")) {
-		d_printf("%s: gencache_del() failed\n", __location__);
-		return False;
-	}
-	if (gencache_del("foo")) {
-		d_printf("%s: second gencache_del() succeeded\n",
-			 __location__);
-		return False;
+	if (!cli_close(cli1, fnum)) {
+		printf("close failed (%s)\n", cli_errstr(cli1));
+		goto fail;
 	}
 
-	if (gencache_get_data_blob("foo", &blob, NULL)) {
-		d_printf("%s: gencache_get_data_blob() on deleted entry "
-			 "succeeded\n", __location__);
-		return False;
+	fnum = cli_open(cli1, fname, O_RDONLY, DENY_NONE);
+	if (fnum == -1) {
+		printf("reopen failed (%s)\n", cli_errstr(cli1));
+		goto fail;
 	}
 
-	if (!gencache_shutdown()) {
-		d_printf("%s: gencache_shutdown() failed\n", __location__);
-		return False;
-	}
+	for (i=0; i<torture_blocksize; i += sizeof(wbuf)) {
+		size_t len = MIN(sizeof(wbuf), torture_blocksize - i);
+		ssize_t nread = cli_read(cli1, fnum, rbuf, i, len);
 
-	if (gencache_shutdown()) {
-		d_printf("%s: second gencache_shutdown() succeeded\n",
-			 __location__);
-		return False;
+		/* The file may end before the block if the tail was
+		 * never written. */
+		if (nread < 0) {
+			printf("cli_read failed: %s\n", cli_errstr(cli1));
+			goto close;
+		}
+		memset(rbuf + nread, 0, len - nread);
+		if (memcmp(rbuf, shadow + i, len) != 0) {
+			printf("data mismatch in final check at %d\n", i);
+			goto close;
+		}
 	}
 
-	return True;
+	ret = true;
+ close:
+	cli_close(cli1, fnum);
+	cli_unlink(cli1, fname);
+ fail:
+	SAFE_FREE(shadow);
+	SAFE_FREE(rbuf);
+	torture_close_connection(cli1);
+	return ret;
 }
 
-static bool rbt_testval(struct db_context *db, const char *key,
-			const char *value)
+/*
+ * Close a file right after the write that starts a write behind of the
+ * server write cache. The close must wait for the write behind, not
+ * cancel it along with the client aio, so all the data must be there
+ * after a reopen. Run it with "aio write size" set and a "write cache
+ * size" of a few MB, so that the write behind is still going when the
+ * close comes in.
+ */
+
+static bool run_write_behind_close(int dummy)
 {
-	struct db_record *rec;
-	TDB_DATA data = string_tdb_data(value);
+	struct cli_state *cli1;
+	int fnum = -1;
+	int i, j;
 	bool ret = false;
-	NTSTATUS status;
+	const char *fname = "\\wb_close.dat";
+	size_t size = 4*1024*1024;
+	char *wbuf = NULL;
+	char *rbuf = NULL;
 
-	rec = db->fetch_locked(db, db, string_tdb_data(key));
-	if (rec == NULL) {
-		d_fprintf(stderr, "fetch_locked failed\n");
-		goto done;
-	}
-	status = rec->store(rec, data, 0);
-	if (!NT_STATUS_IS_OK(status)) {
-		d_fprintf(stderr, "store failed: %s\n", nt_errstr(status));
-		goto done;
+	printf("starting write behind close test\n");
+	if (!torture_open_connection(&cli1, 0)) {
+		return False;
 	}
-	TALLOC_FREE(rec);
 
-	rec = db->fetch_locked(db, db, string_tdb_data(key));
-	if (rec == NULL) {
-		d_fprintf(stderr, "second fetch_locked failed\n");
-		goto done;
-	}
-	if ((rec->value.dsize != data.dsize)
-	    || (memcmp(rec->value.dptr, data.dptr, data.dsize) != 0)) {
-		d_fprintf(stderr, "Got wrong data back\n");
-		goto done;
+	cli_sockopt(cli1, sockops);
+
+	wbuf = SMB_MALLOC_ARRAY(char, size);
+	rbuf = SMB_MALLOC_ARRAY(char, size);
+	if ((wbuf == NULL) || (rbuf == NULL)) {
+		printf("malloc failed\n");
+		goto fail;
 	}
 
-	ret = true;
+	for (i=0; i<torture_numops; i++) {
+		size_t ofs;
+
+		for (j=0; j<size; j++) {
+			wbuf[j] = (char)(i + j/4096 + j);
+		}
+
+		cli_unlink(cli1, fname);
+
+		cli1->use_oplocks = True;
+		fnum = cli_open(cli1, fname, O_RDWR|O_CREAT|O_EXCL,
+				DENY_NONE);
+		cli1->use_oplocks = False;
+		if (fnum == -1) {
+			printf("open failed (%s)\n", cli_errstr(cli1));
+			goto fail;
+		}
+
+		/* Small writes so they go through the write cache. The
+		 * last one fills it and starts a write behind. */
+		for (ofs=0; ofs<size; ofs += 4096) {
+			if (cli_write(cli1, fnum, 0, wbuf + ofs, ofs, 4096)
+			    != 4096) {
+				printf("cli_write failed: %s\n",
+				       cli_errstr(cli1));
+				goto close;
+			}
+		}
+
+		if (!cli_close(cli1, fnum)) {
+			printf("close failed (%s)\n", cli_errstr(cli1));
+			fnum = -1;
+			goto fail;
+		}
+
+		fnum = cli_open(cli1, fname, O_RDONLY, DENY_NONE);
+		if (fnum == -1) {
+			printf("reopen failed (%s)\n", cli_errstr(cli1));
+			goto fail;
+		}
+
+		for (ofs=0; ofs<size; ofs += 65536) {
+			if (cli_read(cli1, fnum, rbuf + ofs, ofs, 65536)
+			    != 65536) {
+				printf("short read at %u in round %d (%s)\n",
+				       (unsigned)ofs, i, cli_errstr(cli1));
+				goto close;
+			}
+		}
+		if (memcmp(rbuf, wbuf, size) != 0) {
+			printf("data mismatch after close in round %d\n", i);
+			goto close;
+		}
+
+		cli_close(cli1, fnum);
+		fnum = -1;
+	}
+
+	ret = true;
+ close:
+	if (fnum != -1) {
+		cli_close(cli1, fnum);
+	}
+	cli_unlink(cli1, fname);
+ fail:
+	SAFE_FREE(wbuf);
+	SAFE_FREE(rbuf);
+	torture_close_connection(cli1);
+	return ret;
+}
+
+/*
+  Test that names remembered as missing by the server's stat cache
+  come back once another client creates them.
+ */
+static bool run_negative_statcache(int dummy)
+{
+	struct cli_state *cli1, *cli2;
+	const char *dname = "\\negcache";
+	const char *fname = "\\negcache\\Missing.Txt";
+	const char *lname = "\\negcache\\MISSING.TXT";
+	int fnum, i;
+	bool correct = true;
+
+	printf("starting negative stat cache test\n");
+
+	if (!torture_open_connection(&cli1, 0) ||
+	    !torture_open_connection(&cli2, 1)) {
+		return false;
+	}
+
+	cli_sockopt(cli1, sockops);
+	cli_sockopt(cli2, sockops);
+
+	cli_unlink(cli1, fname);
+	cli_rmdir(cli1, dname);
+
+	if (!NT_STATUS_IS_OK(cli_mkdir(cli1, dname))) {
+		printf("mkdir of %s failed (%s)\n", dname, cli_errstr(cli1));
+		correct = false;
+		goto done;
+	}
+
+	/* let the directory mtime age so misses get cached */
+	sleep(2);
+
+	for (i = 0; i < 3; i++) {
+		fnum = cli_open(cli1, lname, O_RDONLY, DENY_NONE);
+		if (fnum != -1) {
+			printf("open of missing %s succeeded\n", lname);
+			cli_close(cli1, fnum);
+			correct = false;
+			goto done;
+		}
+	}
+
+	fnum = cli_open(cli2, fname, O_RDWR|O_CREAT|O_EXCL, DENY_NONE);
+	if (fnum == -1) {
+		printf("create of %s failed (%s)\n", fname, cli_errstr(cli2));
+		correct = false;
+		goto done;
+	}
+	cli_close(cli2, fnum);
+
+	fnum = cli_open(cli1, lname, O_RDONLY, DENY_NONE);
+	if (fnum == -1) {
+		printf("open of %s after create failed (%s)\n", lname,
+		       cli_errstr(cli1));
+		correct = false;
+		goto done;
+	}
+	cli_close(cli1, fnum);
+
+	if (!cli_unlink(cli2, fname)) {
+		printf("unlink of %s failed (%s)\n", fname, cli_errstr(cli2));
+		correct = false;
+		goto done;
+	}
+
+	fnum = cli_open(cli1, lname, O_RDONLY, DENY_NONE);
+	if (fnum != -1) {
+		printf("open of %s after unlink succeeded\n", lname);
+		cli_close(cli1, fnum);
+		correct = false;
+	}
+
+ done:
+	cli_unlink(cli1, fname);
+	cli_rmdir(cli1, dname);
+
+	if (!torture_close_connection(cli1)) {
+		correct = false;
+	}
+	if (!torture_close_connection(cli2)) {
+		correct = false;
+	}
+
+	printf("finished negative stat cache test\n");
+	return correct;
+}
+
+/*
+  Look up names in a large directory using a different case than they
+  were created with, so the server has to search the directory.
+ */
+static bool run_case_index(int dummy)
+{
+	struct cli_state *cli1, *cli2;
+	const char *dname = "\\caseidx";
+	fstring fname;
+	int fnum, i;
+	int num_files = MAX(torture_numops, 500);
+	bool correct = true;
+
+	printf("starting case insensitive index test\n");
+
+	if (!torture_open_connection(&cli1, 0) ||
+	    !torture_open_connection(&cli2, 1)) {
+		return false;
+	}
+
+	cli_sockopt(cli1, sockops);
+	cli_sockopt(cli2, sockops);
+
+	for (i = 0; i <= num_files; i++) {
+		slprintf(fname, sizeof(fname), "%s\\file%d.txt", dname, i);
+		cli_unlink(cli1, fname);
+	}
+	cli_rmdir(cli1, dname);
+
+	if (!NT_STATUS_IS_OK(cli_mkdir(cli1, dname))) {
+		printf("mkdir of %s failed (%s)\n", dname, cli_errstr(cli1));
+		correct = false;
+		goto done;
+	}
+
+	for (i = 0; i < num_files; i++) {
+		slprintf(fname, sizeof(fname), "%s\\file%d.txt", dname, i);
+		fnum = cli_open(cli1, fname, O_RDWR|O_CREAT|O_EXCL, DENY_NONE);
+		if (fnum == -1) {
+			printf("create of %s failed (%s)\n", fname,
+			       cli_errstr(cli1));
+			correct = false;
+			goto done;
+		}
+		cli_close(cli1, fnum);
+	}
+
+	/* let the directory mtime age so the server indexes it */
+	sleep(2);
+
+	start_timer();
+	for (i = 0; i < num_files; i++) {
+		slprintf(fname, sizeof(fname), "%s\\FILE%d.TXT", dname, i);
+		fnum = cli_open(cli1, fname, O_RDONLY, DENY_NONE);
+		if (fnum == -1) {
+			printf("open of %s failed (%s)\n", fname,
+			       cli_errstr(cli1));
+			correct = false;
+			goto done;
+		}
+		cli_close(cli1, fnum);
+
+		slprintf(fname, sizeof(fname), "%s\\MISSING%d.TXT", dname, i);
+		fnum = cli_open(cli1, fname, O_RDONLY, DENY_NONE);
+		if (fnum != -1) {
+			printf("open of missing %s succeeded\n", fname);
+			cli_close(cli1, fnum);
+			correct = false;
+			goto done;
+		}
+	}
+	printf("%d case-folded lookups took %g secs\n", num_files * 2,
+	       end_timer());
+
+	/* a name added by another client must be found */
+	slprintf(fname, sizeof(fname), "%s\\file%d.txt", dname, num_files);
+	fnum = cli_open(cli2, fname, O_RDWR|O_CREAT|O_EXCL, DENY_NONE);
+	if (fnum == -1) {
+		printf("create of %s failed (%s)\n", fname, cli_errstr(cli2));
+		correct = false;
+		goto done;
+	}
+	cli_close(cli2, fnum);
+
+	slprintf(fname, sizeof(fname), "%s\\File%d.Txt", dname, num_files);
+	fnum = cli_open(cli1, fname, O_RDONLY, DENY_NONE);
+	if (fnum == -1) {
+		printf("open of %s after create failed (%s)\n", fname,
+		       cli_errstr(cli1));
+		correct = false;
+		goto done;
+	}
+	cli_close(cli1, fnum);
+
+ done:
+	for (i = 0; i <= num_files; i++) {
+		slprintf(fname, sizeof(fname), "%s\\file%d.txt", dname, i);
+		cli_unlink(cli1, fname);
+	}
+	cli_rmdir(cli1, dname);
+
+	if (!torture_close_connection(cli1)) {
+		correct = false;
+	}
+	if (!torture_close_connection(cli2)) {
+		correct = false;
+	}
+
+	printf("finished case insensitive index test\n");
+	return correct;
+}
+
+struct dir_prefetch_state {
+	int num_found;
+	bool correct;
+};
+
+static void dir_prefetch_fn(const char *mnt, file_info *finfo,
+			    const char *mask, void *private_data)
+{
+	struct dir_prefetch_state *state =
+		(struct dir_prefetch_state *)private_data;
+	int i;
+
+	if (strcmp(finfo->name, ".") == 0 || strcmp(finfo->name, "..") == 0) {
+		return;
+	}
+
+	state->num_found++;
+
+	if (sscanf(finfo->name, "prefetch_long_file_name_%d.dat", &i) != 1) {
+		printf("unexpected name %s\n", finfo->name);
+		state->correct = false;
+		return;
+	}
+	if (finfo->size != (uint64_t)i) {
+		printf("%s has size %u, expected %d\n", finfo->name,
+		       (unsigned int)finfo->size, i);
+		state->correct = false;
+	}
+}
+
+/*
+  List a directory big enough to need many FIND_NEXT calls and check
+  every entry comes back once with its own size.
+ */
+static bool run_dir_prefetch(int dummy)
+{
+	struct cli_state *cli;
+	struct dir_prefetch_state state;
+	const char *dname = "\\dirpf";
+	fstring fname;
+	int fnum, i;
+	int num_files = MAX(torture_numops, 1000);
+	bool correct = true;
+
+	printf("starting directory prefetch test\n");
+
+	if (!torture_open_connection(&cli, 0)) {
+		return false;
+	}
+
+	cli_sockopt(cli, sockops);
+
+	for (i = 0; i < num_files; i++) {
+		slprintf(fname, sizeof(fname),
+			 "%s\\prefetch_long_file_name_%d.dat", dname, i);
+		cli_unlink(cli, fname);
+	}
+	cli_rmdir(cli, dname);
+
+	if (!NT_STATUS_IS_OK(cli_mkdir(cli, dname))) {
+		printf("mkdir of %s failed (%s)\n", dname, cli_errstr(cli));
+		correct = false;
+		goto done;
+	}
+
+	for (i = 0; i < num_files; i++) {
+		slprintf(fname, sizeof(fname),
+			 "%s\\prefetch_long_file_name_%d.dat", dname, i);
+		fnum = cli_open(cli, fname, O_RDWR|O_CREAT|O_EXCL, DENY_NONE);
+		if (fnum == -1) {
+			printf("create of %s failed (%s)\n", fname,
+			       cli_errstr(cli));
+			correct = false;
+			goto done;
+		}
+		if (!cli_ftruncate(cli, fnum, i)) {
+			printf("ftruncate of %s failed (%s)\n", fname,
+			       cli_errstr(cli));
+			correct = false;
+		}
+		cli_close(cli, fnum);
+	}
+
+	for (i = 0; i < 3; i++) {
+		ZERO_STRUCT(state);
+		state.correct = true;
+
+		start_timer();
+		cli_list(cli, "\\dirpf\\*", aDIR|aSYSTEM|aHIDDEN,
+			 dir_prefetch_fn, &state);
+		printf("listing %d files took %g secs\n", state.num_found,
+		       end_timer());
+
+		if (state.num_found != num_files) {
+			printf("listed %d files, expected %d\n",
+			       state.num_found, num_files);
+			correct = false;
+		}
+		if (!state.correct) {
+			correct = false;
+		}
+
+		/* the sizes must follow a change */
+		slprintf(fname, sizeof(fname),
+			 "%s\\prefetch_long_file_name_%d.dat", dname, i);
+		cli_unlink(cli, fname);
+		fnum = cli_open(cli, fname, O_RDWR|O_CREAT|O_EXCL, DENY_NONE);
+		if (fnum == -1) {
+			printf("create of %s failed (%s)\n", fname,
+			       cli_errstr(cli));
+			correct = false;
+			goto done;
+		}
+		cli_ftruncate(cli, fnum, i);
+		cli_close(cli, fnum);
+	}
+
+	/* a selective mask only stats its matches, but must see them all */
+	ZERO_STRUCT(state);
+	state.correct = true;
+
+	start_timer();
+	cli_list(cli, "\\dirpf\\prefetch_long_file_name_1?.dat",
+		 aDIR|aSYSTEM|aHIDDEN, dir_prefetch_fn, &state);
+	printf("listing %d matches took %g secs\n", state.num_found,
+	       end_timer());
+
+	if (state.num_found != 10) {
+		printf("listed %d files, expected 10\n", state.num_found);
+		correct = false;
+	}
+	if (!state.correct) {
+		correct = false;
+	}
+
+ done:
+	for (i = 0; i < num_files; i++) {
+		slprintf(fname, sizeof(fname),
+			 "%s\\prefetch_long_file_name_%d.dat", dname, i);
+		cli_unlink(cli, fname);
+	}
+	cli_rmdir(cli, dname);
+
+	if (!torture_close_connection(cli)) {
+		correct = false;
+	}
+
+	printf("finished directory prefetch test\n");
+	return correct;
+}
+
+static bool check_dosattr(struct cli_state *cli, const char *fname,
+			  uint16 expected)
+{
+	uint16 attr;
+
+	if (!cli_getatr(cli, fname, &attr, NULL, NULL)) {
+		printf("getatr of %s failed (%s)\n", fname, cli_errstr(cli));
+		return false;
+	}
+	attr &= (aRONLY|aHIDDEN|aSYSTEM|aARCH);
+	if (attr != expected) {
+		printf("%s has attributes 0x%x, expected 0x%x\n", fname,
+		       (unsigned int)attr, (unsigned int)expected);
+		return false;
+	}
+	return true;
+}
+
+/*
+  DOS attributes and security descriptors read by one client must
+  follow changes made by another. Run against a share with
+  "store dos attributes = yes" to exercise the attribute EA.
+ */
+static bool run_dosattr_cache(int dummy)
+{
+	struct cli_state *cli1, *cli2;
+	const char *fname = "\\dosattr_cache.dat";
+	SEC_DESC *sd1, *sd2, *sd_new;
+	SEC_ACL *dacl;
+	SEC_ACE *aces;
+	size_t sd_size;
+	uint32 num_aces;
+	int fnum, i;
+	bool correct = true;
+
+	printf("starting dos attribute cache test\n");
+
+	if (!torture_open_connection(&cli1, 0) ||
+	    !torture_open_connection(&cli2, 1)) {
+		return false;
+	}
+
+	cli_sockopt(cli1, sockops);
+	cli_sockopt(cli2, sockops);
+
+	cli_setatr(cli1, fname, 0, 0);
+	cli_unlink(cli1, fname);
+
+	fnum = cli_open(cli1, fname, O_RDWR|O_CREAT|O_EXCL, DENY_NONE);
+	if (fnum == -1) {
+		printf("create of %s failed (%s)\n", fname, cli_errstr(cli1));
+		correct = false;
+		goto done;
+	}
+	cli_close(cli1, fnum);
+
+	if (!cli_setatr(cli1, fname, aHIDDEN|aSYSTEM, 0)) {
+		printf("setatr of %s failed (%s)\n", fname, cli_errstr(cli1));
+		correct = false;
+		goto done;
+	}
+
+	/* let the ctime age so the server caches what it reads */
+	sleep(2);
+
+	for (i = 0; i < 3; i++) {
+		if (!check_dosattr(cli1, fname, aHIDDEN|aSYSTEM)) {
+			correct = false;
+			goto done;
+		}
+	}
+
+	fnum = cli_nt_create(cli1, fname, READ_CONTROL_ACCESS);
+	if (fnum == -1) {
+		printf("open of %s failed (%s)\n", fname, cli_errstr(cli1));
+		correct = false;
+		goto done;
+	}
+	sd1 = cli_query_secdesc(cli1, fnum, talloc_tos());
+	sd2 = cli_query_secdesc(cli1, fnum, talloc_tos());
+	cli_close(cli1, fnum);
+
+	if ((sd1 == NULL) || (sd2 == NULL)) {
+		printf("query secdesc of %s failed (%s)\n", fname,
+		       cli_errstr(cli1));
+		correct = false;
+		goto done;
+	}
+	if (!security_descriptor_equal(sd1, sd2)) {
+		printf("repeated secdesc queries differ\n");
+		correct = false;
+	}
+
+	if (!cli_setatr(cli2, fname, aRONLY|aARCH, 0)) {
+		printf("setatr of %s failed (%s)\n", fname, cli_errstr(cli2));
+		correct = false;
+		goto done;
+	}
+
+	if (!check_dosattr(cli1, fname, aRONLY|aARCH)) {
+		correct = false;
+		goto done;
+	}
+
+	/* Give everyone full access from the other connection. */
+	num_aces = (sd1->dacl != NULL) ? sd1->dacl->num_aces : 0;
+	aces = TALLOC_ARRAY(talloc_tos(), SEC_ACE, num_aces + 1);
+	if (aces == NULL) {
+		correct = false;
+		goto done;
+	}
+	if (num_aces != 0) {
+		memcpy(aces, sd1->dacl->aces, num_aces * sizeof(SEC_ACE));
+	}
+	init_sec_ace(&aces[num_aces], &global_sid_World,
+		     SEC_ACE_TYPE_ACCESS_ALLOWED, FILE_GENERIC_ALL, 0);
+	dacl = make_sec_acl(talloc_tos(), NT4_ACL_REVISION, num_aces + 1,
+			    aces);
+	sd_new = make_sec_desc(talloc_tos(), SECURITY_DESCRIPTOR_REVISION_1,
+			       SEC_DESC_SELF_RELATIVE, NULL, NULL, NULL, dacl,
+			       &sd_size);
+
+	fnum = cli_nt_create(cli2, fname, WRITE_DAC_ACCESS|READ_CONTROL_ACCESS);
+	if (fnum == -1) {
+		printf("open of %s failed (%s)\n", fname, cli_errstr(cli2));
+		correct = false;
+		goto done;
+	}
+	if ((sd_new == NULL) || !cli_set_secdesc(cli2, fnum, sd_new)) {
+		printf("set secdesc of %s failed (%s)\n", fname,
+		       cli_errstr(cli2));
+		cli_close(cli2, fnum);
+		correct = false;
+		goto done;
+	}
+	cli_close(cli2, fnum);
+
+	fnum = cli_nt_create(cli1, fname, READ_CONTROL_ACCESS);
+	if (fnum == -1) {
+		printf("open of %s failed (%s)\n", fname, cli_errstr(cli1));
+		correct = false;
+		goto done;
+	}
+	sd2 = cli_query_secdesc(cli1, fnum, talloc_tos());
+	cli_close(cli1, fnum);
+
+	if (sd2 == NULL) {
+		printf("query secdesc of %s failed (%s)\n", fname,
+		       cli_errstr(cli1));
+		correct = false;
+		goto done;
+	}
+	if (security_descriptor_equal(sd1, sd2)) {
+		printf("secdesc did not follow the other connection\n");
+		correct = false;
+	}
+
+ done:
+	cli_setatr(cli1, fname, 0, 0);
+	cli_unlink(cli1, fname);
+
+	if (!torture_close_connection(cli1)) {
+		correct = false;
+	}
+	if (!torture_close_connection(cli2)) {
+		correct = false;
+	}
+
+	printf("finished dos attribute cache test\n");
+	return correct;
+}
+
+/*
+  Time fnum based calls against a server holding many open files.
+ */
+static bool run_openfiles_bench(int dummy)
+{
+	struct cli_state *cli;
+	const char *dname = "\\openfiles";
+	fstring fname;
+	int *fnums;
+	int i, fnum;
+	int num_files = MAX(torture_numops, 1000);
+	bool correct = true;
+
+	printf("starting open files benchmark\n");
+
+	if (!torture_open_connection(&cli, 0)) {
+		return false;
+	}
+
+	cli_sockopt(cli, sockops);
+
+	fnums = SMB_MALLOC_ARRAY(int, num_files);
+	if (fnums == NULL) {
+		printf("malloc failed\n");
+		torture_close_connection(cli);
+		return false;
+	}
+	for (i = 0; i < num_files; i++) {
+		fnums[i] = -1;
+	}
+
+	for (i = 0; i < num_files; i++) {
+		slprintf(fname, sizeof(fname), "%s\\file%d", dname, i);
+		cli_unlink(cli, fname);
+	}
+	cli_rmdir(cli, dname);
+
+	if (!NT_STATUS_IS_OK(cli_mkdir(cli, dname))) {
+		printf("mkdir of %s failed (%s)\n", dname, cli_errstr(cli));
+		correct = false;
+		goto done;
+	}
+
+	start_timer();
+	for (i = 0; i < num_files; i++) {
+		slprintf(fname, sizeof(fname), "%s\\file%d", dname, i);
+		fnums[i] = cli_open(cli, fname, O_RDWR|O_CREAT|O_EXCL,
+				    DENY_NONE);
+		if (fnums[i] == -1) {
+			printf("create of %s failed (%s)\n", fname,
+			       cli_errstr(cli));
+			correct = false;
+			goto done;
+		}
+	}
+	printf("%d creates took %g secs\n", num_files, end_timer());
+
+	start_timer();
+	for (i = 0; i < num_files; i++) {
+		if (!cli_getattrE(cli, fnums[i], NULL, NULL, NULL, NULL,
+				  NULL)) {
+			printf("getattrE on fnum %d failed (%s)\n", fnums[i],
+			       cli_errstr(cli));
+			correct = false;
+			goto done;
+		}
+	}
+	printf("%d getattrE calls took %g secs\n", num_files, end_timer());
+
+	/* Second opens of files already open have to find the first. */
+	start_timer();
+	for (i = 0; i < num_files; i++) {
+		slprintf(fname, sizeof(fname), "%s\\file%d", dname, i);
+		fnum = cli_open(cli, fname, O_RDONLY, DENY_NONE);
+		if (fnum == -1) {
+			printf("reopen of %s failed (%s)\n", fname,
+			       cli_errstr(cli));
+			correct = false;
+			goto done;
+		}
+		cli_close(cli, fnum);
+	}
+	printf("%d reopens took %g secs\n", num_files, end_timer());
+
+	start_timer();
+	for (i = 0; i < num_files; i++) {
+		if (!cli_close(cli, fnums[i])) {
+			printf("close failed (%s)\n", cli_errstr(cli));
+			correct = false;
+		}
+		fnums[i] = -1;
+	}
+	printf("%d closes took %g secs\n", num_files, end_timer());
+
+ done:
+	for (i = 0; i < num_files; i++) {
+		if (fnums[i] != -1) {
+			cli_close(cli, fnums[i]);
+		}
+		slprintf(fname, sizeof(fname), "%s\\file%d", dname, i);
+		cli_unlink(cli, fname);
+	}
+	cli_rmdir(cli, dname);
+	SAFE_FREE(fnums);
+
+	if (!torture_close_connection(cli)) {
+		correct = false;
+	}
+
+	return correct;
+}
+
+/*
+  Send one trans2 findfirst or findnext with info level 1 for up to 10
+  entries in max_data bytes, and return the search count, or -1 on error.
+ */
+static int dir_handles_find(struct cli_state *cli, const char *mask,
+			    int max_data, int *handle, bool *eos)
+{
+	uint16 setup;
+	char param[12+1024];
+	char *p;
+	char *rparam = NULL, *rdata = NULL;
+	unsigned int rparam_len, rdata_len;
+	int count;
+
+	if (*handle == -1) {
+		setup = TRANSACT2_FINDFIRST;
+		SSVAL(param,0,aSYSTEM|aHIDDEN|aDIR);
+		SSVAL(param,2,10);
+		SSVAL(param,4,FLAG_TRANS2_FIND_CLOSE_IF_END);
+		SSVAL(param,6,SMB_FIND_INFO_STANDARD);
+		SIVAL(param,8,0);
+		p = param+12;
+		p += clistr_push(cli, p, mask, sizeof(param)-12,
+				 STR_TERMINATE);
+	} else {
+		setup = TRANSACT2_FINDNEXT;
+		SSVAL(param,0,*handle);
+		SSVAL(param,2,10);
+		SSVAL(param,4,SMB_FIND_INFO_STANDARD);
+		SIVAL(param,6,0);
+		SSVAL(param,10,FLAG_TRANS2_FIND_CONTINUE|
+		      FLAG_TRANS2_FIND_CLOSE_IF_END);
+		p = param+12;
+		p += clistr_push(cli, p, "", sizeof(param)-12,
+				 STR_TERMINATE);
+	}
+
+	if (!cli_send_trans(cli, SMBtrans2, NULL, -1, 0, &setup, 1, 0,
+			    param, PTR_DIFF(p, param), 10,
+			    NULL, 0, max_data)) {
+		return -1;
+	}
+	if (!cli_receive_trans(cli, SMBtrans2, &rparam, &rparam_len,
+			       &rdata, &rdata_len) ||
+	    (rparam == NULL)) {
+		SAFE_FREE(rparam);
+		SAFE_FREE(rdata);
+		return -1;
+	}
+
+	if (*handle == -1) {
+		*handle = SVAL(rparam,0);
+		count = SVAL(rparam,2);
+		*eos = (SVAL(rparam,4) != 0);
+	} else {
+		count = SVAL(rparam,0);
+		*eos = (SVAL(rparam,2) != 0);
+	}
+
+	SAFE_FREE(rparam);
+	SAFE_FREE(rdata);
+	return count;
+}
+
+/*
+  Run num_searches searches over a directory of num_files entries at the
+  same time, one findnext each in turn, and check each sees every entry
+  exactly once.
+ */
+static bool dir_handles_interleave(struct cli_state *cli, const char *mask,
+				   int num_searches, int num_files,
+				   int max_data)
+{
+	int *handles = NULL, *counts = NULL;
+	bool *done = NULL;
+	int i, remaining;
+	bool correct = true;
+
+	handles = SMB_MALLOC_ARRAY(int, num_searches);
+	counts = SMB_MALLOC_ARRAY(int, num_searches);
+	done = SMB_MALLOC_ARRAY(bool, num_searches);
+	if (!handles || !counts || !done) {
+		printf("malloc failed\n");
+		correct = false;
+		goto done;
+	}
+
+	for (i = 0; i < num_searches; i++) {
+		handles[i] = -1;
+		counts[i] = 0;
+		done[i] = false;
+	}
+
+	start_timer();
+
+	remaining = num_searches;
+	while (remaining > 0) {
+		for (i = 0; i < num_searches; i++) {
+			int count;
+
+			if (done[i]) {
+				continue;
+			}
+			count = dir_handles_find(cli, mask, max_data,
+						 &handles[i], &done[i]);
+			if (count == -1) {
+				printf("search %d failed (%s)\n", i,
+				       cli_errstr(cli));
+				correct = false;
+				goto done;
+			}
+			counts[i] += count;
+			if (count == 0) {
+				done[i] = true;
+			}
+			if (counts[i] > num_files + 2) {
+				printf("search %d returned %d entries, "
+				       "expected %d\n", i, counts[i],
+				       num_files + 2);
+				correct = false;
+				goto done;
+			}
+			if (done[i]) {
+				remaining--;
+			}
+		}
+	}
+
+	printf("%d interleaved searches with %d byte replies took %g secs\n",
+	       num_searches, max_data, end_timer());
+
+	for (i = 0; i < num_searches; i++) {
+		if (counts[i] != num_files + 2) {
+			printf("search %d returned %d entries, expected %d\n",
+			       i, counts[i], num_files + 2);
+			correct = false;
+		}
+	}
+
+ done:
+	SAFE_FREE(handles);
+	SAFE_FREE(counts);
+	SAFE_FREE(done);
+	return correct;
+}
+
+/*
+  Keep more searches going at once than the server keeps directories
+  open, so that they are idled and reopened between every findnext.
+  Each search must still see every entry exactly once. Then do it again
+  with replies too small for all the entries asked for, so that every
+  search is idled right after the server stepped back over the entry
+  that didn't fit.
+ */
+static bool run_dir_handles(int dummy)
+{
+	struct cli_state *cli;
+	const char *dname = "\\dirhnd";
+	const char *mask = "\\dirhnd\\*";
+	const char *fmt = "%s\\file_with_a_name_long_enough_to_fill_replies_%d";
+	fstring fname;
+	int num_files = 50;
+	int num_searches = MAX_OPEN_DIRECTORIES + 44;
+	int i, fnum;
+	bool correct = true;
+
+	printf("starting directory handles test\n");
+
+	if (!torture_open_connection(&cli, 0)) {
+		return false;
+	}
+
+	cli_sockopt(cli, sockops);
+
+	for (i = 0; i < num_files; i++) {
+		slprintf(fname, sizeof(fname), fmt, dname, i);
+		cli_unlink(cli, fname);
+	}
+	cli_rmdir(cli, dname);
+
+	if (!NT_STATUS_IS_OK(cli_mkdir(cli, dname))) {
+		printf("mkdir of %s failed (%s)\n", dname, cli_errstr(cli));
+		correct = false;
+		goto done;
+	}
+
+	for (i = 0; i < num_files; i++) {
+		slprintf(fname, sizeof(fname), fmt, dname, i);
+		fnum = cli_open(cli, fname, O_RDWR|O_CREAT|O_EXCL, DENY_NONE);
+		if (fnum == -1) {
+			printf("create of %s failed (%s)\n", fname,
+			       cli_errstr(cli));
+			correct = false;
+			goto done;
+		}
+		cli_close(cli, fnum);
+	}
+
+	if (!dir_handles_interleave(cli, mask, num_searches, num_files,
+				    cli->max_xmit)) {
+		correct = false;
+	}
+
+	/* About 80 bytes per entry, so 4 of the 10 we ask for fit. */
+	if (!dir_handles_interleave(cli, mask, num_searches, num_files,
+				    350)) {
+		correct = false;
+	}
+
+ done:
+	for (i = 0; i < num_files; i++) {
+		slprintf(fname, sizeof(fname), fmt, dname, i);
+		cli_unlink(cli, fname);
+	}
+	cli_rmdir(cli, dname);
+
+	if (!torture_close_connection(cli)) {
+		correct = false;
+	}
+
+	return correct;
+}
+
+/*
+  Time writes to a file while many other connections hold level2
+  oplocks on it. Every first write of a round has to break them all.
+ */
+static bool run_oplock_bench(int dummy)
+{
+	struct cli_state *cli;
+	struct cli_state **holders;
+	const char *fname = "\\oplockb.dat";
+	int num_holders = nprocs * 32;
+	int num_rounds = MAX(torture_numops / 10, 1);
+	int saved_use_oplocks = use_oplocks;
+	int *hfnums;
+	int fnum = -1;
+	int i, r;
+	char buf[4];
+	double first_write = 0, later_writes = 0;
+	bool correct = true;
+
+	printf("starting oplock break benchmark with %d level2 holders\n",
+	       num_holders);
+
+	if (!torture_open_connection(&cli, 0)) {
+		return false;
+	}
+	cli_sockopt(cli, sockops);
+
+	holders = SMB_CALLOC_ARRAY(struct cli_state *, num_holders);
+	hfnums = SMB_MALLOC_ARRAY(int, num_holders);
+	if (!holders || !hfnums) {
+		printf("malloc failed\n");
+		SAFE_FREE(holders);
+		SAFE_FREE(hfnums);
+		torture_close_connection(cli);
+		return false;
+	}
+
+	use_level_II_oplocks = True;
+	use_oplocks = True;
+
+	for (i = 0; i < num_holders; i++) {
+		hfnums[i] = -1;
+		if (!torture_open_connection(&holders[i], i)) {
+			correct = false;
+			break;
+		}
+		holders[i]->use_oplocks = True;
+		holders[i]->use_level_II_oplocks = True;
+		cli_sockopt(holders[i], sockops);
+	}
+
+	use_level_II_oplocks = False;
+	use_oplocks = saved_use_oplocks;
+
+	if (!correct) {
+		goto done;
+	}
+
+	cli_unlink(cli, fname);
+
+	memset(buf, 0, sizeof(buf));
+
+	for (r = 0; r < num_rounds; r++) {
+		/*
+		 * The first open, without an oplock, is given a fake
+		 * level2 oplock, so the holders all get level2 and the
+		 * first write has to break them.
+		 */
+		fnum = cli_open(cli, fname, O_RDWR|O_CREAT, DENY_NONE);
+		if (fnum == -1) {
+			printf("open of %s failed (%s)\n", fname,
+			       cli_errstr(cli));
+			correct = false;
+			goto done;
+		}
+
+		for (i = 0; i < num_holders; i++) {
+			hfnums[i] = cli_open(holders[i], fname, O_RDWR,
+					     DENY_NONE);
+			if (hfnums[i] == -1) {
+				printf("holder open of %s failed (%s)\n",
+				       fname, cli_errstr(holders[i]));
+				correct = false;
+				goto done;
+			}
+		}
+
+		start_timer();
+		if (cli_write(cli, fnum, 0, buf, 0, sizeof(buf))
+		    != sizeof(buf)) {
+			printf("write failed (%s)\n", cli_errstr(cli));
+			correct = false;
+			goto done;
+		}
+		first_write += end_timer();
+
+		start_timer();
+		for (i = 0; i < 10; i++) {
+			if (cli_write(cli, fnum, 0, buf, 0, sizeof(buf))
+			    != sizeof(buf)) {
+				printf("write failed (%s)\n",
+				       cli_errstr(cli));
+				correct = false;
+				goto done;
+			}
+		}
+		later_writes += end_timer();
+
+		cli_close(cli, fnum);
+		fnum = -1;
+
+		for (i = 0; i < num_holders; i++) {
+			cli_close(holders[i], hfnums[i]);
+			hfnums[i] = -1;
+		}
+	}
+
+	printf("first write after level2 opens: %g msecs average\n",
+	       first_write * 1000 / num_rounds);
+	printf("writes without level2 holders: %g msecs average\n",
+	       later_writes * 1000 / (num_rounds * 10));
+
+ done:
+	if (fnum != -1) {
+		cli_close(cli, fnum);
+	}
+	for (i = 0; i < num_holders; i++) {
+		if (holders[i] == NULL) {
+			continue;
+		}
+		if (hfnums[i] != -1) {
+			cli_close(holders[i], hfnums[i]);
+		}
+		torture_close_connection(holders[i]);
+	}
+	cli_unlink(cli, fname);
+
+	SAFE_FREE(holders);
+	SAFE_FREE(hfnums);
+
+	if (!torture_close_connection(cli)) {
+		correct = false;
+	}
+
+	return correct;
+}
+
+/*
+  Send a blocking lockingX request without waiting for the reply.
+ */
+static bool lock_bench_send_lock(struct cli_state *cli, int fnum,
+				 int timeout)
+{
+	char *p;
+
+	memset(cli->outbuf,'\0',smb_size);
+
+	cli_set_message(cli->outbuf,8,0,True);
+
+	SCVAL(cli->outbuf,smb_com,SMBlockingX);
+	SSVAL(cli->outbuf,smb_tid,cli->cnum);
+	cli_setup_packet(cli);
+
+	SCVAL(cli->outbuf,smb_vwv0,0xFF);
+	SSVAL(cli->outbuf,smb_vwv2,fnum);
+	SCVAL(cli->outbuf,smb_vwv3,0);
+	SIVALS(cli->outbuf, smb_vwv4, timeout);
+	SSVAL(cli->outbuf,smb_vwv6,0);
+	SSVAL(cli->outbuf,smb_vwv7,1);
+
+	p = smb_buf(cli->outbuf);
+	SSVAL(p, 0, cli->pid);
+	SIVAL(p, 2, 0);
+	SIVAL(p, 6, 4);
+	p += 10;
+
+	cli_setup_bcc(cli, p);
+
+	return cli_send_smb(cli);
+}
+
+/*
+  One connection holds locks on many files while another connection
+  waits on all of them. Time how long it takes to get every lock once
+  they are released one by one.
+ */
+static bool run_lock_bench(int dummy)
+{
+	struct cli_state *cli1, *cli2;
+	const char *dname = "\\lockbench";
+	fstring fname;
+	int num_files = MAX(torture_numops, 500);
+	int *fnums1 = NULL, *fnums2 = NULL;
+	int i;
+	bool correct = true;
+
+	printf("starting blocking lock benchmark\n");
+
+	if (!torture_open_connection(&cli1, 0) ||
+	    !torture_open_connection(&cli2, 1)) {
+		return false;
+	}
+
+	cli_sockopt(cli1, sockops);
+	cli_sockopt(cli2, sockops);
+
+	for (i = 0; i < num_files; i++) {
+		slprintf(fname, sizeof(fname), "%s\\file%d", dname, i);
+		cli_unlink(cli1, fname);
+	}
+	cli_rmdir(cli1, dname);
+
+	fnums1 = SMB_MALLOC_ARRAY(int, num_files);
+	fnums2 = SMB_MALLOC_ARRAY(int, num_files);
+	if (!fnums1 || !fnums2) {
+		printf("malloc failed\n");
+		correct = false;
+		goto done;
+	}
+	for (i = 0; i < num_files; i++) {
+		fnums1[i] = fnums2[i] = -1;
+	}
+
+	if (!NT_STATUS_IS_OK(cli_mkdir(cli1, dname))) {
+		printf("mkdir of %s failed (%s)\n", dname, cli_errstr(cli1));
+		correct = false;
+		goto done;
+	}
+
+	for (i = 0; i < num_files; i++) {
+		slprintf(fname, sizeof(fname), "%s\\file%d", dname, i);
+		fnums1[i] = cli_open(cli1, fname, O_RDWR|O_CREAT|O_EXCL,
+				     DENY_NONE);
+		if (fnums1[i] == -1) {
+			printf("create of %s failed (%s)\n", fname,
+			       cli_errstr(cli1));
+			correct = false;
+			goto done;
+		}
+		if (!cli_lock(cli1, fnums1[i], 0, 4, 0, WRITE_LOCK)) {
+			printf("lock on %s failed (%s)\n", fname,
+			       cli_errstr(cli1));
+			correct = false;
+			goto done;
+		}
+		fnums2[i] = cli_open(cli2, fname, O_RDWR, DENY_NONE);
+		if (fnums2[i] == -1) {
+			printf("open of %s failed (%s)\n", fname,
+			       cli_errstr(cli2));
+			correct = false;
+			goto done;
+		}
+	}
+
+	for (i = 0; i < num_files; i++) {
+		if (!lock_bench_send_lock(cli2, fnums2[i], 60*1000)) {
+			printf("sending lock request failed\n");
+			correct = false;
+			goto done;
+		}
+	}
+
+	/* All the locks are queued on the server once this returns. */
+	if (!cli_chkpath(cli2, dname)) {
+		printf("chkpath failed (%s)\n", cli_errstr(cli2));
+		correct = false;
+		goto done;
+	}
+
+	start_timer();
+
+	for (i = 0; i < num_files; i++) {
+		if (!cli_unlock(cli1, fnums1[i], 0, 4)) {
+			printf("unlock failed (%s)\n", cli_errstr(cli1));
+			correct = false;
+			goto done;
+		}
+	}
+
+	for (i = 0; i < num_files; i++) {
+		if (!cli_receive_smb(cli2)) {
+			printf("no reply to lock request %d\n", i);
+			correct = false;
+			goto done;
+		}
+		if (cli_is_error(cli2)) {
+			printf("lock request failed (%s)\n",
+			       cli_errstr(cli2));
+			correct = false;
+			goto done;
+		}
+	}
+
+	printf("%d blocked locks granted in %g secs\n", num_files,
+	       end_timer());
+
+ done:
+	for (i = 0; fnums1 && fnums2 && i < num_files; i++) {
+		if (fnums1[i] != -1) {
+			cli_close(cli1, fnums1[i]);
+		}
+		if (fnums2[i] != -1) {
+			cli_close(cli2, fnums2[i]);
+		}
+	}
+	for (i = 0; i < num_files; i++) {
+		slprintf(fname, sizeof(fname), "%s\\file%d", dname, i);
+		cli_unlink(cli1, fname);
+	}
+	cli_rmdir(cli1, dname);
+
+	SAFE_FREE(fnums1);
+	SAFE_FREE(fnums2);
+
+	if (!torture_close_connection(cli1)) {
+		correct = false;
+	}
+	if (!torture_close_connection(cli2)) {
+		correct = false;
+	}
+
+	return correct;
+}
+
+/*
+  Time opens and closes of a file that another connection already has
+  open many times, so every open and close works on a big share mode
+  record.
+ */
+static bool run_sharemode_bench(int dummy)
+{
+	struct cli_state *cli1, *cli2;
+	const char *fname = "\\sharemode.dat";
+	int num_opens = MAX(torture_numops, 500);
+	int *fnums;
+	int i, fnum;
+	bool correct = true;
+
+	printf("starting share mode benchmark\n");
+
+	if (!torture_open_connection(&cli1, 0) ||
+	    !torture_open_connection(&cli2, 1)) {
+		return false;
+	}
+
+	cli_sockopt(cli1, sockops);
+	cli_sockopt(cli2, sockops);
+
+	cli_unlink(cli1, fname);
+
+	fnums = SMB_MALLOC_ARRAY(int, num_opens);
+	if (fnums == NULL) {
+		printf("malloc failed\n");
+		correct = false;
+		goto done;
+	}
+
+	for (i = 0; i < num_opens; i++) {
+		fnums[i] = cli_open(cli1, fname, O_RDWR|O_CREAT, DENY_NONE);
+		if (fnums[i] == -1) {
+			printf("open %d of %s failed (%s)\n", i, fname,
+			       cli_errstr(cli1));
+			correct = false;
+			num_opens = i;
+			goto done;
+		}
+	}
+
+	start_timer();
+	for (i = 0; i < torture_numops; i++) {
+		fnum = cli_open(cli2, fname, O_RDWR, DENY_NONE);
+		if (fnum == -1) {
+			printf("open of %s failed (%s)\n", fname,
+			       cli_errstr(cli2));
+			correct = false;
+			goto done;
+		}
+		if (!cli_close(cli2, fnum)) {
+			printf("close failed (%s)\n", cli_errstr(cli2));
+			correct = false;
+			goto done;
+		}
+	}
+	printf("%d open/close pairs against %d opens took %g secs\n",
+	       torture_numops, num_opens, end_timer());
+
+ done:
+	for (i = 0; fnums && i < num_opens; i++) {
+		cli_close(cli1, fnums[i]);
+	}
+	SAFE_FREE(fnums);
+	cli_unlink(cli1, fname);
+
+	if (!torture_close_connection(cli1)) {
+		correct = false;
+	}
+	if (!torture_close_connection(cli2)) {
+		correct = false;
+	}
+
+	return correct;
+}
+
+/*
+  Take many byte range locks on one file, as a database client locking
+  records would, and time adding, testing and removing them.
+ */
+static bool run_brl_bench(int dummy)
+{
+	struct cli_state *cli1, *cli2;
+	const char *fname = "\\brlbench.dat";
+	int num_locks = MAX(torture_numops, 5000);
+	int fnum1 = -1, fnum2 = -1;
+	int i;
+	char buf[8];
+	bool correct = true;
+
+	printf("starting byte range lock benchmark\n");
+
+	if (!torture_open_connection(&cli1, 0) ||
+	    !torture_open_connection(&cli2, 1)) {
+		return false;
+	}
+
+	cli_sockopt(cli1, sockops);
+	cli_sockopt(cli2, sockops);
+
+	cli_unlink(cli1, fname);
+
+	fnum1 = cli_open(cli1, fname, O_RDWR|O_CREAT|O_EXCL, DENY_NONE);
+	if (fnum1 == -1) {
+		printf("create of %s failed (%s)\n", fname, cli_errstr(cli1));
+		correct = false;
+		goto done;
+	}
+	fnum2 = cli_open(cli2, fname, O_RDWR, DENY_NONE);
+	if (fnum2 == -1) {
+		printf("open of %s failed (%s)\n", fname, cli_errstr(cli2));
+		correct = false;
+		goto done;
+	}
+
+	start_timer();
+
+	for (i = 0; i < num_locks; i++) {
+		if (!cli_lock(cli1, fnum1, i * 16, 8, 0, WRITE_LOCK)) {
+			printf("lock %d failed (%s)\n", i, cli_errstr(cli1));
+			correct = false;
+			goto done;
+		}
+	}
+
+	printf("%d locks taken in %g secs\n", num_locks, end_timer());
+
+	/* A long read lock over all the records, stacked on our own
+	   write locks. */
+	if (!cli_lock(cli1, fnum1, 0, (uint32)num_locks * 16, 0, READ_LOCK)) {
+		printf("read lock failed (%s)\n", cli_errstr(cli1));
+		correct = false;
+		goto done;
+	}
+
+	start_timer();
+
+	for (i = 0; i < num_locks; i++) {
+		/* The gaps between records are only read locked. */
+		if (!cli_lock(cli2, fnum2, i * 16 + 8, 8, 0, READ_LOCK)) {
+			printf("lock in gap %d failed (%s)\n", i,
+			       cli_errstr(cli2));
+			correct = false;
+			goto done;
+		}
+		if (cli_lock(cli2, fnum2, i * 16 + 4, 8, 0, WRITE_LOCK)) {
+			printf("conflicting lock %d succeeded\n", i);
+			correct = false;
+			goto done;
+		}
+	}
+
+	printf("%d conflict checks in %g secs\n", num_locks * 2, end_timer());
+
+	start_timer();
+
+	for (i = 0; i < num_locks; i++) {
+		/* Strict locking checks the read against the lock list. */
+		if (cli_read(cli2, fnum2, buf, i * 16 + 8, sizeof(buf)) == -1) {
+			printf("read %d failed (%s)\n", i, cli_errstr(cli2));
+			correct = false;
+			goto done;
+		}
+	}
+
+	printf("%d reads in %g secs\n", num_locks, end_timer());
+
+	start_timer();
+
+	for (i = 0; i < num_locks; i++) {
+		if (!cli_unlock(cli1, fnum1, i * 16, 8)) {
+			printf("unlock %d failed (%s)\n", i, cli_errstr(cli1));
+			correct = false;
+			goto done;
+		}
+	}
+
+	printf("%d locks removed in %g secs\n", num_locks, end_timer());
+
+	/* Only the read locks are left. */
+	if (cli_lock(cli2, fnum2, 16, 8, 0, WRITE_LOCK)) {
+		printf("write lock over read lock succeeded\n");
+		correct = false;
+		goto done;
+	}
+	if (!cli_lock(cli2, fnum2, 16, 8, 0, READ_LOCK)) {
+		printf("read lock after unlock failed (%s)\n",
+		       cli_errstr(cli2));
+		correct = false;
+		goto done;
+	}
+
+ done:
+	if (fnum2 != -1) {
+		cli_close(cli2, fnum2);
+	}
+	if (fnum1 != -1) {
+		cli_close(cli1, fnum1);
+	}
+	cli_unlink(cli1, fname);
+
+	if (!torture_close_connection(cli1)) {
+		correct = false;
+	}
+	if (!torture_close_connection(cli2)) {
+		correct = false;
+	}
+
+	return correct;
+}
+
+/*
+  Reads and writes on a file nobody has locked skip the brlock database
+  after the first check. Make sure a lock taken later by someone else is
+  still seen, and time reads on the unlocked file.
+ */
+static bool run_strict_lock(int dummy)
+{
+	struct cli_state *cli1, *cli2;
+	const char *fname = "\\strictlock.dat";
+	int fnum1 = -1, fnum2 = -1;
+	int i;
+	char buf[64];
+	bool correct = true;
+
+	printf("starting strict locking test\n");
+
+	if (!torture_open_connection(&cli1, 0) ||
+	    !torture_open_connection(&cli2, 1)) {
+		return false;
+	}
+
+	cli_sockopt(cli1, sockops);
+	cli_sockopt(cli2, sockops);
+
+	cli_unlink(cli1, fname);
+
+	fnum1 = cli_open(cli1, fname, O_RDWR|O_CREAT|O_EXCL, DENY_NONE);
+	if (fnum1 == -1) {
+		printf("create of %s failed (%s)\n", fname, cli_errstr(cli1));
+		correct = false;
+		goto done;
+	}
+	fnum2 = cli_open(cli2, fname, O_RDWR, DENY_NONE);
+	if (fnum2 == -1) {
+		printf("open of %s failed (%s)\n", fname, cli_errstr(cli2));
+		correct = false;
+		goto done;
+	}
+
+	memset(buf, 'x', sizeof(buf));
+	if (cli_write(cli1, fnum1, 0, buf, 0, sizeof(buf)) != sizeof(buf)) {
+		printf("write failed (%s)\n", cli_errstr(cli1));
+		correct = false;
+		goto done;
+	}
+
+	start_timer();
+
+	for (i = 0; i < torture_numops * 10; i++) {
+		if (cli_read(cli1, fnum1, buf, 0, 8) != 8) {
+			printf("read %d failed (%s)\n", i, cli_errstr(cli1));
+			correct = false;
+			goto done;
+		}
+	}
+
+	printf("%d reads of an unlocked file in %g secs\n",
+	       torture_numops * 10, end_timer());
+
+	if (!cli_lock(cli2, fnum2, 0, 8, 0, WRITE_LOCK)) {
+		printf("lock failed (%s)\n", cli_errstr(cli2));
+		correct = false;
+		goto done;
+	}
+
+	if (cli_read(cli1, fnum1, buf, 0, 8) == 8) {
+		printf("read of a range locked since the last read "
+		       "succeeded\n");
+		correct = false;
+		goto done;
+	}
+	if (cli_write(cli1, fnum1, 0, buf, 4, 8) == 8) {
+		printf("write to a locked range succeeded\n");
+		correct = false;
+		goto done;
+	}
+	if (cli_read(cli1, fnum1, buf, 16, 8) != 8) {
+		printf("read outside the lock failed (%s)\n",
+		       cli_errstr(cli1));
+		correct = false;
+		goto done;
+	}
+
+	if (!cli_unlock(cli2, fnum2, 0, 8)) {
+		printf("unlock failed (%s)\n", cli_errstr(cli2));
+		correct = false;
+		goto done;
+	}
+
+	if (cli_read(cli1, fnum1, buf, 0, 8) != 8) {
+		printf("read after unlock failed (%s)\n", cli_errstr(cli1));
+		correct = false;
+		goto done;
+	}
+
+ done:
+	if (fnum2 != -1) {
+		cli_close(cli2, fnum2);
+	}
+	if (fnum1 != -1) {
+		cli_close(cli1, fnum1);
+	}
+	cli_unlink(cli1, fname);
+
+	if (!torture_close_connection(cli1)) {
+		correct = false;
+	}
+	if (!torture_close_connection(cli2)) {
+		correct = false;
+	}
+
+	return correct;
+}
+
+struct notify_bench_state {
+	int pending;
+	NTSTATUS status;
+	uint8_t *param;
+	uint32_t num_param;
+};
+
+static void notify_bench_done(struct tevent_req *req)
+{
+	struct notify_bench_state *state =
+		(struct notify_bench_state *)tevent_req_callback_data_void(
+			req);
+	NTSTATUS status;
+
+	if (state->param == NULL) {
+		status = cli_trans_recv(req, talloc_tos(), NULL, NULL,
+					&state->param, &state->num_param,
+					NULL, NULL);
+		state->status = status;
+	}
+	TALLOC_FREE(req);
+	state->pending -= 1;
+}
+
+static void notify_bench_close_done(struct tevent_req *req)
+{
+	int *pending = (int *)tevent_req_callback_data_void(req);
+	cli_close_recv(req);
+	TALLOC_FREE(req);
+	*pending -= 1;
+}
+
+/*
+  Put recursive change notify watches on many directories, and time
+  setting them up, changing files nobody watches, creating many files
+  below one watch and removing the watches again. A change below one of
+  the directories must still be reported.
+ */
+static bool run_notify_bench(int dummy)
+{
+	struct cli_state *cli1, *cli2;
+	struct event_context *ev = NULL;
+	struct tevent_req *req;
+	struct notify_bench_state first, rest;
+	const char *dname = "\\notify_bench";
+	int num_dirs = MAX(torture_numops, 1000);
+	uint16_t *fnums = NULL;
+	int num_open = 0;
+	int closing = 0;
+	int i, fnum;
+	fstring name;
+	uint16_t setup[4];
+	bool correct = true;
+
+	printf("starting change notify benchmark\n");
+
+	if (!torture_open_connection(&cli1, 0) ||
+	    !torture_open_connection(&cli2, 1)) {
+		return false;
+	}
+
+	cli_sockopt(cli1, sockops);
+	cli_sockopt(cli2, sockops);
+
+	ZERO_STRUCT(first);
+	ZERO_STRUCT(rest);
+
+	ev = event_context_init(talloc_tos());
+	fnums = SMB_MALLOC_ARRAY(uint16_t, num_dirs);
+	if ((ev == NULL) || (fnums == NULL)) {
+		printf("malloc failed\n");
+		correct = false;
+		goto done;
+	}
+
+	cli_mkdir(cli1, dname);
+	fstr_sprintf(name, "%s\\other", dname);
+	cli_mkdir(cli1, name);
+	for (i = 0; i < num_dirs; i++) {
+		fstr_sprintf(name, "%s\\dir%d", dname, i);
+		cli_mkdir(cli1, name);
+	}
+
+	start_timer();
+
+	for (i = 0; i < num_dirs; i++) {
+		NTSTATUS status;
+		fstr_sprintf(name, "%s\\dir%d", dname, i);
+		status = cli_ntcreate(cli1, name, 0, FILE_LIST_DIRECTORY, 0,
+				      FILE_SHARE_READ|FILE_SHARE_WRITE|
+				      FILE_SHARE_DELETE,
+				      FILE_OPEN, FILE_DIRECTORY_FILE, 0,
+				      &fnums[i]);
+		if (!NT_STATUS_IS_OK(status)) {
+			printf("open of %s failed (%s)\n", name,
+			       nt_errstr(status));
+			correct = false;
+			goto done;
+		}
+		num_open = i + 1;
+	}
+
+	SIVAL(setup, 0, FILE_NOTIFY_CHANGE_FILE_NAME);
+
+	for (i = 0; i < num_dirs; i++) {
+		struct notify_bench_state *state = (i == 0) ? &first : &rest;
+
+		SSVAL(setup, 4, fnums[i]);
+		SSVAL(setup, 6, 1); /* watch the whole tree */
+
+		req = cli_trans_send(ev, ev, cli1, SMBnttrans, NULL, -1,
+				     NT_TRANSACT_NOTIFY_CHANGE, 0,
+				     setup, 4, 0, NULL, 0, 1000, NULL, 0, 0);
+		if (req == NULL) {
+			printf("cli_trans_send failed\n");
+			correct = false;
+			goto done;
+		}
+		tevent_req_set_callback(req, notify_bench_done, state);
+		state->pending += 1;
+	}
+
+	/* The server has set up all watches once it answers the echo */
+	req = cli_echo_send(ev, ev, cli1, 1, data_blob_const("x", 1));
+	if ((req == NULL) || !tevent_req_poll(req, ev)
+	    || !NT_STATUS_IS_OK(cli_echo_recv(req))) {
+		printf("echo failed\n");
+		correct = false;
+		goto done;
+	}
+	TALLOC_FREE(req);
+
+	printf("%d recursive watches set up in %g secs\n", num_dirs,
+	       end_timer());
+
+	start_timer();
+
+	for (i = 0; i < torture_numops; i++) {
+		fstr_sprintf(name, "%s\\other\\file%d", dname, i);
+		fnum = cli_open(cli2, name, O_RDWR|O_CREAT, DENY_NONE);
+		if (fnum == -1) {
+			printf("create of %s failed (%s)\n", name,
+			       cli_errstr(cli2));
+			correct = false;
+			goto done;
+		}
+		cli_close(cli2, fnum);
+		cli_unlink(cli2, name);
+	}
+
+	printf("%d unwatched creates and deletes took %g secs\n",
+	       torture_numops, end_timer());
+
+	fstr_sprintf(name, "%s\\dir0\\sub", dname);
+	cli_mkdir(cli2, name);
+	fstr_sprintf(name, "%s\\dir0\\sub\\file", dname);
+	fnum = cli_open(cli2, name, O_RDWR|O_CREAT, DENY_NONE);
+	if (fnum == -1) {
+		printf("create of %s failed (%s)\n", name, cli_errstr(cli2));
+		correct = false;
+		goto done;
+	}
+	cli_close(cli2, fnum);
+
+	while (first.pending > 0) {
+		event_loop_once(ev);
+	}
+
+	/* FILE_NOTIFY_INFORMATION for "sub\file" */
+	if (!NT_STATUS_IS_OK(first.status) || (first.num_param < 12)
+	    || (IVAL(first.param, 4) != NOTIFY_ACTION_ADDED)
+	    || (IVAL(first.param, 8) != 2 * strlen("sub\\file"))) {
+		printf("notify for %s failed (%s)\n", name,
+		       nt_errstr(first.status));
+		correct = false;
+	}
+	TALLOC_FREE(first.param);
+
+	start_timer();
+
+	for (i = 0; i < torture_numops; i++) {
+		fstr_sprintf(name, "%s\\dir0\\sub\\file%d", dname, i);
+		fnum = cli_open(cli2, name, O_RDWR|O_CREAT, DENY_NONE);
+		if (fnum == -1) {
+			printf("create of %s failed (%s)\n", name,
+			       cli_errstr(cli2));
+			correct = false;
+			goto done;
+		}
+		cli_close(cli2, fnum);
+	}
+
+	printf("%d watched creates took %g secs\n", torture_numops,
+	       end_timer());
+
+	/* The queued changes, or a request to enumerate the directory */
+	SSVAL(setup, 4, fnums[0]);
+	req = cli_trans_send(ev, ev, cli1, SMBnttrans, NULL, -1,
+			     NT_TRANSACT_NOTIFY_CHANGE, 0,
+			     setup, 4, 0, NULL, 0, 1000, NULL, 0, 0);
+	if (req == NULL) {
+		printf("cli_trans_send failed\n");
+		correct = false;
+		goto done;
+	}
+	tevent_req_set_callback(req, notify_bench_done, &first);
+	first.pending += 1;
+
+	while (first.pending > 0) {
+		event_loop_once(ev);
+	}
+
+	if (!NT_STATUS_IS_OK(first.status)) {
+		printf("notify after %d creates failed (%s)\n",
+		       torture_numops, nt_errstr(first.status));
+		correct = false;
+	}
+	TALLOC_FREE(first.param);
+
+	start_timer();
+
+	for (i = 0; i < num_open; i++) {
+		req = cli_close_send(ev, ev, cli1, fnums[i]);
+		if (req == NULL) {
+			printf("cli_close_send failed\n");
+			correct = false;
+			goto done;
+		}
+		tevent_req_set_callback(req, notify_bench_close_done,
+					&closing);
+		closing += 1;
+	}
+	num_open = 0;
+
+	while ((closing > 0) || (rest.pending > 0)) {
+		event_loop_once(ev);
+	}
+
+	printf("%d recursive watches removed in %g secs\n", num_dirs,
+	       end_timer());
+
+ done:
+	for (i = 0; i < num_open; i++) {
+		cli_close(cli1, fnums[i]);
+	}
+	SAFE_FREE(fnums);
+	TALLOC_FREE(ev);
+
+	fstr_sprintf(name, "%s\\dir0\\sub\\file", dname);
+	cli_unlink(cli1, name);
+	for (i = 0; i < torture_numops; i++) {
+		fstr_sprintf(name, "%s\\dir0\\sub\\file%d", dname, i);
+		cli_unlink(cli1, name);
+	}
+	fstr_sprintf(name, "%s\\dir0\\sub", dname);
+	cli_rmdir(cli1, name);
+	fstr_sprintf(name, "%s\\other", dname);
+	cli_rmdir(cli1, name);
+	for (i = 0; i < num_dirs; i++) {
+		fstr_sprintf(name, "%s\\dir%d", dname, i);
+		cli_rmdir(cli1, name);
+	}
+	cli_rmdir(cli1, dname);
+
+	if (!torture_close_connection(cli1)) {
+		correct = false;
+	}
+	if (!torture_close_connection(cli2)) {
+		correct = false;
+	}
+
+	return correct;
+}
+
+/*
+  Go through the FILE_NOTIFY_INFORMATION entries of a notify reply:
+  remember the last action on a name of file_len bytes, and whether a
+  name of marker_len bytes showed up.
+ */
+static void notify_order_parse(const uint8_t *param, uint32_t num_param,
+			       uint32_t file_len, uint32_t marker_len,
+			       uint32_t *file_action, bool *marker_seen)
+{
+	uint32_t ofs = 0;
+
+	while (ofs + 12 <= num_param) {
+		uint32_t next = IVAL(param, ofs);
+		uint32_t name_len = IVAL(param, ofs + 8);
+
+		if (name_len == file_len) {
+			*file_action = IVAL(param, ofs + 4);
+		} else if (name_len == marker_len) {
+			*marker_seen = true;
+		}
+		if ((next == 0) || (ofs + next < ofs)) {
+			break;
+		}
+		ofs += next;
+	}
+}
+
+/*
+  Create, delete and re-create a file in a directory another connection
+  watches. The batched notify messages must keep the order, the watcher
+  has to see the file added last. A marker file created afterwards tells
+  us we have seen all changes.
+ */
+static bool run_notify_order(int dummy)
+{
+	struct cli_state *cli1, *cli2;
+	struct event_context *ev = NULL;
+	struct tevent_req *req;
+	struct notify_bench_state state;
+	const char *dname = "\\notify_order";
+	const char *fname = "\\notify_order\\file";
+	const char *mname = "\\notify_order\\marker";
+	uint32_t file_action = 0;
+	bool marker_seen = false;
+	uint16_t setup[4];
+	uint16_t dnum = 0;
+	int i, fnum;
+	bool correct = true;
+	NTSTATUS status;
+
+	printf("starting notify order test\n");
+
+	if (!torture_open_connection(&cli1, 0) ||
+	    !torture_open_connection(&cli2, 1)) {
+		return false;
+	}
+
+	ev = event_context_init(talloc_tos());
+	if (ev == NULL) {
+		printf("event_context_init failed\n");
+		return false;
+	}
+
+	cli_unlink(cli1, fname);
+	cli_unlink(cli1, mname);
+	cli_rmdir(cli1, dname);
+	cli_mkdir(cli1, dname);
+
+	status = cli_ntcreate(cli1, dname, 0, FILE_LIST_DIRECTORY, 0,
+			      FILE_SHARE_READ|FILE_SHARE_WRITE|
+			      FILE_SHARE_DELETE,
+			      FILE_OPEN, FILE_DIRECTORY_FILE, 0, &dnum);
+	if (!NT_STATUS_IS_OK(status)) {
+		printf("open of %s failed (%s)\n", dname, nt_errstr(status));
+		correct = false;
+		goto done;
+	}
+
+	SIVAL(setup, 0, FILE_NOTIFY_CHANGE_FILE_NAME);
+	SSVAL(setup, 4, dnum);
+	SSVAL(setup, 6, 0);
+
+	/* A reply may come back before all changes have arrived */
+	for (i = 0; (i < 5) && !marker_seen; i++) {
+		ZERO_STRUCT(state);
+
+		req = cli_trans_send(ev, ev, cli1, SMBnttrans, NULL, -1,
+				     NT_TRANSACT_NOTIFY_CHANGE, 0,
+				     setup, 4, 0, NULL, 0, 1000, NULL, 0, 0);
+		if (req == NULL) {
+			printf("cli_trans_send failed\n");
+			correct = false;
+			goto done;
+		}
+		tevent_req_set_callback(req, notify_bench_done, &state);
+		state.pending = 1;
+
+		if (i == 0) {
+			/* The server has the watch once it answers */
+			req = cli_echo_send(ev, ev, cli1, 1,
+					    data_blob_const("x", 1));
+			if ((req == NULL) || !tevent_req_poll(req, ev)
+			    || !NT_STATUS_IS_OK(cli_echo_recv(req))) {
+				printf("echo failed\n");
+				correct = false;
+				goto done;
+			}
+			TALLOC_FREE(req);
+
+			fnum = cli_open(cli2, fname, O_RDWR|O_CREAT,
+					DENY_NONE);
+			cli_close(cli2, fnum);
+			cli_unlink(cli2, fname);
+			fnum = cli_open(cli2, fname, O_RDWR|O_CREAT,
+					DENY_NONE);
+			if (fnum == -1) {
+				printf("create of %s failed (%s)\n", fname,
+				       cli_errstr(cli2));
+				correct = false;
+				goto done;
+			}
+			cli_close(cli2, fnum);
+
+			fnum = cli_open(cli2, mname, O_RDWR|O_CREAT,
+					DENY_NONE);
+			cli_close(cli2, fnum);
+		}
+
+		while (state.pending > 0) {
+			event_loop_once(ev);
+		}
+		if (!NT_STATUS_IS_OK(state.status)) {
+			printf("notify failed (%s)\n",
+			       nt_errstr(state.status));
+			correct = false;
+			goto done;
+		}
+		notify_order_parse(state.param, state.num_param,
+				   2 * strlen("file"), 2 * strlen("marker"),
+				   &file_action, &marker_seen);
+		TALLOC_FREE(state.param);
+	}
+
+	if (!marker_seen || (file_action != NOTIFY_ACTION_ADDED)) {
+		printf("file not reported as added last: action %u, "
+		       "marker %s\n", (unsigned)file_action,
+		       marker_seen ? "seen" : "not seen");
+		correct = false;
+	}
+
+ done:
+	cli_close(cli1, dnum);
+	TALLOC_FREE(ev);
+	cli_unlink(cli1, fname);
+	cli_unlink(cli1, mname);
+	cli_rmdir(cli1, dname);
+
+	if (!torture_close_connection(cli1)) {
+		correct = false;
+	}
+	if (!torture_close_connection(cli2)) {
+		correct = false;
+	}
+
+	return correct;
+}
+
+static bool run_cli_echo(int dummy)
+{
+	struct cli_state *cli;
+	NTSTATUS status;
+
+	printf("starting cli_echo test\n");
+	if (!torture_open_connection(&cli, 0)) {
+		return false;
+	}
+	cli_sockopt(cli, sockops);
+
+	status = cli_echo(cli, 5, data_blob_const("hello", 5));
+
+	d_printf("cli_echo returned %s\n", nt_errstr(status));
+
+	torture_close_connection(cli);
+	return NT_STATUS_IS_OK(status);
+}
+
+static bool run_uid_regression_test(int dummy)
+{
+	static struct cli_state *cli;
+	int16_t old_vuid;
+	bool correct = True;
+
+	printf("starting uid regression test\n");
+
+	if (!torture_open_connection(&cli, 0)) {
+		return False;
+	}
+
+	cli_sockopt(cli, sockops);
+
+	/* Ok - now save then logoff our current user. */
+	old_vuid = cli->vuid;
+
+	if (!cli_ulogoff(cli)) {
+		d_printf("(%s) cli_ulogoff failed: %s\n",
+			__location__, cli_errstr(cli));
+		correct = false;
+		goto out;
+	}
+
+	cli->vuid = old_vuid;
+
+	/* Try an operation. */
+	if (!NT_STATUS_IS_OK(cli_mkdir(cli, "\\uid_reg_test"))) {
+		/* We expect bad uid. */
+		if (!check_error(__LINE__, cli, ERRSRV, ERRbaduid,
+				NT_STATUS_NO_SUCH_USER)) {
+			return False;
+		}
+		goto out;
+	}
+
+	cli_rmdir(cli, "\\uid_reg_test");
+
+  out:
+
+	torture_close_connection(cli);
+	return correct;
+}
+
+static bool run_local_substitute(int dummy)
+{
+	bool ok = true;
+
+	ok &= subst_test("%U", "bla", "", -1, -1, "bla");
+	ok &= subst_test("%u%U", "bla", "", -1, -1, "blabla");
+	ok &= subst_test("%g", "", "", -1, -1, "NO_GROUP");
+	ok &= subst_test("%G", "", "", -1, -1, "NO_GROUP");
+	ok &= subst_test("%g", "", "", -1, 0, gidtoname(0));
+	ok &= subst_test("%G", "", "", -1, 0, gidtoname(0));
+	ok &= subst_test("%D%u", "u", "dom", -1, 0, "domu");
+	ok &= subst_test("%i %I", "", "", -1, -1, "0.0.0.0 0.0.0.0");
+
+	/* Different captialization rules in sub_basic... */
+
+	ok &=  (strcmp(talloc_sub_basic(talloc_tos(), "BLA", "dom", "%U%D"),
+		       "blaDOM") == 0);
+
+	return ok;
+}
+
+static void gencache_sweep_test_fn(const char *key, const char *value,
+				   time_t timeout, void *priv)
+{
+	int *num_found = (int *)priv;
+	*num_found += 1;
+}
+
+static bool run_local_gencache(int dummy)
+{
+	char *val;
+	time_t tm;
+	DATA_BLOB blob;
+	int num_found;
+
+	if (!gencache_init()) {
+		d_printf("%s: gencache_init() failed\n", __location__);
+		return False;
+	}
+
+	if (!gencache_set("foo", "bar", time(NULL) + 1000)) {
+		d_printf("%s: gencache_set() failed\n", __location__);
+		return False;
+	}
+
+	if (!gencache_get("foo", &val, &tm)) {
+		d_printf("%s: gencache_get() failed\n", __location__);
+		return False;
+	}
+
+	if (strcmp(val, "bar") != 0) {
+		d_printf("%s: gencache_get() returned %s, expected %s\n",
+			 __location__, val, "bar");
+		SAFE_FREE(val);
+		return False;
+	}
+
+	SAFE_FREE(val);
+
+	if (!gencache_del("foo")) {
+		d_printf("%s: gencache_del() failed\n", __location__);
+		return False;
+	}
+	if (gencache_del("foo")) {
+		d_printf("%s: second gencache_del() succeeded\n",
+			 __location__);
+		return False;
+	}
+			
+	if (gencache_get("foo", &val, &tm)) {
+		d_printf("%s: gencache_get() on deleted entry "
+			 "succeeded\n", __location__);
+		return False;
+	}
+
+	blob = data_blob_string_const_null("bar");
+	tm = time(NULL);
+
+	if (!gencache_set_data_blob("foo", &blob, tm)) {
+		d_printf("%s: gencache_set_data_blob() failed\n", __location__);
+		return False;
+	}
+
+	if (!gencache_get_data_blob("foo", &blob, NULL)) {
+		d_printf("%s: gencache_get_data_blob() failed\n", __location__);
+		return False;
+	}
+
+	if (strcmp((const char *)blob.data, "bar") != 0) {
+		d_printf("%s: gencache_get_data_blob() returned %s, expected %s\n",
+			 __location__, (const char *)blob.data, "bar");
+		data_blob_free(&blob);
+		return False;
+	}
+
+	data_blob_free(&blob);
+
+	if (!gencache_del("foo")) {
+		d_printf("%s: gencache_del() failed\n", __location__);
+		return False;
+	}
+	if (gencache_del("foo")) {
+		d_printf("%s: second gencache_del() succeeded\n",
+			 __location__);
+		return False;
+	}
+
+	if (gencache_get_data_blob("foo", &blob, NULL)) {
+		d_printf("%s: gencache_get_data_blob() on deleted entry "
+			 "succeeded\n", __location__);
+		return False;
+	}
+
+	if (!gencache_set("sweep_expired", "old", time(NULL) - 10)
+	    || !gencache_set("sweep_valid", "new", time(NULL) + 1000)) {
+		d_printf("%s: gencache_set() failed\n", __location__);
+		return False;
+	}
+
+	if (gencache_sweep(100) < 1) {
+		d_printf("%s: gencache_sweep() did not sweep anything\n",
+			 __location__);
+		return False;
+	}
+
+	num_found = 0;
+	gencache_iterate(gencache_sweep_test_fn, &num_found, "sweep_expired");
+	if (num_found != 0) {
+		d_printf("%s: gencache_sweep() left the expired entry\n",
+			 __location__);
+		return False;
+	}
+
+	num_found = 0;
+	gencache_iterate(gencache_sweep_test_fn, &num_found, "sweep_valid");
+	if (num_found != 1) {
+		d_printf("%s: gencache_sweep() removed a valid entry\n",
+			 __location__);
+		return False;
+	}
+
+	if (!gencache_del("sweep_valid")) {
+		d_printf("%s: gencache_del() failed\n", __location__);
+		return False;
+	}
+
+	if (!gencache_set_writebehind("foo", "queued", time(NULL) + 1000)) {
+		d_printf("%s: gencache_set_writebehind() failed\n",
+			 __location__);
+		return False;
+	}
+
+	if (!gencache_get("foo", &val, &tm)) {
+		d_printf("%s: gencache_get() on queued entry failed\n",
+			 __location__);
+		return False;
+	}
+
+	if (strcmp(val, "queued") != 0) {
+		d_printf("%s: gencache_get() returned %s, expected %s\n",
+			 __location__, val, "queued");
+		SAFE_FREE(val);
+		return False;
+	}
+
+	SAFE_FREE(val);
+
+	if (!gencache_del("foo")) {
+		d_printf("%s: gencache_del() of queued entry failed\n",
+			 __location__);
+		return False;
+	}
+	if (gencache_get("foo", &val, &tm)) {
+		d_printf("%s: gencache_get() on deleted queued entry "
+			 "succeeded\n", __location__);
+		return False;
+	}
+
+	if (!gencache_set_writebehind("foo", "written", time(NULL) + 1000)) {
+		d_printf("%s: gencache_set_writebehind() failed\n",
+			 __location__);
+		return False;
+	}
+
+	if (!gencache_shutdown()) {
+		d_printf("%s: gencache_shutdown() failed\n", __location__);
+		return False;
+	}
+
+	/* shutdown must have written the queued entry */
+	if (!gencache_get("foo", &val, &tm)) {
+		d_printf("%s: queued entry was not written\n", __location__);
+		return False;
+	}
+	SAFE_FREE(val);
+
+	if (!gencache_del("foo") || !gencache_shutdown()) {
+		d_printf("%s: cleanup failed\n", __location__);
+		return False;
+	}
+
+	if (gencache_shutdown()) {
+		d_printf("%s: second gencache_shutdown() succeeded\n",
+			 __location__);
+		return False;
+	}
+
+	return True;
+}
+
+static bool rbt_testval(struct db_context *db, const char *key,
+			const char *value)
+{
+	struct db_record *rec;
+	TDB_DATA data = string_tdb_data(value);
+	bool ret = false;
+	NTSTATUS status;
+
+	rec = db->fetch_locked(db, db, string_tdb_data(key));
+	if (rec == NULL) {
+		d_fprintf(stderr, "fetch_locked failed\n");
+		goto done;
+	}
+	status = rec->store(rec, data, 0);
+	if (!NT_STATUS_IS_OK(status)) {
+		d_fprintf(stderr, "store failed: %s\n", nt_errstr(status));
+		goto done;
+	}
+	TALLOC_FREE(rec);
+
+	rec = db->fetch_locked(db, db, string_tdb_data(key));
+	if (rec == NULL) {
+		d_fprintf(stderr, "second fetch_locked failed\n");
+		goto done;
+	}
+	if ((rec->value.dsize != data.dsize)
+	    || (memcmp(rec->value.dptr, data.dptr, data.dsize) != 0)) {
+		d_fprintf(stderr, "Got wrong data back\n");
+		goto done;
+	}
+
+	ret = true;
+ done:
+	TALLOC_FREE(rec);
+	return ret;
+}
+
+static bool run_local_rbtree(int dummy)
+{
+	struct db_context *db;
+	bool ret = false;
+	int i;
+
+	db = db_open_rbt(NULL);
+
+	if (db == NULL) {
+		d_fprintf(stderr, "db_open_rbt failed\n");
+		return false;
+	}
+
+	for (i=0; i<1000; i++) {
+		char *key, *value;
+
+		if (asprintf(&key, "key%ld", random()) == -1) {
+			goto done;
+		}
+		if (asprintf(&value, "value%ld", random()) == -1) {
+			SAFE_FREE(key);
+			goto done;
+		}
+
+		if (!rbt_testval(db, key, value)) {
+			SAFE_FREE(key);
+			SAFE_FREE(value);
+			goto done;
+		}
+
+		SAFE_FREE(value);
+		if (asprintf(&value, "value%ld", random()) == -1) {
+			SAFE_FREE(key);
+			goto done;
+		}
+
+		if (!rbt_testval(db, key, value)) {
+			SAFE_FREE(key);
+			SAFE_FREE(value);
+			goto done;
+		}
+
+		SAFE_FREE(key);
+		SAFE_FREE(value);
+	}
+
+	ret = true;
+
+ done:
+	TALLOC_FREE(db);
+	return ret;
+}
+
+static bool dbcache_check(struct db_context *db, const char *key,
+			  const char *expected)
+{
+	TDB_DATA data;
+	bool ret;
+
+	data = dbwrap_fetch_bystring(db, talloc_tos(), key);
+
+	if (expected == NULL) {
+		ret = (data.dptr == NULL);
+	} else {
+		ret = ((data.dptr != NULL)
+		       && (data.dsize == strlen(expected)+1)
+		       && (memcmp(data.dptr, expected, data.dsize) == 0));
+	}
+	if (!ret) {
+		d_fprintf(stderr, "Got wrong data for %s, expected %s\n",
+			  key, expected ? expected : "(none)");
+	}
+	TALLOC_FREE(data.dptr);
+	return ret;
+}
+
+static bool run_local_dbwrap_cache(int dummy)
+{
+	struct db_context *db;
+	const char *path = lock_path("dbwrap_cache_test.tdb");
+	bool ret = false;
+	int i;
+
+	db = db_open(NULL, path, 0, TDB_SEQNUM|TDB_CLEAR_IF_FIRST,
+		     O_RDWR|O_CREAT, 0600);
+	if (db == NULL) {
+		d_fprintf(stderr, "db_open failed\n");
+		return false;
+	}
+	db = db_open_cache(NULL, db);
+
+	if (!dbcache_check(db, "key", NULL)
+	    || !dbcache_check(db, "key", NULL)) {
+		goto done;
+	}
+
+	for (i=0; i<10; i++) {
+		char *value = talloc_asprintf(talloc_tos(), "value%d", i);
+
+		if (!NT_STATUS_IS_OK(dbwrap_store_bystring(
+					     db, "key", string_term_tdb_data(value),
+					     TDB_REPLACE))) {
+			d_fprintf(stderr, "store failed\n");
+			goto done;
+		}
+		/* The second fetch is served from the cache */
+		if (!dbcache_check(db, "key", value)
+		    || !dbcache_check(db, "key", value)) {
+			goto done;
+		}
+		TALLOC_FREE(value);
+	}
+
+	if (db->transaction_start(db) != 0) {
+		d_fprintf(stderr, "transaction_start failed\n");
+		goto done;
+	}
+	dbwrap_store_bystring(db, "key", string_term_tdb_data("cancelled"),
+			      TDB_REPLACE);
+	if (!dbcache_check(db, "key", "cancelled")) {
+		goto done;
+	}
+	db->transaction_cancel(db);
+
+	if (!dbcache_check(db, "key", "value9")) {
+		goto done;
+	}
+
+	dbwrap_delete_bystring(db, "key");
+	if (!dbcache_check(db, "key", NULL)) {
+		goto done;
+	}
+
+	ret = true;
  done:
-	TALLOC_FREE(rec);
+	TALLOC_FREE(db);
+	unlink(path);
 	return ret;
 }
 
-static bool run_local_rbtree(int dummy)
+static int dbwrap_trans_loop(struct db_context *db, int procnum)
+{
+	int i, failed = 0;
+	double seconds;
+
+	start_timer();
+	for (i=0; i<torture_numops; i++) {
+		char *key = talloc_asprintf(talloc_tos(), "trans%d", i % 10);
+		char *value = talloc_asprintf(talloc_tos(), "%d/%d",
+					      procnum, i);
+
+		if (db->transaction_start(db) != 0) {
+			d_fprintf(stderr, "transaction_start failed\n");
+			failed += 1;
+			continue;
+		}
+		dbwrap_store_bystring(db, key, string_term_tdb_data(value),
+				      TDB_REPLACE);
+		if (db->transaction_commit(db) != 0) {
+			failed += 1;
+		}
+		TALLOC_FREE(key);
+		TALLOC_FREE(value);
+	}
+	seconds = end_timer();
+
+	printf("process %d: %d transactions, %d failed, %.1f usecs each\n",
+	       procnum, torture_numops, failed,
+	       seconds * 1000000 / torture_numops);
+
+	return failed;
+}
+
+/*
+ * Time persistent transactions. Run with -N to have several processes
+ * (possibly on several nodes) commit to the same few records, the
+ * commits then conflict and have to be retried.
+ */
+
+static bool run_local_dbwrap_trans(int procnum)
+{
+	struct db_context *db;
+	int failed;
+
+	if (!lp_clustering()) {
+		printf("not clustered, skipping\n");
+		return true;
+	}
+
+	db = db_open(NULL, lock_path("torture_trans.tdb"), 0, TDB_DEFAULT,
+		     O_RDWR|O_CREAT, 0600);
+	if (db == NULL) {
+		d_fprintf(stderr, "db_open failed\n");
+		return false;
+	}
+
+	failed = dbwrap_trans_loop(db, procnum);
+
+	TALLOC_FREE(db);
+	return (failed == 0);
+}
+
+#ifdef CLUSTER_SUPPORT
+
+/*
+ * A stand-in for ctdbd, just enough of it to run dbwrap_ctdb without a
+ * cluster. It plays node 0, our node. Records of volatile databases
+ * start out on a simulated node 1, every request that needs node 1 costs
+ * latency_msecs. Requests that are already queued when the first of
+ * them is processed share that round trip, like ctdbd working on them
+ * in parallel.
+ *
+ * For persistent databases it can report every n-th commit as failed on
+ * another node, so that the replay and retry path is taken as well. The
+ * stand-in checks that only the transaction notifications are sent
+ * without asking for a reply, and that each of them arrives before the
+ * next commit.
+ */
+
+#define STANDIN_CTDBD_DB_ID 0x5a5a0001
+#define STANDIN_CTDBD_NUM_DBS 2
+#define STANDIN_CTDBD_REMOTE_VNN 1
+
+struct standin_ctdbd_state {
+	uint32_t fail_every;
+	uint32_t latency_msecs;
+	uint32_t remote_records;
+	uint32_t commits;
+	uint32_t failed_commits;
+	uint32_t notifications;
+	uint32_t fetches;
+	uint32_t migrations;
+	uint32_t delegations;
+	uint32_t revokes;
+	uint32_t round_trips;
+	uint32_t replies;
+	uint32_t errors;
+};
+
+static volatile struct standin_ctdbd_state *standin_state;
+
+struct standin_ctdbd_db {
+	uint32_t db_id;
+	char *path;
+	struct tdb_context *tdb;
+	struct tdb_context *remote;
+	bool readonly;
+	bool notification_due;
+	bool retry_due;
+};
+
+struct standin_ctdbd {
+	struct standin_ctdbd_db dbs[STANDIN_CTDBD_NUM_DBS];
+	int num_dbs;
+	bool round_trip_done;
+};
+
+static void standin_ctdbd_error(const char *msg, uint32_t opcode)
+{
+	printf("stand-in ctdbd: %s (opcode %u)\n", msg, (unsigned)opcode);
+	standin_state->errors += 1;
+}
+
+static struct standin_ctdbd_db *standin_ctdbd_find_db(
+	struct standin_ctdbd *s, uint32_t db_id)
+{
+	int i;
+
+	for (i=0; i<s->num_dbs; i++) {
+		if (s->dbs[i].db_id == db_id) {
+			return &s->dbs[i];
+		}
+	}
+	return NULL;
+}
+
+static void standin_ctdbd_round_trip(struct standin_ctdbd *s)
+{
+	if (s->round_trip_done) {
+		return;
+	}
+	smb_msleep(standin_state->latency_msecs);
+	standin_state->round_trips += 1;
+	s->round_trip_done = true;
+}
+
+static bool standin_ctdbd_send(int fd, struct ctdb_req_header *hdr,
+			       size_t hdrlen, TDB_DATA data)
+{
+	hdr->length = hdrlen + data.dsize;
+	hdr->ctdb_magic = CTDB_MAGIC;
+	hdr->ctdb_version = CTDB_VERSION;
+	hdr->generation = 1;
+
+	if (write_data(fd, (char *)hdr, hdrlen) != hdrlen) {
+		return false;
+	}
+	if ((data.dsize != 0)
+	    && (write_data(fd, (char *)data.dptr, data.dsize) != data.dsize)) {
+		return false;
+	}
+	standin_state->replies += 1;
+	return true;
+}
+
+static bool standin_ctdbd_reply_control(int fd, uint32_t reqid,
+					int32_t status, TDB_DATA data)
+{
+	struct ctdb_reply_control r;
+
+	ZERO_STRUCT(r);
+	r.hdr.operation = CTDB_REPLY_CONTROL;
+	r.hdr.reqid = reqid;
+	r.status = status;
+	r.datalen = data.dsize;
+
+	return standin_ctdbd_send(
+		fd, &r.hdr, offsetof(struct ctdb_reply_control, data), data);
+}
+
+static bool standin_ctdbd_store(struct tdb_context *tdb, TDB_DATA key,
+				uint32_t dmaster, uint32_t flags,
+				TDB_DATA data)
+{
+	struct ctdb_ltdb_header header;
+	TDB_DATA rec;
+	int ret;
+
+	ZERO_STRUCT(header);
+	header.dmaster = dmaster;
+#ifdef HAVE_CTDB_WANT_READONLY_DECL
+	header.flags = flags;
+#endif
+
+	rec.dsize = sizeof(header) + data.dsize;
+	rec.dptr = talloc_array(talloc_tos(), uint8_t, rec.dsize);
+	if (rec.dptr == NULL) {
+		return false;
+	}
+	memcpy(rec.dptr, &header, sizeof(header));
+	if (data.dsize != 0) {
+		memcpy(rec.dptr + sizeof(header), data.dptr, data.dsize);
+	}
+
+	ret = tdb_store(tdb, key, rec, TDB_REPLACE);
+	TALLOC_FREE(rec.dptr);
+	return (ret == 0);
+}
+
+/*
+ * Make us the dmaster of a record, what ctdbd does for an immediate
+ * migration call. A record still on node 1 comes over with its data,
+ * which also revokes a read-only copy we might have.
+ */
+
+static bool standin_ctdbd_migrate(struct standin_ctdbd *s,
+				  struct standin_ctdbd_db *db, TDB_DATA key)
+{
+	TDB_DATA local, data;
+	bool ok;
+
+	standin_state->migrations += 1;
+
+	local = tdb_fetch(db->tdb, key);
+
+	if (db->remote != NULL) {
+		data = tdb_fetch(db->remote, key);
+		if (data.dptr != NULL) {
+			standin_ctdbd_round_trip(s);
+			if (local.dptr != NULL) {
+				standin_state->revokes += 1;
+			}
+			SAFE_FREE(local.dptr);
+			tdb_delete(db->remote, key);
+			ok = standin_ctdbd_store(db->tdb, key, 0, 0, data);
+			SAFE_FREE(data.dptr);
+			return ok;
+		}
+	}
+
+	if (local.dsize < sizeof(struct ctdb_ltdb_header)) {
+		SAFE_FREE(local.dptr);
+		return standin_ctdbd_store(db->tdb, key, 0, 0, tdb_null);
+	}
+
+	((struct ctdb_ltdb_header *)local.dptr)->dmaster = 0;
+	ok = (tdb_store(db->tdb, key, local, TDB_REPLACE) == 0);
+	SAFE_FREE(local.dptr);
+	return ok;
+}
+
+/*
+ * Read a record without migrating it. If the database allows it, a
+ * record from node 1 leaves a read-only copy in our tdb.
+ */
+
+static bool standin_ctdbd_fetch(struct standin_ctdbd *s,
+				struct standin_ctdbd_db *db, TDB_DATA key,
+				uint32_t flags, TALLOC_CTX *mem_ctx,
+				TDB_DATA *data)
+{
+	TDB_DATA rec;
+
+	standin_state->fetches += 1;
+	*data = tdb_null;
+
+	rec = tdb_fetch(db->tdb, key);
+	if ((rec.dsize >= sizeof(struct ctdb_ltdb_header))
+	    && (((struct ctdb_ltdb_header *)rec.dptr)->dmaster == 0)) {
+		*data = make_tdb_data(
+			(uint8_t *)talloc_memdup(
+				mem_ctx,
+				rec.dptr + sizeof(struct ctdb_ltdb_header),
+				rec.dsize - sizeof(struct ctdb_ltdb_header)),
+			rec.dsize - sizeof(struct ctdb_ltdb_header));
+		SAFE_FREE(rec.dptr);
+		return true;
+	}
+	SAFE_FREE(rec.dptr);
+
+	if (db->remote == NULL) {
+		return true;
+	}
+	rec = tdb_fetch(db->remote, key);
+	if (rec.dptr == NULL) {
+		return true;
+	}
+	standin_ctdbd_round_trip(s);
+
+	*data = make_tdb_data((uint8_t *)talloc_memdup(mem_ctx, rec.dptr,
+						       rec.dsize),
+			      rec.dsize);
+	SAFE_FREE(rec.dptr);
+
+#ifdef HAVE_CTDB_WANT_READONLY_DECL
+	if (db->readonly && (flags & CTDB_WANT_READONLY)) {
+		standin_state->delegations += 1;
+		return standin_ctdbd_store(db->tdb, key,
+					   STANDIN_CTDBD_REMOTE_VNN,
+					   CTDB_REC_RO_HAVE_READONLY, *data);
+	}
+#endif
+	return true;
+}
+
+static bool standin_ctdbd_call(int fd, struct standin_ctdbd *s,
+			       struct ctdb_req_call *c)
+{
+	struct standin_ctdbd_db *db;
+	struct ctdb_reply_call r;
+	TDB_DATA key, data = tdb_null;
+	bool ok;
+
+	db = standin_ctdbd_find_db(s, c->db_id);
+	if (db == NULL) {
+		return false;
+	}
+	key = make_tdb_data(c->data, c->keylen);
+
+	if (c->callid == CTDB_FETCH_FUNC) {
+		ok = standin_ctdbd_fetch(s, db, key, c->flags, talloc_tos(),
+					 &data);
+	} else {
+		ok = standin_ctdbd_migrate(s, db, key);
+	}
+	if (!ok) {
+		return false;
+	}
+
+	ZERO_STRUCT(r);
+	r.hdr.operation = CTDB_REPLY_CALL;
+	r.hdr.reqid = c->hdr.reqid;
+	r.datalen = data.dsize;
+
+	ok = standin_ctdbd_send(
+		fd, &r.hdr, offsetof(struct ctdb_reply_call, data), data);
+	TALLOC_FREE(data.dptr);
+	return ok;
+}
+
+static bool standin_ctdbd_attach(struct standin_ctdbd *s,
+				 struct ctdb_req_control *c, bool persistent,
+				 TDB_DATA *data)
+{
+	struct standin_ctdbd_db *db;
+	uint32_t i;
+
+	if ((c->datalen == 0) || (c->data[c->datalen-1] != '\0')
+	    || (s->num_dbs == STANDIN_CTDBD_NUM_DBS)) {
+		return false;
+	}
+
+	db = &s->dbs[s->num_dbs];
+	db->db_id = STANDIN_CTDBD_DB_ID + s->num_dbs;
+	db->path = talloc_asprintf(talloc_autofree_context(), "%s.standin",
+				   lock_path((char *)c->data));
+	if (db->path == NULL) {
+		return false;
+	}
+	db->tdb = tdb_open(db->path, 0, TDB_DEFAULT, O_RDWR|O_CREAT|O_TRUNC,
+			   0600);
+	if (db->tdb == NULL) {
+		return false;
+	}
+
+	if (!persistent) {
+		db->remote = tdb_open("remote", 0, TDB_INTERNAL, O_RDWR, 0);
+		if (db->remote == NULL) {
+			return false;
+		}
+		for (i=0; i<standin_state->remote_records; i++) {
+			char *key = talloc_asprintf(talloc_tos(), "remote%u",
+						    (unsigned)i);
+			char *value = talloc_asprintf(talloc_tos(),
+						      "value%u", (unsigned)i);
+
+			if ((key == NULL) || (value == NULL)
+			    || (tdb_store(db->remote,
+					  string_term_tdb_data(key),
+					  string_term_tdb_data(value),
+					  TDB_REPLACE) != 0)) {
+				return false;
+			}
+			TALLOC_FREE(key);
+			TALLOC_FREE(value);
+		}
+	}
+
+	s->num_dbs += 1;
+	*data = make_tdb_data((uint8_t *)&db->db_id, sizeof(db->db_id));
+	return true;
+}
+
+static bool standin_ctdbd_control(int fd, struct standin_ctdbd *s,
+				  struct ctdb_req_control *c)
+{
+	struct standin_ctdbd_db *db = NULL;
+	TDB_DATA data = tdb_null;
+	int32_t status = 0;
+
+	if ((c->flags & CTDB_CTRL_FLAG_NOREPLY)
+	    && (c->opcode != CTDB_CONTROL_TRANS2_FINISHED)
+	    && (c->opcode != CTDB_CONTROL_TRANS2_ERROR)) {
+		standin_ctdbd_error("unexpected NOREPLY", c->opcode);
+	}
+
+	switch (c->opcode) {
+	case CTDB_CONTROL_GETDBPATH:
+	case CTDB_CONTROL_SET_DB_READONLY:
+		if (c->datalen == sizeof(uint32_t)) {
+			db = standin_ctdbd_find_db(s, *(uint32_t *)c->data);
+		}
+		break;
+	case CTDB_CONTROL_TRANS2_COMMIT:
+	case CTDB_CONTROL_TRANS2_COMMIT_RETRY:
+	case CTDB_CONTROL_TRANS2_FINISHED:
+	case CTDB_CONTROL_TRANS2_ERROR:
+		db = standin_ctdbd_find_db(s, (uint32_t)c->srvid);
+		break;
+	default:
+		break;
+	}
+
+	switch (c->opcode) {
+	case CTDB_CONTROL_DB_ATTACH:
+	case CTDB_CONTROL_DB_ATTACH_PERSISTENT:
+		if (!standin_ctdbd_attach(
+			    s, c,
+			    (c->opcode == CTDB_CONTROL_DB_ATTACH_PERSISTENT),
+			    &data)) {
+			status = -1;
+		}
+		break;
+	case CTDB_CONTROL_GETDBPATH:
+		if (db == NULL) {
+			status = -1;
+			break;
+		}
+		data = string_term_tdb_data(db->path);
+		break;
+	case CTDB_CONTROL_SET_DB_READONLY:
+		if (db == NULL) {
+			status = -1;
+			break;
+		}
+		db->readonly = true;
+		break;
+	case CTDB_CONTROL_TRANS2_COMMIT:
+	case CTDB_CONTROL_TRANS2_COMMIT_RETRY:
+		if (db == NULL) {
+			status = -1;
+			break;
+		}
+		if (db->notification_due) {
+			standin_ctdbd_error("commit before notification",
+					    c->opcode);
+		}
+		if (db->retry_due
+		    != (c->opcode == CTDB_CONTROL_TRANS2_COMMIT_RETRY)) {
+			standin_ctdbd_error("unexpected commit type",
+					    c->opcode);
+		}
+		standin_state->commits += 1;
+		db->retry_due = false;
+		if ((c->opcode == CTDB_CONTROL_TRANS2_COMMIT)
+		    && (standin_state->fail_every != 0)
+		    && (standin_state->commits % standin_state->fail_every
+			== 0)) {
+			standin_state->failed_commits += 1;
+			db->retry_due = true;
+			status = CTDB_TRANS2_COMMIT_SOMEFAIL;
+			break;
+		}
+		db->notification_due = true;
+		break;
+	case CTDB_CONTROL_TRANS2_FINISHED:
+	case CTDB_CONTROL_TRANS2_ERROR:
+		if ((db == NULL) || !db->notification_due) {
+			standin_ctdbd_error("unexpected notification",
+					    c->opcode);
+		} else {
+			db->notification_due = false;
+		}
+		standin_state->notifications += 1;
+		if (!(c->flags & CTDB_CTRL_FLAG_NOREPLY)) {
+			standin_ctdbd_error("notification waits for reply",
+					    c->opcode);
+		}
+		break;
+	default:
+		/*
+		 * GET_PNN (we are node 0), REGISTER_SRVID, PROCESS_EXISTS,
+		 * TCP_CLIENT and friends just succeed
+		 */
+		break;
+	}
+
+	if (c->flags & CTDB_CTRL_FLAG_NOREPLY) {
+		return true;
+	}
+	return standin_ctdbd_reply_control(fd, c->hdr.reqid, status, data);
+}
+
+static bool standin_ctdbd_pending(int fd)
+{
+	struct timeval tv;
+	fd_set rfds;
+
+	FD_ZERO(&rfds);
+	FD_SET(fd, &rfds);
+	ZERO_STRUCT(tv);
+
+	return (sys_select(fd+1, &rfds, NULL, NULL, &tv) == 1);
+}
+
+static uint8_t *standin_ctdbd_read(int fd, TALLOC_CTX *mem_ctx)
+{
+	uint32_t length;
+	uint8_t *buf;
+
+	if (!NT_STATUS_IS_OK(read_data(fd, (char *)&length,
+				       sizeof(length)))
+	    || (length < sizeof(struct ctdb_req_header))) {
+		return NULL;
+	}
+	buf = talloc_array(mem_ctx, uint8_t, length);
+	if (buf == NULL) {
+		return NULL;
+	}
+	memcpy(buf, &length, sizeof(length));
+	if (!NT_STATUS_IS_OK(read_data(fd, (char *)buf + sizeof(length),
+				       length - sizeof(length)))) {
+		TALLOC_FREE(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+static bool standin_ctdbd_handle(int fd, struct standin_ctdbd *s,
+				 uint8_t *buf)
+{
+	struct ctdb_req_header *hdr = (struct ctdb_req_header *)buf;
+
+	switch (hdr->operation) {
+	case CTDB_REQ_CALL:
+		return standin_ctdbd_call(fd, s, (struct ctdb_req_call *)buf);
+	case CTDB_REQ_CONTROL:
+		return standin_ctdbd_control(fd, s,
+					     (struct ctdb_req_control *)buf);
+	default:
+		break;
+	}
+	return true;
+}
+
+static void standin_ctdbd(int listen_fd)
+{
+	struct standin_ctdbd s;
+	int fd;
+
+	ZERO_STRUCT(s);
+
+	while ((fd = accept(listen_fd, NULL, NULL)) != -1) {
+		uint8_t **bufs = NULL;
+		uint8_t *buf;
+		int i, num_bufs = 0;
+		bool ok = true;
+
+		while (ok && ((buf = standin_ctdbd_read(fd, NULL)) != NULL)) {
+
+			/*
+			 * Everything the client sent before waiting for a
+			 * reply shares one round trip to node 1
+			 */
+			do {
+				bufs = talloc_realloc(NULL, bufs, uint8_t *,
+						      num_bufs+1);
+				if (bufs == NULL) {
+					_exit(1);
+				}
+				bufs[num_bufs++] = talloc_move(bufs, &buf);
+			} while (standin_ctdbd_pending(fd)
+				 && ((buf = standin_ctdbd_read(fd, NULL))
+				     != NULL));
+
+			s.round_trip_done = false;
+
+			for (i=0; ok && (i<num_bufs); i++) {
+				ok = standin_ctdbd_handle(fd, &s, bufs[i]);
+			}
+			TALLOC_FREE(bufs);
+			num_bufs = 0;
+		}
+		close(fd);
+	}
+}
+
+static void standin_release_ip(const char *ip_addr, void *private_data)
+{
+	return;
+}
+
+/*
+ * Run persistent transactions against the stand-in and time them
+ */
+
+static bool standin_ctdbd_trans(void)
+{
+	struct db_context *db;
+	struct sockaddr_storage server, client;
+	NTSTATUS status;
+	int failed;
+
+	db = db_open(NULL, lock_path("torture_ctdb_trans.tdb"), 0,
+		     TDB_DEFAULT, O_RDWR|O_CREAT, 0600);
+	if (db == NULL) {
+		printf("db_open failed\n");
+		return false;
+	}
+
+	printf("without conflicts: ");
+	failed = dbwrap_trans_loop(db, 0);
+
+	standin_state->fail_every = 5;
+	printf("every 5th commit conflicting: ");
+	failed += dbwrap_trans_loop(db, 0);
+
+	TALLOC_FREE(db);
+
+	/*
+	 * Registering a client connection must still wait for ctdbd's
+	 * reply
+	 */
+	interpret_string_addr(&server, "127.0.0.1", AI_NUMERICHOST);
+	interpret_string_addr(&client, "127.0.0.2", AI_NUMERICHOST);
+	status = ctdbd_register_ips(messaging_ctdbd_connection(),
+				    &server, &client,
+				    standin_release_ip, NULL);
+	if (!NT_STATUS_IS_OK(status)) {
+		printf("ctdbd_register_ips failed: %s\n", nt_errstr(status));
+		return false;
+	}
+
+	/*
+	 * The notifications don't have a reply. Once this is answered
+	 * ctdbd has seen all of them.
+	 */
+	if (!ctdbd_process_exists(messaging_ctdbd_connection(), 0,
+				  sys_getpid())) {
+		printf("ctdbd_process_exists failed\n");
+		return false;
+	}
+
+	printf("%u commits, %u failed and retried, %u notifications\n",
+	       (unsigned)standin_state->commits,
+	       (unsigned)standin_state->failed_commits,
+	       (unsigned)standin_state->notifications);
+
+	if (failed != 0) {
+		return false;
+	}
+	if ((standin_state->commits
+	     != 2 * torture_numops + standin_state->failed_commits)
+	    || (standin_state->notifications != 2 * torture_numops)) {
+		printf("expected %d notifications\n", 2 * torture_numops);
+		return false;
+	}
+	return true;
+}
+
+static TDB_DATA *standin_remote_keys(TALLOC_CTX *mem_ctx, int first,
+				     int num)
+{
+	TDB_DATA *keys;
+	int i;
+
+	keys = TALLOC_ARRAY(mem_ctx, TDB_DATA, num);
+	if (keys == NULL) {
+		return NULL;
+	}
+	for (i=0; i<num; i++) {
+		char *key = talloc_asprintf(keys, "remote%d", first + i);
+		if (key == NULL) {
+			TALLOC_FREE(keys);
+			return NULL;
+		}
+		keys[i] = string_term_tdb_data(key);
+	}
+	return keys;
+}
+
+/*
+ * Lock all of "keys" one after the other, as smbd does
+ */
+
+static bool standin_lock_records(struct db_context *db, TDB_DATA *keys,
+				 int num)
+{
+	int i;
+
+	for (i=0; i<num; i++) {
+		struct db_record *rec;
+
+		rec = db->fetch_locked(db, talloc_tos(), keys[i]);
+		if (rec == NULL) {
+			printf("fetch_locked failed\n");
+			return false;
+		}
+		TALLOC_FREE(rec);
+	}
+	return true;
+}
+
+/*
+ * Read records held by another node twice, the second pass has to be
+ * served from read-only copies. Then lock them, which has to take the
+ * records over. Finally compare locking records one by one against
+ * migrating them in one batch first.
+ */
+
+#define STANDIN_REMOTE_BATCH 20
+
+static bool standin_ctdbd_readonly(void)
 {
+	TALLOC_CTX *frame = talloc_stackframe();
 	struct db_context *db;
+	TDB_DATA *keys;
+	uint32_t fetches, migrations, round_trips;
+	double seconds;
+	int i, pass;
 	bool ret = false;
-	int i;
 
-	db = db_open_rbt(NULL);
+	lp_do_parameter(-1, "ctdb readonly:torture_ctdb_ro.tdb", "yes");
 
+	db = db_open(frame, lock_path("torture_ctdb_ro.tdb"), 0,
+		     TDB_CLEAR_IF_FIRST, O_RDWR|O_CREAT, 0600);
 	if (db == NULL) {
-		d_fprintf(stderr, "db_open_rbt failed\n");
-		return false;
+		printf("db_open failed\n");
+		goto done;
 	}
 
-	for (i=0; i<1000; i++) {
-		char *key, *value;
+	keys = standin_remote_keys(frame, 0, STANDIN_REMOTE_BATCH);
+	if (keys == NULL) {
+		goto done;
+	}
 
-		if (asprintf(&key, "key%ld", random()) == -1) {
-			goto done;
-		}
-		if (asprintf(&value, "value%ld", random()) == -1) {
-			SAFE_FREE(key);
-			goto done;
-		}
+	for (pass=0; pass<2; pass++) {
+		fetches = standin_state->fetches;
+		start_timer();
+		for (i=0; i<STANDIN_REMOTE_BATCH; i++) {
+			TDB_DATA data;
+			char *expected = talloc_asprintf(frame, "value%d", i);
 
-		if (!rbt_testval(db, key, value)) {
-			SAFE_FREE(key);
-			SAFE_FREE(value);
-			goto done;
+			if (db->fetch(db, frame, keys[i], &data) != 0) {
+				printf("fetch failed\n");
+				goto done;
+			}
+			if ((data.dptr == NULL)
+			    || (strcmp((char *)data.dptr, expected) != 0)) {
+				printf("fetch returned wrong data\n");
+				goto done;
+			}
 		}
+		seconds = end_timer();
+		printf("read pass %d: %u requests to ctdbd, %.1f usecs "
+		       "per record\n", pass,
+		       (unsigned)(standin_state->fetches - fetches),
+		       seconds * 1000000 / STANDIN_REMOTE_BATCH);
+	}
+
+	if ((standin_state->fetches != STANDIN_REMOTE_BATCH)
+	    || (standin_state->delegations != STANDIN_REMOTE_BATCH)) {
+		printf("expected %d read-only copies, got %u\n",
+		       STANDIN_REMOTE_BATCH,
+		       (unsigned)standin_state->delegations);
+		goto done;
+	}
 
-		SAFE_FREE(value);
-		if (asprintf(&value, "value%ld", random()) == -1) {
-			SAFE_FREE(key);
-			goto done;
-		}
+	/*
+	 * A read-only copy is not good enough to write
+	 */
+	migrations = standin_state->migrations;
+	if (!standin_lock_records(db, keys, STANDIN_REMOTE_BATCH)) {
+		goto done;
+	}
+	if ((standin_state->migrations - migrations != STANDIN_REMOTE_BATCH)
+	    || (standin_state->revokes != STANDIN_REMOTE_BATCH)) {
+		printf("locking read-only copies did not migrate them\n");
+		goto done;
+	}
 
-		if (!rbt_testval(db, key, value)) {
-			SAFE_FREE(key);
-			SAFE_FREE(value);
-			goto done;
-		}
+	/*
+	 * One by one
+	 */
+	keys = standin_remote_keys(frame, STANDIN_REMOTE_BATCH,
+				   STANDIN_REMOTE_BATCH);
+	if (keys == NULL) {
+		goto done;
+	}
+	round_trips = standin_state->round_trips;
+	start_timer();
+	if (!standin_lock_records(db, keys, STANDIN_REMOTE_BATCH)) {
+		goto done;
+	}
+	seconds = end_timer();
+	printf("locking one by one: %u round trips, %.1f usecs per record\n",
+	       (unsigned)(standin_state->round_trips - round_trips),
+	       seconds * 1000000 / STANDIN_REMOTE_BATCH);
 
-		SAFE_FREE(key);
-		SAFE_FREE(value);
+	/*
+	 * Batch migration first
+	 */
+	keys = standin_remote_keys(frame, 2 * STANDIN_REMOTE_BATCH,
+				   STANDIN_REMOTE_BATCH);
+	if (keys == NULL) {
+		goto done;
+	}
+	round_trips = standin_state->round_trips;
+	start_timer();
+	if (!NT_STATUS_IS_OK(dbwrap_migrate_records(
+				     db, keys, STANDIN_REMOTE_BATCH))) {
+		printf("dbwrap_migrate_records failed\n");
+		goto done;
+	}
+	migrations = standin_state->migrations;
+	if (!standin_lock_records(db, keys, STANDIN_REMOTE_BATCH)) {
+		goto done;
+	}
+	seconds = end_timer();
+	printf("locking after batch migration: %u round trips, "
+	       "%.1f usecs per record\n",
+	       (unsigned)(standin_state->round_trips - round_trips),
+	       seconds * 1000000 / STANDIN_REMOTE_BATCH);
+
+	if (standin_state->migrations != migrations) {
+		printf("records were migrated again after the batch\n");
+		goto done;
+	}
+	if (standin_state->round_trips - round_trips
+	    >= STANDIN_REMOTE_BATCH) {
+		printf("batch migration took one round trip per record\n");
+		goto done;
+	}
+
+	/*
+	 * We own them now, nothing left to migrate
+	 */
+	if (!NT_STATUS_IS_OK(dbwrap_migrate_records(
+				     db, keys, STANDIN_REMOTE_BATCH))
+	    || (standin_state->migrations != migrations)) {
+		printf("batch migration migrated local records\n");
+		goto done;
 	}
 
 	ret = true;
+ done:
+	TALLOC_FREE(frame);
+	return ret;
+}
+
+static bool run_local_dbwrap_ctdb(int dummy)
+{
+	struct sockaddr_un addr;
+	const char *sockname;
+	int listen_fd;
+	pid_t child;
+	bool ret = false;
+
+	standin_state = (volatile struct standin_ctdbd_state *)shm_setup(
+		sizeof(struct standin_ctdbd_state));
+	if (standin_state == NULL) {
+		return false;
+	}
+	ZERO_STRUCTP(standin_state);
+	standin_state->latency_msecs = 2;
+	standin_state->remote_records = 3 * STANDIN_REMOTE_BATCH;
+
+	sockname = lock_path("standin_ctdbd.socket");
+
+	ZERO_STRUCT(addr);
+	addr.sun_family = AF_UNIX;
+	strlcpy(addr.sun_path, sockname, sizeof(addr.sun_path));
+	unlink(sockname);
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd == -1) {
+		printf("socket failed: %s\n", strerror(errno));
+		return false;
+	}
+	if ((bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+	    || (listen(listen_fd, 5) == -1)) {
+		printf("bind/listen on %s failed: %s\n", sockname,
+		       strerror(errno));
+		close(listen_fd);
+		return false;
+	}
+
+	child = fork();
+	if (child == -1) {
+		printf("fork failed: %s\n", strerror(errno));
+		close(listen_fd);
+		return false;
+	}
+	if (child == 0) {
+		standin_ctdbd(listen_fd);
+		_exit(0);
+	}
+	close(listen_fd);
+
+	/*
+	 * The ctdbd connection is per process, so both parts have to run
+	 * against the same stand-in
+	 */
+	lp_do_parameter(-1, "ctdbd socket", sockname);
+	lp_do_parameter(-1, "clustering", "yes");
+
+	if (!standin_ctdbd_trans()) {
+		goto done;
+	}
+	if (!standin_ctdbd_readonly()) {
+		goto done;
+	}
 
+	if (standin_state->errors != 0) {
+		printf("stand-in ctdbd saw %u protocol errors\n",
+		       (unsigned)standin_state->errors);
+		goto done;
+	}
+
+	ret = true;
  done:
-	TALLOC_FREE(db);
+	lp_do_parameter(-1, "clustering", "no");
+	kill(child, SIGTERM);
+	waitpid(child, NULL, 0);
+	unlink(sockname);
+	unlink(lock_path("torture_ctdb_trans.tdb.standin"));
+	unlink(lock_path("torture_ctdb_ro.tdb.standin"));
 	return ret;
 }
 
+#else
+
+static bool run_local_dbwrap_ctdb(int dummy)
+{
+	printf("no cluster support, skipping\n");
+	return true;
+}
+
+#endif
+
+/*
+ * Compare convert_string() UTF8 -> UTF16LE and back with what iconv does
+ */
+
+static bool test_convert_string(const char *str)
+{
+	smb_iconv_t cd;
+	char ref[1024], buf[1024], back[1024];
+	const char *inbuf = str;
+	char *outbuf = ref;
+	size_t inleft = strlen(str)+1;
+	size_t outleft = sizeof(ref);
+	size_t reflen, len;
+
+	cd = smb_iconv_open("UTF-16LE", "UTF8");
+	if (cd == (smb_iconv_t)-1) {
+		printf("smb_iconv_open failed\n");
+		return false;
+	}
+	if (smb_iconv(cd, &inbuf, &inleft, &outbuf, &outleft) == (size_t)-1) {
+		printf("smb_iconv failed for %s: %s\n", str, strerror(errno));
+		smb_iconv_close(cd);
+		return false;
+	}
+	smb_iconv_close(cd);
+	reflen = sizeof(ref) - outleft;
+
+	len = convert_string(CH_UTF8, CH_UTF16LE, str, strlen(str)+1,
+			     buf, sizeof(buf), false);
+	if ((len != reflen) || (memcmp(buf, ref, len) != 0)) {
+		printf("UTF8->UTF16LE of %s differs from iconv: %d/%d bytes\n",
+		       str, (int)len, (int)reflen);
+		return false;
+	}
+
+	len = convert_string(CH_UTF8, CH_UTF16LE, str, (size_t)-1,
+			     buf, sizeof(buf), false);
+	if ((len != reflen) || (memcmp(buf, ref, len) != 0)) {
+		printf("UTF8->UTF16LE of 0-terminated %s differs from iconv\n",
+		       str);
+		return false;
+	}
+
+	len = convert_string(CH_UTF16LE, CH_UTF8, buf, reflen,
+			     back, sizeof(back), false);
+	if ((len != strlen(str)+1) || (strcmp(back, str) != 0)) {
+		printf("UTF16LE->UTF8 of %s gave %d bytes: %s\n", str,
+		       (int)len, back);
+		return false;
+	}
+
+	return true;
+}
+
+static bool run_local_convert_string(int dummy)
+{
+	const char *strs[] = {
+		"",
+		"hello",
+		"an ascii string of more than thirty-two characters",
+		"a long ascii prefix of more than 16 bytes \xc3\xa9t\xc3\xa9 "
+		"caf\xc3\xa9 and ascii behind it for the block kernels",
+		"\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e",
+		"\xf0\x9f\x98\x80 smile \xf0\x90\x80\x80",
+	};
+	char buf[64];
+	size_t i, len;
+
+	lazy_initialize_conv();
+
+	for (i=0; i<ARRAY_SIZE(strs); i++) {
+		if (!test_convert_string(strs[i])) {
+			return false;
+		}
+	}
+
+	/* Invalid UTF-8 must still be rejected */
+	len = convert_string(CH_UTF8, CH_UTF16LE, "ab\xc3(", 6,
+			     buf, sizeof(buf), false);
+	if (len != (size_t)-1) {
+		printf("invalid UTF-8 converted to %d bytes\n", (int)len);
+		return false;
+	}
+
+	/* Running out of space */
+	errno = 0;
+	len = convert_string(CH_UTF8, CH_UTF16LE, "h\xc3\xa9llo", 7,
+			     buf, 4, false);
+	if ((len != 4) || (errno != E2BIG)) {
+		printf("short buffer: got %d bytes, errno %d\n", (int)len,
+		       errno);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Compare the case insensitive functions with what the UCS2 versions say
+ */
+
+static bool test_strcasecmp(const char *s1, const char *s2)
+{
+	smb_ucs2_t *w1, *w2;
+	size_t size, n;
+	int ret, ref;
+
+	if (!push_ucs2_talloc(talloc_tos(), &w1, s1, &size) ||
+	    !push_ucs2_talloc(talloc_tos(), &w2, s2, &size)) {
+		printf("push_ucs2_talloc failed\n");
+		return false;
+	}
+
+	ret = StrCaseCmp(s1, s2);
+	ref = strcasecmp_w(w1, w2);
+	if (((ret < 0) != (ref < 0)) || ((ret == 0) != (ref == 0))) {
+		printf("StrCaseCmp(%s, %s) gave %d, expected %d\n",
+		       s1, s2, ret, ref);
+		return false;
+	}
+	if (strequal(s1, s2) != (ref == 0)) {
+		printf("strequal(%s, %s) gave %d\n", s1, s2,
+		       (int)strequal(s1, s2));
+		return false;
+	}
+
+	for (n = 0; n < 8; n++) {
+		ret = StrnCaseCmp(s1, s2, n);
+		ref = strncasecmp_w(w1, w2, n);
+		if (((ret < 0) != (ref < 0)) || ((ret == 0) != (ref == 0))) {
+			printf("StrnCaseCmp(%s, %s, %d) gave %d, "
+			       "expected %d\n", s1, s2, (int)n, ret, ref);
+			return false;
+		}
+	}
+
+	TALLOC_FREE(w1);
+	TALLOC_FREE(w2);
+	return true;
+}
+
+static bool test_strupper(const char *str, bool upper)
+{
+	smb_ucs2_t *w;
+	char *ref, *buf;
+	size_t size;
+
+	if (!push_ucs2_talloc(talloc_tos(), &w, str, &size)) {
+		printf("push_ucs2_talloc failed\n");
+		return false;
+	}
+	if (upper) {
+		strupper_w(w);
+	} else {
+		strlower_w(w);
+	}
+	if (!pull_ucs2_talloc(talloc_tos(), &ref, w, &size)) {
+		printf("pull_ucs2_talloc failed\n");
+		return false;
+	}
+
+	buf = talloc_strdup(talloc_tos(), str);
+	if (buf == NULL) {
+		printf("talloc_strdup failed\n");
+		return false;
+	}
+	if (upper) {
+		strupper_m(buf);
+	} else {
+		strlower_m(buf);
+	}
+	if (strcmp(buf, ref) != 0) {
+		printf("%s(%s) gave %s, expected %s\n",
+		       upper ? "strupper_m" : "strlower_m", str, buf, ref);
+		return false;
+	}
+
+	TALLOC_FREE(w);
+	TALLOC_FREE(ref);
+	TALLOC_FREE(buf);
+	return true;
+}
+
+static bool run_local_strcasecmp(int dummy)
+{
+	const char *pairs[][2] = {
+		{ "", "" },
+		{ "hello", "HELLO" },
+		{ "hello", "help" },
+		{ "caf\xc3\xa9", "CAF\xc3\x89" },
+		{ "caf\xc3\xa9", "caf\xc3\xa8" },
+		{ "\xc3\xa9t\xc3\xa9", "\xc3\x89T\xc3\x89" },
+		{ "\xc3\xa9", "\xc3\xa9x" },
+		{ "\xc3\xa9x", "\xc3\xa9" },
+		{ "a\xc3\xa9" "b", "A\xc3\x89" "C" },
+		{ "stra\xc3\x9f" "e", "STRASSE" },
+		{ "\xd0\xbf\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82",
+		  "\xd0\x9f\xd0\xa0\xd0\x98\xd0\x92\xd0\x95\xd0\xa2" },
+		{ "\xe6\x97\xa5\xe6\x9c\xac", "\xe6\x97\xa5\xe6\x9c\xad" },
+		{ "\xf0\x9f\x98\x80" "a", "\xf0\x9f\x98\x80" "A" },
+		{ "\xf0\x9f\x98\x80", "\xf0\x9f\x98\x81" },
+		{ "\xf0\x9f\x98\x80", "\xef\xbf\xbd" },
+		{ "\xef\xbf\xbd", "\xf0\x9f\x98\x80" },
+	};
+	const char *strs[] = {
+		"",
+		"hello world",
+		"an ascii string of more than thirty-two characters",
+		"an ascii prefix of more than 16 bytes, then caf\xc3\xa9",
+		"\xc3\xa9t\xc3\xa9 \xc3\x89T\xc3\x89",
+		"\xd0\xbf\xd1\x80\xd0\xb8\xd0\x92\xd0\x95\xd0\xa2",
+		"\xc4\xb1 and \xc4\xb0",
+		"\xf0\x9f\x98\x80 smile",
+	};
+	size_t i;
+
+	lazy_initialize_conv();
+
+	for (i=0; i<ARRAY_SIZE(pairs); i++) {
+		if (!test_strcasecmp(pairs[i][0], pairs[i][1])) {
+			return false;
+		}
+	}
+
+	for (i=0; i<ARRAY_SIZE(strs); i++) {
+		if (!test_strupper(strs[i], true) ||
+		    !test_strupper(strs[i], false)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
 static bool test_stream_name(const char *fname, const char *expected_base,
 			     const char *expected_stream,
 			     NTSTATUS expected_status)
@@ -5599,6 +9260,8 @@ static bool run_local_memcache(int dummy)
 	TALLOC_CTX *mem_ctx;
 	char *str1, *str2;
 	size_t size1, size2;
+	struct memcache_stats stats;
+	int i;
 	bool ret = false;
 
 	cache = memcache_init(NULL, 100);
@@ -5675,6 +9338,86 @@ static bool run_local_memcache(int dummy)
 		goto fail;
 	}
 
+	TALLOC_FREE(cache);
+
+	/*
+	 * A cache type over its budget must only evict its own entries
+	 */
+
+	cache = memcache_init(NULL, 0);
+	memcache_set_budget(cache, STAT_CACHE, 1000);
+
+	memcache_add(cache, UID_SID_CACHE, k1, d1);
+
+	for (i=0; i<100; i++) {
+		memcache_add(cache, STAT_CACHE, data_blob_const(&i, sizeof(i)),
+			     d2);
+	}
+
+	if (!memcache_lookup(cache, UID_SID_CACHE, k1, &v1)) {
+		printf("STAT_CACHE evicted an UID_SID_CACHE entry\n");
+		goto fail;
+	}
+
+	i = 99;
+	if (!memcache_lookup(cache, STAT_CACHE, data_blob_const(&i, sizeof(i)),
+			     &v2)) {
+		printf("could not find the latest STAT_CACHE entry\n");
+		goto fail;
+	}
+	i = 0;
+	if (memcache_lookup(cache, STAT_CACHE, data_blob_const(&i, sizeof(i)),
+			    &v2)) {
+		printf("Did find the first STAT_CACHE entry, should have "
+		       "been purged\n");
+		goto fail;
+	}
+
+	if (!memcache_get_stats(cache, STAT_CACHE, &stats)) {
+		printf("memcache_get_stats failed\n");
+		goto fail;
+	}
+	if ((stats.size > 1000) || (stats.evictions == 0)
+	    || (stats.num_entries + stats.evictions != 100)
+	    || (stats.hits != 1) || (stats.misses != 1)) {
+		printf("unexpected STAT_CACHE stats: size=%d, entries=%u, "
+		       "evictions=%u, hits=%u, misses=%u\n", (int)stats.size,
+		       stats.num_entries, stats.evictions, stats.hits,
+		       stats.misses);
+		goto fail;
+	}
+
+	TALLOC_FREE(cache);
+
+	/*
+	 * Overwriting a value with a shorter one reuses the record, its
+	 * size must still be fully given back when it goes away
+	 */
+
+	cache = memcache_init(NULL, 0);
+
+	memcache_add(cache, STAT_CACHE, k1,
+		     data_blob_const("a longer value", 14));
+	memcache_add(cache, STAT_CACHE, k1, d1);
+
+	if (!memcache_lookup(cache, STAT_CACHE, k1, &v1)
+	    || !data_blob_equal(d1, v1)) {
+		printf("could not find shortened k1\n");
+		goto fail;
+	}
+
+	memcache_delete(cache, STAT_CACHE, k1);
+
+	if (!memcache_get_stats(cache, STAT_CACHE, &stats)) {
+		printf("memcache_get_stats failed\n");
+		goto fail;
+	}
+	if ((stats.size != 0) || (stats.num_entries != 0)) {
+		printf("STAT_CACHE size %d with %u entries after delete\n",
+		       (int)stats.size, stats.num_entries);
+		goto fail;
+	}
+
 	ret = true;
  fail:
 	TALLOC_FREE(cache);
@@ -5852,6 +9595,7 @@ static struct {
 	{"LOCK5",  run_locktest5,  0},
 	{"LOCK6",  run_locktest6,  0},
 	{"LOCK7",  run_locktest7,  0},
+	{"STRICT-LOCK", run_strict_lock, 0},
 	{"UNLINK", run_unlinktest, 0},
 	{"BROWSE", run_browsetest, 0},
 	{"ATTR",   run_attrtest,   0},
@@ -5900,11 +9644,31 @@ static struct {
 	{ "SESSSETUP_BENCH", run_sesssetup_bench, 0},
 	{ "CHAIN1", run_chain1, 0},
 	{ "WINDOWS-WRITE", run_windows_write, 0},
+	{ "BENCH-READWRITE", run_bench_readwrite, 0},
+	{ "BENCH-SMALLWRITE", run_bench_smallwrite, 0},
+	{ "WRITE-BEHIND-CLOSE", run_write_behind_close, 0},
+	{ "NEGATIVE-STATCACHE", run_negative_statcache, 0},
+	{ "CASE-INDEX", run_case_index, 0},
+	{ "DIR-PREFETCH", run_dir_prefetch, 0},
+	{ "DOSATTR-CACHE", run_dosattr_cache, 0},
+	{ "BENCH-OPENFILES", run_openfiles_bench, 0},
+	{ "DIR-HANDLES", run_dir_handles, 0},
+	{ "BENCH-OPLOCK", run_oplock_bench, 0},
+	{ "BENCH-LOCK", run_lock_bench, 0},
+	{ "BENCH-SHAREMODE", run_sharemode_bench, 0},
+	{ "BENCH-BRL", run_brl_bench, 0},
+	{ "BENCH-NOTIFY", run_notify_bench, 0},
+	{ "NOTIFY-ORDER", run_notify_order, 0},
 	{ "CLI_ECHO", run_cli_echo, 0},
 	{ "LOCAL-SUBSTITUTE", run_local_substitute, 0},
 	{ "LOCAL-GENCACHE", run_local_gencache, 0},
 	{ "LOCAL-RBTREE", run_local_rbtree, 0},
+	{ "LOCAL-DBWRAP-CACHE", run_local_dbwrap_cache, 0},
+	{ "LOCAL-DBWRAP-TRANS", run_local_dbwrap_trans, FLAG_MULTIPROC},
+	{ "LOCAL-DBWRAP-CTDB", run_local_dbwrap_ctdb, 0},
 	{ "LOCAL-MEMCACHE", run_local_memcache, 0},
+	{ "LOCAL-CONVERT-STRING", run_local_convert_string, 0},
+	{ "LOCAL-STRCASECMP", run_local_strcasecmp, 0},
 	{ "LOCAL-STREAM-NAME", run_local_stream_name, 0},
 	{ "LOCAL-WBCLIENT", run_local_wbclient, 0},
 	{NULL, NULL, 0}};
@@ -796,6 +796,35 @@ static bool do_poolusage(struct messaging_context *msg_ctx,
 	return num_replies;
 }
 
+/* Display memcache statistics */
+
+static bool do_memcache_stats(struct messaging_context *msg_ctx,
+			      const struct server_id pid,
+			      const int argc, const char **argv)
+{
+	if (argc != 1) {
+		fprintf(stderr, "Usage: smbcontrol <dest> memcache-stats\n");
+		return False;
+	}
+
+	messaging_register(msg_ctx, NULL, MSG_MEMCACHE_STATS,
+			   print_string_cb);
+
+	if (!send_message(msg_ctx, pid, MSG_REQ_MEMCACHE_STATS, NULL, 0))
+		return False;
+
+	wait_replies(msg_ctx, procid_to_pid(&pid) == 0);
+
+	/* No replies were received within the timeout period */
+
+	if (num_replies == 0)
+		printf("No replies received\n");
+
+	messaging_deregister(msg_ctx, MSG_MEMCACHE_STATS, NULL);
+
+	return num_replies;
+}
+
 /* Perform a dmalloc mark */
 
 static bool do_dmalloc_mark(struct messaging_context *msg_ctx,
@@ -1182,6 +1211,8 @@ static const struct {
         { "samsync", do_samsync, "Initiate SAM synchronisation" },
         { "samrepl", do_samrepl, "Initiate SAM replication" },
 	{ "pool-usage", do_poolusage, "Display talloc memory usage" },
+	{ "memcache-stats", do_memcache_stats,
+	  "Display memcache hits, misses and evictions" },
 	{ "dmalloc-mark", do_dmalloc_mark, "" },
 	{ "dmalloc-log-changed", do_dmalloc_changed, "" },
 	{ "shutdown", do_shutdown, "Shut down daemon" },
@@ -127,6 +127,7 @@ bool status_profile_dump(bool verbose)
 	d_printf("lookups:                        %u\n", profile_p->statcache_lookups);
 	d_printf("misses:                         %u\n", profile_p->statcache_misses);
 	d_printf("hits:                           %u\n", profile_p->statcache_hits);
+	d_printf("negative_hits:                  %u\n", profile_p->statcache_negative_hits);
 
 	profile_separator("Write Cache");
 	d_printf("read_hits:                      %u\n", profile_p->writecache_read_hits);
@@ -147,6 +148,25 @@ bool status_profile_dump(bool verbose)
 	d_printf("num_write_caches:               %u\n", profile_p->writecache_num_write_caches);
 	d_printf("allocated_write_caches:         %u\n", profile_p->writecache_allocated_write_caches);
 
+	profile_separator("Change Notify");
+	d_printf("events_sent:                    %u\n", profile_p->notify_events_sent);
+	d_printf("events_merged:                  %u\n", profile_p->notify_events_merged);
+	d_printf("events_dropped:                 %u\n", profile_p->notify_events_dropped);
+	d_printf("batches_sent:                   %u\n", profile_p->notify_batches_sent);
+
+	profile_separator("Dbwrap Cache");
+	d_printf("hits:                           %u\n", profile_p->dbwrap_cache_hits);
+	d_printf("negative_hits:                  %u\n", profile_p->dbwrap_cache_negative_hits);
+	d_printf("misses:                         %u\n", profile_p->dbwrap_cache_misses);
+	d_printf("flushes:                        %u\n", profile_p->dbwrap_cache_flushes);
+
+	profile_separator("Gencache");
+	d_printf("ram_hits:                       %u\n", profile_p->gencache_ram_hits);
+	d_printf("ram_misses:                     %u\n", profile_p->gencache_ram_misses);
+	d_printf("writebehind_flushes:            %u\n", profile_p->gencache_writebehind_flushes);
+	d_printf("sweeps:                         %u\n", profile_p->gencache_sweeps);
+	d_printf("swept_entries:                  %u\n", profile_p->gencache_swept_entries);
+
 	profile_separator("SMB Calls");
 	d_printf("mkdir_count:                    %u\n", profile_p->SMBmkdir_count);
 	d_printf("mkdir_time:                     %u\n", profile_p->SMBmkdir_time);
@@ -1404,6 +1404,10 @@ int main(int argc, char **argv, char **envp)
 
 		rescan_trusted_domains();
 
+		/* get rid of expired cache entries */
+
+		gencache_housekeeping();
+
 		/* Dispose of client connection if it is marked as
 		   finished */
 		state = winbindd_client_list();